@@ -233,6 +233,26 @@ static inline void cbox_biquadf_set_1php_lookup(struct cbox_biquadf_coeffs *coef
     cbox_biquadf_set_1p(coeffs, q, -q, b1, two_copies);    
 }
 
+// Per-step increments for a linear transition from 'from' to 'to' in 'steps' steps
+static inline void cbox_biquadf_set_ramp(struct cbox_biquadf_coeffs *delta, const struct cbox_biquadf_coeffs *from, const struct cbox_biquadf_coeffs *to, uint32_t steps)
+{
+    float inv = 1.f / steps;
+    delta->a0 = (to->a0 - from->a0) * inv;
+    delta->a1 = (to->a1 - from->a1) * inv;
+    delta->a2 = (to->a2 - from->a2) * inv;
+    delta->b1 = (to->b1 - from->b1) * inv;
+    delta->b2 = (to->b2 - from->b2) * inv;
+}
+
+static inline void cbox_biquadf_add_coeffs(struct cbox_biquadf_coeffs *coeffs, const struct cbox_biquadf_coeffs *delta)
+{
+    coeffs->a0 += delta->a0;
+    coeffs->a1 += delta->a1;
+    coeffs->a2 += delta->a2;
+    coeffs->b1 += delta->b1;
+    coeffs->b2 += delta->b2;
+}
+
 #if USE_NEON
 
 #include <arm_neon.h>
@@ -331,6 +351,73 @@ static inline void cbox_biquadf_process_stereo(struct cbox_biquadf_state *lstate
     rstate->y1 = sanef(ry1);
 }
 
+// One biquad of a stereo cascade
+struct cbox_biquadf_stage
+{
+    struct cbox_biquadf_coeffs *coeffs;
+    struct cbox_biquadf_state *left, *right;
+};
+
+#define CBOX_BIQUADF_FUSED_STAGES 3
+
+static inline void cbox_biquadf_process_stereo_fused(const struct cbox_biquadf_stage *stages, int num_stages, float *buffer)
+{
+    struct cbox_biquadf_coeffs c[CBOX_BIQUADF_FUSED_STAGES];
+    struct cbox_biquadf_state l[CBOX_BIQUADF_FUSED_STAGES], r[CBOX_BIQUADF_FUSED_STAGES];
+    for (int j = 0; j < num_stages; j++)
+    {
+        c[j] = *stages[j].coeffs;
+        l[j] = *stages[j].left;
+        r[j] = *stages[j].right;
+    }
+    for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i += 2)
+    {
+        float inl = buffer[i], inr = buffer[i + 1];
+        for (int j = 0; j < num_stages; j++)
+        {
+            float outl = c[j].a0 * inl + c[j].a1 * l[j].x1 + c[j].a2 * l[j].x2 - c[j].b1 * l[j].y1 - c[j].b2 * l[j].y2;
+            float outr = c[j].a0 * inr + c[j].a1 * r[j].x1 + c[j].a2 * r[j].x2 - c[j].b1 * r[j].y1 - c[j].b2 * r[j].y2;
+            l[j].x2 = l[j].x1;
+            l[j].x1 = inl;
+            l[j].y2 = l[j].y1;
+            l[j].y1 = outl;
+            r[j].x2 = r[j].x1;
+            r[j].x1 = inr;
+            r[j].y2 = r[j].y1;
+            r[j].y1 = outr;
+            inl = outl;
+            inr = outr;
+        }
+        buffer[i] = inl;
+        buffer[i + 1] = inr;
+    }
+    for (int j = 0; j < num_stages; j++)
+    {
+        l[j].y1 = sanef(l[j].y1);
+        l[j].y2 = sanef(l[j].y2);
+        r[j].y1 = sanef(r[j].y1);
+        r[j].y2 = sanef(r[j].y2);
+        *stages[j].left = l[j];
+        *stages[j].right = r[j];
+    }
+}
+
+// Runs an interleaved stereo buffer through a cascade of biquads. Up to
+// CBOX_BIQUADF_FUSED_STAGES stages are done in one pass over the buffer, with
+// each sample going through all of them and the states kept in locals, so
+// that the stages overlap instead of each one waiting for the previous one
+// to finish the whole block.
+static inline void cbox_biquadf_process_stereo_cascade(const struct cbox_biquadf_stage *stages, int num_stages, float *buffer)
+{
+    for (; num_stages >= CBOX_BIQUADF_FUSED_STAGES; num_stages -= CBOX_BIQUADF_FUSED_STAGES, stages += CBOX_BIQUADF_FUSED_STAGES)
+        cbox_biquadf_process_stereo_fused(stages, CBOX_BIQUADF_FUSED_STAGES, buffer);
+    // constant stage counts, so that the loops over stages get unrolled
+    if (num_stages == 2)
+        cbox_biquadf_process_stereo_fused(stages, 2, buffer);
+    else if (num_stages == 1)
+        cbox_biquadf_process_stereo_fused(stages, 1, buffer);
+}
+
 static inline double cbox_biquadf_process_sample(struct cbox_biquadf_state *state, struct cbox_biquadf_coeffs *coeffs, double in)
 {    
     double out = sanef(coeffs->a0 * sanef(in) + coeffs->a1 * state->x1 + coeffs->a2 * state->x2 - coeffs->b1 * state->y1 - coeffs->b2 * state->y2);
@@ -44,7 +44,9 @@ struct compressor_module
 {
     struct cbox_module module;
 
-    struct compressor_params *params, *old_params;
+    struct compressor_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
     struct cbox_onepolef_coeffs attack_lp, release_lp, fast_attack_lp;
     struct cbox_onepolef_state tracker;
     struct cbox_onepolef_state tracker2;
@@ -84,17 +86,19 @@ void compressor_process_event(struct cbox_module *module, const uint8_t *data, u
 void compressor_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct compressor_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct compressor_params *p = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
         float scale = M_PI * 1000 / m->module.srate;
-        cbox_onepolef_set_lowpass(&m->fast_attack_lp, 2 * scale / m->params->attack);
-        cbox_onepolef_set_lowpass(&m->attack_lp, scale / m->params->attack);
-        cbox_onepolef_set_lowpass(&m->release_lp, scale / m->params->release);
-        m->old_params = m->params;
+        cbox_onepolef_set_lowpass(&m->fast_attack_lp, 2 * scale / p->attack);
+        cbox_onepolef_set_lowpass(&m->attack_lp, scale / p->attack);
+        cbox_onepolef_set_lowpass(&m->release_lp, scale / p->release);
+        m->old_params_generation = generation;
     }
     
-    float threshold = m->params->threshold, invratio = 1.0 / m->params->ratio;
+    float threshold = p->threshold, invratio = 1.0 / p->ratio;
     for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
     {
         float left = inputs[0][i], right = inputs[1][i];
@@ -107,7 +111,7 @@ void compressor_process_block(struct cbox_module *module, cbox_sample_t **inputs
         float gain = 1.0;
         if (sig > threshold)
             gain = threshold * powf(sig / threshold, invratio) / sig;
-        gain *= m->params->makeup;
+        gain *= p->makeup;
                 
         outputs[0][i] = left * gain;
         outputs[1][i] = right * gain;
@@ -136,7 +140,7 @@ MODULE_CREATE_FUNCTION(compressor)
     p->release = cbox_config_get_float(cfg_section, "release", 100.0);
     p->makeup = cbox_config_get_gain_db(cfg_section, "makeup", 6.0);
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     
     cbox_onepolef_reset(&m->tracker);
     cbox_onepolef_reset(&m->tracker2);
@@ -77,12 +77,13 @@ void delay_process_event(struct cbox_module *module, const uint8_t *data, uint32
 void delay_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct delay_module *m = (struct delay_module *)module;
+    struct delay_params *p = m->params;
     
     int pos = m->pos;
-    int dv = m->params->time * m->module.srate / 1000.0;
-    float dryamt = 1 - m->params->wet_dry;
-    float wetamt = m->params->wet_dry;
-    float fbamt = m->params->fb_amt;
+    int dv = p->time * m->module.srate / 1000.0;
+    float dryamt = 1 - p->wet_dry;
+    float wetamt = p->wet_dry;
+    float fbamt = p->fb_amt;
     
     for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
     {
@@ -40,7 +40,9 @@ struct distortion_module
 {
     struct cbox_module module;
 
-    struct distortion_params *params, *old_params;
+    struct distortion_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
 };
 
 gboolean distortion_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
@@ -71,14 +73,17 @@ void distortion_process_event(struct cbox_module *module, const uint8_t *data, u
 void distortion_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct distortion_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct distortion_params *p = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
         // update calculated values
+        m->old_params_generation = generation;
     }
     
-    float drive = m->params->drive;
-    float shape = m->params->shape;
+    float drive = p->drive;
+    float shape = p->shape;
     
     float a0 = shape;
     float a1 = -2 * shape - 0.5;
@@ -122,7 +127,7 @@ MODULE_CREATE_FUNCTION(distortion)
     p->drive = cbox_config_get_gain_db(cfg_section, "drive", 0.f);
     p->shape = cbox_config_get_gain_db(cfg_section, "shape", 0.f);
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     
     return &m->module;
 }
@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define CBOX_BLOCK_SIZE 16
 
+#include "config.h"
 #include <complex.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -107,21 +108,76 @@ static inline void zerobf(float *to)
         to[i] = 0.f;
 }
 
+// Fast approximations used by the per-block control code. Both are
+// branch-free, so loops calling them can be auto-vectorised.
+
+// 2^x, relative error below 2e-7 for -126 <= x <= 127 (clamped outside).
+// Rounds x to the nearest integer for the exponent and evaluates a degree 6
+// polynomial (Cephes exp2f coefficients) on the remaining [-0.5, 0.5] part.
+static inline float cbox_fast_exp2f(float x)
+{
+    union { float f; int32_t i; } scale;
+    x = x < -126.f ? -126.f : (x > 127.f ? 127.f : x);
+    // x + 126.5 is positive, so truncation rounds it down
+    int32_t xi = (int32_t)(x + 126.5f) - 126;
+    float f = x - xi;
+    float p = 1.535336188319500e-4f;
+    p = p * f + 1.339887440266574e-3f;
+    p = p * f + 9.618437357674640e-3f;
+    p = p * f + 5.550332471162809e-2f;
+    p = p * f + 2.402264791363012e-1f;
+    p = p * f + 6.931472028550421e-1f;
+    p = p * f + 1.f;
+    scale.i = (xi + 127) << 23;
+    return p * scale.f;
+}
+
+// tan(x), [5/4] Pade approximant, relative error below 3e-7 for |x| <= pi/4.
+static inline float cbox_fast_tanf(float x)
+{
+    float x2 = x * x;
+    return x * (945.f - x2 * (105.f - x2)) / (945.f - x2 * (420.f - 15.f * x2));
+}
+
+#if USE_FAST_MATH
+static inline float cbox_exp2f(float x) { return cbox_fast_exp2f(x); }
+static inline float cbox_tanf(float x) { return cbox_fast_tanf(x); }
+#else
+static inline float cbox_exp2f(float x) { return exp2f(x); }
+static inline float cbox_tanf(float x) { return tanf(x); }
+#endif
+
 static inline float cent2factor(float cent)
 {
-    return powf(2.0, cent * (1.f / 1200.f)); // I think this may be optimised using exp()
+    return cbox_exp2f(cent * (1.f / 1200.f));
 }
 
 static inline float dB2gain(float dB)
 {
-    return powf(2.f, dB * (1.f / 6.f));
+    return cbox_exp2f(dB * (1.f / 6.f));
 }
 
 static inline float dB2gain_simple(float dB)
 {
     if (dB <= -96)
         return 0;
-    return powf(2.f, dB * (1.f / 6.f));
+    return cbox_exp2f(dB * (1.f / 6.f));
+}
+
+// Filter design values for 0 < freq < sr/2: sin/cos of w = 2*pi*freq/sr
+// and 2*tan(w/8) used by the one-pole designs. Only one tangent is evaluated,
+// sin/cos of w/2 are derived from it with the double angle formulas
+// (tan(w/4) = n/d), then sin/cos of w from those.
+static inline void cbox_sincos_from_freq(struct cbox_sincos *sc, float freq, float sr)
+{
+    float t = cbox_tanf(hz2w(freq, sr) * 0.5f);
+    float n = 2 * t, d = 1 - t * t;
+    float inv = 1.f / ((1 + t * t) * (1 + t * t));
+    float s2 = 2 * n * d * inv, c2 = (d - n) * (d + n) * inv;
+    sc->sine = 2 * s2 * c2;
+    sc->cosine = 1 - 2 * s2 * s2;
+    sc->prewarp = 2 * t;
+    sc->prewarp2 = 1.f / (1 + sc->prewarp);
 }
 
 static inline float gain2dB_simple(float gain)
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "blob.h"
+#include "config-api.h"
 #include "dom.h"
 #include "engine.h"
 #include "instr.h"
@@ -31,12 +32,39 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "song.h"
 #include "stm.h"
 #include "track.h"
+#include "workerpool.h"
 #include <assert.h>
 #include <stdio.h>
 #include <unistd.h>
 
 CBOX_CLASS_DEFINITION_ROOT(cbox_engine)
 
+// Number of MIDI events lost to full buffers (engine inputs, scene inputs,
+// instrument inputs, layer outputs, track outputs of the current song and
+// ad-hoc pattern outputs). Called from the control thread, which is also the
+// one that frees the song playbacks and ad-hoc patterns, so they cannot go
+// away while being counted.
+static uint32_t cbox_engine_get_dropped_midi_events(struct cbox_engine *engine)
+{
+    uint32_t dropped = engine->midibuf_aux.dropped + engine->midibuf_jack.dropped + engine->midibuf_song.dropped +
+        engine->appsink.midibufs[0].dropped + engine->appsink.midibufs[1].dropped;
+    for (uint32_t i = 0; i < engine->scene_count; i++)
+    {
+        struct cbox_scene *scene = engine->scenes[i];
+        dropped += scene->midibuf_total.dropped;
+        for (uint32_t j = 0; j < scene->instrument_count; j++)
+            dropped += scene->instruments[j]->module->midi_input.dropped;
+        for (uint32_t j = 0; j < scene->layer_count; j++)
+            dropped += scene->layers[j]->output_buffer.dropped;
+        for (struct cbox_adhoc_pattern *ap = scene->adhoc_patterns; ap; ap = ap->next)
+            dropped += ap->output_buffer.dropped;
+    }
+    struct cbox_song_playback *spb = engine->spb;
+    for (uint32_t i = 0; spb && i < spb->track_count; i++)
+        dropped += spb->tracks[i]->output_buffer.dropped;
+    return dropped;
+}
+
 static gboolean cbox_engine_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error);
 
 struct cbox_engine *cbox_engine_new(struct cbox_document *doc, struct cbox_rt *rt)
@@ -53,6 +81,7 @@ struct cbox_engine *cbox_engine_new(struct cbox_document *doc, struct cbox_rt *r
     engine->spb = NULL;
     engine->spb_lock = 0;
     engine->spb_retry = 0;
+    engine->render_pool = NULL;
     
     if (rt)
         cbox_io_env_copy(&engine->io_env, &rt->io_env);
@@ -63,10 +92,24 @@ struct cbox_engine *cbox_engine_new(struct cbox_document *doc, struct cbox_rt *r
         engine->io_env.input_count = 0;
         engine->io_env.output_count = 2;
     }
+    int render_threads = cbox_config_get_int("io", "render_threads", 0);
+    if (render_threads > 0)
+        engine->render_pool = cbox_worker_pool_new(render_threads, cbox_config_get_int("io", "rtpriority", 10), cbox_config_get_int("io", "render_pin_threads", 0));
 
+    // 0 or less disables the arena, so full buffers drop events
+    int midi_arena_size = cbox_config_get_int("io", "midi_arena_size", 262144);
+    if (midi_arena_size > CBOX_MIDI_ARENA_MAX_SIZE)
+    {
+        g_warning("MIDI arena size %d is too large, using %d instead", midi_arena_size, CBOX_MIDI_ARENA_MAX_SIZE);
+        midi_arena_size = CBOX_MIDI_ARENA_MAX_SIZE;
+    }
+    cbox_midi_arena_init(&engine->midi_arena, midi_arena_size > 0 ? midi_arena_size : 0);
     cbox_midi_buffer_init(&engine->midibuf_aux);
     cbox_midi_buffer_init(&engine->midibuf_jack);
     cbox_midi_buffer_init(&engine->midibuf_song);
+    cbox_midi_buffer_set_arena(&engine->midibuf_aux, &engine->midi_arena);
+    cbox_midi_buffer_set_arena(&engine->midibuf_jack, &engine->midi_arena);
+    cbox_midi_buffer_set_arena(&engine->midibuf_song, &engine->midi_arena);
     engine->stmap = malloc(sizeof(struct cbox_song_time_mapper));
     cbox_song_time_mapper_init(engine->stmap, engine);
     cbox_midi_appsink_init(&engine->appsink, rt, &engine->stmap->tmap);
@@ -96,6 +139,12 @@ void cbox_engine_destroyfunc(struct cbox_objhdr *obj_ptr)
     engine->master = NULL;
     free(engine->stmap);
     engine->stmap = NULL;
+    if (engine->render_pool)
+    {
+        cbox_worker_pool_destroy(engine->render_pool);
+        engine->render_pool = NULL;
+    }
+    cbox_midi_arena_destroy(&engine->midi_arena);
 
     free(engine);
 }
@@ -110,7 +159,9 @@ static gboolean cbox_engine_process_cmd(struct cbox_command_target *ct, struct c
             if (!cbox_execute_on(fb, NULL, "/scene", "o", error, engine->scenes[i]))
                 return FALSE;
         }
-        return CBOX_OBJECT_DEFAULT_STATUS(engine, fb, error);
+        return cbox_execute_on(fb, NULL, "/midi_dropped", "i", error, cbox_engine_get_dropped_midi_events(engine)) &&
+            cbox_execute_on(fb, NULL, "/midi_arena_failed_allocs", "i", error, engine->midi_arena.failed_allocs) &&
+            CBOX_OBJECT_DEFAULT_STATUS(engine, fb, error);
     }
     else if (!strcmp(cmd->command, "/render_stereo") && !strcmp(cmd->arg_types, "i"))
     {
@@ -175,6 +226,8 @@ void cbox_engine_process(struct cbox_engine *engine, struct cbox_io *io, uint32_
     struct cbox_module *effect = engine->effect;
     uint32_t i, j;
     
+    // Nothing refers to the overflow storage from the previous period by now
+    cbox_midi_arena_reset(&engine->midi_arena);
     cbox_midi_buffer_clear(&engine->midibuf_aux);
     cbox_midi_buffer_clear(&engine->midibuf_song);
     if (io)
@@ -318,9 +371,18 @@ void cbox_engine_update_song_playback(struct cbox_engine *engine)
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
+// Instruments may be rendered by different threads at the same time, each
+// one processing a different block
+static __thread uint32_t song_pos_offset;
+
+void cbox_engine_set_song_pos_offset(struct cbox_engine *engine, uint32_t offset)
+{
+    song_pos_offset = offset;
+}
+
 uint32_t cbox_engine_current_pos_samples(struct cbox_engine *engine)
 {
-    uint32_t pos = engine->frame_start_song_pos + engine->song_pos_offset;
+    uint32_t pos = engine->frame_start_song_pos + song_pos_offset;
     if (engine->spb && engine->spb->loop_start_ppqn < engine->spb->loop_end_ppqn)
         pos = cbox_song_playback_correct_for_looping(engine->spb, pos);
     return pos;
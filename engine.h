@@ -29,6 +29,8 @@ CBOX_EXTERN_CLASS(cbox_engine)
 
 #define GET_RT_FROM_cbox_engine(ptr) ((ptr)->rt)
 
+struct cbox_worker_pool;
+
 struct cbox_engine
 {
     CBOX_OBJECT_HEADER()
@@ -41,12 +43,16 @@ struct cbox_engine
     struct cbox_module *effect;
     struct cbox_master *master;
     struct cbox_midi_buffer midibuf_aux, midibuf_jack, midibuf_song;
+    // Overflow storage for the MIDI buffers filled during each period
+    struct cbox_midi_arena midi_arena;
     struct cbox_song_time_mapper *stmap;
     struct cbox_midi_appsink appsink;
 
     int spb_lock, spb_retry;
+    // optional helper threads for rendering instruments in parallel
+    struct cbox_worker_pool *render_pool;
 
-    uint32_t frame_start_song_pos, song_pos_offset; // samples
+    uint32_t frame_start_song_pos; // samples
 };
 
 // These use an RT command internally
@@ -65,6 +71,9 @@ extern gboolean cbox_engine_on_transport_sync(struct cbox_engine *engine, enum c
 extern void cbox_engine_on_tempo_sync(struct cbox_engine *engine, double beats_per_minute);
 extern struct cbox_midi_merger *cbox_engine_get_midi_output(struct cbox_engine *engine, struct cbox_uuid *uuid);
 extern uint32_t cbox_engine_current_pos_samples(struct cbox_engine *engine);
+// Position of the block being rendered by the calling thread, relative to the
+// start of the current buffer
+extern void cbox_engine_set_song_pos_offset(struct cbox_engine *engine, uint32_t offset);
 
 extern int cbox_engine_get_sample_rate(struct cbox_engine *engine);
 extern int cbox_engine_get_buffer_size(struct cbox_engine *engine);
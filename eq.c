@@ -42,23 +42,24 @@ struct parametric_eq_module
 {
     struct cbox_module module;
 
-    struct parametric_eq_params *params, *old_params;
+    struct parametric_eq_params *params;
+    // generation of the parameter block the filters were computed from
+    uint32_t old_params_generation;
 
     struct cbox_biquadf_state state[MAX_EQ_BANDS][2];
     struct cbox_biquadf_coeffs coeffs[MAX_EQ_BANDS];
 };
 
-static void redo_filters(struct parametric_eq_module *m)
+static void redo_filters(struct parametric_eq_module *m, const struct parametric_eq_params *p)
 {
     for (int i = 0; i < MAX_EQ_BANDS; i++)
     {
-        struct eq_band *band = &m->params->bands[i];
+        const struct eq_band *band = &p->bands[i];
         if (band->active)
         {
             cbox_biquadf_set_peakeq_rbj(&m->coeffs[i], band->center, band->q, band->gain, m->module.srate);
         }
     }
-    m->old_params = m->params;
 }
 
 gboolean parametric_eq_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
@@ -101,16 +102,21 @@ void parametric_eq_process_event(struct cbox_module *module, const uint8_t *data
 void parametric_eq_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct parametric_eq_module *m = (struct parametric_eq_module *)module;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct parametric_eq_params *p = m->params;
     
-    if (m->params != m->old_params)
-        redo_filters(m);
+    if (generation != m->old_params_generation)
+    {
+        redo_filters(m, p);
+        m->old_params_generation = generation;
+    }
     
     for (int c = 0; c < 2; c++)
     {
         gboolean first = TRUE;
         for (int i = 0; i < MAX_EQ_BANDS; i++)
         {
-            if (!m->params->bands[i].active)
+            if (!p->bands[i].active)
                 continue;
             if (first)
             {
@@ -168,7 +174,7 @@ MODULE_CREATE_FUNCTION(parametric_eq)
     m->module.process_block = parametric_eq_process_block;
     struct parametric_eq_params *p = malloc(sizeof(struct parametric_eq_params));
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     
     for (int b = 0; b < MAX_EQ_BANDS; b++)
     {
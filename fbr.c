@@ -57,7 +57,9 @@ struct feedback_reducer_module
 {
     struct cbox_module module;
     
-    struct feedback_reducer_params *params, *old_params;
+    struct feedback_reducer_params *params;
+    // generation of the parameter block the filters were computed from
+    uint32_t old_params_generation;
 
     struct cbox_biquadf_coeffs coeffs[MAX_FBR_BANDS];
     struct cbox_biquadf_state state[MAX_FBR_BANDS][2];
@@ -203,17 +205,16 @@ static int find_peaks(complex float *spectrum, float srate, float peak_freqs[16]
     return peak_count;
 }
 
-static void redo_filters(struct feedback_reducer_module *m)
+static void redo_filters(struct feedback_reducer_module *m, const struct feedback_reducer_params *p)
 {
     for (int i = 0; i < MAX_FBR_BANDS; i++)
     {
-        struct eq_band *band = &m->params->bands[i];
+        const struct eq_band *band = &p->bands[i];
         if (band->active)
         {
             cbox_biquadf_set_peakeq_rbj(&m->coeffs[i], band->center, band->q, band->gain, m->module.srate);
         }
     }
-    m->old_params = m->params;
 }
 
 gboolean feedback_reducer_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
@@ -247,7 +248,7 @@ gboolean feedback_reducer_process_cmd(struct cbox_command_target *ct, struct cbo
                 p->bands[i].q = freqs[i] / 50; // each band ~100 Hz (not really sure about filter Q vs bandwidth)
                 p->bands[i].gain = 0.125;
             }
-            free(cbox_rt_swap_pointers(m->module.rt, (void **)&m->params, p)); \
+            cbox_module_publish_params(&m->module, (void **)&m->params, p);
             m->analysed = 1;
             if (!cbox_execute_on(fb, NULL, "/refresh", "i", error, 1))
                 return FALSE;
@@ -281,9 +282,14 @@ void feedback_reducer_process_event(struct cbox_module *module, const uint8_t *d
 void feedback_reducer_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct feedback_reducer_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct feedback_reducer_params *p = m->params;
     
-    if (m->params != m->old_params)
-        redo_filters(m);
+    if (generation != m->old_params_generation)
+    {
+        redo_filters(m, p);
+        m->old_params_generation = generation;
+    }
     
     if (m->wrptr && m->wrptr != m->analysis_buffer + ANALYSIS_BUFFER_SIZE)
     {
@@ -299,7 +305,7 @@ void feedback_reducer_process_block(struct cbox_module *module, cbox_sample_t **
         gboolean first = TRUE;
         for (int i = 0; i < MAX_FBR_BANDS; i++)
         {
-            if (!m->params->bands[i].active)
+            if (!p->bands[i].active)
                 continue;
             if (first)
             {
@@ -345,7 +351,7 @@ MODULE_CREATE_FUNCTION(feedback_reducer)
     m->module.process_block = feedback_reducer_process_block;
     struct feedback_reducer_params *p = malloc(sizeof(struct feedback_reducer_params));
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     m->analysed = 0;
     m->wrptr = NULL;
     
@@ -356,7 +362,7 @@ MODULE_CREATE_FUNCTION(feedback_reducer)
         p->bands[b].q = cbox_eq_get_band_param(cfg_section, b, "q", 0.707 * 2);
         p->bands[b].gain = cbox_eq_get_band_param_db(cfg_section, b, "gain", 0);
     }
-    redo_filters(m);
+    redo_filters(m, p);
     cbox_eq_reset_bands(m->state, MAX_FBR_BANDS);
     
     return &m->module;
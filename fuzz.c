@@ -46,7 +46,9 @@ struct fuzz_module
 {
     struct cbox_module module;
 
-    struct fuzz_params *params, *old_params;
+    struct fuzz_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
     
     struct cbox_biquadf_coeffs split_coeffs;
     struct cbox_biquadf_coeffs post_coeffs;
@@ -92,17 +94,20 @@ void fuzz_process_event(struct cbox_module *module, const uint8_t *data, uint32_
 void fuzz_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct fuzz_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct fuzz_params *p = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
         // update calculated values
+        m->old_params_generation = generation;
     }
     
-    cbox_biquadf_set_bp_rbj(&m->split_coeffs, m->params->band, 0.7 / m->params->bandwidth, m->module.srate);
-    cbox_biquadf_set_bp_rbj(&m->post_coeffs, m->params->band2, 0.7 / m->params->bandwidth2, m->module.srate);
+    cbox_biquadf_set_bp_rbj(&m->split_coeffs, p->band, 0.7 / p->bandwidth, m->module.srate);
+    cbox_biquadf_set_bp_rbj(&m->post_coeffs, p->band2, 0.7 / p->bandwidth2, m->module.srate);
     
     float splitbuf[2][CBOX_BLOCK_SIZE];
-    float drive = m->params->drive;
+    float drive = p->drive;
     float sdrive = pow(drive, -0.7);
     for (int c = 0; c < 2; c++)
     {
@@ -115,7 +120,7 @@ void fuzz_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox
             
             val *= drive;
             
-            val += m->params->rectify;
+            val += p->rectify;
             if (fabs(val) > 1.0)
                 val = (val > 0) ? 1 : -1;
             else
@@ -125,7 +130,7 @@ void fuzz_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox
             
             val = cbox_biquadf_process_sample(&m->post_state[c], &m->post_coeffs, val);
             
-            outputs[c][i] = in + (val - in) * m->params->wet_dry;
+            outputs[c][i] = in + (val - in) * p->wet_dry;
         }
     }
 }
@@ -153,7 +158,7 @@ MODULE_CREATE_FUNCTION(fuzz)
     p->band2 = cbox_config_get_float(cfg_section, "band2", 2000.f);
     p->bandwidth2 = cbox_config_get_float(cfg_section, "bandwidth2", 1);
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     cbox_biquadf_reset(&m->split_state[0]);
     cbox_biquadf_reset(&m->split_state[1]);
     cbox_biquadf_reset(&m->post_state[0]);
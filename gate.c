@@ -44,7 +44,9 @@ struct gate_module
 {
     struct cbox_module module;
 
-    struct gate_params *params, *old_params;
+    struct gate_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
     struct cbox_onepolef_coeffs attack_lp, release_lp, shifter_lp;
     struct cbox_onepolef_state shifter1, shifter2;
     struct cbox_onepolef_state tracker;
@@ -85,18 +87,20 @@ void gate_process_event(struct cbox_module *module, const uint8_t *data, uint32_
 void gate_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct gate_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct gate_params *p = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
         float scale = M_PI * 1000 / m->module.srate;
-        cbox_onepolef_set_lowpass(&m->attack_lp, scale / m->params->attack);
-        cbox_onepolef_set_lowpass(&m->release_lp, scale / m->params->release);
+        cbox_onepolef_set_lowpass(&m->attack_lp, scale / p->attack);
+        cbox_onepolef_set_lowpass(&m->release_lp, scale / p->release);
         cbox_onepolef_set_allpass(&m->shifter_lp, M_PI * 100 / m->module.srate);
-        m->hold_threshold = (int)(m->module.srate * m->params->hold * 0.001);
-        m->old_params = m->params;
+        m->hold_threshold = (int)(m->module.srate * p->hold * 0.001);
+        m->old_params_generation = generation;
     }
     
-    float threshold = m->params->threshold;
+    float threshold = p->threshold;
     float threshold2 = threshold * threshold * 1.73;
     for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
     {
@@ -116,7 +120,7 @@ void gate_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox
             // hold vs release
             if (m->hold_time >= m->hold_threshold)
             {
-                gain = powf(sig / threshold2, 0.5 * (m->params->ratio - 1));
+                gain = powf(sig / threshold2, 0.5 * (p->ratio - 1));
                 // gain = powf(sqrt(sig) / threshold, (m->params->ratio - 1));
             }
             else
@@ -161,7 +165,7 @@ MODULE_CREATE_FUNCTION(gate)
     p->hold = cbox_config_get_float(cfg_section, "hold", 100.0);
     p->release = cbox_config_get_float(cfg_section, "release", 100.0);
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     
     cbox_onepolef_reset(&m->tracker);
     cbox_onepolef_reset(&m->shifter1);
@@ -204,6 +204,7 @@ void cbox_instrument_destroyfunc(struct cbox_objhdr *objhdr)
     }
     free(instrument->aux_output_names);
     free(instrument->aux_outputs);
+    free(instrument->render_buffers);
     CBOX_DELETE(instrument->module);
     free(instrument);
 }
@@ -48,6 +48,10 @@ struct cbox_instrument
     gchar **aux_output_names;
     struct cbox_aux_bus **aux_outputs;
     uint32_t aux_output_count;
+    // private output buffers for parallel rendering (module->outputs buffers
+    // of render_buffer_size samples each), NULL if rendering serially
+    float *render_buffers;
+    uint32_t render_buffer_size;
 };
 
 extern void cbox_instrument_unref_aux_buses(struct cbox_instrument *instrument);
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "config-api.h"
+#include "engine.h"
 #include "errors.h"
 #include "instr.h"
 #include "layer.h"
@@ -246,6 +247,8 @@ struct cbox_layer *cbox_layer_new(struct cbox_scene *scene)
     cbox_uuid_clear(&l->external_output);
     l->external_output_set = FALSE;
     l->external_merger = NULL;
+    cbox_midi_buffer_init(&l->output_buffer);
+    cbox_midi_buffer_set_arena(&l->output_buffer, &scene->engine->midi_arena);
     CBOX_OBJECT_REGISTER(l);
     return l;
 }
@@ -42,7 +42,9 @@ struct limiter_module
 {
     struct cbox_module module;
 
-    struct limiter_params *params, *old_params;
+    struct limiter_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
     
     double cur_gain;
     double atk_coeff, rel_coeff;
@@ -78,13 +80,15 @@ void limiter_process_event(struct cbox_module *module, const uint8_t *data, uint
 void limiter_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct limiter_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
     struct limiter_params *mp = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
+        // update calculated values
         m->atk_coeff = 1 - exp(-1000.0 / (mp->attack * m->module.srate));
         m->rel_coeff = 1 - exp(-1000.0 / (mp->release * m->module.srate));
-        // update calculated values
+        m->old_params_generation = generation;
     }
     const double minval = pow(2.0, -110.0);
     for (int i = 0; i < CBOX_BLOCK_SIZE; ++i)
@@ -137,7 +141,7 @@ MODULE_CREATE_FUNCTION(limiter)
     p->attack = 10.f;
     p->release = 2000.f;
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     m->cur_gain = 0.f;
     
     return &m->module;
@@ -311,13 +311,14 @@ int main(int argc, char *argv[])
         }
     }
 
+    // The engine reads its settings (e.g. render_threads) from the config
+    cbox_config_init(config_name);
     app.tarpool = cbox_tarpool_new();
     app.document = cbox_document_new();
     app.rt = cbox_rt_new(app.document);
     app.engine = cbox_engine_new(app.document, app.rt);
     app.rt->engine = app.engine;
-    
-    cbox_config_init(config_name);
+
     if (tempo < 1)
         tempo = cbox_config_get_float("master", "tempo", 120);
     if (bpb < 1)
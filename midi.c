@@ -32,15 +32,90 @@ int cbox_midi_buffer_write_inline(struct cbox_midi_buffer *buffer, uint32_t time
     return cbox_midi_buffer_write_event(buffer, time, buf, size);
 }
 
-int cbox_midi_buffer_write_event(struct cbox_midi_buffer *buffer, uint32_t time, uint8_t *data, uint32_t size)
+void cbox_midi_arena_init(struct cbox_midi_arena *arena, uint32_t size)
 {
-    struct cbox_midi_event *evt;
-    
-    if (buffer->count >= CBOX_MIDI_MAX_EVENTS)
+    arena->data = size ? malloc(size) : NULL;
+    arena->size = arena->data ? size : 0;
+    arena->used = 0;
+    arena->failed_allocs = 0;
+}
+
+void *cbox_midi_arena_alloc(struct cbox_midi_arena *arena, uint32_t size)
+{
+    uint32_t used;
+    size = (size + 15) & ~15;
+    do {
+        used = arena->used;
+        if (size > arena->size - used)
+        {
+            __sync_fetch_and_add(&arena->failed_allocs, 1);
+            return NULL;
+        }
+    } while(!__sync_bool_compare_and_swap(&arena->used, used, used + size));
+    return arena->data + used;
+}
+
+void cbox_midi_arena_destroy(struct cbox_midi_arena *arena)
+{
+    free(arena->data);
+    arena->data = NULL;
+    arena->size = 0;
+}
+
+// Make room for one more event, moving the events to a twice as large
+// arena block if needed
+static int midi_buffer_reserve_event(struct cbox_midi_buffer *buffer)
+{
+    uint32_t capacity = buffer->ext_events ? buffer->ext_events_capacity : CBOX_MIDI_MAX_EVENTS;
+    if (buffer->count < capacity)
+        return 1;
+    if (!buffer->arena)
+        return 0;
+    struct cbox_midi_event *events = cbox_midi_arena_alloc(buffer->arena, 2 * capacity * sizeof(struct cbox_midi_event));
+    if (!events)
+        return 0;
+    memcpy(events, buffer->ext_events ? buffer->ext_events : buffer->events, buffer->count * sizeof(struct cbox_midi_event));
+    buffer->ext_events = events;
+    buffer->ext_events_capacity = 2 * capacity;
+    return 1;
+}
+
+// Make room for size bytes of long event data, moving the data to a larger
+// arena block (and updating the events that point to it) if needed
+static int midi_buffer_reserve_long_data(struct cbox_midi_buffer *buffer, uint32_t size)
+{
+    uint8_t *old_data = buffer->ext_long_data ? buffer->ext_long_data : buffer->long_data;
+    uint32_t capacity = buffer->ext_long_data ? buffer->ext_long_data_capacity : CBOX_MIDI_MAX_LONG_DATA;
+    if (size <= capacity - buffer->long_data_size)
+        return 1;
+    if (!buffer->arena)
+        return 0;
+    uint32_t new_capacity = 2 * capacity;
+    while(new_capacity - buffer->long_data_size < size)
+        new_capacity *= 2;
+    uint8_t *data = cbox_midi_arena_alloc(buffer->arena, new_capacity);
+    if (!data)
         return 0;
-    if (size > 4 && size > CBOX_MIDI_MAX_LONG_DATA - buffer->long_data_size)
+    memcpy(data, old_data, buffer->long_data_size);
+    struct cbox_midi_event *events = buffer->ext_events ? buffer->ext_events : buffer->events;
+    for (uint32_t i = 0; i < buffer->count; i++)
+    {
+        if (events[i].size > 4)
+            events[i].data_ext = data + (events[i].data_ext - old_data);
+    }
+    buffer->ext_long_data = data;
+    buffer->ext_long_data_capacity = new_capacity;
+    return 1;
+}
+
+static int midi_buffer_append(struct cbox_midi_buffer *buffer, uint32_t time, const uint8_t *data, uint32_t size)
+{
+    if (!midi_buffer_reserve_event(buffer) || (size > 4 && !midi_buffer_reserve_long_data(buffer, size)))
+    {
+        buffer->dropped++;
         return 0;
-    evt = &buffer->events[buffer->count++];
+    }
+    struct cbox_midi_event *evt = (buffer->ext_events ? buffer->ext_events : buffer->events) + buffer->count++;
     evt->time = time;
     evt->size = size;
     if (size <= 4)
@@ -49,35 +124,32 @@ int cbox_midi_buffer_write_event(struct cbox_midi_buffer *buffer, uint32_t time,
     }
     else
     {
-        evt->data_ext = buffer->long_data + buffer->long_data_size;
+        uint8_t *long_data = buffer->ext_long_data ? buffer->ext_long_data : buffer->long_data;
+        evt->data_ext = long_data + buffer->long_data_size;
         memcpy(evt->data_ext, data, size);
         buffer->long_data_size += size;
     }
     return 1;
 }
 
+int cbox_midi_buffer_write_event(struct cbox_midi_buffer *buffer, uint32_t time, uint8_t *data, uint32_t size)
+{
+    return midi_buffer_append(buffer, time, data, size);
+}
+
 int cbox_midi_buffer_copy_event(struct cbox_midi_buffer *buffer, const struct cbox_midi_event *event, int new_time)
 {
-    struct cbox_midi_event *evt;
-    
-    if (buffer->count >= CBOX_MIDI_MAX_EVENTS)
-        return 0;
-    if (event->size > 4 && event->size > CBOX_MIDI_MAX_LONG_DATA - buffer->long_data_size)
-        return 0;
-    evt = &buffer->events[buffer->count++];
-    evt->time = new_time;
-    evt->size = event->size;
-    if (event->size <= 4)
-    {
-        memcpy(evt->data_inline, event->data_inline, event->size);
-    }
-    else
+    return midi_buffer_append(buffer, new_time, cbox_midi_event_get_data(event), event->size);
+}
+
+void cbox_midi_buffer_copy(struct cbox_midi_buffer *dst, const struct cbox_midi_buffer *src)
+{
+    cbox_midi_buffer_clear(dst);
+    for (uint32_t i = 0; i < src->count; i++)
     {
-        evt->data_ext = buffer->long_data + buffer->long_data_size;
-        memcpy(evt->data_ext, event->data_ext, event->size);
-        buffer->long_data_size += event->size;
+        const struct cbox_midi_event *event = cbox_midi_buffer_get_event(src, i);
+        cbox_midi_buffer_copy_event(dst, event, event->time);
     }
-    return 1;
 }
 
 int note_from_string(const char *note)
@@ -36,6 +36,30 @@ struct cbox_midi_event
 
 #define CBOX_MIDI_MAX_EVENTS 256
 #define CBOX_MIDI_MAX_LONG_DATA 256
+// Upper limit for the io/midi_arena_size setting
+#define CBOX_MIDI_ARENA_MAX_SIZE (64 << 20)
+
+// Bump allocator for MIDI buffers that outgrow their inline storage. It is
+// reset at the start of every processing period, so it may only be used by
+// buffers that are cleared and refilled in each period. Allocation is
+// lock-free, so it can be used from parallel render threads.
+struct cbox_midi_arena
+{
+    uint8_t *data;
+    uint32_t size;
+    volatile uint32_t used;
+    // allocations that did not fit, since the arena was created
+    uint32_t failed_allocs;
+};
+
+extern void cbox_midi_arena_init(struct cbox_midi_arena *arena, uint32_t size);
+extern void *cbox_midi_arena_alloc(struct cbox_midi_arena *arena, uint32_t size);
+extern void cbox_midi_arena_destroy(struct cbox_midi_arena *arena);
+
+static inline void cbox_midi_arena_reset(struct cbox_midi_arena *arena)
+{
+    arena->used = 0;
+}
 
 struct cbox_midi_buffer
 {
@@ -43,48 +67,67 @@ struct cbox_midi_buffer
     uint32_t long_data_size;
     struct cbox_midi_event events[CBOX_MIDI_MAX_EVENTS];
     uint8_t long_data[CBOX_MIDI_MAX_LONG_DATA];
+    // If set, the buffer grows into the arena instead of dropping events
+    // once the inline arrays are full
+    struct cbox_midi_arena *arena;
+    // Arena blocks that replaced the inline arrays, NULL if not outgrown yet
+    struct cbox_midi_event *ext_events;
+    uint8_t *ext_long_data;
+    uint32_t ext_events_capacity, ext_long_data_capacity;
+    // Events that could not be stored, since the buffer was initialised
+    uint32_t dropped;
 };
 
 static inline void cbox_midi_buffer_init(struct cbox_midi_buffer *buffer)
 {
     buffer->count = 0;
     buffer->long_data_size = 0;
+    buffer->arena = NULL;
+    buffer->ext_events = NULL;
+    buffer->ext_long_data = NULL;
+    buffer->dropped = 0;
+}
+
+static inline void cbox_midi_buffer_set_arena(struct cbox_midi_buffer *buffer, struct cbox_midi_arena *arena)
+{
+    buffer->arena = arena;
 }
 
 static inline void cbox_midi_buffer_clear(struct cbox_midi_buffer *buffer)
 {
     buffer->count = 0;
     buffer->long_data_size = 0;
+    // The arena blocks are only valid until the end of the period
+    buffer->ext_events = NULL;
+    buffer->ext_long_data = NULL;
 }
 
-static inline void cbox_midi_buffer_copy(struct cbox_midi_buffer *dst, const struct cbox_midi_buffer *src)
+extern void cbox_midi_buffer_copy(struct cbox_midi_buffer *dst, const struct cbox_midi_buffer *src);
+
+static inline uint32_t cbox_midi_buffer_get_count(const struct cbox_midi_buffer *buffer)
 {
-    dst->count = src->count;
-    dst->long_data_size = src->long_data_size;
-    memcpy(dst->events, src->events, src->count * sizeof(struct cbox_midi_event));
-    memcpy(dst->long_data, src->long_data, src->long_data_size);
-    // for any long events, update data pointers
-    for (uint32_t i = 0; i < src->count; i++)
-    {
-        if (dst->events[i].size > 4)
-            dst->events[i].data_ext += &dst->long_data[0] - &src->long_data[0];
-    }
+    return buffer->count;
 }
 
-static inline uint32_t cbox_midi_buffer_get_count(struct cbox_midi_buffer *buffer)
+static inline const struct cbox_midi_event *cbox_midi_buffer_get_event(const struct cbox_midi_buffer *buffer, uint32_t pos)
 {
-    return buffer->count;
+    if (pos >= buffer->count)
+        return NULL;
+    return buffer->ext_events ? &buffer->ext_events[pos] : &buffer->events[pos];
 }
 
-static inline uint32_t cbox_midi_buffer_get_last_event_time(struct cbox_midi_buffer *buffer)
+static inline uint32_t cbox_midi_buffer_get_last_event_time(const struct cbox_midi_buffer *buffer)
 {
     if (!buffer->count)
         return 0;
-    return buffer->events[buffer->count - 1].time;
+    return cbox_midi_buffer_get_event(buffer, buffer->count - 1)->time;
 }
 
-static inline int cbox_midi_buffer_can_store_msg(struct cbox_midi_buffer *buffer, int size)
+static inline int cbox_midi_buffer_can_store_msg(const struct cbox_midi_buffer *buffer, int size)
 {
+    // May still fail later if the arena is exhausted
+    if (buffer->arena)
+        return 1;
     if (buffer->count >= CBOX_MIDI_MAX_EVENTS)
         return 0;
     if (size < 4)
@@ -92,13 +135,6 @@ static inline int cbox_midi_buffer_can_store_msg(struct cbox_midi_buffer *buffer
     return buffer->long_data_size + size <= CBOX_MIDI_MAX_LONG_DATA;
 }
 
-static inline const struct cbox_midi_event *cbox_midi_buffer_get_event(const struct cbox_midi_buffer *buffer, uint32_t pos)
-{
-    if (pos >= buffer->count)
-        return NULL;
-    return &buffer->events[pos];
-}
-
 static inline const uint8_t *cbox_midi_event_get_data(const struct cbox_midi_event *evt)
 {
     return evt->size > 4 ? evt->data_ext : evt->data_inline;
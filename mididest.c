@@ -29,18 +29,12 @@ void cbox_midi_merger_init(struct cbox_midi_merger *dest, struct cbox_midi_buffe
         cbox_midi_buffer_clear(dest->output);
 }
 
-// void cbox_midi_buffer_merge(struct cbox_midi_buffer *output, struct cbox_midi_buffer **inputs, int count, int *positions)
-void cbox_midi_merger_render_to(struct cbox_midi_merger *dest, struct cbox_midi_buffer *output)
-{
-    if (!output)
-        return;
-    cbox_midi_buffer_clear(output);
-    for (struct cbox_midi_source *p = dest->inputs; p; p = p->next)
-    {
-        if (p->streaming)
-            p->bpos = 0;
-    }
+#define MIDI_MERGER_MIN_HEAP_INPUTS 5
 
+// Merge by scanning all the inputs for the earliest event - used when there
+// are too few or too many inputs with events for the heap
+static void midi_merger_render_linear(struct cbox_midi_merger *dest, struct cbox_midi_buffer *output)
+{
     struct cbox_midi_source *first = dest->inputs;
     struct cbox_midi_source *first_not = NULL;
     while(first)
@@ -82,6 +76,125 @@ void cbox_midi_merger_render_to(struct cbox_midi_merger *dest, struct cbox_midi_
     }    
 }
 
+struct midi_merger_heap_item
+{
+    uint32_t time;
+    // position in the input list, so that simultaneous events come out in
+    // the same order as with the linear scan
+    uint32_t order;
+    struct cbox_midi_source *source;
+};
+
+static inline gboolean midi_merger_heap_item_before(const struct midi_merger_heap_item *a, const struct midi_merger_heap_item *b)
+{
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void midi_merger_heap_sift_down(struct midi_merger_heap_item *heap, int count, int pos)
+{
+    struct midi_merger_heap_item item = heap[pos];
+    while(1)
+    {
+        int child = 2 * pos + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && midi_merger_heap_item_before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!midi_merger_heap_item_before(&heap[child], &item))
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = item;
+}
+
+void cbox_midi_merger_render_to(struct cbox_midi_merger *dest, struct cbox_midi_buffer *output)
+{
+    if (!output)
+        return;
+    cbox_midi_buffer_clear(output);
+
+    // Min-heap of the inputs that have events left, keyed by the time of
+    // the next event
+    struct midi_merger_heap_item heap[CBOX_MIDI_MERGER_HEAP_SIZE];
+    int count = 0;
+    uint32_t order = 0;
+    gboolean too_many = FALSE;
+    for (struct cbox_midi_source *p = dest->inputs; p; p = p->next, order++)
+    {
+        if (p->streaming)
+            p->bpos = 0;
+        if (p->bpos >= p->data->count)
+            continue;
+        if (count == CBOX_MIDI_MERGER_HEAP_SIZE)
+        {
+            too_many = TRUE;
+            continue;
+        }
+        heap[count].time = cbox_midi_buffer_get_event(p->data, p->bpos)->time;
+        heap[count].order = order;
+        heap[count].source = p;
+        count++;
+    }
+    // A scan is cheaper than maintaining the heap for a handful of inputs
+    if (too_many || (count > 1 && count < MIDI_MERGER_MIN_HEAP_INPUTS))
+    {
+        midi_merger_render_linear(dest, output);
+        return;
+    }
+    if (count == 1)
+    {
+        struct cbox_midi_source *src = heap[0].source;
+        for (; src->bpos < src->data->count; src->bpos++)
+        {
+            const struct cbox_midi_event *event = cbox_midi_buffer_get_event(src->data, src->bpos);
+            cbox_midi_buffer_copy_event(output, event, event->time);
+        }
+        return;
+    }
+    for (int i = count / 2 - 1; i >= 0; i--)
+        midi_merger_heap_sift_down(heap, count, i);
+    while(count)
+    {
+        struct cbox_midi_source *src = heap[0].source;
+        cbox_midi_buffer_copy_event(output, cbox_midi_buffer_get_event(src->data, src->bpos), heap[0].time);
+        src->bpos++;
+        if (src->bpos < src->data->count)
+            heap[0].time = cbox_midi_buffer_get_event(src->data, src->bpos)->time;
+        else
+            heap[0] = heap[--count];
+        if (count > 1)
+            midi_merger_heap_sift_down(heap, count, 0);
+    }
+}
+
+const struct cbox_midi_buffer *cbox_midi_merger_render_view(struct cbox_midi_merger *dest)
+{
+    struct cbox_midi_source *only = NULL;
+    for (struct cbox_midi_source *p = dest->inputs; p; p = p->next)
+    {
+        uint32_t bpos = p->streaming ? 0 : p->bpos;
+        if (bpos >= p->data->count)
+            continue;
+        if (only)
+        {
+            only = NULL;
+            break;
+        }
+        only = p;
+    }
+    // Buffers pushed from other threads only live until they're consumed,
+    // so those are always copied
+    if (only && only->streaming)
+    {
+        if (dest->output)
+            cbox_midi_buffer_clear(dest->output);
+        return only->data;
+    }
+    cbox_midi_merger_render(dest);
+    return dest->output;
+}
+
 struct cbox_midi_source **cbox_midi_merger_find_source(struct cbox_midi_merger *dest, struct cbox_midi_buffer *buffer)
 {
     for (struct cbox_midi_source **pp = &dest->inputs; *pp; pp = &((*pp)->next))
@@ -180,7 +293,10 @@ void cbox_midi_appsink_supply(struct cbox_midi_appsink *appsink, struct cbox_mid
         if (event)
         {
             if (!cbox_midi_buffer_can_store_msg(sinkbuf, event->size))
+            {
+                sinkbuf->dropped += buffer->count - i;
                 break;
+            }
             uint32_t abs_time_samples = time_offset + event->time;
             uint32_t etime = abs_time_samples;
             if (appsink->tmap)
@@ -34,6 +34,10 @@ struct cbox_midi_source
     struct cbox_midi_merger **merger_ptr;
 };
 
+// Maximum number of inputs with events that are merged using a heap, above
+// that the merger falls back to a linear scan
+#define CBOX_MIDI_MERGER_HEAP_SIZE 64
+
 struct cbox_midi_merger
 {
     struct cbox_midi_source *inputs;
@@ -47,6 +51,10 @@ static inline void cbox_midi_merger_render(struct cbox_midi_merger *dest)
     if (dest->output)
         cbox_midi_merger_render_to(dest, dest->output);
 }
+// Returns the merged events of all the inputs - either the buffer of the
+// only streaming input that has any, passed through without copying, or
+// the output buffer with everything merged into it
+const struct cbox_midi_buffer *cbox_midi_merger_render_view(struct cbox_midi_merger *dest);
 struct cbox_midi_source **cbox_midi_merger_find_source(struct cbox_midi_merger *dest, struct cbox_midi_buffer *buffer);
 void cbox_midi_merger_connect(struct cbox_midi_merger *dest, struct cbox_midi_buffer *buffer, struct cbox_rt *rt, struct cbox_midi_merger **dest_ptr);
 void cbox_midi_merger_disconnect(struct cbox_midi_merger *dest, struct cbox_midi_buffer *buffer, struct cbox_rt *rt);
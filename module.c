@@ -124,6 +124,8 @@ struct cbox_module *cbox_module_manifest_create_module(struct cbox_module_manife
     module->output_samples = malloc(sizeof(float) * CBOX_BLOCK_SIZE * module->outputs);
     module->engine_name = manifest->name;
     cbox_midi_buffer_init(&module->midi_input);
+    if (engine)
+        cbox_midi_buffer_set_arena(&module->midi_input, &engine->midi_arena);
     
     return module;
 }
@@ -141,6 +143,9 @@ void cbox_module_init(struct cbox_module *module, struct cbox_document *doc, str
     module->outputs = outputs;
     module->aux_offset = outputs;
     module->bypass = 0;
+    module->retired_params = NULL;
+    pthread_mutex_init(&module->retired_params_lock, NULL);
+    module->params_generation = 0;
     module->srate = engine->io_env.srate;
     module->srate_inv = 1.0 / module->srate;
     
@@ -253,9 +258,50 @@ gboolean cbox_module_slot_process_cmd(struct cbox_module **psm,
     return cbox_object_default_process_cmd(&sm->cmd_target, fb, cmd, error);
 }
 
-void cbox_module_swap_pointers_and_free(struct cbox_module *sm, void **pptr, void *value)
+static void cbox_module_reclaim_params(struct cbox_module *sm, gboolean all)
 {
-    free(cbox_rt_swap_pointers(sm->rt, pptr, value));
+    struct cbox_rt *rt = sm->rt;
+    uint32_t epoch = rt ? rt->epoch : 0;
+    struct cbox_module_retired_params **pp = &sm->retired_params;
+    while(*pp)
+    {
+        struct cbox_module_retired_params *rp = *pp;
+        if (all || rp->epoch != epoch)
+        {
+            *pp = rp->next;
+            free(rp->params);
+            free(rp);
+        }
+        else
+            pp = &rp->next;
+    }
+}
+
+void cbox_module_publish_params(struct cbox_module *sm, void **pptr, void *value)
+{
+    struct cbox_rt *rt = sm->rt;
+    // Make sure the contents of the new block are visible before the pointer,
+    // and the pointer before the new generation number
+    void *old_value = __sync_lock_test_and_set(pptr, value);
+    __sync_synchronize();
+    __sync_fetch_and_add(&sm->params_generation, 1);
+    pthread_mutex_lock(&sm->retired_params_lock);
+    if (!rt || !rt->started || rt->disconnected)
+    {
+        // Nothing is running the module right now
+        free(old_value);
+        cbox_module_reclaim_params(sm, TRUE);
+    }
+    else
+    {
+        struct cbox_module_retired_params *rp = malloc(sizeof(struct cbox_module_retired_params));
+        rp->params = old_value;
+        rp->epoch = rt->epoch;
+        rp->next = sm->retired_params;
+        sm->retired_params = rp;
+        cbox_module_reclaim_params(sm, FALSE);
+    }
+    pthread_mutex_unlock(&sm->retired_params_lock);
 }
 
 void cbox_module_destroyfunc(struct cbox_objhdr *hdr)
@@ -266,5 +312,7 @@ void cbox_module_destroyfunc(struct cbox_objhdr *hdr)
     free(module->output_samples);
     if (module->destroy)
         module->destroy(module);
+    cbox_module_reclaim_params(module, TRUE);
+    pthread_mutex_destroy(&module->retired_params_lock);
     free(module);
 }
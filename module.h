@@ -25,6 +25,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "midi.h"
 
 #include <stdint.h>
+#include <pthread.h>
 
 CBOX_EXTERN_CLASS(cbox_module)
 
@@ -63,6 +64,15 @@ struct cbox_module_voicingparam_metadata
 {
 };
 
+// A parameter block replaced by cbox_module_publish_params, waiting for the
+// RT thread to move past the period in which it might still have been used
+struct cbox_module_retired_params
+{
+    void *params;
+    uint32_t epoch;
+    struct cbox_module_retired_params *next;
+};
+
 struct cbox_module
 {
     CBOX_OBJECT_HEADER()
@@ -80,6 +90,11 @@ struct cbox_module
     double srate_inv;
     
     struct cbox_command_target cmd_target;
+    struct cbox_module_retired_params *retired_params;
+    // protects retired_params against concurrent publishers
+    pthread_mutex_t retired_params_lock;
+    // incremented on every cbox_module_publish_params
+    volatile uint32_t params_generation;
         
     void (*process_event)(struct cbox_module *module, const uint8_t *data, uint32_t len);
     void (*process_block)(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs);
@@ -127,7 +142,20 @@ extern struct cbox_module *cbox_module_manifest_create_module(struct cbox_module
 extern struct cbox_module *cbox_module_new_from_fx_preset(const char *name, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, GError **error);
 
 extern void cbox_module_init(struct cbox_module *module, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, void *user_data, int inputs, int outputs, cbox_process_cmd cmd_handler, void (*destroy)(struct cbox_module *module));
-extern void cbox_module_swap_pointers_and_free(struct cbox_module *sm, void **pptr, void *value);
+// Replaces the parameter block pointed to by pptr without waiting for the RT
+// thread; the old block is freed once the RT thread has started a new period
+// (on a later call, or when the module is destroyed). Control threads only.
+extern void cbox_module_publish_params(struct cbox_module *sm, void **pptr, void *value);
+
+// Returns the number of parameter blocks published so far. Read it before
+// loading the parameter pointer (once per block): the block loaded after it
+// is at least as new as that generation, so a change is never missed.
+static inline uint32_t cbox_module_get_params_generation(struct cbox_module *sm)
+{
+    uint32_t generation = sm->params_generation;
+    __sync_synchronize();
+    return generation;
+}
 
 extern gboolean cbox_module_slot_process_cmd(struct cbox_module **psm, struct cbox_command_target *fb, struct cbox_osc_command *cmd, const char *subcmd, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, GError **error);
 
@@ -143,7 +171,7 @@ extern gboolean cbox_module_slot_process_cmd(struct cbox_module **psm, struct cb
             return cbox_set_range_error(error, path, minv, maxv);\
         EFFECT_PARAM_CLONE(pp); \
         pp->field = expr(value); \
-        cbox_module_swap_pointers_and_free(&m->module, (void **)&m->params, pp); \
+        cbox_module_publish_params(&m->module, (void **)&m->params, pp); \
     } \
 
 #define EFFECT_PARAM_ARRAY(path, type, array, field, ctype, expr, minv, maxv) \
@@ -155,7 +183,7 @@ extern gboolean cbox_module_slot_process_cmd(struct cbox_module **psm, struct cb
             return cbox_set_range_error(error, path, minv, maxv);\
         EFFECT_PARAM_CLONE(pp); \
         pp->array[pos].field = expr(value); \
-        cbox_module_swap_pointers_and_free(&m->module, (void **)&m->params, pp); \
+        cbox_module_publish_params(&m->module, (void **)&m->params, pp); \
     } \
 
 #define MODULE_CREATE_FUNCTION(module) \
@@ -0,0 +1,193 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pcmcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PCM_CACHE_CHUNK_FRAMES 65536
+
+static gchar *get_cache_pathname(const char *dir, const char *canonical_name)
+{
+    if (!dir || !*dir)
+        return NULL;
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, canonical_name, -1);
+    gchar *filename = g_strdup_printf("%s.pcm", hash);
+    gchar *pathname = g_build_filename(dir, filename, NULL);
+    g_free(filename);
+    g_free(hash);
+    return pathname;
+}
+
+static struct cbox_pcm_cache_entry *map_entry(const char *cache_pathname, const struct stat *source_st)
+{
+    int fd = open(cache_pathname, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < CBOX_PCM_CACHE_DATA_OFFSET)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file open
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const struct cbox_pcm_cache_header *hdr = mapping;
+    if (memcmp(hdr->magic, CBOX_PCM_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->data_offset != CBOX_PCM_CACHE_DATA_OFFSET ||
+        hdr->source_mtime_sec != (int64_t)source_st->st_mtim.tv_sec ||
+        hdr->source_mtime_nsec != (int64_t)source_st->st_mtim.tv_nsec ||
+        hdr->source_size != (uint64_t)source_st->st_size ||
+        (hdr->channels != 1 && hdr->channels != 2) ||
+        hdr->data_offset + hdr->frames * hdr->channels * sizeof(int16_t) > (uint64_t)st.st_size)
+    {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    struct cbox_pcm_cache_entry *entry = malloc(sizeof(struct cbox_pcm_cache_entry));
+    entry->header = hdr;
+    entry->data = (int16_t *)((uint8_t *)mapping + hdr->data_offset);
+    entry->mapping = mapping;
+    entry->mapping_size = st.st_size;
+    return entry;
+}
+
+struct cbox_pcm_cache_entry *cbox_pcm_cache_lookup(const char *cache_dir, const char *canonical_name, const char *source_pathname)
+{
+    struct stat source_st;
+    gchar *cache_pathname = get_cache_pathname(cache_dir, canonical_name);
+    if (!cache_pathname)
+        return NULL;
+    struct cbox_pcm_cache_entry *entry = NULL;
+    if (!stat(source_pathname, &source_st))
+        entry = map_entry(cache_pathname, &source_st);
+    g_free(cache_pathname);
+    return entry;
+}
+
+static gboolean write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *ptr = data;
+    while(size > 0)
+    {
+        ssize_t written = write(fd, ptr, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return TRUE;
+}
+
+struct cbox_pcm_cache_entry *cbox_pcm_cache_create(const char *cache_dir, const char *canonical_name, const char *source_pathname, SNDFILE *sndfile, const SF_INFO *info, gboolean has_loop, uint32_t loop_start, uint32_t loop_end)
+{
+    struct stat source_st;
+    gchar *cache_pathname = get_cache_pathname(cache_dir, canonical_name);
+    if (!cache_pathname)
+        return NULL;
+    if (stat(source_pathname, &source_st))
+    {
+        g_free(cache_pathname);
+        return NULL;
+    }
+    gchar *dir = g_path_get_dirname(cache_pathname);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    // Written under a temporary name and renamed, so that other processes
+    // never see an incomplete entry
+    gchar *temp_pathname = g_strdup_printf("%s.XXXXXX", cache_pathname);
+    int fd = g_mkstemp(temp_pathname);
+    if (fd == -1)
+    {
+        g_warning("Cannot create PCM cache file '%s': %s", temp_pathname, strerror(errno));
+        g_free(temp_pathname);
+        g_free(cache_pathname);
+        return NULL;
+    }
+    // may be shared with other users of the same sample library
+    fchmod(fd, 0644);
+
+    uint8_t header_block[CBOX_PCM_CACHE_DATA_OFFSET];
+    struct cbox_pcm_cache_header *hdr = (struct cbox_pcm_cache_header *)header_block;
+    memset(header_block, 0, sizeof(header_block));
+    memcpy(hdr->magic, CBOX_PCM_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->data_offset = CBOX_PCM_CACHE_DATA_OFFSET;
+    hdr->channels = info->channels;
+    hdr->sample_rate = info->samplerate;
+    hdr->format = info->format;
+    hdr->source_mtime_sec = source_st.st_mtim.tv_sec;
+    hdr->source_mtime_nsec = source_st.st_mtim.tv_nsec;
+    hdr->source_size = source_st.st_size;
+    hdr->has_loop = has_loop;
+    hdr->loop_start = loop_start;
+    hdr->loop_end = loop_end;
+
+    gboolean ok = write_all(fd, header_block, sizeof(header_block));
+    uint64_t frames = 0;
+    int16_t *buffer = malloc(PCM_CACHE_CHUNK_FRAMES * info->channels * sizeof(int16_t));
+    sf_seek(sndfile, 0, SEEK_SET);
+    while(ok)
+    {
+        sf_count_t count = sf_readf_short(sndfile, buffer, PCM_CACHE_CHUNK_FRAMES);
+        if (count <= 0)
+            break;
+        ok = write_all(fd, buffer, count * info->channels * sizeof(int16_t));
+        frames += count;
+    }
+    free(buffer);
+    // The frame count is only known for sure after decoding the whole file
+    hdr->frames = frames;
+    if (ok)
+        ok = pwrite(fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr);
+    if (close(fd))
+        ok = FALSE;
+    if (ok && rename(temp_pathname, cache_pathname))
+        ok = FALSE;
+    if (!ok)
+    {
+        g_warning("Cannot write PCM cache file '%s': %s", cache_pathname, strerror(errno));
+        unlink(temp_pathname);
+    }
+    g_free(temp_pathname);
+
+    struct cbox_pcm_cache_entry *entry = ok ? map_entry(cache_pathname, &source_st) : NULL;
+    g_free(cache_pathname);
+    return entry;
+}
+
+void cbox_pcm_cache_entry_close(struct cbox_pcm_cache_entry *entry)
+{
+    munmap(entry->mapping, entry->mapping_size);
+    free(entry);
+}
@@ -0,0 +1,64 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CBOX_PCMCACHE_H
+#define CBOX_PCMCACHE_H
+
+#include <glib.h>
+#include <sndfile.h>
+#include <stdint.h>
+
+// On-disk cache of decoded sample files. Each entry holds the interleaved
+// 16-bit PCM data of one file, and is mapped into memory instead of being
+// decoded by libsndfile again. Entries are keyed by the canonical name of
+// the waveform, and are regenerated when the modification time or size of
+// the source file change. Enabled by setting [streaming] pcm_cache_dir.
+// All the functions are thread-safe.
+
+#define CBOX_PCM_CACHE_MAGIC "CBOXPCM1"
+// Sample data starts at a page boundary
+#define CBOX_PCM_CACHE_DATA_OFFSET 4096
+
+struct cbox_pcm_cache_header
+{
+    char magic[8];
+    uint32_t data_offset;
+    uint32_t channels;
+    uint32_t sample_rate;
+    int32_t format;
+    uint64_t frames;
+    int64_t source_mtime_sec, source_mtime_nsec;
+    uint64_t source_size;
+    uint32_t has_loop, loop_start, loop_end;
+};
+
+struct cbox_pcm_cache_entry
+{
+    const struct cbox_pcm_cache_header *header;
+    int16_t *data;
+    void *mapping;
+    size_t mapping_size;
+};
+
+// Returns NULL if caching is disabled (cache_dir is NULL), or there is no valid entry for the file
+extern struct cbox_pcm_cache_entry *cbox_pcm_cache_lookup(const char *cache_dir, const char *canonical_name, const char *source_pathname);
+// Decodes the whole file (from the start) into a new cache entry
+extern struct cbox_pcm_cache_entry *cbox_pcm_cache_create(const char *cache_dir, const char *canonical_name, const char *source_pathname, SNDFILE *sndfile, const SF_INFO *info, gboolean has_loop, uint32_t loop_start, uint32_t loop_end);
+extern void cbox_pcm_cache_entry_close(struct cbox_pcm_cache_entry *entry);
+
+#endif
@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <assert.h>
 #include <malloc.h>
 #include <memory.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -33,23 +34,74 @@ void cbox_prefetch_pipe_init(struct cbox_prefetch_pipe *pipe, uint32_t buffer_si
     pipe->buffer_size = buffer_size;
     pipe->min_buffer_frames = min_buffer_frames;
     pipe->sndfile = NULL;
+    pipe->busy = FALSE;
     pipe->state = pps_free;
+    memset(&pipe->stats, 0, sizeof(pipe->stats));
+    pipe->seen_stall_count = 0;
+}
+
+static void prefetch_pipe_resize(struct cbox_prefetch_pipe *pipe, uint32_t buffer_size, uint32_t min_buffer_frames)
+{
+    int16_t *data = malloc(buffer_size);
+    // Out of memory - keep using the old buffer
+    if (!data)
+        return;
+    free(pipe->data);
+    pipe->data = data;
+    pipe->buffer_size = buffer_size;
+    pipe->min_buffer_frames = min_buffer_frames;
+}
+
+// Reads from the mapped PCM cache entry when there is one, from the sound
+// file otherwise
+
+static uint32_t pipe_seek(struct cbox_prefetch_pipe *pipe, sf_count_t frames, int whence)
+{
+    if (pipe->sndfile)
+        return sf_seek(pipe->sndfile, frames, whence);
+    sf_count_t pos = whence == SEEK_CUR ? pipe->file_pos_frame + frames : frames;
+    if (pos > pipe->info.frames)
+        pos = pipe->info.frames;
+    return pos;
+}
+
+static int32_t pipe_read(struct cbox_prefetch_pipe *pipe, int16_t *dest, int32_t frames)
+{
+    if (pipe->sndfile)
+        return sf_readf_short(pipe->sndfile, dest, frames);
+    if (pipe->file_pos_frame + frames > pipe->info.frames)
+        frames = pipe->info.frames - pipe->file_pos_frame;
+    memcpy(dest, pipe->waveform->pcm_cache->data + (size_t)pipe->file_pos_frame * pipe->info.channels, frames * pipe->info.channels * sizeof(int16_t));
+    return frames;
 }
 
 gboolean cbox_prefetch_pipe_openfile(struct cbox_prefetch_pipe *pipe)
 {
-    if (pipe->waveform->taritem)
-        pipe->sndfile = cbox_tarfile_opensndfile(pipe->waveform->tarfile, pipe->waveform->taritem, &pipe->sndstream, &pipe->info);
+    if (pipe->waveform->pcm_cache)
+    {
+        // No file to open, the data is already mapped
+        pipe->info = pipe->waveform->info;
+        pipe->sndfile = NULL;
+        pipe->file_pos_frame = pipe->waveform->preloaded_frames;
+    }
     else
-        pipe->sndfile = sf_open(pipe->waveform->canonical_name, SFM_READ, &pipe->info);
-    if (!pipe->sndfile)
-        return FALSE;
-    pipe->file_pos_frame = sf_seek(pipe->sndfile, pipe->waveform->preloaded_frames, SEEK_SET);
+    {
+        if (pipe->waveform->taritem)
+            pipe->sndfile = cbox_tarfile_opensndfile(pipe->waveform->tarfile, pipe->waveform->taritem, &pipe->sndstream, &pipe->info);
+        else
+            pipe->sndfile = sf_open(pipe->waveform->canonical_name, SFM_READ, &pipe->info);
+        if (!pipe->sndfile)
+            return FALSE;
+        pipe->file_pos_frame = sf_seek(pipe->sndfile, pipe->waveform->preloaded_frames, SEEK_SET);
+    }
     if (pipe->file_loop_end > pipe->info.frames)
         pipe->file_loop_end = pipe->info.frames;
     pipe->buffer_loop_end = pipe->buffer_size / (sizeof(int16_t) * pipe->info.channels);
     pipe->produced = pipe->file_pos_frame;
     pipe->write_ptr = 0;
+    // assume playback at the original pitch until measured
+    pipe->consumption_rate = pipe->info.samplerate;
+    pipe->last_consumed = pipe->consumed;
     pipe->state = pps_active;
     
     return TRUE;
@@ -60,9 +112,20 @@ void cbox_prefetch_pipe_consumed(struct cbox_prefetch_pipe *pipe, uint32_t frame
     pipe->consumed += frames;
 }
 
+static void prefetch_pipe_record_read(struct cbox_prefetch_pipe *pipe, int64_t usecs)
+{
+    int bucket = g_bit_storage((gulong)(usecs >> 8));
+    if (bucket >= CBOX_PREFETCH_LATENCY_BUCKETS)
+        bucket = CBOX_PREFETCH_LATENCY_BUCKETS - 1;
+    pipe->stats.read_latency[bucket]++;
+    pipe->stats.reads++;
+}
+
 void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
 {
     gboolean retry;
+    size_t start_produced = pipe->produced;
+    gboolean did_read = FALSE;
     do {
         retry = FALSE;
         // XXXKF take consumption rate into account
@@ -77,7 +140,7 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
             
             // XXXKF This may or may not be stupid. I didn't put much thought into it.
             pipe->produced += overrun;
-            pipe->file_pos_frame = sf_seek(pipe->sndfile, overrun, SEEK_CUR);
+            pipe->file_pos_frame = pipe_seek(pipe, overrun, SEEK_CUR);
             pipe->write_ptr += overrun;
             if (pipe->write_ptr >= pipe->buffer_loop_end)
                 pipe->write_ptr %= pipe->buffer_loop_end;
@@ -107,15 +170,14 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
             if (pipe->file_loop_start == (uint32_t)-1 || (pipe->loop_count && pipe->play_count >= pipe->loop_count - 1))
             {
                 pipe->finished = TRUE;
-                for (int i = 0; i < readsize * pipe->info.channels; i++)
-                    pipe->data[pipe->write_ptr * pipe->info.channels + i] = rand();
+                memset(pipe->data + pipe->write_ptr * pipe->info.channels, 0, readsize * pipe->info.channels * sizeof(int16_t));
                 break;
             }
             else
             {
                 pipe->play_count++;
                 pipe->file_pos_frame = pipe->file_loop_start;
-                sf_seek(pipe->sndfile, pipe->file_loop_start, SEEK_SET);
+                pipe_seek(pipe, pipe->file_loop_start, SEEK_SET);
             }
         }
         // If reading across file loop boundary, read up to loop end and 
@@ -126,18 +188,26 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
             retry = TRUE;
         }
         
-        int32_t actread = sf_readf_short(pipe->sndfile, pipe->data + pipe->write_ptr * pipe->info.channels, readsize);
+        int64_t read_start = g_get_monotonic_time();
+        int32_t actread = pipe_read(pipe, pipe->data + pipe->write_ptr * pipe->info.channels, readsize);
+        prefetch_pipe_record_read(pipe, g_get_monotonic_time() - read_start);
+        did_read = TRUE;
         pipe->produced += actread;
         pipe->file_pos_frame += actread;
         pipe->write_ptr += actread;
     } while(retry);
+
+    // A near miss - the voice was about to run out of data while reading
+    if (did_read && (int32_t)(start_produced - pipe->consumed) < (int32_t)(pipe->buffer_loop_end / 8))
+        pipe->stats.late_reads++;
 }
 
 void cbox_prefetch_pipe_closefile(struct cbox_prefetch_pipe *pipe)
 {
     assert(pipe->state == pps_closing);
-    assert(pipe->sndfile);
-    sf_close(pipe->sndfile);
+    assert(pipe->sndfile || pipe->waveform->pcm_cache);
+    if (pipe->sndfile)
+        sf_close(pipe->sndfile);
     pipe->sndfile = NULL;
     pipe->state = pps_free;
 }
@@ -153,6 +223,167 @@ void cbox_prefetch_pipe_close(struct cbox_prefetch_pipe *pipe)
     }
 }
 
+// Returns TRUE if the pipe should be given to an I/O thread
+static gboolean prefetch_pipe_needs_io(struct cbox_prefetch_pipe *pipe, float elapsed)
+{
+    switch(pipe->state)
+    {
+    case pps_opening:
+        pipe->deadline = 0;
+        return TRUE;
+    case pps_active:
+        if (pipe->returned)
+        {
+            pipe->state = pps_closing;
+            // not urgent, but still needs doing before the pipe can be reused
+            pipe->deadline = 1;
+            return TRUE;
+        }
+        else
+        {
+            if (elapsed > 0)
+            {
+                float rate = (pipe->consumed - pipe->last_consumed) / elapsed;
+                pipe->consumption_rate += (rate - pipe->consumption_rate) * 0.25;
+            }
+            pipe->last_consumed = pipe->consumed;
+            // Same conditions as the ones that make cbox_prefetch_pipe_fetch
+            // do anything
+            int32_t supply = pipe->produced - pipe->consumed;
+            if (supply >= 0 && ((uint32_t)supply >= pipe->buffer_loop_end || pipe->buffer_loop_end - supply < pipe->min_buffer_frames))
+                return FALSE;
+            pipe->deadline = supply > 0 ? supply / (pipe->consumption_rate > 1 ? pipe->consumption_rate : 1) : 0;
+            return TRUE;
+        }
+    case pps_closing:
+        pipe->deadline = 1;
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static uint32_t prefetch_stack_min_buffer_frames(struct cbox_prefetch_stack *stack, uint32_t buffer_size)
+{
+    return (uint64_t)stack->initial_min_buffer_frames * buffer_size / stack->initial_buffer_size;
+}
+
+static void prefetch_pipe_do_io(struct cbox_prefetch_stack *stack, struct cbox_prefetch_pipe *pipe)
+{
+    switch(pipe->state)
+    {
+    case pps_opening:
+        if (!cbox_prefetch_pipe_openfile(pipe))
+            pipe->state = pps_error;
+        assert(pipe->state != pps_opening);
+        break;
+    case pps_active:
+        cbox_prefetch_pipe_fetch(pipe);
+        break;
+    case pps_closing:
+    {
+        // The voice has let go of the buffer, so this is the place to
+        // replace it with a larger one
+        uint32_t buffer_size = stack->buffer_size;
+        if (pipe->buffer_size < buffer_size)
+            prefetch_pipe_resize(pipe, buffer_size, prefetch_stack_min_buffer_frames(stack, buffer_size));
+        cbox_prefetch_pipe_closefile(pipe);
+        break;
+    }
+    default:
+        break;
+    }
+    __sync_synchronize();
+    pipe->busy = FALSE;
+}
+
+// Called with queue_lock held
+void cbox_prefetch_stack_schedule(struct cbox_prefetch_stack *stack, float elapsed)
+{
+    // Keep the entries not yet taken by the I/O threads, their deadlines
+    // are updated below along with everything else
+    int count = 0;
+    for (int i = stack->queue_pos; i < stack->queue_len; i++)
+    {
+        struct cbox_prefetch_pipe *pipe = &stack->pipes[stack->queue[i]];
+        if (prefetch_pipe_needs_io(pipe, elapsed))
+            stack->queue[count++] = stack->queue[i];
+        else
+            pipe->busy = FALSE;
+    }
+    for (int i = 0; i < stack->pipe_count; i++)
+    {
+        struct cbox_prefetch_pipe *pipe = &stack->pipes[i];
+        if (pipe->busy)
+            continue;
+        if (prefetch_pipe_needs_io(pipe, elapsed))
+        {
+            pipe->busy = TRUE;
+            stack->queue[count++] = i;
+        }
+    }
+    // Insertion sort by deadline - the list is short, and mostly sorted
+    // already when carried over from the previous pass
+    for (int i = 1; i < count; i++)
+    {
+        int pos = stack->queue[i];
+        float deadline = stack->pipes[pos].deadline;
+        int j = i;
+        while(j > 0 && stack->pipes[stack->queue[j - 1]].deadline > deadline)
+        {
+            stack->queue[j] = stack->queue[j - 1];
+            j--;
+        }
+        stack->queue[j] = pos;
+    }
+    stack->queue_pos = 0;
+    stack->queue_len = count;
+}
+
+// Double the buffer size for pipes reused from now on if any of the pipes
+// ran dry or nearly did since the last pass. Once a second at most, as a
+// single disk stall is usually noticed by several pipes.
+void cbox_prefetch_stack_adapt(struct cbox_prefetch_stack *stack, int64_t now)
+{
+    gboolean stalled = FALSE;
+    for (int i = 0; i < stack->pipe_count; i++)
+    {
+        struct cbox_prefetch_pipe *pipe = &stack->pipes[i];
+        uint32_t stall_count = pipe->stats.underruns + pipe->stats.late_reads;
+        if (stall_count != pipe->seen_stall_count)
+        {
+            pipe->seen_stall_count = stall_count;
+            stalled = TRUE;
+        }
+    }
+    if (!stalled || stack->buffer_size >= stack->max_buffer_size || now - stack->last_grow_time < 1000000)
+        return;
+    uint32_t buffer_size = stack->buffer_size * 2;
+    stack->buffer_size = buffer_size < stack->max_buffer_size ? buffer_size : stack->max_buffer_size;
+    stack->last_grow_time = now;
+}
+
+static void *prefetch_io_thread(void *user_data)
+{
+    struct cbox_prefetch_stack *stack = user_data;
+
+    pthread_mutex_lock(&stack->queue_lock);
+    while(!stack->finished)
+    {
+        if (stack->queue_pos >= stack->queue_len)
+        {
+            pthread_cond_wait(&stack->queue_cond, &stack->queue_lock);
+            continue;
+        }
+        struct cbox_prefetch_pipe *pipe = &stack->pipes[stack->queue[stack->queue_pos++]];
+        pthread_mutex_unlock(&stack->queue_lock);
+        prefetch_pipe_do_io(stack, pipe);
+        pthread_mutex_lock(&stack->queue_lock);
+    }
+    pthread_mutex_unlock(&stack->queue_lock);
+    return 0;
+}
+
 static void *prefetch_thread(void *user_data)
 {
     struct cbox_prefetch_stack *stack = user_data;
@@ -160,42 +391,34 @@ static void *prefetch_thread(void *user_data)
     while(!stack->finished)
     {
         usleep(1000);
-        for (int i = 0; i < stack->pipe_count; i++)
+        int64_t now = g_get_monotonic_time();
+        float elapsed = (now - stack->last_schedule_time) / 1000000.0;
+        stack->last_schedule_time = now;
+        cbox_prefetch_stack_adapt(stack, now);
+
+        pthread_mutex_lock(&stack->queue_lock);
+        cbox_prefetch_stack_schedule(stack, elapsed);
+        if (stack->io_thread_count)
         {
-            struct cbox_prefetch_pipe *pipe = &stack->pipes[i];
-            switch(pipe->state)
-            {
-            case pps_free:
-            case pps_finished:
-            case pps_error:
-                break;
-            case pps_opening:
-                if (!cbox_prefetch_pipe_openfile(pipe))
-                    pipe->state = pps_error;
-                assert(pipe->state != pps_opening);
-                break;
-            case pps_active:
-                if (pipe->returned)
-                    pipe->state = pps_closing;
-                else
-                    cbox_prefetch_pipe_fetch(pipe);
-                break;
-            case pps_closing:
-                cbox_prefetch_pipe_closefile(pipe);
-                break;
-            default:
-                break;
-            }
+            if (stack->queue_len)
+                pthread_cond_broadcast(&stack->queue_cond);
+            pthread_mutex_unlock(&stack->queue_lock);
+            continue;
         }
+        pthread_mutex_unlock(&stack->queue_lock);
+        // No I/O threads - do all the work here, most urgent first
+        while(stack->queue_pos < stack->queue_len)
+            prefetch_pipe_do_io(stack, &stack->pipes[stack->queue[stack->queue_pos++]]);
     }
     return 0;
 }
 
-struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_size, uint32_t min_buffer_frames)
+struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_size, uint32_t max_buffer_size, uint32_t min_buffer_frames, int io_threads)
 {
     struct cbox_prefetch_stack *stack = calloc(1, sizeof(struct cbox_prefetch_stack));
     stack->pipes = calloc(npipes, sizeof(struct cbox_prefetch_pipe));
     stack->next_free_pipe = calloc(npipes, sizeof(int));
+    stack->queue = calloc(npipes, sizeof(int));
     
     for (int i = 0; i < npipes; i++)
     {
@@ -204,7 +427,29 @@ struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_
     }
     stack->pipe_count = npipes;
     stack->last_free_pipe = npipes - 1;
+    stack->buffer_size = buffer_size;
+    stack->initial_buffer_size = buffer_size;
+    stack->initial_min_buffer_frames = min_buffer_frames;
+    stack->max_buffer_size = max_buffer_size > buffer_size ? max_buffer_size : buffer_size;
+    stack->last_grow_time = 0;
     stack->finished = FALSE;
+    stack->queue_pos = 0;
+    stack->queue_len = 0;
+    pthread_mutex_init(&stack->queue_lock, NULL);
+    pthread_cond_init(&stack->queue_cond, NULL);
+    stack->last_schedule_time = g_get_monotonic_time();
+
+    stack->thr_io = calloc(io_threads > 0 ? io_threads : 1, sizeof(pthread_t));
+    stack->io_thread_count = 0;
+    for (int i = 0; i < io_threads; i++)
+    {
+        if (pthread_create(&stack->thr_io[i], NULL, prefetch_io_thread, stack))
+        {
+            g_warning("Cannot create a prefetch I/O thread, using %d instead of %d.", i, io_threads);
+            break;
+        }
+        stack->io_thread_count = i + 1;
+    }
     
     if (pthread_create(&stack->thr_prefetch, NULL, prefetch_thread, stack))
     {
@@ -247,6 +492,7 @@ struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *s
     pipe->returned = FALSE;
     pipe->produced = waveform->preloaded_frames;
     pipe->consumed = 0;
+    pipe->last_consumed = 0;
     pipe->play_count = 0;
     pipe->loop_count = loop_count;
     
@@ -296,13 +542,27 @@ int cbox_prefetch_stack_get_active_pipe_count(struct cbox_prefetch_stack *stack)
     return count;
 }
 
+uint32_t cbox_prefetch_stack_get_min_buffer_frames(struct cbox_prefetch_stack *stack)
+{
+    return prefetch_stack_min_buffer_frames(stack, stack->buffer_size);
+}
+
 void cbox_prefetch_stack_destroy(struct cbox_prefetch_stack *stack)
 {
     void *result = NULL;
+    pthread_mutex_lock(&stack->queue_lock);
     stack->finished = TRUE;
+    pthread_cond_broadcast(&stack->queue_cond);
+    pthread_mutex_unlock(&stack->queue_lock);
     pthread_join(stack->thr_prefetch, &result);
+    for (int i = 0; i < stack->io_thread_count; i++)
+        pthread_join(stack->thr_io[i], &result);
     for (int i = 0; i < stack->pipe_count; i++)
         cbox_prefetch_pipe_close(&stack->pipes[i]);
+    pthread_mutex_destroy(&stack->queue_lock);
+    pthread_cond_destroy(&stack->queue_cond);
+    free(stack->thr_io);
+    free(stack->queue);
     free(stack->next_free_pipe);
     free(stack->pipes);
     free(stack);
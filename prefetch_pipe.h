@@ -27,6 +27,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "tarfile.h"
 
 #define PIPE_MIN_PREFETCH_SIZE_FRAMES 2048
+#define CBOX_PREFETCH_LATENCY_BUCKETS 8
 
 struct cbox_waveform;
 
@@ -41,6 +42,20 @@ enum cbox_prefetch_pipe_state
     pps_closed,
 };
 
+// Each counter is only incremented by one thread, and is read without
+// locking for reporting purposes
+struct cbox_prefetch_pipe_stats
+{
+    // voices that ran out of streamed data before the end of the sample
+    // (counted by the audio thread)
+    uint32_t underruns;
+    // reads that completed with less than 1/8 of the buffer left to play
+    uint32_t late_reads;
+    uint32_t reads;
+    // read durations: <256us, <512us, <1ms, <2ms, <4ms, <8ms, <16ms, longer
+    uint32_t read_latency[CBOX_PREFETCH_LATENCY_BUCKETS];
+};
+
 struct cbox_prefetch_pipe
 {
     union {
@@ -64,12 +79,33 @@ struct cbox_prefetch_pipe
     size_t consumed;
     gboolean finished;
     gboolean returned;
+    // set by the scheduler when the pipe is queued for an I/O thread,
+    // cleared by the I/O thread when done
+    volatile gboolean busy;
+    // estimated consumption rate, in frames per second
+    float consumption_rate;
+    size_t last_consumed;
+    // seconds until the buffered data runs out at the current rate
+    float deadline;
+    // cumulative over all the voices that used this pipe
+    struct cbox_prefetch_pipe_stats stats;
+    // underruns + late reads as of the last scheduler pass
+    uint32_t seen_stall_count;
 };
 
 extern void cbox_prefetch_pipe_init(struct cbox_prefetch_pipe *pipe, uint32_t buffer_size, uint32_t min_buffer_frames);
 extern void cbox_prefetch_pipe_consumed(struct cbox_prefetch_pipe *pipe, uint32_t frames);
 extern void cbox_prefetch_pipe_close(struct cbox_prefetch_pipe *pipe);
 
+static inline void cbox_prefetch_pipe_stats_add(struct cbox_prefetch_pipe_stats *total, const struct cbox_prefetch_pipe_stats *stats)
+{
+    total->underruns += stats->underruns;
+    total->late_reads += stats->late_reads;
+    total->reads += stats->reads;
+    for (int i = 0; i < CBOX_PREFETCH_LATENCY_BUCKETS; i++)
+        total->read_latency[i] += stats->read_latency[i];
+}
+
 static inline uint32_t cbox_prefetch_pipe_get_remaining(struct cbox_prefetch_pipe *pipe)
 {
     assert(pipe->consumed <= pipe->produced);
@@ -84,12 +120,35 @@ struct cbox_prefetch_stack
     pthread_t thr_prefetch;
     int last_free_pipe;
     gboolean finished;
+
+    // Pipes that need opening, refilling or closing, most urgent first
+    // (pipes before queue_pos have already been taken by the I/O threads)
+    int *queue;
+    int queue_pos, queue_len;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    int io_thread_count;
+    pthread_t *thr_io;
+    int64_t last_schedule_time;
+
+    // Buffer size for newly (re)allocated pipe buffers. Doubled, up to
+    // max_buffer_size, when pipes fall behind; pipes pick up the new size
+    // when they are closed after use.
+    volatile uint32_t buffer_size;
+    uint32_t initial_buffer_size, initial_min_buffer_frames, max_buffer_size;
+    int64_t last_grow_time;
 };
 
-extern struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_size, uint32_t min_buffer_frames);
+extern struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_size, uint32_t max_buffer_size, uint32_t min_buffer_frames, int io_threads);
 extern struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *stack, struct cbox_waveform *waveform, uint32_t file_loop_start, uint32_t file_loop_end, uint32_t loop_count);
 extern void cbox_prefetch_stack_push(struct cbox_prefetch_stack *stack, struct cbox_prefetch_pipe *pipe);
 extern int cbox_prefetch_stack_get_active_pipe_count(struct cbox_prefetch_stack *stack);
+extern uint32_t cbox_prefetch_stack_get_min_buffer_frames(struct cbox_prefetch_stack *stack);
+// Called by the prefetch thread on every pass, now is in microseconds
+extern void cbox_prefetch_stack_adapt(struct cbox_prefetch_stack *stack, int64_t now);
+// Called by the prefetch thread on every pass with queue_lock held, elapsed
+// is the time since the previous pass in seconds
+extern void cbox_prefetch_stack_schedule(struct cbox_prefetch_stack *stack, float elapsed);
 extern void cbox_prefetch_stack_destroy(struct cbox_prefetch_stack *stack);
 
 #endif
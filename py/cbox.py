@@ -23,11 +23,17 @@ class GetUUID:
     and stores the passed UUID in its uuid attribute.
 
     Example use: GetUUID('/command', arg1, arg2...).uuid
+
+    If a progress keyword argument is given, /load_progress callbacks are
+    passed to it as progress(done, total).
     """
-    def __init__(self, cmd, *cmd_args):
+    def __init__(self, cmd, *cmd_args, **kwargs):
+        progress = kwargs.get('progress', None)
         def callback(cmd, fb, args):
             if cmd == "/uuid" and len(args) == 1:
                 self.uuid = args[0]
+            elif cmd == "/load_progress" and progress is not None and len(args) == 2:
+                progress(args[0], args[1])
             else:
                 raise ValueException("Unexpected callback: %s" % cmd)
         self.callback = callback
@@ -935,22 +941,32 @@ class SamplerEngine(NonDocObj):
         channel_prevoices = AltPropName('/channel_prevoices', {int:int})
         """MIDI channel -> (program number, program name)"""
         patches = {int:(int, str)}
-
-    def load_patch_from_cfg(self, patch_no, cfg_section, display_name):
-        """Load a sampler program from an 'spgm:' config section."""
-        return self.cmd_makeobj("/load_patch", int(patch_no), cfg_section, display_name)
-
-    def load_patch_from_string(self, patch_no, sample_dir, sfz_data, display_name):
+        """Number of samples between recalculations of filter coefficients."""
+        filter_control_period = int
+        """Member channel counts of the lower and upper MPE zones (0 = disabled)."""
+        mpe_zones = (int, int)
+
+    def _load_patch(self, cmd, progress, *args):
+        if progress is None:
+            return self.cmd_makeobj(cmd, *args)
+        return Document.map_uuid(GetUUID(self.path + cmd, *(args + (1,)), progress = progress).uuid)
+
+    def load_patch_from_cfg(self, patch_no, cfg_section, display_name, progress = None):
+        """Load a sampler program from an 'spgm:' config section.
+        If progress is given, it is called as progress(done, total) while the samples are being loaded."""
+        return self._load_patch("/load_patch", progress, int(patch_no), cfg_section, display_name)
+
+    def load_patch_from_string(self, patch_no, sample_dir, sfz_data, display_name, progress = None):
         """Load a sampler program from a string, using given filesystem path for sample directory."""
-        return self.cmd_makeobj("/load_patch_from_string", int(patch_no), sample_dir, sfz_data, display_name)
+        return self._load_patch("/load_patch_from_string", progress, int(patch_no), sample_dir, sfz_data, display_name)
 
-    def load_patch_from_file(self, patch_no, sfz_name, display_name):
+    def load_patch_from_file(self, patch_no, sfz_name, display_name, progress = None):
         """Load a sampler program from a filesystem file."""
-        return self.cmd_makeobj("/load_patch_from_file", int(patch_no), sfz_name, display_name)
+        return self._load_patch("/load_patch_from_file", progress, int(patch_no), sfz_name, display_name)
 
-    def load_patch_from_tar(self, patch_no, tar_name, sfz_name, display_name):
+    def load_patch_from_tar(self, patch_no, tar_name, sfz_name, display_name, progress = None):
         """Load a sampler program from a tar file."""
-        return self.cmd_makeobj("/load_patch_from_file", int(patch_no), "sbtar:%s;%s" % (tar_name, sfz_name), display_name)
+        return self._load_patch("/load_patch_from_file", progress, int(patch_no), "sbtar:%s;%s" % (tar_name, sfz_name), display_name)
 
     def set_patch(self, channel, patch_no):
         """Select patch identified by patch_no in a specified MIDI channel."""
@@ -964,9 +980,26 @@ class SamplerEngine(NonDocObj):
     def set_polyphony(self, polyphony):
         """Set a maximum number of voices that can be played at a given time."""
         self.cmd("/polyphony", None, int(polyphony))
+    def set_filter_control_period(self, period):
+        """Set the number of samples between recalculations of filter coefficients
+        (a multiple of the block size, or 0 for a default based on the sample rate)."""
+        self.cmd("/filter_control_period", None, int(period))
+    def set_mpe_zone(self, zone, members):
+        """Configure the lower (zone 0, master channel 1) or upper (zone 1,
+        master channel 16) MPE zone with a number of member channels, or
+        disable it with members = 0."""
+        self.cmd("/mpe_zone", None, int(zone), int(members))
     def get_patches(self):
         """Return a map of program identifiers to program objects."""
         return self.get_thing("/patches", '/patch', {int : (str, SamplerProgram, int)})
+    def get_streaming_stats(self):
+        """Return disk streaming counters: underruns (voices cut short by a
+        pipe running dry), late_reads (reads that completed when less than
+        1/8 of the buffer was left), reads, read_latency (histogram of read
+        durations: <256us, <512us, ... <16ms, longer) summed over all pipes,
+        the current buffer_size and min_buffer_frames, and pipe: a map of
+        pipe index to (underruns, late_reads, reads, *read_latency)."""
+        return self.get_things("/streaming_stats", ["underruns", "late_reads", "reads", "read_latency", "buffer_size", "min_buffer_frames", "%pipe"])
     def get_keyswitch_state(self, channel, group):
         """Return a map of program identifiers to program objects."""
         return self.get_thing("/keyswitch_state", '/last_key', int, channel, group)
@@ -1102,6 +1135,10 @@ Document.classmap['cbox_module'] = DocModule
 class DocEngine(DocObj):
     class Status:
         scenes = AltPropName('/scene', [DocScene])
+        """Number of MIDI events lost so far because a buffer was full."""
+        midi_dropped = int
+        """Number of times the per-period MIDI overflow storage ran out."""
+        midi_arena_failed_allocs = int
     def init_object(self):
         self.master_effect = EffectSlot(self.path + "/master_effect")
         self.master_effect.init_object()
@@ -117,7 +117,9 @@ struct reverb_module
     struct cbox_module module;
 
     struct cbox_onepolef_coeffs filter_coeffs[2];
-    struct reverb_params *params, *old_params;
+    struct reverb_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
     struct reverb_state *state;
     float gain;
     int pos;
@@ -209,20 +211,21 @@ static void cbox_reverb_process_leg(struct reverb_module *m, int u)
 void reverb_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct reverb_module *m = (struct reverb_module *)module;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
     struct reverb_params *p = m->params;
     
     float dryamt = p->dryamt;
     float wetamt = p->wetamt;
     struct reverb_state *s = m->state;
 
-    if (p != m->old_params)
+    if (generation != m->old_params_generation)
     {
         float tpdsr = 2.f * M_PI * m->module.srate_inv;
         cbox_onepolef_set_lowpass(&m->filter_coeffs[0], p->lowpass * tpdsr);
         cbox_onepolef_set_highpass(&m->filter_coeffs[1], p->highpass * tpdsr);
         float rv = p->decay_time * m->module.srate / 1000;
         m->gain = pow(0.001, s->total_time / (rv * s->leg_count / 2));
-        m->old_params = p;
+        m->old_params_generation = generation;
     }
 
     int mid = s->leg_count >> 1;
@@ -297,7 +300,7 @@ MODULE_CREATE_FUNCTION(reverb)
     m->module.process_event = reverb_process_event;
     m->module.process_block = reverb_process_block;
     m->pos = 0;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     m->params = malloc(sizeof(struct reverb_params));
     m->params->decay_time = cbox_config_get_float(cfg_section, "decay_time", 1000);
     m->params->dryamt = cbox_config_get_gain_db(cfg_section, "dry_gain", 0.f);
@@ -26,7 +26,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "seq.h"
 #include "song.h"
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 CBOX_CLASS_DEFINITION_ROOT(cbox_rt)
@@ -37,9 +43,146 @@ struct cbox_rt_cmd_instance
 {
     struct cbox_rt_cmd_definition *definition;
     void *user_data;
-    int *completed_ptr; // for synchronous commands only
+    volatile int *completed_ptr; // for synchronous commands only
 };
 
+////////////////////////////////////////////////////////////////////////////////////////
+
+// Completion flag states for synchronous commands
+#define RT_CMD_PENDING 0
+#define RT_CMD_DONE 1
+#define RT_CMD_WAITING 2
+
+static inline void futex_wake(volatile int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Returns immediately if *addr != value, otherwise sleeps until woken up or
+// until timeout_ms passes
+static inline void futex_wait(volatile int *addr, int value, int timeout_ms)
+{
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, &ts, NULL, 0);
+}
+
+// Bounded multiple-producer, single-consumer queue of command instances.
+// Each slot has a sequence number that tells whether it is free for the
+// writer with a given position, or contains data for the reader.
+struct cbox_rt_cmd_slot
+{
+    volatile uint32_t sequence;
+    struct cbox_rt_cmd_instance cmd;
+};
+
+struct cbox_rt_cmd_queue
+{
+    struct cbox_rt_cmd_slot *slots;
+    uint32_t mask;
+    volatile uint32_t write_pos;
+    char pad1[64 - sizeof(uint32_t)];
+    volatile uint32_t read_pos;
+    char pad2[64 - sizeof(uint32_t)];
+    // producers waiting for the RT thread to free some space
+    volatile int space_waiters;
+    volatile int space_seq;
+};
+
+static struct cbox_rt_cmd_queue *cbox_rt_cmd_queue_new(uint32_t items)
+{
+    assert(!(items & (items - 1)));
+    struct cbox_rt_cmd_queue *q = calloc(1, sizeof(struct cbox_rt_cmd_queue));
+    q->slots = calloc(items, sizeof(struct cbox_rt_cmd_slot));
+    q->mask = items - 1;
+    for (uint32_t i = 0; i < items; i++)
+        q->slots[i].sequence = i;
+    q->write_pos = 0;
+    q->read_pos = 0;
+    return q;
+}
+
+static void cbox_rt_cmd_queue_destroy(struct cbox_rt_cmd_queue *q)
+{
+    free(q->slots);
+    free(q);
+}
+
+static gboolean cbox_rt_cmd_queue_push(struct cbox_rt_cmd_queue *q, const struct cbox_rt_cmd_instance *cmd)
+{
+    uint32_t pos = q->write_pos;
+    struct cbox_rt_cmd_slot *slot;
+    while(1)
+    {
+        slot = &q->slots[pos & q->mask];
+        int32_t diff = (int32_t)(slot->sequence - pos);
+        if (diff == 0)
+        {
+            if (__sync_bool_compare_and_swap(&q->write_pos, pos, pos + 1))
+                break;
+        }
+        else if (diff < 0)
+            return FALSE; // full
+        pos = q->write_pos;
+    }
+    slot->cmd = *cmd;
+    // Make sure the command is in the slot before handing it over to the reader
+    __sync_synchronize();
+    slot->sequence = pos + 1;
+    return TRUE;
+}
+
+static gboolean cbox_rt_cmd_queue_peek(struct cbox_rt_cmd_queue *q, struct cbox_rt_cmd_instance *cmd)
+{
+    struct cbox_rt_cmd_slot *slot = &q->slots[q->read_pos & q->mask];
+    if (slot->sequence != q->read_pos + 1)
+        return FALSE;
+    __sync_synchronize();
+    *cmd = slot->cmd;
+    return TRUE;
+}
+
+static void cbox_rt_cmd_queue_consume(struct cbox_rt_cmd_queue *q)
+{
+    struct cbox_rt_cmd_slot *slot = &q->slots[q->read_pos & q->mask];
+    __sync_synchronize();
+    slot->sequence = q->read_pos + q->mask + 1;
+    q->read_pos++;
+}
+
+// Called by the RT thread after consuming some commands
+static void cbox_rt_cmd_queue_notify_space(struct cbox_rt_cmd_queue *q)
+{
+    __sync_synchronize();
+    if (q->space_waiters)
+    {
+        __sync_fetch_and_add(&q->space_seq, 1);
+        futex_wake(&q->space_seq);
+    }
+}
+
+static void cbox_rt_cmd_queue_push_wait(struct cbox_rt_cmd_queue *q, const struct cbox_rt_cmd_instance *cmd)
+{
+    int t = 0;
+    while(!cbox_rt_cmd_queue_push(q, cmd))
+    {
+        // wait until some space frees up in the execute queue
+        __sync_fetch_and_add(&q->space_waiters, 1);
+        int seq = q->space_seq;
+        if (!cbox_rt_cmd_queue_push(q, cmd))
+            futex_wait(&q->space_seq, seq, 100);
+        else
+            t = -1;
+        __sync_fetch_and_sub(&q->space_waiters, 1);
+        if (t < 0)
+            break;
+        if (++t >= 10)
+        {
+            fprintf(stderr, "Execute queue full, waiting...\n");
+            t = 0;
+        }
+    }
+}
+
 static gboolean cbox_rt_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
 {
     struct cbox_rt *rt = ct->user_data;
@@ -97,12 +240,14 @@ struct cbox_rt *cbox_rt_new(struct cbox_document *doc)
 {
     struct cbox_rt *rt = malloc(sizeof(struct cbox_rt));
     CBOX_OBJECT_HEADER_INIT(rt, cbox_rt, doc);
-    rt->rb_execute = cbox_fifo_new(sizeof(struct cbox_rt_cmd_instance) * RT_CMD_QUEUE_ITEMS);
+    rt->rb_execute = cbox_rt_cmd_queue_new(RT_CMD_QUEUE_ITEMS);
     rt->rb_cleanup = cbox_fifo_new(sizeof(struct cbox_rt_cmd_instance) * RT_CMD_QUEUE_ITEMS * 2);
+    pthread_mutex_init(&rt->cleanup_lock, NULL);
     rt->io = NULL;
     rt->engine = NULL;
     rt->started = FALSE;
     rt->disconnected = FALSE;
+    rt->epoch = 0;
     rt->io_env.srate = 0;
     rt->io_env.buffer_size = 0;
     rt->io_env.input_count = 0;
@@ -123,8 +268,9 @@ struct cbox_objhdr *cbox_rt_newfunc(struct cbox_class *class_ptr, struct cbox_do
 void cbox_rt_destroyfunc(struct cbox_objhdr *obj_ptr)
 {
     struct cbox_rt *rt = (void *)obj_ptr;
-    cbox_fifo_destroy(rt->rb_execute);
+    cbox_rt_cmd_queue_destroy(rt->rb_execute);
     cbox_fifo_destroy(rt->rb_cleanup);
+    pthread_mutex_destroy(&rt->cleanup_lock);
 
     free(rt);
 }
@@ -281,31 +427,29 @@ void cbox_rt_stop(struct cbox_rt *rt)
     }
 }
 
-void cbox_rt_handle_cmd_queue(struct cbox_rt *rt)
+// Returns FALSE if the cleanup queue is empty
+static gboolean cbox_rt_cleanup_one(struct cbox_rt *rt)
 {
     struct cbox_rt_cmd_instance cmd;
-    
-    while(cbox_fifo_read_atomic(rt->rb_cleanup, &cmd, sizeof(cmd)))
-    {
-        assert(!cmd.completed_ptr);
-        cmd.definition->cleanup(cmd.user_data);
-    }
+    // The lock is only held while reading the entry, so that the cleanup
+    // function may submit other commands
+    pthread_mutex_lock(&rt->cleanup_lock);
+    gboolean success = cbox_fifo_read_atomic(rt->rb_cleanup, &cmd, sizeof(cmd));
+    pthread_mutex_unlock(&rt->cleanup_lock);
+    if (!success)
+        return FALSE;
+    assert(!cmd.completed_ptr);
+    cmd.definition->cleanup(cmd.user_data);
+    return TRUE;
 }
 
-static void wait_write_space(struct cbox_fifo *rb)
+void cbox_rt_handle_cmd_queue(struct cbox_rt *rt)
 {
-    int t = 0;
-    while (cbox_fifo_writespace(rb) < sizeof(struct cbox_rt_cmd_instance))
-    {
-        // wait until some space frees up in the execute queue
-        usleep(1000);
-        t++;
-        if (t >= 1000)
-        {
-            fprintf(stderr, "Execute queue full, waiting...\n");
-            t = 0;
-        }
-    }
+    // No realtime thread - all commands have been executed synchronously
+    if (!rt)
+        return;
+    while(cbox_rt_cleanup_one(rt))
+        ;
 }
 
 void cbox_rt_execute_cmd_sync(struct cbox_rt *rt, struct cbox_rt_cmd_definition *def, void *user_data)
@@ -326,33 +470,28 @@ void cbox_rt_execute_cmd_sync(struct cbox_rt *rt, struct cbox_rt_cmd_definition
         return;
     }
     
-    int completed = 0;
+    volatile int completed = RT_CMD_PENDING;
     memset(&cmd, 0, sizeof(cmd));
     cmd.definition = def;
     cmd.user_data = user_data;
     cmd.completed_ptr = &completed;
     
-    wait_write_space(rt->rb_execute);
-    cbox_fifo_write_atomic(rt->rb_execute, &cmd, sizeof(cmd));
-    do
+    cbox_rt_cmd_queue_push_wait(rt->rb_execute, &cmd);
+    // Acquire pairs with the release in cbox_rt_handle_rt_commands, so that
+    // everything written by execute() is visible once the command is done
+    while(__atomic_load_n(&completed, __ATOMIC_ACQUIRE) != RT_CMD_DONE)
     {
-        if (completed)
-        {
-            if (def->cleanup)
-                def->cleanup(user_data);
-            break;
-        }
-        struct cbox_rt_cmd_instance cmd2;
-        
-        if (!cbox_fifo_read_atomic(rt->rb_cleanup, &cmd2, sizeof(cmd2)))
-        {
-            // still no result in cleanup queue - wait
-            usleep(10000);
+        // async commands or something from outer layer - clean them up
+        if (cbox_rt_cleanup_one(rt))
             continue;
-        }
-        // async command or something from outer layer - clean it up
-        cmd2.definition->cleanup(cmd2.user_data);
-    } while(1);
+        // Sleep until the RT thread signals completion. The timeout is there
+        // so that the cleanup queue is still serviced while waiting for a
+        // command that takes several periods.
+        __sync_bool_compare_and_swap(&completed, RT_CMD_PENDING, RT_CMD_WAITING);
+        futex_wait(&completed, RT_CMD_WAITING, 10);
+    }
+    if (def->cleanup)
+        def->cleanup(user_data);
 }
 
 int cbox_rt_execute_cmd_async(struct cbox_rt *rt, struct cbox_rt_cmd_definition *def, void *user_data)
@@ -373,8 +512,7 @@ int cbox_rt_execute_cmd_async(struct cbox_rt *rt, struct cbox_rt_cmd_definition
         if (def->cleanup)
             def->cleanup(user_data);
     } else {
-        wait_write_space(rt->rb_execute);
-        cbox_fifo_write_atomic(rt->rb_execute, &cmd, sizeof(cmd));
+        cbox_rt_cmd_queue_push_wait(rt->rb_execute, &cmd);
         // will be cleaned up by next sync call or by cbox_rt_cmd_handle_queue
     }
 
@@ -386,6 +524,7 @@ int cbox_rt_execute_cmd_async(struct cbox_rt *rt, struct cbox_rt_cmd_definition
 void cbox_rt_process(void *user_data, struct cbox_io *io, uint32_t nframes)
 {
     struct cbox_rt *rt = user_data;
+    __sync_fetch_and_add(&rt->epoch, 1);
     if (rt->engine)
         cbox_engine_process(rt->engine, io, nframes, io->output_buffers, io->io_env.output_count);
     else
@@ -400,15 +539,24 @@ void cbox_rt_handle_rt_commands(struct cbox_rt *rt)
 
     // Process command queue, needs engine's MIDI aux buf to be initialised to work
     int cost = 0;
-    while(cost < RT_MAX_COST_PER_CALL && cbox_fifo_peek(rt->rb_execute, &cmd, sizeof(cmd)))
+    gboolean consumed = FALSE;
+    while(cost < RT_MAX_COST_PER_CALL && cbox_rt_cmd_queue_peek(rt->rb_execute, &cmd))
     {
         int result = (cmd.definition->execute)(cmd.user_data);
         if (!result)
             break;
         cost += result;
-        cbox_fifo_consume(rt->rb_execute, sizeof(cmd));
+        cbox_rt_cmd_queue_consume(rt->rb_execute);
+        consumed = TRUE;
         if (cmd.completed_ptr)
-            *cmd.completed_ptr = 1;
+        {
+            // Only do the (non-blocking) wake-up call if the submitting
+            // thread has already gone to sleep. The release half makes the
+            // results of execute() visible before the command is seen as
+            // done.
+            if (__atomic_exchange_n(cmd.completed_ptr, RT_CMD_DONE, __ATOMIC_ACQ_REL) == RT_CMD_WAITING)
+                futex_wake(cmd.completed_ptr);
+        }
         else if (cmd.definition->cleanup)
         {
             gboolean success = cbox_fifo_write_atomic(rt->rb_cleanup, (const char *)&cmd, sizeof(cmd));
@@ -416,6 +564,8 @@ void cbox_rt_handle_rt_commands(struct cbox_rt *rt)
                 g_error("Clean-up FIFO full. Main thread deadlock?");
         }
     }
+    if (consumed)
+        cbox_rt_cmd_queue_notify_space(rt->rb_execute);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -450,6 +600,170 @@ DEFINE_RT_FUNC(void *, cbox_rt, rt, cbox_rt_swap_pointers_and_update_count)
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
+#define RT_BATCH_BLOCK_SIZE 4096
+
+struct cbox_rt_batch_block
+{
+    struct cbox_rt_batch_block *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct cbox_rt_batch_entry
+{
+    struct cbox_rt_cmd_definition *definition;
+    void *user_data;
+    struct cbox_rt_batch_entry *next;
+};
+
+struct cbox_rt_batch
+{
+    struct cbox_rt *rt;
+    int cost_budget;
+    struct cbox_rt_batch_block *blocks;
+    struct cbox_rt_batch_entry *first, *last;
+    // next entry to execute, only touched by the RT thread after submission
+    struct cbox_rt_batch_entry *current;
+};
+
+struct cbox_rt_batch *cbox_rt_batch_new(struct cbox_rt *rt, int cost_budget)
+{
+    struct cbox_rt_batch *batch = calloc(1, sizeof(struct cbox_rt_batch));
+    batch->rt = rt;
+    batch->cost_budget = cost_budget;
+    return batch;
+}
+
+void *cbox_rt_batch_alloc(struct cbox_rt_batch *batch, size_t size)
+{
+    size = (size + 15) &~ 15;
+    struct cbox_rt_batch_block *block = batch->blocks;
+    if (!block || block->used + size > block->size)
+    {
+        size_t block_size = size > RT_BATCH_BLOCK_SIZE ? size : RT_BATCH_BLOCK_SIZE;
+        block = malloc(sizeof(struct cbox_rt_batch_block) + block_size);
+        block->next = batch->blocks;
+        block->size = block_size;
+        block->used = 0;
+        batch->blocks = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void cbox_rt_batch_add(struct cbox_rt_batch *batch, struct cbox_rt_cmd_definition *def, void *user_data)
+{
+    if (def->prepare && def->prepare(user_data))
+        return;
+    struct cbox_rt_batch_entry *entry = cbox_rt_batch_alloc(batch, sizeof(struct cbox_rt_batch_entry));
+    entry->definition = def;
+    entry->user_data = user_data;
+    entry->next = NULL;
+    if (batch->last)
+        batch->last->next = entry;
+    else
+        batch->first = entry;
+    batch->last = entry;
+}
+
+static int cbox_rt_batch_cmd_execute(void *user_data)
+{
+    struct cbox_rt_batch *batch = user_data;
+    int cost = 0;
+    while(batch->current)
+    {
+        int result = batch->current->definition->execute(batch->current->user_data);
+        // Resume from the same command in the next period
+        if (!result)
+            return 0;
+        cost += result;
+        batch->current = batch->current->next;
+        if (batch->cost_budget && cost >= batch->cost_budget && batch->current)
+            return 0;
+    }
+    return cost ? cost : 1;
+}
+
+static void cbox_rt_batch_destroy(struct cbox_rt_batch *batch)
+{
+    while(batch->blocks)
+    {
+        struct cbox_rt_batch_block *block = batch->blocks;
+        batch->blocks = block->next;
+        free(block);
+    }
+    free(batch);
+}
+
+static void cbox_rt_batch_cmd_cleanup(void *user_data)
+{
+    struct cbox_rt_batch *batch = user_data;
+    for (struct cbox_rt_batch_entry *entry = batch->first; entry; entry = entry->next)
+    {
+        if (entry->definition->cleanup)
+            entry->definition->cleanup(entry->user_data);
+    }
+    cbox_rt_batch_destroy(batch);
+}
+
+static struct cbox_rt_cmd_definition cbox_rt_batch_cmd = {
+    .prepare = NULL,
+    .execute = cbox_rt_batch_cmd_execute,
+    .cleanup = cbox_rt_batch_cmd_cleanup,
+};
+
+void cbox_rt_batch_execute_sync(struct cbox_rt_batch *batch)
+{
+    if (!batch->first)
+    {
+        cbox_rt_batch_destroy(batch);
+        return;
+    }
+    batch->current = batch->first;
+    cbox_rt_execute_cmd_sync(batch->rt, &cbox_rt_batch_cmd, batch);
+}
+
+void cbox_rt_batch_execute_async(struct cbox_rt_batch *batch)
+{
+    if (!batch->first)
+    {
+        cbox_rt_batch_destroy(batch);
+        return;
+    }
+    batch->current = batch->first;
+    cbox_rt_execute_cmd_async(batch->rt, &cbox_rt_batch_cmd, batch);
+}
+
+struct cbox_rt_batch_swap_pointers_args
+{
+    void **ptr;
+    void *new_value;
+    void **old_value_p;
+};
+
+static int cbox_rt_batch_swap_pointers_execute(void *user_data)
+{
+    struct cbox_rt_batch_swap_pointers_args *args = user_data;
+    void *old_value = *args->ptr;
+    *args->ptr = args->new_value;
+    if (args->old_value_p)
+        *args->old_value_p = old_value;
+    return 1;
+}
+
+void cbox_rt_batch_swap_pointers(struct cbox_rt_batch *batch, void **ptr, void *new_value, void **old_value_p)
+{
+    static struct cbox_rt_cmd_definition def = { .prepare = NULL, .execute = cbox_rt_batch_swap_pointers_execute, .cleanup = NULL };
+    struct cbox_rt_batch_swap_pointers_args *args = cbox_rt_batch_alloc(batch, sizeof(struct cbox_rt_batch_swap_pointers_args));
+    args->ptr = ptr;
+    args->new_value = new_value;
+    args->old_value_p = old_value_p;
+    cbox_rt_batch_add(batch, &def, args);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
 void cbox_rt_array_insert(struct cbox_rt *rt, void ***ptr, uint32_t *pcount, int index, void *new_value)
 {
     assert(index >= -1);
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CBOX_RT_H
 #define CBOX_RT_H
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include "cmd.h"
@@ -37,6 +38,8 @@ struct cbox_io;
 struct cbox_midi_pattern;
 struct cbox_song;
 struct cbox_rt_cmd_instance;
+struct cbox_rt_cmd_queue;
+struct cbox_rt_batch;
 
 struct cbox_rt_cmd_definition
 {
@@ -54,7 +57,16 @@ struct cbox_rt
     struct cbox_io *io;
     struct cbox_io_callbacks *cbs;
     
-    struct cbox_fifo *rb_execute, *rb_cleanup;
+    // Commands to execute: any number of control threads may submit, only
+    // the RT thread reads
+    struct cbox_rt_cmd_queue *rb_execute;
+    // Commands executed, waiting for cleanup: written by the RT thread only,
+    // read by control threads (serialised by cleanup_lock)
+    struct cbox_fifo *rb_cleanup;
+    pthread_mutex_t cleanup_lock;
+    // Incremented by the RT thread at the start of every period - anything
+    // unpublished before the value changed is no longer in use by the RT side
+    volatile uint32_t epoch;
     
     struct cbox_command_target cmd_target;
     int started, disconnected;
@@ -72,7 +84,8 @@ extern void cbox_rt_handle_cmd_queue(struct cbox_rt *rt);
 extern void cbox_rt_handle_rt_commands(struct cbox_rt *rt);
 extern void cbox_rt_stop(struct cbox_rt *rt);
 
-// Those are for calling from the main thread. I will add a RT-thread version later.
+// Those are for calling from the main thread (or any other non-RT thread -
+// several threads may submit commands concurrently).
 extern void cbox_rt_execute_cmd_sync(struct cbox_rt *rt, struct cbox_rt_cmd_definition *cmd, void *user_data);
 extern int cbox_rt_execute_cmd_async(struct cbox_rt *rt, struct cbox_rt_cmd_definition *cmd, void *user_data);
 extern void *cbox_rt_swap_pointers(struct cbox_rt *rt, void **ptr, void *new_value);
@@ -84,6 +97,22 @@ extern void *cbox_rt_array_remove(struct cbox_rt *rt, void ***ptr, uint32_t *pco
 extern gboolean cbox_rt_array_remove_by_value(struct cbox_rt *rt, void ***ptr, uint32_t *pcount, void *value_to_remove);
 extern struct cbox_midi_merger *cbox_rt_get_midi_output(struct cbox_rt *rt, struct cbox_uuid *uuid);
 
+// A batch collects many commands to be passed to the RT thread as a single
+// queue entry, with a single completion wait (or a single cleanup call for
+// the async version). The commands are executed in order. With cost_budget
+// equal to 0, the whole batch runs within one period (unless one of the
+// commands asks to be called again later); otherwise, the execution is
+// spread across several periods, each doing at least cost_budget worth of
+// work. The prepare functions are called when the command is added, the
+// cleanup functions after the whole batch has been executed. Executing
+// the batch frees it, including any memory obtained via cbox_rt_batch_alloc.
+extern struct cbox_rt_batch *cbox_rt_batch_new(struct cbox_rt *rt, int cost_budget);
+extern void *cbox_rt_batch_alloc(struct cbox_rt_batch *batch, size_t size);
+extern void cbox_rt_batch_add(struct cbox_rt_batch *batch, struct cbox_rt_cmd_definition *cmd, void *user_data);
+extern void cbox_rt_batch_swap_pointers(struct cbox_rt_batch *batch, void **ptr, void *new_value, void **old_value_ptr);
+extern void cbox_rt_batch_execute_sync(struct cbox_rt_batch *batch);
+extern void cbox_rt_batch_execute_async(struct cbox_rt_batch *batch);
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #define GET_RT_FROM_cbox_rt(ptr) (ptr)
@@ -35,6 +35,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sndfile.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 float sampler_sine_wave[2049];
 
@@ -47,27 +48,33 @@ static void sampler_process_block(struct cbox_module *module, cbox_sample_t **in
 static void sampler_process_event(struct cbox_module *module, const uint8_t *data, uint32_t len);
 static void sampler_destroyfunc(struct cbox_module *module);
 
+// Upper bound of the part of the stealing priority that does not come from
+// the voice's age in blocks (playback progress of one-shot voices, or the
+// bonus for released voices)
+#define SAMPLER_STEAL_MAX_BONUS 100
+
 void sampler_steal_voice(struct sampler_module *m)
 {
     int max_age = 0;
     struct sampler_voice *voice_found = NULL;
-    for (int i = 0; i < 16; i++)
+    // Going from the oldest voice, so the scan can stop as soon as none of
+    // the remaining voices can score higher than the best one found so far
+    for (struct sampler_voice *v = m->oldest_voice; v; v = v->newer)
     {
-        FOREACH_VOICE(m->channels[i].voices_running, v)
+        int age = m->serial_no - v->serial_no;
+        if (age + SAMPLER_STEAL_MAX_BONUS <= max_age)
+            break;
+        if (v->amp_env.cur_stage == 15)
+            continue;
+        if (v->gen.loop_start == (uint32_t)-1)
+            age += (int)((v->gen.bigpos >> 32) * 100.0 / v->gen.cur_sample_end);
+        else
+        if (v->released)
+            age += 10;
+        if (age > max_age)
         {
-            if (v->amp_env.cur_stage == 15)
-                continue;
-            int age = m->serial_no - v->serial_no;
-            if (v->gen.loop_start == (uint32_t)-1)
-                age += (int)((v->gen.bigpos >> 32) * 100.0 / v->gen.cur_sample_end);
-            else
-            if (v->released)
-                age += 10;
-            if (age > max_age)
-            {
-                max_age = age;
-                voice_found = v;
-            }
+            max_age = age;
+            voice_found = v;
         }
     }
     if (voice_found)
@@ -92,7 +99,9 @@ void sampler_create_voice_from_prevoice(struct sampler_module *m, struct sampler
         return;
     struct sampler_released_groups exgroups;
     sampler_released_groups_init(&exgroups);
+    pv->channel->note_expression = pv->expression;
     sampler_voice_start(m->voices_free, pv->channel, pv->layer_data, pv->note, pv->vel, &exgroups);
+    pv->channel->note_expression = NULL;
     if (exgroups.low_groups || exgroups.group_count)
         sampler_channel_release_groups(pv->channel, pv->note, &exgroups);
 }
@@ -129,7 +138,12 @@ void sampler_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
         int cvcount = 0;
         FOREACH_VOICE(m->channels[i].voices_running, v)
         {
-            sampler_voice_process(v, m, outputs);
+            if (m->batch)
+                sampler_voice_batch_add(m->batch, v, m);
+            else if (m->parallel)
+                sampler_voice_parallel_add(m->parallel, v);
+            else
+                sampler_voice_process(v, m, outputs);
 
             if (v->amp_env.cur_stage == 15)
                 vrel++;
@@ -141,6 +155,10 @@ void sampler_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
         vcount += cvcount;
         pvcount += cpvcount;
     }
+    if (m->batch)
+        sampler_voice_batch_render(m->batch, m, outputs);
+    else if (m->parallel)
+        sampler_voice_parallel_render(m->parallel, m, outputs);
     m->active_voices = vcount;
     m->active_prevoices = pvcount;
     if(vcount - vrel > m->max_voices + 1)
@@ -151,6 +169,111 @@ void sampler_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
     m->current_time += CBOX_BLOCK_SIZE;
 }
 
+// Release the notes a member channel is playing on its master, so that they
+// do not get stuck when the channel stops being a member of that zone
+static void sampler_release_mpe_member_notes(struct sampler_module *m, struct sampler_channel *master, struct sampler_channel *member)
+{
+    FOREACH_PREVOICE(m->prevoices_running, pv)
+    {
+        if (pv->expression == &member->expression)
+            sampler_prevoice_unlink(&m->prevoices_running, pv);
+    }
+    FOREACH_VOICE(master->voices_running, v)
+    {
+        if (v->expression == &member->expression && v->layer->trigger != stm_release)
+            sampler_voice_release(v, FALSE);
+    }
+}
+
+void sampler_set_mpe_zone_RT(struct sampler_module *m, int zone, int members)
+{
+    if (members < 0)
+        members = 0;
+    if (members > 15)
+        members = 15;
+    int new_members[2] = { m->mpe_members[0], m->mpe_members[1] };
+    new_members[zone] = members;
+    // Both zones need a master channel of their own
+    if (new_members[0] + new_members[1] > 14)
+        new_members[!zone] = members < 14 ? 14 - members : 0;
+
+    struct sampler_channel *masters[16];
+    for (int i = 0; i < 16; i++)
+        masters[i] = NULL;
+    for (int i = 1; i <= new_members[0]; i++)
+        masters[i] = &m->channels[0];
+    for (int i = 1; i <= new_members[1]; i++)
+        masters[15 - i] = &m->channels[15];
+    for (int i = 0; i < 16; i++)
+    {
+        struct sampler_channel *c = &m->channels[i];
+        if (c->mpe_master && c->mpe_master != masters[i])
+            sampler_release_mpe_member_notes(m, c->mpe_master, c);
+        c->mpe_master = masters[i];
+        sampler_channel_reset_expression(c);
+    }
+    m->mpe_members[0] = new_members[0];
+    m->mpe_members[1] = new_members[1];
+}
+
+#define sampler_set_mpe_zone_args(ARG) ARG(int, zone) ARG(int, members)
+
+DEFINE_RT_VOID_FUNC(sampler_module, m, sampler_set_mpe_zone)
+{
+    sampler_set_mpe_zone_RT(m, zone, members);
+}
+
+// Events on an MPE member channel. Notes are played by the zone's master
+// channel (so the master's program, controllers and pedals apply), with
+// the member's pitch bend, pressure and CC74 as the note's own expression.
+// Returns FALSE for the events that are processed as usual.
+static gboolean sampler_process_mpe_member_event(struct sampler_module *m, struct sampler_channel *c, int cmd, const uint8_t *data)
+{
+    struct sampler_channel *master = c->mpe_master;
+    switch(cmd)
+    {
+        case 8:
+        case 9:
+            master->note_expression = &c->expression;
+            if (cmd == 9 && data[2] > 0)
+                sampler_channel_start_note(master, data[1], data[2], stm_attack);
+            else
+                sampler_channel_stop_note(master, data[1], data[2], FALSE);
+            master->note_expression = NULL;
+            return TRUE;
+
+        case 11:
+            if (data[1] == 74)
+            {
+                c->expression.timbre = data[2];
+                return TRUE;
+            }
+            // RPN 0 (pitch bend sensitivity) on any member applies to the whole zone
+            if (data[1] == 6 && c->intcc[101] == 0 && c->intcc[100] == 0)
+            {
+                for (int i = 0; i < 16; i++)
+                {
+                    if (m->channels[i].mpe_master == master)
+                        m->channels[i].expression.bend_range = data[2] * 100;
+                }
+            }
+            return FALSE;
+
+        case 12:
+            // member channels always use the master channel's program
+            return TRUE;
+
+        case 13:
+            c->expression.pressure = data[1];
+            return TRUE;
+
+        case 14:
+            c->expression.pitchwheel = data[1] + 128 * data[2] - 8192;
+            return TRUE;
+    }
+    return FALSE;
+}
+
 void sampler_process_event(struct cbox_module *module, const uint8_t *data, uint32_t len)
 {
     struct sampler_module *m = (struct sampler_module *)module;
@@ -159,6 +282,8 @@ void sampler_process_event(struct cbox_module *module, const uint8_t *data, uint
         int cmd = data[0] >> 4;
         int chn = data[0] & 15;
         struct sampler_channel *c = &m->channels[chn];
+        if (c->mpe_master && sampler_process_mpe_member_event(m, c, cmd, data))
+            return;
         switch(cmd)
         {
             case 8:
@@ -188,6 +313,9 @@ void sampler_process_event(struct cbox_module *module, const uint8_t *data, uint
                 break;
 
             case 11:
+                // MPE Configuration Message (RPN 6) on the first or last channel
+                if (data[1] == 6 && (chn == 0 || chn == 15) && c->intcc[101] == 0 && c->intcc[100] == 6)
+                    sampler_set_mpe_zone_RT(m, chn == 15, data[2]);
                 sampler_channel_process_cc(c, data[1], data[2]);
                 break;
 
@@ -397,6 +525,25 @@ static gboolean load_from_string(struct sampler_module *m, const char *sample_di
     return TRUE;
 }
 
+static gboolean sampler_filter_control_period_valid(int period)
+{
+    return period == 0 || (period >= CBOX_BLOCK_SIZE && period <= MAX_FILTER_CONTROL_PERIOD && !(period % CBOX_BLOCK_SIZE));
+}
+
+// Sets the interval between recalculations of filter coefficients, 0 picks
+// a period giving approximately the same control rate as 16 samples at 48 kHz
+static void sampler_set_filter_control_period(struct sampler_module *m, int period)
+{
+    if (!period)
+    {
+        int blocks = m->module.srate / 48000;
+        period = CBOX_BLOCK_SIZE * (blocks < 1 ? 1 : blocks);
+        if (period > MAX_FILTER_CONTROL_PERIOD)
+            period = MAX_FILTER_CONTROL_PERIOD;
+    }
+    m->filter_control_blocks = period / CBOX_BLOCK_SIZE;
+}
+
 gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
 {
     struct sampler_module *m = (struct sampler_module *)ct->user_data;
@@ -427,9 +574,38 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
             cbox_execute_on(fb, NULL, "/active_prevoices", "i", error, m->active_prevoices) &&
             cbox_execute_on(fb, NULL, "/active_pipes", "i", error, cbox_prefetch_stack_get_active_pipe_count(m->pipe_stack)) &&
             cbox_execute_on(fb, NULL, "/polyphony", "i", error, m->max_voices) &&
+            cbox_execute_on(fb, NULL, "/filter_control_period", "i", error, m->filter_control_blocks * CBOX_BLOCK_SIZE) &&
+            cbox_execute_on(fb, NULL, "/mpe_zones", "ii", error, m->mpe_members[0], m->mpe_members[1]) &&
             CBOX_OBJECT_DEFAULT_STATUS(&m->module, fb, error);
     }
     else
+    if (!strcmp(cmd->command, "/streaming_stats") && !strcmp(cmd->arg_types, ""))
+    {
+        if (!cbox_check_fb_channel(fb, cmd->command, error))
+            return FALSE;
+        struct cbox_prefetch_stack *stack = m->pipe_stack;
+        struct cbox_prefetch_pipe_stats total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < stack->pipe_count; i++)
+        {
+            const struct cbox_prefetch_pipe_stats *stats = &stack->pipes[i].stats;
+            if (!stats->reads && !stats->underruns)
+                continue;
+            const uint32_t *lat = stats->read_latency;
+            if (!cbox_execute_on(fb, NULL, "/pipe", "iiiiiiiiiii", error, i, stats->underruns, stats->late_reads, stats->reads,
+                lat[0], lat[1], lat[2], lat[3], lat[4], lat[5], lat[6], lat[7]))
+                return FALSE;
+            cbox_prefetch_pipe_stats_add(&total, stats);
+        }
+        const uint32_t *lat = total.read_latency;
+        return cbox_execute_on(fb, NULL, "/underruns", "i", error, total.underruns) &&
+            cbox_execute_on(fb, NULL, "/late_reads", "i", error, total.late_reads) &&
+            cbox_execute_on(fb, NULL, "/reads", "i", error, total.reads) &&
+            cbox_execute_on(fb, NULL, "/read_latency", "iiiiiiii", error, lat[0], lat[1], lat[2], lat[3], lat[4], lat[5], lat[6], lat[7]) &&
+            cbox_execute_on(fb, NULL, "/buffer_size", "i", error, stack->buffer_size) &&
+            cbox_execute_on(fb, NULL, "/min_buffer_frames", "i", error, cbox_prefetch_stack_get_min_buffer_frames(stack));
+    }
+    else
     if (!strcmp(cmd->command, "/keyswitch_state") && !strcmp(cmd->arg_types, "ii"))
     {
         int channel = CBOX_ARG_I(cmd, 0);
@@ -464,14 +640,37 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
     else if (!strcmp(cmd->command, "/polyphony") && !strcmp(cmd->arg_types, "i"))
     {
         int polyphony = CBOX_ARG_I(cmd, 0);
-        if (polyphony < 1 || polyphony > MAX_SAMPLER_VOICES)
+        if (polyphony < 1 || polyphony > (int)m->voice_count)
         {
-            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid polyphony %d (must be between 1 and %d)", polyphony, (int)MAX_SAMPLER_VOICES);
+            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid polyphony %d (must be between 1 and %d)", polyphony, (int)m->voice_count);
             return FALSE;
         }
         m->max_voices = polyphony;
         return TRUE;
     }
+    else if (!strcmp(cmd->command, "/filter_control_period") && !strcmp(cmd->arg_types, "i"))
+    {
+        int period = CBOX_ARG_I(cmd, 0);
+        if (!sampler_filter_control_period_valid(period))
+        {
+            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid filter control period %d (must be a multiple of %d up to %d)", period, CBOX_BLOCK_SIZE, MAX_FILTER_CONTROL_PERIOD);
+            return FALSE;
+        }
+        sampler_set_filter_control_period(m, period);
+        return TRUE;
+    }
+    else if (!strcmp(cmd->command, "/mpe_zone") && !strcmp(cmd->arg_types, "ii"))
+    {
+        int zone = CBOX_ARG_I(cmd, 0);
+        int members = CBOX_ARG_I(cmd, 1);
+        if (zone < 0 || zone > 1 || members < 0 || members > 15)
+        {
+            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid MPE zone %d with %d member channels (zone must be 0 or 1, members between 0 and 15)", zone, members);
+            return FALSE;
+        }
+        sampler_set_mpe_zone(m, zone, members);
+        return TRUE;
+    }
     else if (!strcmp(cmd->command, "/set_patch") && !strcmp(cmd->arg_types, "ii"))
     {
         int channel = CBOX_ARG_I(cmd, 0);
@@ -510,29 +709,39 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
         m->channels[channel - 1].output_shift = output;
         return TRUE;
     }
-    else if (!strcmp(cmd->command, "/load_patch") && !strcmp(cmd->arg_types, "iss"))
+    // The variants with an extra int argument report the loading progress
+    // as /load_progress messages to fb if the argument is non-zero
+    else if (!strcmp(cmd->command, "/load_patch") && (!strcmp(cmd->arg_types, "iss") || !strcmp(cmd->arg_types, "issi")))
     {
         struct sampler_program *pgm = NULL;
-        if (!load_program_at(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, error))
+        m->load_progress_fb = (cmd->arg_types[3] && CBOX_ARG_I(cmd, 3)) ? fb : NULL;
+        gboolean res = load_program_at(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, error);
+        m->load_progress_fb = NULL;
+        if (!res)
             return FALSE;
         if (fb)
             return cbox_execute_on(fb, NULL, "/uuid", "o", error, pgm);
         return TRUE;
     }
-    else if (!strcmp(cmd->command, "/load_patch_from_file") && !strcmp(cmd->arg_types, "iss"))
+    else if (!strcmp(cmd->command, "/load_patch_from_file") && (!strcmp(cmd->arg_types, "iss") || !strcmp(cmd->arg_types, "issi")))
     {
         struct sampler_program *pgm = NULL;
         char *cfg_section = g_strdup_printf("spgm:!%s", CBOX_ARG_S(cmd, 1));
+        m->load_progress_fb = (cmd->arg_types[3] && CBOX_ARG_I(cmd, 3)) ? fb : NULL;
         gboolean res = load_program_at(m, cfg_section, CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, error);
+        m->load_progress_fb = NULL;
         g_free(cfg_section);
         if (res && pgm && fb)
             return cbox_execute_on(fb, NULL, "/uuid", "o", error, pgm);
         return res;
     }
-    else if (!strcmp(cmd->command, "/load_patch_from_string") && !strcmp(cmd->arg_types, "isss"))
+    else if (!strcmp(cmd->command, "/load_patch_from_string") && (!strcmp(cmd->arg_types, "isss") || !strcmp(cmd->arg_types, "isssi")))
     {
         struct sampler_program *pgm = NULL;
-        if (!load_from_string(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_S(cmd, 3), CBOX_ARG_I(cmd, 0), &pgm, error))
+        m->load_progress_fb = (cmd->arg_types[4] && CBOX_ARG_I(cmd, 4)) ? fb : NULL;
+        gboolean res = load_from_string(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_S(cmd, 3), CBOX_ARG_I(cmd, 0), &pgm, error);
+        m->load_progress_fb = NULL;
+        if (!res)
             return FALSE;
         if (fb && pgm)
             return cbox_execute_on(fb, NULL, "/uuid", "o", error, pgm);
@@ -579,15 +788,24 @@ MODULE_CREATE_FUNCTION(sampler)
     {
         for (int i = 0; i < 2049; i++)
             sampler_sine_wave[i] = sin(i * M_PI / 1024.0);
+        sampler_gen_init(cbox_config_get_string("sampler", "resampler_isa"));
         inited = 1;
     }
 
     int max_voices = cbox_config_get_int(cfg_section, "polyphony", MAX_SAMPLER_VOICES);
-    if (max_voices < 1 || max_voices > MAX_SAMPLER_VOICES)
+    if (max_voices < 1 || max_voices > MAX_SAMPLER_POLYPHONY)
     {
         g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid polyphony value", cfg_section);
         return NULL;
     }
+    // Voices that are being stolen still need to fade out, so leave some
+    // headroom above the polyphony limit
+    int voice_count = cbox_config_get_int(cfg_section, "voice_pool", max_voices > MAX_SAMPLER_VOICES ? max_voices + max_voices / 4 : MAX_SAMPLER_VOICES);
+    if (voice_count < max_voices || voice_count > 2 * MAX_SAMPLER_POLYPHONY)
+    {
+        g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid voice pool size", cfg_section);
+        return NULL;
+    }
     int output_pairs = cbox_config_get_int(cfg_section, "output_pairs", 1);
     if (output_pairs < 1 || output_pairs > 16)
     {
@@ -600,6 +818,12 @@ MODULE_CREATE_FUNCTION(sampler)
         g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid aux pairs value", cfg_section);
         return NULL;
     }
+    int filter_control_period = cbox_config_get_int(cfg_section, "filter_control_period", 0);
+    if (!sampler_filter_control_period_valid(filter_control_period))
+    {
+        g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid filter control period", cfg_section);
+        return NULL;
+    }
 
     struct sampler_module *m = calloc(1, sizeof(struct sampler_module));
     CALL_MODULE_INIT(m, 0, (output_pairs + aux_pairs) * 2, sampler);
@@ -610,28 +834,31 @@ MODULE_CREATE_FUNCTION(sampler)
     m->module.process_block = sampler_process_block;
     m->programs = NULL;
     m->max_voices = max_voices;
+    m->voice_count = voice_count;
+    m->prevoice_count = voice_count > MAX_SAMPLER_PREVOICES ? voice_count : MAX_SAMPLER_PREVOICES;
     m->serial_no = 0;
     m->deleting = FALSE;
     // XXXKF read defaults from some better place, like config
     // XXXKF allow dynamic change of the number of the pipes
-    m->pipe_stack = cbox_prefetch_stack_new(MAX_SAMPLER_VOICES, cbox_config_get_int("streaming", "streambuf_size", 65536), cbox_config_get_int("streaming", "min_buf_frames", PIPE_MIN_PREFETCH_SIZE_FRAMES));
+    int streambuf_size = cbox_config_get_int("streaming", "streambuf_size", 65536);
+    // One pipe per voice within the polyphony limit, not per pool voice: the
+    // extra pool voices are there for fading out, and voices that do not get
+    // a pipe play their preloaded part only
+    int max_pipes = cbox_config_get_int("streaming", "max_pipes", max_voices);
+    if (max_pipes < 1)
+        max_pipes = 1;
+    if (max_pipes > voice_count)
+        max_pipes = voice_count;
+    m->pipe_stack = cbox_prefetch_stack_new(max_pipes, streambuf_size, cbox_config_get_int("streaming", "streambuf_max_size", 4 * streambuf_size), cbox_config_get_int("streaming", "min_buf_frames", PIPE_MIN_PREFETCH_SIZE_FRAMES), cbox_config_get_int("streaming", "io_threads", 1));
     m->disable_mixer_controls = cbox_config_get_int("sampler", "disable_mixer_controls", 0);
+    m->batch = cbox_config_get_int(cfg_section, "batch_render", 0) ? sampler_voice_batch_new(m->voice_count) : NULL;
+    int voice_threads = cbox_config_get_int(cfg_section, "voice_threads", 0);
+    m->parallel = (voice_threads > 0 && !m->batch) ? sampler_voice_parallel_new(m, m->voice_count, voice_threads) : NULL;
+    m->load_progress_fb = NULL;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    m->load_threads = cbox_config_get_int("sampler", "load_threads", ncpus > 8 ? 8 : (ncpus < 1 ? 1 : (int)ncpus));
+    sampler_set_filter_control_period(m, filter_control_period);
 
-    float srate = m->module.srate;
-    for (i = 0; i < 12800; i++)
-    {
-        float freq = 440 * pow(2, (i - 5700) / 1200.0);
-        if (freq < 20.0)
-            freq = 20.0;
-        if (freq > srate * 0.45)
-            freq = srate * 0.45;
-        float omega=(float)(2*M_PI*freq/srate);
-        m->sincos[i].sine = sinf(omega);
-        m->sincos[i].cosine = cosf(omega);
-        m->sincos[i].prewarp = 2.0 * tan(hz2w(freq, srate) * 0.5f);
-        m->sincos[i].prewarp2 = 1.0 / (1.0 + m->sincos[i].prewarp);
-
-    }
     for (i = 0; ; i++)
     {
         gchar *s = g_strdup_printf("program%d", i);
@@ -682,8 +909,9 @@ MODULE_CREATE_FUNCTION(sampler)
         return NULL;
     }
     m->voices_free = NULL;
-    memset(m->voices_all, 0, sizeof(m->voices_all));
-    for (i = 0; i < MAX_SAMPLER_VOICES; i++)
+    m->voices_all = calloc(m->voice_count, sizeof(struct sampler_voice));
+    m->oldest_voice = m->newest_voice = NULL;
+    for (i = 0; i < (int)m->voice_count; i++)
     {
         struct sampler_voice *v = &m->voices_all[i];
         v->gen.mode = spt_inactive;
@@ -693,8 +921,8 @@ MODULE_CREATE_FUNCTION(sampler)
     m->active_prevoices = 0;
 
     m->prevoices_free = NULL;
-    memset(m->prevoices_all, 0, sizeof(m->prevoices_all));
-    for (i = 0; i < MAX_SAMPLER_PREVOICES; i++)
+    m->prevoices_all = calloc(m->prevoice_count, sizeof(struct sampler_prevoice));
+    for (i = 0; i < (int)m->prevoice_count; i++)
     {
         struct sampler_prevoice *v = &m->prevoices_all[i];
         sampler_prevoice_link(&m->prevoices_free, v);
@@ -720,6 +948,8 @@ MODULE_CREATE_FUNCTION(sampler)
         m->channels[i].output_shift = cbox_config_get_int(cfg_section, key, 1) - 1;
         g_free(key);
     }
+    sampler_set_mpe_zone_RT(m, 0, cbox_config_get_int(cfg_section, "mpe_lower_zone", 0));
+    sampler_set_mpe_zone_RT(m, 1, cbox_config_get_int(cfg_section, "mpe_upper_zone", 0));
 
 
     return &m->module;
@@ -743,6 +973,12 @@ void sampler_destroyfunc(struct cbox_module *module)
         assert (m->channels[i].voices_running == NULL);
     }
     cbox_prefetch_stack_destroy(m->pipe_stack);
+    if (m->batch)
+        sampler_voice_batch_destroy(m->batch);
+    if (m->parallel)
+        sampler_voice_parallel_destroy(m->parallel);
+    free(m->voices_all);
+    free(m->prevoices_all);
     free(m->programs);
 }
 
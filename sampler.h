@@ -29,8 +29,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "wavebank.h"
 #include <stdint.h>
 
+// Default polyphony and minimum size of the voice pool
 #define MAX_SAMPLER_VOICES 128
 #define MAX_SAMPLER_PREVOICES 128
+#define MAX_SAMPLER_POLYPHONY 4096
+#define MAX_FILTER_CONTROL_PERIOD 128
 #define SAMPLER_NO_LOOP ((uint32_t)-1)
 
 #define CBOX_SAMPLER_ERROR cbox_sampler_error_quark()
@@ -48,9 +51,24 @@ struct sampler_voice;
 struct sampler_prevoice;
 
 #define GET_RT_FROM_sampler_channel(channel) ((channel)->module->module.rt)
+#define GET_RT_FROM_sampler_module(sm) ((sm)->module.rt)
 
 #define MAX_KEYSWITCH_GROUPS 16
 
+// Default pitch bend range of MPE member channels, in cents
+#define SAMPLER_MPE_MEMBER_BEND_RANGE 4800
+
+// Per-note expression (MPE) received on a member channel. Voices of the
+// notes started from that channel point to it, so pitch bend, pressure and
+// timbre (CC74) updates are a single store, with no voice lookup.
+struct sampler_note_expression
+{
+    int pitchwheel;
+    // in cents, for the full range of pitchwheel
+    int bend_range;
+    uint8_t pressure, timbre;
+};
+
 struct sampler_channel
 {
     struct sampler_module *module;
@@ -73,6 +91,12 @@ struct sampler_channel
     uint8_t last_polyaft, last_chanaft;
     uint8_t keyswitch_state[MAX_KEYSWITCH_GROUPS];
     uint8_t keyswitch_lastkey[MAX_KEYSWITCH_GROUPS];
+    // MPE: zone master channel if this is a member channel, NULL otherwise
+    struct sampler_channel *mpe_master;
+    struct sampler_note_expression expression;
+    // MPE: expression of the note being started or stopped on this (master)
+    // channel, NULL for ordinary notes
+    const struct sampler_note_expression *note_expression;
 };
 
 struct sampler_lfo
@@ -117,6 +141,7 @@ struct sampler_prevoice
     struct sampler_prevoice *prev, *next;
     struct sampler_layer_data *layer_data;
     struct sampler_channel *channel;
+    const struct sampler_note_expression *expression;
     int note, vel;
     uint32_t age;
     double sync_trigger_time, sync_initial_time, sync_beats;
@@ -128,11 +153,18 @@ struct sampler_filter
     struct cbox_biquadf_coeffs filter_coeffs, filter_coeffs_extra;
     struct cbox_biquadf_coeffs *second_filter;
     struct cbox_biquadf_state filter_left[3], filter_right[3];
+    // Coefficients calculated on the last control update, and per-block
+    // increments used to reach them over ramp_blocks blocks
+    struct cbox_biquadf_coeffs target_coeffs, target_coeffs_extra;
+    struct cbox_biquadf_coeffs delta_coeffs, delta_coeffs_extra;
+    uint32_t ramp_blocks;
 };
 
 struct sampler_voice
 {
     struct sampler_voice *prev, *next;
+    // running voices of all channels, in the order they were started
+    struct sampler_voice *older, *newer;
     struct sampler_layer_data *layer;
     // Note: may be NULL when program is being deleted
     struct sampler_program *program;
@@ -151,6 +183,8 @@ struct sampler_voice
     struct cbox_onepolef_state onepole_left, onepole_right;
     struct cbox_onepolef_coeffs onepole_coeffs;
     struct sampler_channel *channel;
+    // NULL unless started from an MPE member channel
+    const struct sampler_note_expression *expression;
     struct cbox_envelope amp_env, filter_env, pitch_env;
     struct sampler_lfo amp_lfo, filter_lfo, pitch_lfo;
     enum sampler_loop_mode loop_mode;
@@ -171,12 +205,43 @@ struct sampler_voice
     uint64_t flexlfo_phase[MAX_FLEX_LFOS];
 };
 
+// filter (3) + filter2 (3) + EQ bands (3)
+#define SAMPLER_BATCH_MAX_STAGES 9
+
+struct sampler_voice_batch
+{
+    uint32_t capacity, count;
+    struct sampler_voice **voices;
+    float (*leftright)[2 * CBOX_BLOCK_SIZE];
+    struct cbox_biquadf_stage *stages;
+    uint8_t *num_stages;
+    uint32_t *order;
+    float *transposed;
+    float *soa;
+};
+
+struct cbox_worker_pool;
+
+struct sampler_voice_parallel
+{
+    struct cbox_worker_pool *pool;
+    struct sampler_module *module;
+    uint32_t capacity, count;
+    struct sampler_voice **voices;
+    // Each partition accumulates its voices into its own set of output
+    // buffers, which are then added together in a fixed order
+    uint32_t partition_count, active_partitions;
+    float *buffers;
+};
+
 struct sampler_module
 {
     struct cbox_module module;
 
-    struct sampler_voice *voices_free, voices_all[MAX_SAMPLER_VOICES];
-    struct sampler_prevoice *prevoices_free, prevoices_all[MAX_SAMPLER_PREVOICES], *prevoices_running;
+    struct sampler_voice *voices_free, *voices_all;
+    struct sampler_voice *oldest_voice, *newest_voice;
+    struct sampler_prevoice *prevoices_free, *prevoices_all, *prevoices_running;
+    uint32_t voice_count, prevoice_count;
     struct sampler_channel channels[16];
     struct sampler_program **programs;
     uint32_t program_count;
@@ -188,7 +253,18 @@ struct sampler_module
     gboolean deleting;
     int disable_mixer_controls;
     struct cbox_prefetch_stack *pipe_stack;
-    struct cbox_sincos sincos[12800];
+    // NULL unless batched rendering is enabled
+    struct sampler_voice_batch *batch;
+    // NULL unless rendering voices on helper threads is enabled
+    struct sampler_voice_parallel *parallel;
+    // Receives /load_progress messages while a program is being loaded, if set
+    struct cbox_command_target *load_progress_fb;
+    int load_threads;
+    // Number of blocks between recalculations of filter coefficients
+    uint32_t filter_control_blocks;
+    // Member channel counts of the lower (channel 1) and upper (channel 16)
+    // MPE zones, 0 if the zone is disabled
+    int mpe_members[2];
 };
 
 #define MAX_RELEASED_GROUPS 16
@@ -238,8 +314,16 @@ extern void sampler_register_program(struct sampler_module *m, struct sampler_pr
 extern gboolean sampler_select_program(struct sampler_module *m, int channel, const gchar *preset, GError **error);
 extern void sampler_unselect_program(struct sampler_module *m, struct sampler_program *prg);
 extern double sampler_get_current_beat(struct sampler_module *m);
+// Configure the lower (zone 0) or upper (zone 1) MPE zone, with 0 to 15 member
+// channels; shrinks the other zone if they would overlap. Notes held on
+// channels that leave a zone are released.
+// This function may only be called from RT thread!
+extern void sampler_set_mpe_zone_RT(struct sampler_module *m, int zone, int members);
+// ... and this one is RT-safe
+extern void sampler_set_mpe_zone(struct sampler_module *m, int zone, int members);
 
 extern void sampler_channel_init(struct sampler_channel *c, struct sampler_module *m);
+extern void sampler_channel_reset_expression(struct sampler_channel *c);
 // This function may only be called from RT thread!
 extern void sampler_channel_set_program_RT(struct sampler_channel *c, struct sampler_program *prg);
 // ... and this one is RT-safe
@@ -259,12 +343,31 @@ extern void sampler_voice_start(struct sampler_voice *v, struct sampler_channel
 extern void sampler_voice_start_silent(struct sampler_layer_data *l, struct sampler_released_groups *exgroups);
 extern void sampler_voice_release(struct sampler_voice *v, gboolean is_polyaft);
 extern void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs);
+// The stages of sampler_voice_process. They only touch the voice itself, so
+// different voices can be processed on different threads; a voice that has
+// finished playing is left with gen.mode == spt_inactive, and the caller
+// needs to call sampler_voice_inactivate on it.
+extern gboolean sampler_voice_process_control(struct sampler_voice *v, struct sampler_module *m);
+extern void sampler_voice_generate(struct sampler_voice *v, float *leftright);
+extern int sampler_voice_get_filter_stages(struct sampler_voice *v, struct cbox_biquadf_stage *stages);
+extern int sampler_voice_get_eq_stages(struct sampler_voice *v, struct cbox_biquadf_stage *stages);
+extern void sampler_voice_process_filters(struct sampler_voice *v, float *leftright);
+extern void sampler_voice_mix(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright);
 extern void sampler_voice_link(struct sampler_voice **pv, struct sampler_voice *v);
 extern void sampler_voice_unlink(struct sampler_voice **pv, struct sampler_voice *v);
 extern void sampler_voice_inactivate(struct sampler_voice *v, gboolean expect_active);
 extern void sampler_voice_update_params_from_layer(struct sampler_voice *v);
 extern float sampler_channel_get_expensive_cc(struct sampler_channel *c, struct sampler_voice *v, struct sampler_prevoice *pv, int cc_no);
 
+extern struct sampler_voice_batch *sampler_voice_batch_new(uint32_t capacity);
+extern void sampler_voice_batch_add(struct sampler_voice_batch *b, struct sampler_voice *v, struct sampler_module *m);
+extern void sampler_voice_batch_render(struct sampler_voice_batch *b, struct sampler_module *m, cbox_sample_t **outputs);
+extern void sampler_voice_batch_destroy(struct sampler_voice_batch *b);
+extern struct sampler_voice_parallel *sampler_voice_parallel_new(struct sampler_module *m, uint32_t capacity, int thread_count);
+extern void sampler_voice_parallel_add(struct sampler_voice_parallel *p, struct sampler_voice *v);
+extern void sampler_voice_parallel_render(struct sampler_voice_parallel *p, struct sampler_module *m, cbox_sample_t **outputs);
+extern void sampler_voice_parallel_destroy(struct sampler_voice_parallel *p);
+
 extern void sampler_prevoice_start(struct sampler_prevoice *pv, struct sampler_channel *c, struct sampler_layer_data *l, int note, int vel);
 extern int sampler_prevoice_process(struct sampler_prevoice *pv, struct sampler_module *m);
 extern void sampler_prevoice_link(struct sampler_prevoice **pv, struct sampler_prevoice *v);
@@ -279,6 +382,8 @@ static inline int sampler_channel_addcc(struct sampler_channel *c, int cc_no)
 
 static inline float sampler_channel_getcc(struct sampler_channel *c, struct sampler_voice *v, int cc_no)
 {
+    if (cc_no == 74 && v && v->expression)
+        return v->expression->timbre * (1.f / 127.f);
     if (cc_no < 128)
         return c->floatcc[cc_no];
     return sampler_channel_get_expensive_cc(c, v, NULL, cc_no);
@@ -336,7 +441,11 @@ static inline float sampler_program_get_curve_value(struct sampler_program *prog
 
 static inline float sampler_channel_getcc_mod(struct sampler_channel *c, struct sampler_voice *v, int cc_no, int curve_id, float step)
 {
-    float val = (cc_no < 128) ? c->floatcc[cc_no] : sampler_channel_get_expensive_cc(c, v, NULL, cc_no);
+    float val;
+    if (cc_no == 74 && v && v->expression)
+        val = v->expression->timbre * (1.f / 127.f);
+    else
+        val = (cc_no < 128) ? c->floatcc[cc_no] : sampler_channel_get_expensive_cc(c, v, NULL, cc_no);
     if (step)
         val = floorf(0.9999f * val * (step + 1)) / step;
     if (curve_id || c->program->interpolated_curves[0])
@@ -353,7 +462,11 @@ static inline int sampler_channel_getintcc(struct sampler_channel *c, struct sam
 
 static inline float sampler_channel_getcc_prevoice(struct sampler_channel *c, struct sampler_prevoice *pv, int cc_no, int curve_id, float step)
 {
-    float val = (cc_no < 128) ? c->floatcc[cc_no] : sampler_channel_get_expensive_cc(c, NULL, pv, cc_no);
+    float val;
+    if (cc_no == 74 && pv->expression)
+        val = pv->expression->timbre * (1.f / 127.f);
+    else
+        val = (cc_no < 128) ? c->floatcc[cc_no] : sampler_channel_get_expensive_cc(c, NULL, pv, cc_no);
     if (step)
         val = floorf(0.9999f * val * (step + 1)) / step;
     if (curve_id || c->program->interpolated_curves[0])
@@ -0,0 +1,237 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "config-api.h"
+#include "dspmath.h"
+#include "errors.h"
+#include "midi.h"
+#include "module.h"
+#include "rt.h"
+#include "sampler.h"
+#include "sampler_impl.h"
+#include <assert.h>
+#include <stdlib.h>
+
+// Batched voice rendering. Instead of running the whole pipeline for one
+// voice at a time, every stage is run for all the voices before moving on
+// to the next one. The biquad cascades (filter, filter2 and EQ bands) are
+// processed across voices: the audio is transposed into sample-major order,
+// and the coefficients and states of each stage are gathered into
+// structure-of-arrays form, so that the inner loop runs over voices and can
+// be vectorised.
+
+enum sampler_batch_soa_array
+{
+    sbsa_a0, sbsa_a1, sbsa_a2, sbsa_b1, sbsa_b2,
+    sbsa_xl1, sbsa_xl2, sbsa_yl1, sbsa_yl2,
+    sbsa_xr1, sbsa_xr2, sbsa_yr1, sbsa_yr2,
+    sbsa_count
+};
+
+struct sampler_voice_batch *sampler_voice_batch_new(uint32_t capacity)
+{
+    struct sampler_voice_batch *b = calloc(1, sizeof(struct sampler_voice_batch));
+    b->capacity = capacity;
+    b->count = 0;
+    b->voices = calloc(capacity, sizeof(struct sampler_voice *));
+    b->leftright = calloc(capacity, sizeof(*b->leftright));
+    b->stages = calloc(capacity * SAMPLER_BATCH_MAX_STAGES, sizeof(struct cbox_biquadf_stage));
+    b->num_stages = calloc(capacity, sizeof(uint8_t));
+    b->order = calloc(capacity, sizeof(uint32_t));
+    b->transposed = calloc(2 * CBOX_BLOCK_SIZE * capacity, sizeof(float));
+    b->soa = calloc(sbsa_count * capacity, sizeof(float));
+    return b;
+}
+
+void sampler_voice_batch_destroy(struct sampler_voice_batch *b)
+{
+    free(b->voices);
+    free(b->leftright);
+    free(b->stages);
+    free(b->num_stages);
+    free(b->order);
+    free(b->transposed);
+    free(b->soa);
+    free(b);
+}
+
+void sampler_voice_batch_add(struct sampler_voice_batch *b, struct sampler_voice *v, struct sampler_module *m)
+{
+    if (!sampler_voice_process_control(v, m))
+    {
+        sampler_voice_inactivate(v, FALSE);
+        return;
+    }
+    assert(b->count < b->capacity);
+    b->voices[b->count++] = v;
+}
+
+// Returns -1 if the voice has to go through the per-voice path
+static int collect_biquad_stages(struct sampler_voice *v, struct cbox_biquadf_stage *stages)
+{
+    // One pole tone control sits between the filters and the EQ, so the
+    // cascade cannot be treated as a sequence of biquads
+    if (v->layer->tonectl_freq != 0)
+        return -1;
+    int count = sampler_voice_get_filter_stages(v, stages);
+    return count + sampler_voice_get_eq_stages(v, stages + count);
+}
+
+static void process_biquad_lanes(float *restrict soa, uint32_t stride, float *restrict left, float *restrict right, uint32_t lanes)
+{
+    const float *restrict a0 = soa + sbsa_a0 * stride, *restrict a1 = soa + sbsa_a1 * stride, *restrict a2 = soa + sbsa_a2 * stride;
+    const float *restrict b1 = soa + sbsa_b1 * stride, *restrict b2 = soa + sbsa_b2 * stride;
+    float *restrict xl1 = soa + sbsa_xl1 * stride, *restrict xl2 = soa + sbsa_xl2 * stride;
+    float *restrict yl1 = soa + sbsa_yl1 * stride, *restrict yl2 = soa + sbsa_yl2 * stride;
+    float *restrict xr1 = soa + sbsa_xr1 * stride, *restrict xr2 = soa + sbsa_xr2 * stride;
+    float *restrict yr1 = soa + sbsa_yr1 * stride, *restrict yr2 = soa + sbsa_yr2 * stride;
+
+    for (uint32_t s = 0; s < CBOX_BLOCK_SIZE; s++)
+    {
+        float *restrict l = left + s * stride, *restrict r = right + s * stride;
+        for (uint32_t k = 0; k < lanes; k++)
+        {
+            float inl = l[k], inr = r[k];
+            float outl = a0[k] * inl + a1[k] * xl1[k] + a2[k] * xl2[k] - b1[k] * yl1[k] - b2[k] * yl2[k];
+            float outr = a0[k] * inr + a1[k] * xr1[k] + a2[k] * xr2[k] - b1[k] * yr1[k] - b2[k] * yr2[k];
+            xl2[k] = xl1[k];
+            xl1[k] = inl;
+            yl2[k] = yl1[k];
+            yl1[k] = outl;
+            xr2[k] = xr1[k];
+            xr1[k] = inr;
+            yr2[k] = yr1[k];
+            yr1[k] = outr;
+            l[k] = outl;
+            r[k] = outr;
+        }
+    }
+}
+
+static void process_biquad_cascades(struct sampler_voice_batch *b, uint32_t nvoices, uint32_t max_stages)
+{
+    uint32_t stride = b->capacity;
+    float *left = b->transposed, *right = b->transposed + CBOX_BLOCK_SIZE * stride;
+    float *soa = b->soa;
+
+    for (uint32_t p = 0; p < nvoices; p++)
+    {
+        const float *lr = b->leftright[b->order[p]];
+        for (uint32_t s = 0; s < CBOX_BLOCK_SIZE; s++)
+        {
+            left[s * stride + p] = lr[2 * s];
+            right[s * stride + p] = lr[2 * s + 1];
+        }
+    }
+    // Voices are sorted by descending number of stages, so the voices that
+    // have a given stage always form a prefix of the list
+    uint32_t lanes = nvoices;
+    for (uint32_t j = 0; j < max_stages; j++)
+    {
+        while (lanes > 0 && b->num_stages[b->order[lanes - 1]] <= j)
+            lanes--;
+        for (uint32_t p = 0; p < lanes; p++)
+        {
+            const struct cbox_biquadf_stage *st = &b->stages[b->order[p] * SAMPLER_BATCH_MAX_STAGES + j];
+            soa[sbsa_a0 * stride + p] = st->coeffs->a0;
+            soa[sbsa_a1 * stride + p] = st->coeffs->a1;
+            soa[sbsa_a2 * stride + p] = st->coeffs->a2;
+            soa[sbsa_b1 * stride + p] = st->coeffs->b1;
+            soa[sbsa_b2 * stride + p] = st->coeffs->b2;
+            soa[sbsa_xl1 * stride + p] = st->left->x1;
+            soa[sbsa_xl2 * stride + p] = st->left->x2;
+            soa[sbsa_yl1 * stride + p] = st->left->y1;
+            soa[sbsa_yl2 * stride + p] = st->left->y2;
+            soa[sbsa_xr1 * stride + p] = st->right->x1;
+            soa[sbsa_xr2 * stride + p] = st->right->x2;
+            soa[sbsa_yr1 * stride + p] = st->right->y1;
+            soa[sbsa_yr2 * stride + p] = st->right->y2;
+        }
+        process_biquad_lanes(soa, stride, left, right, lanes);
+        for (uint32_t p = 0; p < lanes; p++)
+        {
+            const struct cbox_biquadf_stage *st = &b->stages[b->order[p] * SAMPLER_BATCH_MAX_STAGES + j];
+            st->left->x1 = soa[sbsa_xl1 * stride + p];
+            st->left->x2 = soa[sbsa_xl2 * stride + p];
+            st->left->y1 = sanef(soa[sbsa_yl1 * stride + p]);
+            st->left->y2 = sanef(soa[sbsa_yl2 * stride + p]);
+            st->right->x1 = soa[sbsa_xr1 * stride + p];
+            st->right->x2 = soa[sbsa_xr2 * stride + p];
+            st->right->y1 = sanef(soa[sbsa_yr1 * stride + p]);
+            st->right->y2 = sanef(soa[sbsa_yr2 * stride + p]);
+        }
+    }
+    for (uint32_t p = 0; p < nvoices; p++)
+    {
+        float *lr = b->leftright[b->order[p]];
+        for (uint32_t s = 0; s < CBOX_BLOCK_SIZE; s++)
+        {
+            lr[2 * s] = left[s * stride + p];
+            lr[2 * s + 1] = right[s * stride + p];
+        }
+    }
+}
+
+void sampler_voice_batch_render(struct sampler_voice_batch *b, struct sampler_module *m, cbox_sample_t **outputs)
+{
+    uint32_t count = b->count;
+    uint32_t stage_histogram[SAMPLER_BATCH_MAX_STAGES + 1] = {0};
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        struct sampler_voice *v = b->voices[k];
+        sampler_voice_generate(v, b->leftright[k]);
+        int stages = collect_biquad_stages(v, &b->stages[k * SAMPLER_BATCH_MAX_STAGES]);
+        if (stages < 0)
+        {
+            sampler_voice_process_filters(v, b->leftright[k]);
+            stages = 0;
+        }
+        b->num_stages[k] = stages;
+        stage_histogram[stages]++;
+    }
+
+    // Counting sort by descending number of stages; voices without any
+    // biquad stages are left out
+    uint32_t pos = 0, max_stages = 0;
+    uint32_t start[SAMPLER_BATCH_MAX_STAGES + 1];
+    for (int j = SAMPLER_BATCH_MAX_STAGES; j >= 1; j--)
+    {
+        if (stage_histogram[j] && !max_stages)
+            max_stages = j;
+        start[j] = pos;
+        pos += stage_histogram[j];
+    }
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (b->num_stages[k])
+            b->order[start[b->num_stages[k]]++] = k;
+    }
+    if (pos)
+        process_biquad_cascades(b, pos, max_stages);
+
+    for (uint32_t k = 0; k < count; k++)
+    {
+        struct sampler_voice *v = b->voices[k];
+        sampler_voice_mix(v, m, outputs, b->leftright[k]);
+        if (v->gen.mode == spt_inactive)
+            sampler_voice_inactivate(v, FALSE);
+    }
+    b->count = 0;
+}
@@ -71,6 +71,14 @@ void sampler_channel_reset_keyswitches(struct sampler_channel *c)
     }
 }
 
+void sampler_channel_reset_expression(struct sampler_channel *c)
+{
+    c->expression.pitchwheel = 0;
+    c->expression.bend_range = SAMPLER_MPE_MEMBER_BEND_RANGE;
+    c->expression.pressure = 0;
+    c->expression.timbre = 64;
+}
+
 void sampler_channel_init(struct sampler_channel *c, struct sampler_module *m)
 {
     c->module = m;
@@ -85,6 +93,9 @@ void sampler_channel_init(struct sampler_channel *c, struct sampler_module *m)
         c->floatcc[i] = 0;
     }
     c->poly_pressure_mask = 0;
+    c->mpe_master = NULL;
+    c->note_expression = NULL;
+    sampler_channel_reset_expression(c);
     
     // default to maximum and pan=centre if MIDI mixing disabled
     if (m->disable_mixer_controls)
@@ -117,15 +128,15 @@ void sampler_channel_process_cc(struct sampler_channel *c, int cc, int val)
 {
     struct sampler_module *m = c->module;
     // Handle CC triggering.
-    if (c->program && c->program->rll && c->program->rll->layers_oncc)
+    if (c->program && c->program->rll && c->program->rll->layers_oncc_count)
     {
         struct sampler_rll *rll = c->program->rll;
         if ((rll->cc_trigger_bitmask[cc >> 5] & (1 << (cc & 31))))
         {
             int old_value = c->intcc[cc];
-            for (GSList *p = rll->layers_oncc; p; p = p->next)
+            for (uint32_t i = 0; i < rll->layers_oncc_count; i++)
             {
-                struct sampler_layer *layer = p->data;
+                struct sampler_layer *layer = rll->layers_oncc[i];
                 assert(layer->runtime);
                 // Default (compatible) behaviour means the region will trigger
                 // on every CC that has value within the specified range.
@@ -376,12 +387,13 @@ void sampler_channel_stop_note(struct sampler_channel *c, int note, int vel, gbo
     c->switchmask[note >> 5] &= ~(1 << (note & 31));
     FOREACH_PREVOICE(c->module->prevoices_running, pv)
     {
-        if (pv->note == note)
+        if (pv->note == note && pv->expression == c->note_expression)
             sampler_prevoice_unlink(&c->module->prevoices_running, pv);
     }
     FOREACH_VOICE(c->voices_running, v)
     {
-        if (v->note == note && v->layer->trigger != stm_release)
+        // With MPE, the same note number may be held on several member channels
+        if (v->note == note && v->expression == c->note_expression && v->layer->trigger != stm_release)
         {
             v->off_vel = vel;
             if (v->captured_sostenuto)
@@ -525,11 +537,15 @@ void sampler_channel_program_change(struct sampler_channel *c, int program)
 
 float sampler_channel_get_expensive_cc(struct sampler_channel *c, struct sampler_voice *v, struct sampler_prevoice *pv, int cc_no)
 {
+    // Notes from MPE member channels report their own bend and pressure
+    const struct sampler_note_expression *expr = v ? v->expression : (pv ? pv->expression : NULL);
     switch(cc_no)
     {
         case smsrc_pitchbend:
-            return c->pitchwheel / 8191.f;
+            return (expr ? expr->pitchwheel : c->pitchwheel) / 8191.f;
         case smsrc_lastpolyaft: // how this is defined? is it last or is it current voice's?
+            if (expr)
+                return expr->pressure / 127.0;
             return sampler_channel_get_poly_pressure(c, v ? v->note : (pv ? pv->note : 0));
         case smsrc_noteonvel:
             return v ? v->vel / 127.0 : (pv ? pv->vel / 127.0 : 0);
@@ -540,7 +556,7 @@ float sampler_channel_get_expensive_cc(struct sampler_channel *c, struct sampler
         case smsrc_keynotegate:
             return c->switchmask[0] || c->switchmask[1] || c->switchmask[2] || c->switchmask[3]; // XXXKF test interactions with sustain/sostenuto
         case smsrc_chanaft_sfz2:
-            return c->last_chanaft / 127.0;
+            return (expr ? expr->pressure : c->last_chanaft) / 127.0;
         case smsrc_random_unipolar:
         case smsrc_alternate:
             return c->floatcc[cc_no];
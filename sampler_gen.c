@@ -29,6 +29,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <math.h>
 #include <memory.h>
 #include <stdio.h>
+#include <string.h>
 
 #define LOW_QUALITY_INTERPOLATION 0
 
@@ -245,6 +246,276 @@ static inline void process_voice_stereo_noloop(struct sampler_gen *v, struct res
 
 #endif
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !LOW_QUALITY_INTERPOLATION
+
+// Wide kernels, compiled regardless of --with-sse and selected at runtime
+// depending on what the CPU supports. Each iteration produces 8 (AVX2) or
+// 16 (AVX-512) output frames; the remainder of the range is handled by the
+// narrow kernels above.
+
+#define USE_WIDE_RESAMPLER 1
+
+#include <immintrin.h>
+
+enum sampler_gen_isa
+{
+    sgi_narrow,
+    sgi_avx2,
+    sgi_avx512,
+};
+
+static enum sampler_gen_isa resampler_isa = sgi_narrow;
+
+#define AVX2_FUNC __attribute__((target("avx2,fma")))
+
+// Cubic interpolation weights for 8 fractional positions.
+#define AVX2_CUBIC_WEIGHTS(t) \
+    const __m256 tp1 = _mm256_add_ps(t, one), tm1 = _mm256_sub_ps(t, one), tm2 = _mm256_sub_ps(t, two); \
+    const __m256 b0 = _mm256_mul_ps(_mm256_mul_ps(t, tm1), _mm256_mul_ps(tm2, mfrac)); \
+    const __m256 b1 = _mm256_mul_ps(_mm256_mul_ps(tp1, tm1), _mm256_mul_ps(tm2, frac3)); \
+    const __m256 b2 = _mm256_mul_ps(_mm256_mul_ps(tp1, t), _mm256_mul_ps(tm2, mfrac3)); \
+    const __m256 b3 = _mm256_mul_ps(_mm256_mul_ps(tp1, t), _mm256_mul_ps(tm1, frac));
+
+// Split two vectors of 4 64-bit positions into 8 integer sample offsets and
+// 8 fractional parts in [0, 1).
+#define AVX2_SPLIT_POSITIONS(posA, posB, ipos, t) \
+    __m256i ipos, ab_lo, ab_hi; \
+    { \
+        __m256i a = _mm256_permutevar8x32_epi32(posA, even_odd); \
+        __m256i b = _mm256_permutevar8x32_epi32(posB, even_odd); \
+        ab_lo = _mm256_permute2x128_si256(a, b, 0x20); \
+        ab_hi = _mm256_permute2x128_si256(a, b, 0x31); \
+    } \
+    ipos = ab_hi; \
+    __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(ab_lo, 1)), scaler);
+
+#define AVX2_LOW16(x) _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16))
+#define AVX2_HIGH16(x) _mm256_cvtepi32_ps(_mm256_srai_epi32(x, 16))
+
+#define AVX2_STORE_INTERLEAVED(dest, l, r) \
+    { \
+        __m256 lo = _mm256_unpacklo_ps(l, r), hi = _mm256_unpackhi_ps(l, r); \
+        _mm256_storeu_ps(dest, _mm256_permute2f128_ps(lo, hi, 0x20)); \
+        _mm256_storeu_ps(dest + 8, _mm256_permute2f128_ps(lo, hi, 0x31)); \
+    }
+
+#define AVX2_KERNEL_PROLOGUE \
+    const __m256 one = _mm256_set1_ps(1.f), two = _mm256_set1_ps(2.f); \
+    const __m256 frac = _mm256_set1_ps(1.f / 6.f), mfrac = _mm256_set1_ps(-1.f / 6.f); \
+    const __m256 frac3 = _mm256_set1_ps(3.f / 6.f), mfrac3 = _mm256_set1_ps(-3.f / 6.f); \
+    const __m256 scaler = _mm256_set1_ps(1.f / 2147483648.f); \
+    const __m256i even_odd = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7); \
+    const __m256 ramp = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); \
+    uint64_t pos = v->bigpos, delta = v->bigdelta; \
+    __m256i posA = _mm256_setr_epi64x(pos, pos + delta, pos + 2 * delta, pos + 3 * delta); \
+    __m256i posB = _mm256_add_epi64(posA, _mm256_set1_epi64x(4 * delta)); \
+    const __m256i posstep = _mm256_set1_epi64x(8 * delta); \
+    __m256 lgains = _mm256_fmadd_ps(ramp, _mm256_set1_ps(rs->lgain_delta), _mm256_set1_ps(rs->lgain)); \
+    __m256 rgains = _mm256_fmadd_ps(ramp, _mm256_set1_ps(rs->rgain_delta), _mm256_set1_ps(rs->rgain)); \
+    const __m256 lgainstep = _mm256_set1_ps(8 * rs->lgain_delta), rgainstep = _mm256_set1_ps(8 * rs->rgain_delta); \
+    int i = rs->offset, frames = (endpos - i) & ~7;
+
+#define WIDE_KERNEL_EPILOGUE \
+    v->bigpos = pos + frames * delta; \
+    rs->lgain += frames * rs->lgain_delta; \
+    rs->rgain += frames * rs->rgain_delta; \
+    rs->offset = i;
+
+AVX2_FUNC
+static void process_voice_mono_noloop_avx2(struct sampler_gen *v, struct resampler_state *rs, const int16_t *srcdata, int endpos)
+{
+    AVX2_KERNEL_PROLOGUE
+    for (int end = i + frames; i < end; i += 8)
+    {
+        AVX2_SPLIT_POSITIONS(posA, posB, ipos, t)
+        posA = _mm256_add_epi64(posA, posstep);
+        posB = _mm256_add_epi64(posB, posstep);
+
+        // Each gather fetches a pair of adjacent 16-bit samples per lane.
+        __m256i s01 = _mm256_i32gather_epi32((const int *)srcdata, ipos, 2);
+        __m256i s23 = _mm256_i32gather_epi32((const int *)(srcdata + 2), ipos, 2);
+
+        AVX2_CUBIC_WEIGHTS(t)
+        __m256 c = _mm256_mul_ps(b0, AVX2_LOW16(s01));
+        c = _mm256_fmadd_ps(b1, AVX2_HIGH16(s01), c);
+        c = _mm256_fmadd_ps(b2, AVX2_LOW16(s23), c);
+        c = _mm256_fmadd_ps(b3, AVX2_HIGH16(s23), c);
+
+        AVX2_STORE_INTERLEAVED(&rs->leftright[2 * i], _mm256_mul_ps(c, lgains), _mm256_mul_ps(c, rgains))
+        lgains = _mm256_add_ps(lgains, lgainstep);
+        rgains = _mm256_add_ps(rgains, rgainstep);
+    }
+    WIDE_KERNEL_EPILOGUE
+    if (i < endpos)
+        process_voice_mono_noloop(v, rs, srcdata, endpos);
+}
+
+AVX2_FUNC
+static void process_voice_stereo_noloop_avx2(struct sampler_gen *v, struct resampler_state *rs, const int16_t *srcdata, int endpos)
+{
+    AVX2_KERNEL_PROLOGUE
+    for (int end = i + frames; i < end; i += 8)
+    {
+        AVX2_SPLIT_POSITIONS(posA, posB, ipos, t)
+        posA = _mm256_add_epi64(posA, posstep);
+        posB = _mm256_add_epi64(posB, posstep);
+
+        // Each gather fetches one left/right frame per lane.
+        __m256i f0 = _mm256_i32gather_epi32((const int *)srcdata, ipos, 4);
+        __m256i f1 = _mm256_i32gather_epi32((const int *)(srcdata + 2), ipos, 4);
+        __m256i f2 = _mm256_i32gather_epi32((const int *)(srcdata + 4), ipos, 4);
+        __m256i f3 = _mm256_i32gather_epi32((const int *)(srcdata + 6), ipos, 4);
+
+        AVX2_CUBIC_WEIGHTS(t)
+        __m256 cl = _mm256_mul_ps(b0, AVX2_LOW16(f0));
+        cl = _mm256_fmadd_ps(b1, AVX2_LOW16(f1), cl);
+        cl = _mm256_fmadd_ps(b2, AVX2_LOW16(f2), cl);
+        cl = _mm256_fmadd_ps(b3, AVX2_LOW16(f3), cl);
+        __m256 cr = _mm256_mul_ps(b0, AVX2_HIGH16(f0));
+        cr = _mm256_fmadd_ps(b1, AVX2_HIGH16(f1), cr);
+        cr = _mm256_fmadd_ps(b2, AVX2_HIGH16(f2), cr);
+        cr = _mm256_fmadd_ps(b3, AVX2_HIGH16(f3), cr);
+
+        AVX2_STORE_INTERLEAVED(&rs->leftright[2 * i], _mm256_mul_ps(cl, lgains), _mm256_mul_ps(cr, rgains))
+        lgains = _mm256_add_ps(lgains, lgainstep);
+        rgains = _mm256_add_ps(rgains, rgainstep);
+    }
+    WIDE_KERNEL_EPILOGUE
+    if (i < endpos)
+        process_voice_stereo_noloop(v, rs, srcdata, endpos);
+}
+
+#define AVX512_FUNC __attribute__((target("avx512f")))
+
+#define AVX512_CUBIC_WEIGHTS(t) \
+    const __m512 tp1 = _mm512_add_ps(t, one), tm1 = _mm512_sub_ps(t, one), tm2 = _mm512_sub_ps(t, two); \
+    const __m512 b0 = _mm512_mul_ps(_mm512_mul_ps(t, tm1), _mm512_mul_ps(tm2, mfrac)); \
+    const __m512 b1 = _mm512_mul_ps(_mm512_mul_ps(tp1, tm1), _mm512_mul_ps(tm2, frac3)); \
+    const __m512 b2 = _mm512_mul_ps(_mm512_mul_ps(tp1, t), _mm512_mul_ps(tm2, mfrac3)); \
+    const __m512 b3 = _mm512_mul_ps(_mm512_mul_ps(tp1, t), _mm512_mul_ps(tm1, frac));
+
+// Split two vectors of 8 64-bit positions into 16 integer sample offsets and
+// 16 fractional parts in [0, 1).
+#define AVX512_SPLIT_POSITIONS(posA, posB, ipos, t) \
+    __m512i ipos = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(_mm512_srli_epi64(posA, 32))), _mm512_cvtepi64_epi32(_mm512_srli_epi64(posB, 32)), 1); \
+    __m512i fpos = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(posA)), _mm512_cvtepi64_epi32(posB), 1); \
+    __m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(fpos, 1)), scaler);
+
+#define AVX512_LOW16(x) _mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(x, 16), 16))
+#define AVX512_HIGH16(x) _mm512_cvtepi32_ps(_mm512_srai_epi32(x, 16))
+
+#define AVX512_STORE_INTERLEAVED(dest, l, r) \
+    { \
+        __m512 lo = _mm512_unpacklo_ps(l, r), hi = _mm512_unpackhi_ps(l, r); \
+        _mm512_storeu_ps(dest, _mm512_permutex2var_ps(lo, interleave_first, hi)); \
+        _mm512_storeu_ps(dest + 16, _mm512_permutex2var_ps(lo, interleave_second, hi)); \
+    }
+
+#define AVX512_KERNEL_PROLOGUE \
+    const __m512 one = _mm512_set1_ps(1.f), two = _mm512_set1_ps(2.f); \
+    const __m512 frac = _mm512_set1_ps(1.f / 6.f), mfrac = _mm512_set1_ps(-1.f / 6.f); \
+    const __m512 frac3 = _mm512_set1_ps(3.f / 6.f), mfrac3 = _mm512_set1_ps(-3.f / 6.f); \
+    const __m512 scaler = _mm512_set1_ps(1.f / 2147483648.f); \
+    const __m512i interleave_first = _mm512_setr_epi32(0, 1, 2, 3, 16, 17, 18, 19, 4, 5, 6, 7, 20, 21, 22, 23); \
+    const __m512i interleave_second = _mm512_setr_epi32(8, 9, 10, 11, 24, 25, 26, 27, 12, 13, 14, 15, 28, 29, 30, 31); \
+    const __m512 ramp = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); \
+    uint64_t pos = v->bigpos, delta = v->bigdelta; \
+    __m512i posA = _mm512_add_epi64(_mm512_set1_epi64(pos), _mm512_set_epi64(7 * delta, 6 * delta, 5 * delta, 4 * delta, 3 * delta, 2 * delta, delta, 0)); \
+    __m512i posB = _mm512_add_epi64(posA, _mm512_set1_epi64(8 * delta)); \
+    const __m512i posstep = _mm512_set1_epi64(16 * delta); \
+    __m512 lgains = _mm512_fmadd_ps(ramp, _mm512_set1_ps(rs->lgain_delta), _mm512_set1_ps(rs->lgain)); \
+    __m512 rgains = _mm512_fmadd_ps(ramp, _mm512_set1_ps(rs->rgain_delta), _mm512_set1_ps(rs->rgain)); \
+    const __m512 lgainstep = _mm512_set1_ps(16 * rs->lgain_delta), rgainstep = _mm512_set1_ps(16 * rs->rgain_delta); \
+    int i = rs->offset, frames = (endpos - i) & ~15;
+
+AVX512_FUNC
+static void process_voice_mono_noloop_avx512(struct sampler_gen *v, struct resampler_state *rs, const int16_t *srcdata, int endpos)
+{
+    AVX512_KERNEL_PROLOGUE
+    for (int end = i + frames; i < end; i += 16)
+    {
+        AVX512_SPLIT_POSITIONS(posA, posB, ipos, t)
+        posA = _mm512_add_epi64(posA, posstep);
+        posB = _mm512_add_epi64(posB, posstep);
+
+        __m512i s01 = _mm512_i32gather_epi32(ipos, (const int *)srcdata, 2);
+        __m512i s23 = _mm512_i32gather_epi32(ipos, (const int *)(srcdata + 2), 2);
+
+        AVX512_CUBIC_WEIGHTS(t)
+        __m512 c = _mm512_mul_ps(b0, AVX512_LOW16(s01));
+        c = _mm512_fmadd_ps(b1, AVX512_HIGH16(s01), c);
+        c = _mm512_fmadd_ps(b2, AVX512_LOW16(s23), c);
+        c = _mm512_fmadd_ps(b3, AVX512_HIGH16(s23), c);
+
+        AVX512_STORE_INTERLEAVED(&rs->leftright[2 * i], _mm512_mul_ps(c, lgains), _mm512_mul_ps(c, rgains))
+        lgains = _mm512_add_ps(lgains, lgainstep);
+        rgains = _mm512_add_ps(rgains, rgainstep);
+    }
+    WIDE_KERNEL_EPILOGUE
+    if (i < endpos)
+        process_voice_mono_noloop(v, rs, srcdata, endpos);
+}
+
+AVX512_FUNC
+static void process_voice_stereo_noloop_avx512(struct sampler_gen *v, struct resampler_state *rs, const int16_t *srcdata, int endpos)
+{
+    AVX512_KERNEL_PROLOGUE
+    for (int end = i + frames; i < end; i += 16)
+    {
+        AVX512_SPLIT_POSITIONS(posA, posB, ipos, t)
+        posA = _mm512_add_epi64(posA, posstep);
+        posB = _mm512_add_epi64(posB, posstep);
+
+        __m512i f0 = _mm512_i32gather_epi32(ipos, (const int *)srcdata, 4);
+        __m512i f1 = _mm512_i32gather_epi32(ipos, (const int *)(srcdata + 2), 4);
+        __m512i f2 = _mm512_i32gather_epi32(ipos, (const int *)(srcdata + 4), 4);
+        __m512i f3 = _mm512_i32gather_epi32(ipos, (const int *)(srcdata + 6), 4);
+
+        AVX512_CUBIC_WEIGHTS(t)
+        __m512 cl = _mm512_mul_ps(b0, AVX512_LOW16(f0));
+        cl = _mm512_fmadd_ps(b1, AVX512_LOW16(f1), cl);
+        cl = _mm512_fmadd_ps(b2, AVX512_LOW16(f2), cl);
+        cl = _mm512_fmadd_ps(b3, AVX512_LOW16(f3), cl);
+        __m512 cr = _mm512_mul_ps(b0, AVX512_HIGH16(f0));
+        cr = _mm512_fmadd_ps(b1, AVX512_HIGH16(f1), cr);
+        cr = _mm512_fmadd_ps(b2, AVX512_HIGH16(f2), cr);
+        cr = _mm512_fmadd_ps(b3, AVX512_HIGH16(f3), cr);
+
+        AVX512_STORE_INTERLEAVED(&rs->leftright[2 * i], _mm512_mul_ps(cl, lgains), _mm512_mul_ps(cr, rgains))
+        lgains = _mm512_add_ps(lgains, lgainstep);
+        rgains = _mm512_add_ps(rgains, rgainstep);
+    }
+    WIDE_KERNEL_EPILOGUE
+    if (i < endpos)
+        process_voice_stereo_noloop(v, rs, srcdata, endpos);
+}
+
+const char *sampler_gen_init(const char *max_isa)
+{
+    static const char *names[] = { "narrow", "avx2", "avx512" };
+    __builtin_cpu_init();
+    resampler_isa = sgi_narrow;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        resampler_isa = sgi_avx2;
+    if (__builtin_cpu_supports("avx512f"))
+        resampler_isa = sgi_avx512;
+    // Allow limiting the instruction set used, for testing/benchmarking
+    if (max_isa && !strcmp(max_isa, "narrow"))
+        resampler_isa = sgi_narrow;
+    else if (max_isa && !strcmp(max_isa, "avx2") && resampler_isa == sgi_avx512)
+        resampler_isa = sgi_avx2;
+    return names[resampler_isa];
+}
+
+#else
+
+const char *sampler_gen_init(const char *max_isa)
+{
+    return "narrow";
+}
+
+#endif
+
 static inline uint32_t process_voice_noloop(struct sampler_gen *v, struct resampler_state *rs, const int16_t *srcdata, uint32_t pos_offset, uint32_t usable_sample_end)
 {
     uint32_t out_frames = CBOX_BLOCK_SIZE - rs->offset;
@@ -257,6 +528,33 @@ static inline uint32_t process_voice_noloop(struct sampler_gen *v, struct resamp
     
     assert(out_frames > 0 && out_frames <= (uint32_t)(CBOX_BLOCK_SIZE - rs->offset));
     uint32_t oldpos = v->bigpos >> 32;
+#if USE_WIDE_RESAMPLER
+    switch(resampler_isa)
+    {
+    case sgi_avx512:
+        if (out_frames >= 16)
+        {
+            if (v->mode == spt_stereo16)
+                process_voice_stereo_noloop_avx512(v, rs, srcdata - (pos_offset << 1), rs->offset + out_frames);
+            else
+                process_voice_mono_noloop_avx512(v, rs, srcdata - pos_offset, rs->offset + out_frames);
+            return (v->bigpos >> 32) - oldpos;
+        }
+        // fall through
+    case sgi_avx2:
+        if (out_frames >= 8)
+        {
+            if (v->mode == spt_stereo16)
+                process_voice_stereo_noloop_avx2(v, rs, srcdata - (pos_offset << 1), rs->offset + out_frames);
+            else
+                process_voice_mono_noloop_avx2(v, rs, srcdata - pos_offset, rs->offset + out_frames);
+            return (v->bigpos >> 32) - oldpos;
+        }
+        break;
+    default:
+        break;
+    }
+#endif
     if (v->mode == spt_stereo16)
         process_voice_stereo_noloop(v, rs, srcdata - (pos_offset << 1), rs->offset + out_frames);
     else
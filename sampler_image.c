@@ -0,0 +1,677 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "errors.h"
+#include "sampler.h"
+#include "sampler_prg.h"
+#include "wavebank.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Precompiled sampler programs. The image contains the fully resolved
+// layers of a program: the sampler_layer_data structures are stored as they
+// are in memory (with the values inherited from the parent layers already
+// copied in), each followed by the contents of the strings and lists it
+// points to. Loading an image maps the file, copies the structures and fixes
+// up the pointers, so no SFZ text is parsed and no opcodes are looked up.
+//
+// The images are only valid for the build that wrote them - the header
+// contains a signature of the layout of the layer data, and the list of the
+// source files (with their sizes and modification times) to detect stale
+// images.
+//
+// Layout:
+// - header
+// - source files: count, then (name, struct sampler_image_source) each
+// - sample_dir
+// - controller inits: count, then (controller, value) each
+// - controller, pitch and output labels: count, then (number, text) each
+// - MAX_MIDI_CURVES x (present flag, struct sampler_midi_curve if present)
+// - layers: count, then (parent index, flags, layer data, waveform name,
+//   unknown keys) each; parents come before their children, and the
+//   regions come last, in the order of prg->all_layers
+//
+// Numbers are uint32_t, strings are stored as length + 1 (0 for NULL)
+// followed by the characters, without the terminating NUL.
+
+#define SAMPLER_IMAGE_MAGIC "CBOXPRG1"
+#define SAMPLER_IMAGE_VERSION 1
+#define SAMPLER_IMAGE_NO_PARENT 0xFFFFFFFFU
+
+enum sampler_image_layer_flags
+{
+    silf_default_child = 1,
+    silf_region = 2,
+};
+
+struct sampler_image_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t signature;
+    uint64_t size;
+};
+
+struct sampler_image_source
+{
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t size;
+};
+
+// Function pointers are stored as indexes into this table
+static const void *nif_functions[] = {
+    sampler_nif_vel2pitch,
+    sampler_nif_vel2offset,
+    sampler_nif_vel2reloffset,
+    sampler_nif_vel2env,
+    sampler_nif_cc2offset,
+    sampler_nif_cc2reloffset,
+    sampler_nif_addrandom,
+    sampler_nif_cc2delay,
+    sampler_nif_addrandomdelay,
+    sampler_nif_syncbeats,
+};
+
+#define NIF_FUNCTION_COUNT (sizeof(nif_functions) / sizeof(nif_functions[0]))
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void put(GString *image, const void *data, size_t size)
+{
+    g_string_append_len(image, data, size);
+}
+
+static void put_u32(GString *image, uint32_t value)
+{
+    put(image, &value, sizeof(value));
+}
+
+static void put_string(GString *image, const char *str)
+{
+    if (!str)
+    {
+        put_u32(image, 0);
+        return;
+    }
+    size_t len = strlen(str);
+    put_u32(image, len + 1);
+    put(image, str, len);
+}
+
+static inline void encode_sampler_modulation(struct sampler_modulation *item) {}
+static inline void encode_sampler_cc_range(struct sampler_cc_range *item) {}
+static inline void encode_sampler_flex_lfo(struct sampler_flex_lfo *item) {}
+
+static inline void encode_sampler_noteinitfunc(struct sampler_noteinitfunc *item)
+{
+    uintptr_t index;
+    for (index = 0; index < NIF_FUNCTION_COUNT; index++)
+    {
+        if (nif_functions[index] == (const void *)item->key.notefunc_voice)
+            break;
+    }
+    // an unknown function will make the image fail the validation
+    item->key.notefunc_voice = (SamplerNoteInitFunc)index;
+}
+
+#define SAMPLER_IMAGE_PUT_COLL(sname) \
+    static void put_##sname##_list(GString *image, const struct sname *list) \
+    { \
+        uint32_t count = 0; \
+        for (const struct sname *p = list; p; p = p->next) \
+            count++; \
+        put_u32(image, count); \
+        for (const struct sname *p = list; p; p = p->next) \
+        { \
+            struct sname item = *p; \
+            item.next = NULL; \
+            encode_##sname(&item); \
+            put(image, &item, sizeof(item)); \
+        } \
+    }
+
+SAMPLER_COLL_LIST(SAMPLER_IMAGE_PUT_COLL)
+
+#define PROC_FIELDS_PUT(type, name, def_value)
+#define PROC_FIELDS_PUT_string(name) \
+    put_string(image, l->name);
+#define PROC_FIELDS_PUT_dBamp(type, name, def_value)
+#define PROC_FIELDS_PUT_enum(enumtype, name, def_value)
+#define PROC_FIELDS_PUT_dahdsr(name, parname, index)
+#define PROC_FIELDS_PUT_lfo(name, parname, index)
+#define PROC_FIELDS_PUT_eq(name, parname, index)
+#define PROC_FIELDS_PUT_ccrange(name, parname) \
+    put_sampler_cc_range_list(image, l->name);
+#define PROC_FIELDS_PUT_midicurve(name)
+
+static void put_layer_data(GString *image, const struct sampler_layer_data *l)
+{
+    put(image, l, sizeof(*l));
+    SAMPLER_FIXED_FIELDS(PROC_FIELDS_PUT)
+    put_sampler_modulation_list(image, l->modulations);
+    put_sampler_noteinitfunc_list(image, l->voice_nifs);
+    put_sampler_noteinitfunc_list(image, l->prevoice_nifs);
+    put_sampler_flex_lfo_list(image, l->flex_lfos);
+    put_string(image, l->computed.eff_waveform ? l->computed.eff_waveform->canonical_name : NULL);
+}
+
+static void put_layer(GString *image, struct sampler_layer *l, uint32_t parent_index, uint32_t flags)
+{
+    put_u32(image, parent_index);
+    put_u32(image, flags);
+    put_layer_data(image, &l->data);
+    put_u32(image, l->unknown_keys ? g_hash_table_size(l->unknown_keys) : 0);
+    if (l->unknown_keys)
+    {
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init(&iter, l->unknown_keys);
+        while(g_hash_table_iter_next(&iter, &key, &value))
+        {
+            put_string(image, key);
+            put_string(image, value);
+        }
+    }
+}
+
+// Lists the layers in the hierarchy, parents first; regions are not
+// included, as they're stored separately
+static void collect_layers(struct sampler_layer *l, GHashTable *regions, GPtrArray *layers, GHashTable *indexes)
+{
+    g_ptr_array_add(layers, l);
+    g_hash_table_insert(indexes, l, GUINT_TO_POINTER(layers->len));
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, l->child_layers);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+        if (!g_hash_table_lookup(regions, key))
+            collect_layers(key, regions, layers, indexes);
+    }
+}
+
+gboolean sampler_program_write_image(struct sampler_program *prg, const char *filename, GSList *sources, GError **error)
+{
+    GString *image = g_string_sized_new(65536);
+    struct sampler_image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SAMPLER_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = SAMPLER_IMAGE_VERSION;
+    header.signature = sampler_layer_data_layout_signature();
+    put(image, &header, sizeof(header));
+
+    put_u32(image, g_slist_length(sources));
+    for (GSList *p = sources; p; p = p->next)
+    {
+        const struct sampler_program_source *ps = p->data;
+        struct sampler_image_source src = { ps->mtime_sec, ps->mtime_nsec, ps->size };
+        put_string(image, ps->pathname);
+        put(image, &src, sizeof(src));
+    }
+    put_string(image, prg->sample_dir);
+
+    put_u32(image, g_slist_length(prg->ctrl_init_list));
+    for (GSList *p = prg->ctrl_init_list; p; p = p->next)
+    {
+        union sampler_ctrlinit_union u;
+        u.ptr = p->data;
+        put_u32(image, u.cinit.controller);
+        put_u32(image, u.cinit.value);
+    }
+    put_u32(image, g_slist_length(prg->ctrl_label_list));
+    for (GSList *p = prg->ctrl_label_list; p; p = p->next)
+    {
+        struct sampler_ctrllabel *label = p->data;
+        put_u32(image, label->controller);
+        put_string(image, label->label);
+    }
+    put_u32(image, g_slist_length(prg->pitch_label_list));
+    for (GSList *p = prg->pitch_label_list; p; p = p->next)
+    {
+        struct sampler_pitchlabel *label = p->data;
+        put_u32(image, label->pitch);
+        put_string(image, label->label);
+    }
+    put_u32(image, g_slist_length(prg->output_label_list));
+    for (GSList *p = prg->output_label_list; p; p = p->next)
+    {
+        struct sampler_outputlabel *label = p->data;
+        put_u32(image, label->pitch);
+        put_string(image, label->label);
+    }
+    for (int i = 0; i < MAX_MIDI_CURVES; ++i)
+    {
+        put_u32(image, prg->curves[i] != NULL);
+        if (prg->curves[i])
+            put(image, prg->curves[i], sizeof(struct sampler_midi_curve));
+    }
+
+    GHashTable *regions = g_hash_table_new(NULL, NULL);
+    for (GSList *p = prg->all_layers; p; p = p->next)
+        g_hash_table_insert(regions, p->data, p->data);
+    GPtrArray *layers = g_ptr_array_new();
+    // layer -> index + 1
+    GHashTable *indexes = g_hash_table_new(NULL, NULL);
+    collect_layers(prg->global, regions, layers, indexes);
+    uint32_t group_count = layers->len;
+    for (GSList *p = prg->all_layers; p; p = p->next)
+        g_ptr_array_add(layers, p->data);
+
+    put_u32(image, layers->len);
+    for (uint32_t i = 0; i < layers->len; ++i)
+    {
+        struct sampler_layer *l = layers->pdata[i];
+        uint32_t parent_index = l->parent ? GPOINTER_TO_UINT(g_hash_table_lookup(indexes, l->parent)) - 1 : SAMPLER_IMAGE_NO_PARENT;
+        uint32_t flags = (l->parent && l->parent->default_child == l ? silf_default_child : 0) | (i >= group_count ? silf_region : 0);
+        put_layer(image, l, parent_index, flags);
+    }
+    g_hash_table_destroy(indexes);
+    g_hash_table_destroy(regions);
+    g_ptr_array_free(layers, TRUE);
+
+    ((struct sampler_image_header *)image->str)->size = image->len;
+    gboolean result = g_file_set_contents(filename, image->str, image->len, error);
+    g_string_free(image, TRUE);
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The image is read twice: once to validate it, with NULL passed as the
+// destination pointers, and then again to actually create the layers, which
+// cannot fail at that point.
+
+struct sampler_image_reader
+{
+    const uint8_t *pos, *end;
+};
+
+static gboolean get(struct sampler_image_reader *r, void *data, size_t size)
+{
+    if ((size_t)(r->end - r->pos) < size)
+        return FALSE;
+    if (data)
+        memcpy(data, r->pos, size);
+    r->pos += size;
+    return TRUE;
+}
+
+static gboolean get_u32(struct sampler_image_reader *r, uint32_t *value)
+{
+    return get(r, value, sizeof(*value));
+}
+
+static gboolean get_string(struct sampler_image_reader *r, gchar **str)
+{
+    uint32_t len;
+    if (!get_u32(r, &len))
+        return FALSE;
+    const char *start = (const char *)r->pos;
+    if (len && !get(r, NULL, len - 1))
+        return FALSE;
+    if (str)
+        *str = len ? g_strndup(start, len - 1) : NULL;
+    return TRUE;
+}
+
+static inline gboolean decode_sampler_modulation(struct sampler_modulation *item) { return TRUE; }
+static inline gboolean decode_sampler_cc_range(struct sampler_cc_range *item) { return TRUE; }
+
+static inline gboolean decode_sampler_flex_lfo(struct sampler_flex_lfo *item)
+{
+    // used as an index into eff_flex_lfo_by_num
+    return item->key.id < MAX_FLEX_LFOS;
+}
+
+static inline gboolean decode_sampler_noteinitfunc(struct sampler_noteinitfunc *item)
+{
+    uintptr_t index = (uintptr_t)item->key.notefunc_voice;
+    if (index >= NIF_FUNCTION_COUNT)
+        return FALSE;
+    item->key.notefunc_voice = (SamplerNoteInitFunc)nif_functions[index];
+    return TRUE;
+}
+
+#define SAMPLER_IMAGE_GET_COLL(sname) \
+    static gboolean get_##sname##_list(struct sampler_image_reader *r, struct sname **list) \
+    { \
+        uint32_t count; \
+        if (!get_u32(r, &count)) \
+            return FALSE; \
+        struct sname **last = list; \
+        for (uint32_t i = 0; i < count; i++) \
+        { \
+            struct sname item; \
+            if (!get(r, &item, sizeof(item)) || !decode_##sname(&item)) \
+                return FALSE; \
+            if (last) \
+            { \
+                struct sname *p = g_malloc(sizeof(struct sname)); \
+                memcpy(p, &item, sizeof(struct sname)); \
+                *last = p; \
+                last = &p->next; \
+            } \
+        } \
+        if (last) \
+            *last = NULL; \
+        return TRUE; \
+    }
+
+SAMPLER_COLL_LIST(SAMPLER_IMAGE_GET_COLL)
+
+#define PROC_FIELDS_GET(type, name, def_value)
+#define PROC_FIELDS_GET_string(name) \
+    if (!get_string(r, l ? &l->name : NULL)) \
+        return FALSE; \
+    if (l) \
+        l->name##_changed = FALSE;
+#define PROC_FIELDS_GET_dBamp(type, name, def_value)
+#define PROC_FIELDS_GET_enum(enumtype, name, def_value)
+#define PROC_FIELDS_GET_dahdsr(name, parname, index)
+#define PROC_FIELDS_GET_lfo(name, parname, index)
+#define PROC_FIELDS_GET_eq(name, parname, index)
+#define PROC_FIELDS_GET_ccrange(name, parname) \
+    if (!get_sampler_cc_range_list(r, l ? &l->name : NULL)) \
+        return FALSE;
+#define PROC_FIELDS_GET_midicurve(name)
+
+// The waveform is not looked up here, only its name is returned
+static gboolean get_layer_data(struct sampler_image_reader *r, struct sampler_layer_data *l, gchar **waveform_name)
+{
+    if (!get(r, l, sizeof(*l)))
+        return FALSE;
+    SAMPLER_FIXED_FIELDS(PROC_FIELDS_GET)
+    if (!get_sampler_modulation_list(r, l ? &l->modulations : NULL) ||
+        !get_sampler_noteinitfunc_list(r, l ? &l->voice_nifs : NULL) ||
+        !get_sampler_noteinitfunc_list(r, l ? &l->prevoice_nifs : NULL) ||
+        !get_sampler_flex_lfo_list(r, l ? &l->flex_lfos : NULL))
+        return FALSE;
+    if (l)
+    {
+        l->computed.eff_waveform = NULL;
+        l->computed.eff_flex_lfo_by_num = NULL;
+        memset(&l->computed.mod_program, 0, sizeof(l->computed.mod_program));
+    }
+    return get_string(r, waveform_name);
+}
+
+static gboolean source_is_current(const char *filename, const struct sampler_image_source *src)
+{
+    struct stat st;
+    if (stat(filename, &st))
+        return FALSE;
+    return src->mtime_sec == (int64_t)st.st_mtim.tv_sec && src->mtime_nsec == (int64_t)st.st_mtim.tv_nsec && src->size == (uint64_t)st.st_size;
+}
+
+static gboolean get_labels(struct sampler_image_reader *r, struct sampler_program *prg, void (*add_label)(struct sampler_program *prg, uint16_t number, gchar *label))
+{
+    uint32_t count;
+    if (!get_u32(r, &count))
+        return FALSE;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t number;
+        gchar *label = NULL;
+        if (!get_u32(r, &number) || !get_string(r, prg ? &label : NULL))
+            return FALSE;
+        if (prg)
+            add_label(prg, number, label);
+    }
+    return TRUE;
+}
+
+// prg is NULL when validating
+static gboolean read_image(struct sampler_image_reader *r, struct sampler_program *prg)
+{
+    struct sampler_image_header header;
+    if (!get(r, &header, sizeof(header)))
+        return FALSE;
+
+    uint32_t count;
+    if (!get_u32(r, &count))
+        return FALSE;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        gchar *filename = NULL;
+        struct sampler_image_source src;
+        if (!get_string(r, &filename) || !get(r, &src, sizeof(src)))
+        {
+            g_free(filename);
+            return FALSE;
+        }
+        gboolean current = prg || source_is_current(filename, &src);
+        g_free(filename);
+        if (!current)
+            return FALSE;
+    }
+    gchar *sample_dir = NULL;
+    if (!get_string(r, prg ? &sample_dir : NULL))
+        return FALSE;
+    if (prg)
+    {
+        g_free(prg->sample_dir);
+        prg->sample_dir = sample_dir ? sample_dir : g_strdup("");
+    }
+
+    if (!get_u32(r, &count))
+        return FALSE;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t controller, value;
+        if (!get_u32(r, &controller) || !get_u32(r, &value))
+            return FALSE;
+        if (prg)
+            sampler_program_add_controller_init(prg, controller, value);
+    }
+    if (!get_labels(r, prg, sampler_program_add_controller_label) ||
+        !get_labels(r, prg, sampler_program_add_pitch_label) ||
+        !get_labels(r, prg, sampler_program_add_output_label))
+        return FALSE;
+
+    for (int i = 0; i < MAX_MIDI_CURVES; ++i)
+    {
+        uint32_t present;
+        if (!get_u32(r, &present))
+            return FALSE;
+        if (!present)
+            continue;
+        struct sampler_midi_curve *curve = prg ? g_new(struct sampler_midi_curve, 1) : NULL;
+        if (!get(r, curve, sizeof(struct sampler_midi_curve)))
+            return FALSE;
+        if (prg)
+        {
+            if (prg->curves[i])
+                g_free(prg->curves[i]);
+            else
+                prg->interpolated_curves[i] = g_new(float, 128);
+            sampler_midi_curve_interpolate(curve, prg->interpolated_curves[i], 0, 1, FALSE);
+            prg->curves[i] = curve;
+        }
+    }
+
+    if (!get_u32(r, &count) || !count || count > (size_t)(r->end - r->pos) / sizeof(struct sampler_layer_data))
+        return FALSE;
+    // Depth of each layer when validating, the layer objects when loading
+    uint8_t *depths = prg ? NULL : g_malloc(count);
+    struct sampler_layer **layers = prg ? g_new(struct sampler_layer *, count) : NULL;
+    gchar **waveform_names = prg ? g_new0(gchar *, count) : NULL;
+    GPtrArray *regions = prg ? g_ptr_array_new() : NULL;
+    gboolean ok = TRUE;
+    for (uint32_t i = 0; ok && i < count; i++)
+    {
+        uint32_t parent_index, flags;
+        if (!get_u32(r, &parent_index) || !get_u32(r, &flags))
+        {
+            ok = FALSE;
+            break;
+        }
+        struct sampler_layer *l = NULL;
+        if (!prg)
+        {
+            // The first layer is the global one, and there are no loops
+            if ((i == 0) != (parent_index == SAMPLER_IMAGE_NO_PARENT) || (i && parent_index >= i))
+            {
+                ok = FALSE;
+                break;
+            }
+            depths[i] = i ? depths[parent_index] + 1 : 0;
+            // Regions must be in a group in a master (see sampler_program_add_layer)
+            if (depths[i] > 3 || ((flags & silf_region) && depths[i] != 3))
+            {
+                ok = FALSE;
+                break;
+            }
+        }
+        else if (i == 0)
+            l = prg->global;
+        else
+        {
+            struct sampler_layer *parent = layers[parent_index];
+            // The default children of the global layer and of its default
+            // child are already created by sampler_program_new
+            if ((flags & silf_default_child) && parent->default_child)
+                l = parent->default_child;
+            else
+            {
+                l = sampler_layer_new(prg->module, prg, parent);
+                if (flags & silf_default_child)
+                    parent->default_child = l;
+            }
+        }
+        if (l)
+        {
+            sampler_layer_data_close(&l->data);
+            layers[i] = l;
+        }
+        uint32_t unknown_count;
+        if (!get_layer_data(r, l ? &l->data : NULL, prg ? &waveform_names[i] : NULL) || !get_u32(r, &unknown_count))
+        {
+            ok = FALSE;
+            break;
+        }
+        for (uint32_t j = 0; ok && j < unknown_count; j++)
+        {
+            gchar *key = NULL, *value = NULL;
+            ok = get_string(r, l ? &key : NULL) && get_string(r, l ? &value : NULL);
+            if (l)
+            {
+                sampler_layer_apply_param(l, key, value, NULL);
+                g_free(key);
+                g_free(value);
+            }
+        }
+        if (l && (flags & silf_region))
+            g_ptr_array_add(regions, GUINT_TO_POINTER(i));
+    }
+    if (!prg)
+    {
+        g_free(depths);
+        return ok && r->pos == r->end;
+    }
+
+    // The regions are finalised the same way the SFZ loader does it, but with
+    // the waveforms that were used when the image was written. Those are
+    // loaded in parallel first.
+    struct cbox_waveform_request *requests = g_new(struct cbox_waveform_request, count);
+    uint32_t request_count = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (waveform_names[i])
+        {
+            requests[request_count].sample_dir = "";
+            requests[request_count].filename = waveform_names[i];
+            request_count++;
+        }
+    }
+    GSList *preloaded = request_count ? cbox_wavebank_preload(prg->name, NULL, requests, request_count, prg->module->load_threads, NULL, NULL) : NULL;
+    g_free(requests);
+
+    for (uint32_t j = 0; j < regions->len; j++)
+    {
+        uint32_t i = GPOINTER_TO_UINT(regions->pdata[j]);
+        struct sampler_layer *l = layers[i];
+        if (waveform_names[i])
+        {
+            GError *error = NULL;
+            l->data.computed.eff_waveform = cbox_wavebank_get_waveform(prg->name, NULL, "", waveform_names[i], &error);
+            if (!l->data.computed.eff_waveform)
+            {
+                g_warning("Cannot load waveform \"%s\" : \"%s\"", waveform_names[i], error ? error->message : "unknown error");
+                g_clear_error(&error);
+            }
+        }
+        sampler_layer_data_finalize(&l->data, &l->parent->data, prg);
+        sampler_layer_reset_switches(l, prg->module);
+        sampler_layer_update(l);
+        sampler_program_add_layer(prg, l);
+    }
+    prg->all_layers = g_slist_reverse(prg->all_layers);
+    for (GSList *p = preloaded; p; p = p->next)
+        cbox_waveform_unref(p->data);
+    g_slist_free(preloaded);
+    for (uint32_t i = 0; i < count; i++)
+        g_free(waveform_names[i]);
+    g_free(waveform_names);
+    g_free(layers);
+    g_ptr_array_free(regions, TRUE);
+    sampler_program_update_layers(prg);
+    return TRUE;
+}
+
+gboolean sampler_program_load_image(struct sampler_program *prg, const char *filename, GError **error)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st))
+    {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Cannot open '%s': %s", filename, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return FALSE;
+    }
+    void *mapping = st.st_size >= (off_t)sizeof(struct sampler_image_header) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const struct sampler_image_header *header = mapping;
+    if (mapping == MAP_FAILED ||
+        memcmp(header->magic, SAMPLER_IMAGE_MAGIC, sizeof(header->magic)) ||
+        header->version != SAMPLER_IMAGE_VERSION ||
+        header->signature != sampler_layer_data_layout_signature() ||
+        header->size != (uint64_t)st.st_size)
+    {
+        g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "'%s' is not a program image for this version", filename);
+        if (mapping != MAP_FAILED)
+            munmap(mapping, st.st_size);
+        return FALSE;
+    }
+
+    struct sampler_image_reader r = { mapping, (const uint8_t *)mapping + st.st_size };
+    if (!read_image(&r, NULL))
+    {
+        g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Program image '%s' is damaged or out of date", filename);
+        munmap(mapping, st.st_size);
+        return FALSE;
+    }
+    r.pos = mapping;
+    read_image(&r, prg);
+    munmap(mapping, st.st_size);
+    return TRUE;
+}
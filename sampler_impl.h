@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CBOX_SAMPLER_IMPL_H
 #define CBOX_SAMPLER_IMPL_H
 
+// Returns the name of the instruction set used by the resampler
+extern const char *sampler_gen_init(const char *max_isa);
 extern void sampler_gen_reset(struct sampler_gen *v);
 extern uint32_t sampler_gen_sample_playback(struct sampler_gen *v, float *leftright, uint32_t limit);
 extern void sampler_program_change_byidx(struct sampler_module *m, struct sampler_channel *c, int program_idx);
@@ -523,8 +523,42 @@ static int compare_entries(const void *p1, const void *p2)
     return strcmp(e1->name, e2->name);
 }
 
+// Open addressing hash table of the parameters, indexed by the hash of the
+// name with every number (or the # in a template) replaced by a single #.
+// A key can only match the templates that have the same hash, so the lookup
+// needs only a single templcmp call in most cases.
+#define PARAM_HASH_SIZE 2048
+
+struct sampler_layer_param_hash_slot
+{
+    uint32_t hash;
+    const struct sampler_layer_param_entry *entry;
+};
+
+static struct sampler_layer_param_hash_slot param_hash[PARAM_HASH_SIZE];
+
+static inline uint32_t param_name_hash(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    while(*name)
+    {
+        unsigned char ch = *name++;
+        if (ch == '#' || isdigit(ch))
+        {
+            ch = '#';
+            while(isdigit((unsigned char)*name))
+                name++;
+        }
+        hash = (hash ^ ch) * 16777619U;
+    }
+    // 0 marks an empty slot
+    return hash ? hash : 1;
+}
+
 void sampler_layer_prepare_params(void)
 {
+    assert(NPARAMS * 2 <= PARAM_HASH_SIZE);
     qsort(sampler_layer_params, NPARAMS, sizeof(struct sampler_layer_param_entry), compare_entries);
     for (size_t i = 0; i < NPARAMS; ++i)
     {
@@ -539,6 +573,12 @@ void sampler_layer_prepare_params(void)
             assert(found);
             e->extra_ptr = found;
         }
+        uint32_t hash = param_name_hash(e->name);
+        uint32_t slot = hash & (PARAM_HASH_SIZE - 1);
+        while(param_hash[slot].hash)
+            slot = (slot + 1) & (PARAM_HASH_SIZE - 1);
+        param_hash[slot].hash = hash;
+        param_hash[slot].entry = e;
         if (i)
         {
             struct sampler_layer_param_entry *prev_e = &sampler_layer_params[i - 1];
@@ -551,6 +591,25 @@ void sampler_layer_prepare_params(void)
     }
 }
 
+uint32_t sampler_layer_data_layout_signature(void)
+{
+    // The table is sorted on first use, so the entries are combined in an
+    // order-independent way
+    uint32_t signature = (uint32_t)sizeof(struct sampler_layer_data) * 2654435761U;
+    signature ^= (sizeof(void *) << 24) ^ (sizeof(struct sampler_modulation) << 16) ^ (sizeof(struct sampler_noteinitfunc) << 8);
+    signature ^= (sizeof(struct sampler_flex_lfo) << 20) ^ (sizeof(struct sampler_cc_range) << 12) ^ sizeof(struct sampler_midi_curve);
+    for (size_t i = 0; i < NPARAMS; ++i)
+    {
+        const struct sampler_layer_param_entry *e = &sampler_layer_params[i];
+        uint32_t hash = g_str_hash(e->name);
+        hash = (hash ^ (uint32_t)e->offset) * 16777619U;
+        hash = (hash ^ (uint32_t)e->type) * 16777619U;
+        hash = (hash ^ (uint32_t)e->extra_int) * 16777619U;
+        signature += hash;
+    }
+    return signature;
+}
+
 // This only works for setting. Unsetting is slightly different.
 static gboolean override_logic(gboolean is_equal, gboolean has_value, gboolean set_local_value)
 {
@@ -1098,24 +1157,18 @@ const struct sampler_layer_param_entry *sampler_layer_param_find(const char *key
         sampler_layer_prepare_params();
         prepared = 1;
     }
-    int niter = 0;
-    uint32_t lo = 0, hi = NPARAMS;
-    while(lo < hi) {
-        ++niter;
-        uint32_t mid = (lo + hi) >> 1;
-        const struct sampler_layer_param_entry *e = &sampler_layer_params[mid];
-        int res = templcmp(key, e->name, args);
-        if (res == 0)
+    uint32_t hash = param_name_hash(key);
+    for (uint32_t slot = hash & (PARAM_HASH_SIZE - 1); param_hash[slot].hash; slot = (slot + 1) & (PARAM_HASH_SIZE - 1))
+    {
+        if (param_hash[slot].hash != hash)
+            continue;
+        const struct sampler_layer_param_entry *e = param_hash[slot].entry;
+        if (templcmp(key, e->name, args) == 0)
         {
-            // printf("%s found in %d iterations\n", key, niter);
             if (e->type == slpt_alias)
                 return (const struct sampler_layer_param_entry *)e->extra_ptr;
             return e;
         }
-        if (res < 0)
-            hi = mid;
-        else
-            lo = mid + 1;
     }
     return NULL;
 }
@@ -1227,9 +1280,11 @@ static gboolean sampler_layer_process_cmd(struct cbox_command_target *ct, struct
         const char *value = CBOX_ARG_S(cmd, 1);
         if (sampler_layer_apply_param(layer, key, value, error))
         {
+            if (!layer->parent_program->auto_update_layers)
+                sampler_program_layer_changed(layer->parent_program);
             sampler_layer_update(layer);
             if (layer->parent_program->auto_update_layers)
-                sampler_program_update_layers(layer->parent_program);
+                sampler_program_update_layer(layer->parent_program, layer, FALSE);
             return TRUE;
         }
         return FALSE;
@@ -1239,9 +1294,11 @@ static gboolean sampler_layer_process_cmd(struct cbox_command_target *ct, struct
         const char *key = CBOX_ARG_S(cmd, 0);
         if (sampler_layer_unapply_param(layer, key, error))
         {
+            if (!layer->parent_program->auto_update_layers)
+                sampler_program_layer_changed(layer->parent_program);
             sampler_layer_update(layer);
             if (layer->parent_program->auto_update_layers)
-                sampler_program_update_layers(layer->parent_program);
+                sampler_program_update_layer(layer->parent_program, layer, FALSE);
             return TRUE;
         }
         return FALSE;
@@ -1262,7 +1319,7 @@ static gboolean sampler_layer_process_cmd(struct cbox_command_target *ct, struct
         if (l->parent && l->parent->parent && l->parent->parent->parent)
         {
             sampler_program_add_layer(layer->parent_program, l);
-            sampler_program_update_layers(layer->parent_program);
+            sampler_program_update_layer(layer->parent_program, l, FALSE);
         }
 
         return cbox_execute_on(fb, NULL, "/uuid", "o", error, l);
@@ -1341,6 +1398,7 @@ struct sampler_layer *sampler_layer_new(struct sampler_module *m, struct sampler
     SAMPLER_FIXED_FIELDS(PROC_FIELDS_INITIALISER)
 
     ld->computed.eff_flex_lfo_by_num = NULL;
+    memset(&ld->computed.mod_program, 0, sizeof(ld->computed.mod_program));
     ld->computed.eff_waveform = NULL;
     ld->computed.eff_freq = 44100;
     ld->modulations = NULL;
@@ -1401,6 +1459,7 @@ void sampler_layer_data_clone(struct sampler_layer_data *dst, const struct sampl
     dst->flex_lfos = sampler_flex_lfo_clone(src->flex_lfos, copy_hasattr);
     dst->computed.eff_waveform = src->computed.eff_waveform;
     dst->computed.eff_flex_lfo_by_num = NULL;
+    memset(&dst->computed.mod_program, 0, sizeof(dst->computed.mod_program));
     if (dst->computed.eff_waveform)
         cbox_waveform_ref(dst->computed.eff_waveform);
 }
@@ -1459,6 +1518,129 @@ static inline int sampler_filter_num_stages(float cutoff, enum sampler_filter_ty
     return 1;
 }
 
+enum sampler_mod_op_kind
+{
+    smok_none = -1,
+    smok_add,
+    smok_mul,
+    smok_eg,
+    smok_count
+};
+
+static enum sampler_mod_op_kind sampler_mod_op_kind(const struct sampler_modulation *sm)
+{
+    if (sm->key.dest >= smdest_eg_stage_start && sm->key.dest <= smdest_eg_stage_end)
+        // Simplified modulations for EG stages (CCs only)
+        return sm->key.src < smsrc_pernote_offset ? smok_eg : smok_none;
+    if (sm->key.dest == smdest_amplitude)
+        return smok_mul;
+    if (sm->key.dest < smdestcount)
+        return smok_add;
+    return smok_none;
+}
+
+static void sampler_mod_program_clear(struct sampler_mod_program *mp)
+{
+    g_free(mp->cc_inputs);
+    g_free(mp->flex_lfo_inputs);
+    g_free(mp->ops);
+    memset(mp, 0, sizeof(*mp));
+}
+
+static uint8_t sampler_mod_program_cc_input(struct sampler_mod_program *mp, uint32_t cc_number, const struct sampler_modulation_value *value, gboolean add)
+{
+    for (uint32_t i = 0; i < mp->cc_input_count; ++i)
+    {
+        const struct sampler_mod_cc_input *ci = &mp->cc_inputs[i];
+        if (ci->cc_number == cc_number && ci->curve_id == value->curve_id && ci->step == value->step)
+            return smi_compiled_start + i;
+    }
+    if (!add || smi_compiled_start + mp->cc_input_count >= smi_count)
+        return smi_zero;
+    mp->cc_inputs[mp->cc_input_count] = (struct sampler_mod_cc_input){ cc_number, value->curve_id, value->step };
+    return smi_compiled_start + mp->cc_input_count++;
+}
+
+static uint8_t sampler_mod_program_input(struct sampler_mod_program *mp, const struct sampler_layer_data *l, enum sampler_modsrc src, const struct sampler_modulation_value *value)
+{
+    if (src == smsrc_none)
+        return smi_one;
+    if (src < smsrc_pernote_offset)
+        return sampler_mod_program_cc_input(mp, src, value, FALSE);
+    if (!IS_SMSRC_FLEXLFO(src))
+        return src - smsrc_pernote_offset;
+
+    struct sampler_flex_lfo *lfo = l->computed.eff_flex_lfo_by_num ? l->computed.eff_flex_lfo_by_num[SMSRC_FLEXLFO_NUM(src)] : NULL;
+    if (!lfo)
+        return smi_zero;
+    uint32_t first = smi_compiled_start + mp->cc_input_count;
+    for (uint32_t i = 0; i < mp->flex_lfo_input_count; ++i)
+    {
+        if (mp->flex_lfo_inputs[i] == lfo)
+            return first + i;
+    }
+    if (first + mp->flex_lfo_input_count >= smi_count)
+        return smi_zero;
+    mp->flex_lfo_inputs[mp->flex_lfo_input_count] = lfo;
+    return first + mp->flex_lfo_input_count++;
+}
+
+static void sampler_mod_program_compile(struct sampler_mod_program *mp, const struct sampler_layer_data *l)
+{
+    sampler_mod_program_clear(mp);
+
+    uint32_t count = 0, kind_count[smok_count] = {0};
+    for (const struct sampler_modulation *sm = l->modulations; sm; sm = sm->next)
+    {
+        ++count;
+        enum sampler_mod_op_kind kind = sampler_mod_op_kind(sm);
+        if (kind != smok_none)
+            kind_count[kind]++;
+    }
+    if (!count)
+        return;
+    mp->cc_inputs = g_new(struct sampler_mod_cc_input, 2 * count);
+    mp->flex_lfo_inputs = g_new(struct sampler_flex_lfo *, count);
+    mp->ops = g_new(struct sampler_mod_op, count);
+
+    // CC inputs go first, so that the flex LFO inputs can follow them
+    for (const struct sampler_modulation *sm = l->modulations; sm; sm = sm->next)
+    {
+        if (sampler_mod_op_kind(sm) == smok_none)
+            continue;
+        if (sm->key.src < smsrc_pernote_offset)
+            sampler_mod_program_cc_input(mp, sm->key.src, &sm->value, TRUE);
+        if (sm->key.src2 < smsrc_pernote_offset)
+            sampler_mod_program_cc_input(mp, sm->key.src2, &sm->value, TRUE);
+    }
+
+    struct sampler_mod_op *next_op[smok_count] = { mp->ops, mp->ops + kind_count[smok_add], mp->ops + kind_count[smok_add] + kind_count[smok_mul] };
+    for (const struct sampler_modulation *sm = l->modulations; sm; sm = sm->next)
+    {
+        enum sampler_mod_op_kind kind = sampler_mod_op_kind(sm);
+        if (kind == smok_none)
+            continue;
+        struct sampler_mod_op *op = next_op[kind]++;
+        op->amount = sm->value.amount;
+        if (kind == smok_eg)
+        {
+            op->input = sampler_mod_program_input(mp, l, sm->key.src, &sm->value);
+            op->input2 = smi_one;
+            op->dest = sm->key.dest - smdest_eg_stage_start;
+            continue;
+        }
+        op->input = sm->key.src == smsrc_none ? smi_zero : sampler_mod_program_input(mp, l, sm->key.src, &sm->value);
+        op->input2 = sampler_mod_program_input(mp, l, sm->key.src2, &sm->value);
+        op->dest = sm->key.dest;
+        if (kind == smok_mul)
+            mp->mul_dest_mask |= 1 << sm->key.dest;
+        else
+            mp->dest_mask |= 1 << sm->key.dest;
+    }
+    mp->add_op_count = kind_count[smok_add];
+    mp->mul_op_count = kind_count[smok_mul];
+    mp->eg_op_count = kind_count[smok_eg];
+}
 
 // If veltrack > 0, then the default range goes from -84dB to 0dB
 // If veltrack == 0, then the default range is all 0dB
@@ -1603,6 +1785,7 @@ void sampler_layer_data_finalize(struct sampler_layer_data *l, struct sampler_la
         for (struct sampler_flex_lfo *p = l->flex_lfos; p; p = p->next)
             l->computed.eff_flex_lfo_by_num[p->key.id] = p;
     }
+    sampler_mod_program_compile(&l->computed.mod_program, l);
 }
 
 void sampler_layer_reset_switches(struct sampler_layer *l, struct sampler_module *m)
@@ -2057,6 +2240,7 @@ void sampler_layer_data_close(struct sampler_layer_data *l)
         free(l->computed.eff_flex_lfo_by_num);
         l->computed.eff_flex_lfo_by_num = NULL;
     }
+    sampler_mod_program_clear(&l->computed.mod_program);
     g_free(l->sample);
 }
 
@@ -2110,7 +2294,7 @@ void sampler_layer_destroyfunc(struct cbox_objhdr *objhdr)
         if (prg && prg->rll)
         {
             sampler_program_delete_layer(prg, l);
-            sampler_program_update_layers(l->parent_program);
+            sampler_program_update_layer(l->parent_program, l, TRUE);
         }
         l->parent = NULL;
     }
@@ -2148,7 +2332,6 @@ static int sampler_layer_update_cmd_prepare(void *data)
         // initial update of the layer, so none of the voices need updating yet
         // because the layer hasn't been allocated to any voice
         cmd->layer->runtime = cmd->new_data;
-        free(cmd);
         return 1;
     }
     return 0;
@@ -2190,10 +2373,9 @@ static void sampler_layer_update_cmd_cleanup(void *data)
     struct sampler_layer_update_cmd *cmd = data;
 
     sampler_layer_data_destroy(cmd->old_data);
-    free(cmd);
 }
 
-void sampler_layer_update(struct sampler_layer *l)
+static void sampler_layer_update_batched(struct sampler_layer *l, struct cbox_rt_batch *batch)
 {
     // if changing a group, update all child regions instead
     if (g_hash_table_size(l->child_layers))
@@ -2204,7 +2386,7 @@ void sampler_layer_update(struct sampler_layer *l)
         while(g_hash_table_iter_next(&iter, &key, &value))
         {
             sampler_layer_data_finalize(&((struct sampler_layer *)key)->data, &l->data, l->parent_program);
-            sampler_layer_update((struct sampler_layer *)key);
+            sampler_layer_update_batched((struct sampler_layer *)key, batch);
         }
         return;
     }
@@ -2215,11 +2397,22 @@ void sampler_layer_update(struct sampler_layer *l)
     };
 
     sampler_layer_data_finalize(&l->data, l->parent ? &l->parent->data : NULL, l->parent_program);
-    struct sampler_layer_update_cmd *lcmd = malloc(sizeof(struct sampler_layer_update_cmd));
+    struct sampler_layer_update_cmd *lcmd = cbox_rt_batch_alloc(batch, sizeof(struct sampler_layer_update_cmd));
     lcmd->module = l->module;
     lcmd->layer = l;
     lcmd->new_data = NULL;
     lcmd->old_data = NULL;
 
-    cbox_rt_execute_cmd_async(l->module->module.rt, &rtcmd, lcmd);
+    cbox_rt_batch_add(batch, &rtcmd, lcmd);
+}
+
+void sampler_layer_update(struct sampler_layer *l)
+{
+    // All the regions of a group go into one queue entry instead of one per
+    // region. Each region's voices are switched over together with the
+    // region itself, but a large group may be spread over several periods
+    // to keep the per-period cost bounded.
+    struct cbox_rt_batch *batch = cbox_rt_batch_new(l->module->module.rt, RT_MAX_COST_PER_CALL);
+    sampler_layer_update_batched(l, batch);
+    cbox_rt_batch_execute_async(batch);
 }
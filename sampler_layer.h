@@ -645,6 +645,51 @@ enum sampler_layer_mod_bitmasks
     slmb_pitcheg_cc = 0x04,
 };
 
+// Indexes into the array of modulation inputs evaluated once per control
+// block. Per-note sources come first (at src - smsrc_pernote_offset),
+// followed by the constants and the compiled CC and flex LFO inputs.
+enum sampler_mod_input
+{
+    smi_one = smsrc_none - smsrc_pernote_offset,
+    smi_zero,
+    smi_compiled_start,
+
+    smi_count = 256,
+};
+
+// A CC source with its own curve and step - shared by all the modulations
+// that read the same CC in the same way
+struct sampler_mod_cc_input
+{
+    uint32_t cc_number;
+    uint32_t curve_id;
+    float step;
+};
+
+struct sampler_mod_op
+{
+    uint8_t input, input2;
+    // modulation destination, or EG stage index (dest - smdest_eg_stage_start)
+    uint8_t dest;
+    float amount;
+};
+
+// The modulation list of a layer flattened into arrays, so that the voice
+// doesn't need to walk and classify the list on every control block.
+// Inputs are numbered: CC inputs from smi_compiled_start, flex LFO inputs
+// right after them.
+struct sampler_mod_program
+{
+    uint32_t cc_input_count, flex_lfo_input_count;
+    struct sampler_mod_cc_input *cc_inputs;
+    struct sampler_flex_lfo **flex_lfo_inputs;
+    // additive ops, then multiplicative ops, then EG stage ops
+    uint32_t add_op_count, mul_op_count, eg_op_count;
+    struct sampler_mod_op *ops;
+    // destinations written to by the add and mul ops, respectively
+    uint32_t dest_mask, mul_dest_mask;
+};
+
 struct sampler_layer_computed
 {
     // computed values:
@@ -669,6 +714,7 @@ struct sampler_layer_computed
 
     float eff_amp_velcurve[128];
     struct sampler_flex_lfo **eff_flex_lfo_by_num; // For O(1) lookup
+    struct sampler_mod_program mod_program;
 };
 
 struct sampler_layer_data
@@ -709,12 +755,18 @@ extern void sampler_layer_add_nif(struct sampler_layer *l, SamplerNoteInitFunc n
 extern void sampler_layer_load_overrides(struct sampler_layer *l, const char *cfg_section);
 extern void sampler_layer_data_finalize(struct sampler_layer_data *l, struct sampler_layer_data *parent, struct sampler_program *p);
 extern void sampler_layer_reset_switches(struct sampler_layer *l, struct sampler_module *m);
+// Finds the definition of an SFZ opcode, args receives the numbers in it
+// (e.g. 7 for cutoff_cc7)
+extern const struct sampler_layer_param_entry *sampler_layer_param_find(const char *key, uint32_t *args);
 extern gboolean sampler_layer_apply_param(struct sampler_layer *l, const char *key, const char *value, GError **error);
 extern gboolean sampler_layer_unapply_param(struct sampler_layer *l, const char *key, GError **error);
 extern gchar *sampler_layer_to_string(struct sampler_layer *l, gboolean show_inherited);
 extern void sampler_layer_dump(struct sampler_layer *l, FILE *f);
 extern void sampler_layer_update(struct sampler_layer *l);
 
+// Changes whenever the layout of struct sampler_layer_data or the list of
+// the opcodes change, used to reject outdated precompiled programs
+extern uint32_t sampler_layer_data_layout_signature(void);
 extern void sampler_layer_data_clone(struct sampler_layer_data *dst, const struct sampler_layer_data *src, gboolean copy_hasattr);
 extern void sampler_layer_data_close(struct sampler_layer_data *l);
 extern void sampler_layer_data_destroy(struct sampler_layer_data *l);
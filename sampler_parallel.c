@@ -0,0 +1,129 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "config-api.h"
+#include "module.h"
+#include "sampler.h"
+#include "sampler_impl.h"
+#include "workerpool.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rendering of the voices of a single sampler instance on several threads.
+// The running voices are dealt out to a number of partitions, each rendered
+// as one job of the worker pool into its own set of output buffers. Once all
+// the partitions are done, their buffers are added up in partition order, and
+// the voices that have finished are returned to the free list - that part is
+// done on the calling thread, as it modifies the shared voice lists.
+
+// Below this number of voices, the overhead of waking up the helper threads
+// is not worth it
+#define SAMPLER_PARALLEL_MIN_VOICES 8
+// More partitions than threads, so that the threads that finish early can
+// steal some work from the slower ones
+#define SAMPLER_PARALLEL_PARTITIONS_PER_THREAD 2
+
+struct sampler_voice_parallel *sampler_voice_parallel_new(struct sampler_module *m, uint32_t capacity, int thread_count)
+{
+    struct cbox_worker_pool *pool = cbox_worker_pool_new(thread_count, cbox_config_get_int("io", "rtpriority", 10), cbox_config_get_int("io", "render_pin_threads", 0));
+    if (!pool)
+        return NULL;
+    struct sampler_voice_parallel *p = calloc(1, sizeof(struct sampler_voice_parallel));
+    p->pool = pool;
+    p->module = m;
+    p->capacity = capacity;
+    p->count = 0;
+    p->voices = calloc(capacity, sizeof(struct sampler_voice *));
+    p->partition_count = (pool->thread_count + 1) * SAMPLER_PARALLEL_PARTITIONS_PER_THREAD;
+    p->buffers = calloc(p->partition_count * m->module.outputs * CBOX_BLOCK_SIZE, sizeof(float));
+    return p;
+}
+
+void sampler_voice_parallel_destroy(struct sampler_voice_parallel *p)
+{
+    cbox_worker_pool_destroy(p->pool);
+    free(p->voices);
+    free(p->buffers);
+    free(p);
+}
+
+void sampler_voice_parallel_add(struct sampler_voice_parallel *p, struct sampler_voice *v)
+{
+    assert(p->count < p->capacity);
+    p->voices[p->count++] = v;
+}
+
+static void render_partition(void *user_data, uint32_t index)
+{
+    struct sampler_voice_parallel *p = user_data;
+    struct sampler_module *m = p->module;
+    uint32_t outputs_count = m->module.outputs;
+    float *buffers = p->buffers + index * outputs_count * CBOX_BLOCK_SIZE;
+    cbox_sample_t *outputs[CBOX_MAX_AUDIO_PORTS];
+
+    memset(buffers, 0, outputs_count * CBOX_BLOCK_SIZE * sizeof(float));
+    for (uint32_t i = 0; i < outputs_count; i++)
+        outputs[i] = buffers + i * CBOX_BLOCK_SIZE;
+    // Interleaved assignment, so that the voices started at around the same
+    // time (and likely to have similar cost) end up in different partitions
+    for (uint32_t k = index; k < p->count; k += p->active_partitions)
+    {
+        struct sampler_voice *v = p->voices[k];
+        if (!sampler_voice_process_control(v, m))
+            continue;
+        float leftright[2 * CBOX_BLOCK_SIZE];
+        sampler_voice_generate(v, leftright);
+        sampler_voice_process_filters(v, leftright);
+        sampler_voice_mix(v, m, outputs, leftright);
+    }
+}
+
+void sampler_voice_parallel_render(struct sampler_voice_parallel *p, struct sampler_module *m, cbox_sample_t **outputs)
+{
+    uint32_t count = p->count;
+    if (count < SAMPLER_PARALLEL_MIN_VOICES)
+    {
+        for (uint32_t k = 0; k < count; k++)
+            sampler_voice_process(p->voices[k], m, outputs);
+        p->count = 0;
+        return;
+    }
+
+    p->active_partitions = count < p->partition_count ? count : p->partition_count;
+    cbox_worker_pool_run(p->pool, render_partition, p, p->active_partitions);
+
+    uint32_t outputs_count = m->module.outputs;
+    for (uint32_t j = 0; j < p->active_partitions; j++)
+    {
+        const float *buffers = p->buffers + j * outputs_count * CBOX_BLOCK_SIZE;
+        for (uint32_t o = 0; o < outputs_count; o++)
+        {
+            const float *src = buffers + o * CBOX_BLOCK_SIZE;
+            for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+                outputs[o][i] += src[i];
+        }
+    }
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (p->voices[k]->gen.mode == spt_inactive)
+            sampler_voice_inactivate(p->voices[k], FALSE);
+    }
+    p->count = 0;
+}
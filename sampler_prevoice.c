@@ -11,6 +11,7 @@
 void sampler_prevoice_start(struct sampler_prevoice *pv, struct sampler_channel *channel, struct sampler_layer_data *l, int note, int vel)
 {
     pv->channel = channel;
+    pv->expression = channel->note_expression;
     pv->layer_data = l;
     pv->note = note;
     pv->vel = vel;
@@ -30,16 +30,62 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 CBOX_CLASS_DEFINITION_ROOT(sampler_program)
 
-// GSList *sampler_channel_get_next_layer(struct sampler_channel *c, GSList *next_layer, int note, int vel, float random, gboolean is_first, gboolean is_release)
+// Returns the index of the first entry from pos onwards that passes the
+// velocity and random range checks, or the number of entries. The entries
+// are checked 16 at a time, so that the compiler can vectorise the
+// comparisons.
+static inline uint32_t find_candidate(const struct sampler_rll_block *b, uint32_t pos, int vel, float random)
+{
+    const uint8_t *lovel = b->lovel, *hivel = b->hivel;
+    const float *lorand = b->lorand, *hirand = b->hirand;
+    uint32_t end = b->count;
+    while(pos < end)
+    {
+        uint32_t count = end - pos < 16 ? end - pos : 16;
+        uint32_t mask = 0;
+        for (uint32_t k = 0; k < count; k++)
+            mask |= (uint32_t)((vel >= lovel[pos + k]) & (vel <= hivel[pos + k]) & (random >= lorand[pos + k]) & (random < hirand[pos + k])) << k;
+        if (mask)
+            return pos + __builtin_ctz(mask);
+        pos += count;
+    }
+    return end;
+}
+
+static inline gboolean cc_tests_pass(const struct sampler_rll_block *b, uint32_t entry, struct sampler_channel *c)
+{
+    for (uint32_t i = b->cc_test_index[entry]; i < b->cc_test_index[entry + 1]; i++)
+    {
+        const struct sampler_rll_cc_test *test = &b->cc_tests[i];
+        int ccval = sampler_channel_getintcc(c, NULL, test->cc_number);
+        if (ccval < 0 || ccval > 127 || !(test->values[ccval >> 5] & (1U << (ccval & 31))))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static inline void set_iterator_block(struct sampler_rll_iterator *iter, const struct sampler_rll_block *block)
+{
+    iter->block = block;
+    iter->next_entry = 0;
+}
 
 struct sampler_layer *sampler_rll_iterator_next(struct sampler_rll_iterator *iter)
 {
+    struct sampler_rll *rll = iter->rll;
 retry:
-    while(iter->next_layer)
+    while(iter->block && iter->next_entry < iter->block->count)
     {
-        struct sampler_layer *lr = iter->next_layer->data;
+        const struct sampler_rll_block *b = iter->block;
+        gboolean bounds_stale = rll->bounds_stale;
+        uint32_t entry = bounds_stale ? iter->next_entry : find_candidate(b, iter->next_entry, iter->vel, iter->random);
+        if (entry == b->count)
+            break;
+        iter->next_entry = entry + 1;
+        if (!bounds_stale && !cc_tests_pass(b, entry, iter->channel))
+            continue;
+        struct sampler_layer *lr = b->layers[entry];
         struct sampler_layer_data *l = lr->runtime;
-        iter->next_layer = g_slist_next(iter->next_layer);
         if (!l->computed.eff_waveform)
             continue;
 
@@ -67,7 +113,7 @@ retry:
             c->last_chanaft >= l->lochanaft && c->last_chanaft <= l->hichanaft &&
             c->last_polyaft >= l->lopolyaft && c->last_polyaft <= l->hipolyaft &&
             c->module->module.engine->master->tempo >= l->lobpm && c->module->module.engine->master->tempo < l->hibpm &&
-            sampler_cc_range_is_in(l->cc, c))
+            (!bounds_stale || sampler_cc_range_is_in(l->cc, c))) // otherwise CC ranges are checked by cc_tests_pass
         {
             if (!l->computed.eff_use_keyswitch ||
                 ((l->sw_down == -1 || (c->switchmask[l->sw_down >> 5] & (1 << (l->sw_down & 31)))) &&
@@ -85,10 +131,9 @@ retry:
             }
         }
     }
-    while(iter->next_keyswitch_index < iter->rll->keyswitch_group_count &&
+    while(iter->next_keyswitch_index < rll->keyswitch_group_count &&
         iter->next_keyswitch_index < MAX_KEYSWITCH_GROUPS)
     {
-        struct sampler_rll *rll = iter->rll;
         uint32_t ks_group = iter->next_keyswitch_index++;
 
         uint8_t ks_state = iter->channel->keyswitch_state[ks_group];
@@ -97,13 +142,13 @@ retry:
         uint8_t key_range = rll->ranges_by_key[iter->note];
         if (key_range != 255)
         {
-            GSList **layers_by_range = iter->release_mode == stm_release ? rll->release_layers_by_range : rll->layers_by_range;
+            struct sampler_rll_block **layers_by_range = iter->release_mode == stm_release ? rll->release_layers_by_range : rll->layers_by_range;
             if (iter->release_mode == stm_release_key)
                 layers_by_range = rll->key_release_layers_by_range;
             assert(layers_by_range);
             layers_by_range += (rll->keyswitch_groups[ks_group]->group_offset + ks_state) * rll->layers_by_range_count;
-            iter->next_layer = layers_by_range[key_range];
-            if (iter->next_layer)
+            set_iterator_block(iter, layers_by_range[key_range]);
+            if (iter->block)
                 goto retry;
         }
     }
@@ -120,24 +165,21 @@ void sampler_rll_iterator_init(struct sampler_rll_iterator *iter, struct sampler
     iter->release_mode = release_mode;
     iter->rll = rll;
     iter->next_keyswitch_index = 0;
+    set_iterator_block(iter, NULL);
 
     if (note >= rll->lokey && note <= rll->hikey)
     {
         assert(note >= 0 && note <= 127);
-        GSList **layers_by_range = release_mode == stm_release ? rll->release_layers_by_range : rll->layers_by_range;
+        struct sampler_rll_block **layers_by_range = release_mode == stm_release ? rll->release_layers_by_range : rll->layers_by_range;
         if (release_mode == stm_release_key)
             layers_by_range = rll->key_release_layers_by_range;
         if (layers_by_range)
         {
             uint8_t key_range = rll->ranges_by_key[note];
             if (key_range != 255)
-                iter->next_layer = layers_by_range[key_range];
+                set_iterator_block(iter, layers_by_range[key_range]);
         }
-        else
-            iter->next_layer = NULL;
     }
-    else
-        iter->next_layer = NULL;
 }
 
 static gboolean return_layers(GSList *layers, const char *keyword, struct cbox_command_target *fb, GError **error)
@@ -666,6 +708,44 @@ void sampler_program_update_layers(struct sampler_program *prg)
         sampler_rll_destroy(old_rll);
 }
 
+void sampler_program_layer_changed(struct sampler_program *prg)
+{
+    if (prg->rll)
+        prg->rll->bounds_stale = TRUE;
+}
+
+static void collect_regions(struct sampler_layer *l, GPtrArray *regions)
+{
+    if (l->parent && l->parent->parent && l->parent->parent->parent)
+    {
+        g_ptr_array_add(regions, l);
+        return;
+    }
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, l->child_layers);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+        collect_regions(key, regions);
+}
+
+void sampler_program_update_layer(struct sampler_program *prg, struct sampler_layer *l, gboolean removed)
+{
+    struct sampler_module *m = prg->module;
+    struct sampler_rll *new_rll = NULL;
+    if (prg->rll)
+    {
+        GPtrArray *regions = g_ptr_array_new();
+        collect_regions(l, regions);
+        new_rll = sampler_rll_new_updated(prg->rll, prg, (struct sampler_layer **)regions->pdata, regions->len, removed);
+        g_ptr_array_free(regions, TRUE);
+    }
+    if (!new_rll)
+        new_rll = sampler_rll_new_from_program(prg);
+    struct sampler_rll *old_rll = cbox_rt_swap_pointers(m->module.rt, (void **)&prg->rll, new_rll);
+    if (old_rll)
+        sampler_rll_destroy(old_rll);
+}
+
 struct sampler_program *sampler_program_clone(struct sampler_program *prg, struct sampler_module *m, int prog_no, GError **error)
 {
     struct sampler_program *newprg = sampler_program_new(m, prog_no, prg->name, prg->tarfile, prg->sample_dir, error);
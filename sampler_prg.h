@@ -36,19 +36,52 @@ struct sampler_keyswitch_group
     uint8_t key_offsets[];
 };
 
-// Runtime layer lists; in future, I might something more clever, like a tree
+// A set of accepted values of a single CC; several conditions on the same CC
+// are merged into one test
+struct sampler_rll_cc_test
+{
+    uint32_t values[4];
+    uint8_t cc_number;
+};
+
+// The layers that can be triggered by a single key range in a single
+// keyswitch state. The cheapest conditions are stored in structure of arrays
+// form, so that most of the layers can be rejected without touching the
+// layer data. Blocks are immutable once created, and shared between the
+// ranges with the same layers and between the old and new versions of the
+// rll during an incremental update.
+struct sampler_rll_block
+{
+    uint32_t refcount; // only accessed from the main thread
+    uint32_t count;
+    struct sampler_layer **layers;
+    float *lorand, *hirand;
+    // CC tests of entry i are cc_tests[cc_test_index[i]] to cc_tests[cc_test_index[i + 1] - 1]
+    uint32_t *cc_test_index;
+    struct sampler_rll_cc_test *cc_tests;
+    uint8_t *lovel, *hivel;
+};
+
+// Runtime layer lists
 struct sampler_rll
 {
-    GSList *layers_oncc;
+    struct sampler_layer **layers_oncc;
+    uint32_t layers_oncc_count;
     uint32_t cc_trigger_bitmask[4]; // one bit per CC
     uint8_t lokey, hikey;
     uint8_t ranges_by_key[128];
     uint32_t layers_by_range_count;
-    GSList **layers_by_range, **release_layers_by_range, **key_release_layers_by_range;
+    // One block per key range and keyswitch state, NULL if there are no layers
+    struct sampler_rll_block **layers_by_range, **release_layers_by_range, **key_release_layers_by_range;
     struct sampler_keyswitch_group **keyswitch_groups;
     uint32_t keyswitch_group_count;
     uint32_t keyswitch_key_count;
     uint32_t num_release_layers, num_key_release_layers;
+    // Set when a layer has been changed without updating the rll (with
+    // auto_update_layers off). The velocity, random and CC bounds stored in
+    // the blocks may be out of date then, so the ones in the runtime layer
+    // data are used instead.
+    volatile gboolean bounds_stale;
 };
 
 struct sampler_rll_iterator
@@ -58,7 +91,8 @@ struct sampler_rll_iterator
     float random;
     gboolean is_first;
     enum sampler_trigger release_mode;
-    GSList *next_layer;
+    const struct sampler_rll_block *block;
+    uint32_t next_entry;
     struct sampler_rll *rll;
     uint32_t next_keyswitch_index;
 };
@@ -115,6 +149,8 @@ struct sampler_program
 };
 
 extern struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg);
+// Returns NULL if the changes require a full rebuild
+extern struct sampler_rll *sampler_rll_new_updated(struct sampler_rll *rll, struct sampler_program *prg, struct sampler_layer **layers, uint32_t layer_count, gboolean removed);
 extern void sampler_rll_destroy(struct sampler_rll *rll);
 
 extern void sampler_rll_iterator_init(struct sampler_rll_iterator *iter, struct sampler_rll *rll, struct sampler_channel *c, int note, int vel, float random, gboolean is_first, enum sampler_trigger release_mode);
@@ -131,6 +167,25 @@ extern void sampler_program_add_pitch_label(struct sampler_program *prg, uint16_
 extern void sampler_program_add_output_label(struct sampler_program *prg, uint16_t pitch, gchar *label); // keeps ownership
 extern void sampler_program_remove_controller_init(struct sampler_program *prg, uint16_t controller, int which);
 extern void sampler_program_update_layers(struct sampler_program *prg);
+// Updates the runtime layer lists after a change to a single layer (and the
+// regions inside it) or its removal from the program
+extern void sampler_program_update_layer(struct sampler_program *prg, struct sampler_layer *l, gboolean removed);
+// Called before changing a layer without updating the runtime layer lists
+extern void sampler_program_layer_changed(struct sampler_program *prg);
 extern struct sampler_program *sampler_program_clone(struct sampler_program *prg, struct sampler_module *m, int prog_no, GError **error);
 
+// A file a program was loaded from, with its modification time and size at
+// the time it was read
+struct sampler_program_source
+{
+    gchar *pathname;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t size;
+};
+
+// Precompiled programs, see sampler_image.c; sources is a list of
+// struct sampler_program_source
+extern gboolean sampler_program_write_image(struct sampler_program *prg, const char *filename, GSList *sources, GError **error);
+extern gboolean sampler_program_load_image(struct sampler_program *prg, const char *filename, GError **error);
+
 #endif
@@ -7,47 +7,234 @@
 
 /////////////////////////////////////////////////////////////////////////////////
 
-static void add_layers(struct sampler_rll *rll, GSList **layers_by_range, struct sampler_layer *l, uint32_t lokey, uint32_t hikey)
+enum sampler_rll_list
 {
-    if (lokey >= 0 && lokey <= 127 &&
-        hikey >= 0 && hikey <= 127 && lokey <= hikey)
+    srl_normal,
+    srl_release,
+    srl_key_release,
+    srl_count,
+};
+
+static gboolean get_key_span(struct sampler_layer *l, uint32_t *lokey, uint32_t *hikey)
+{
+    uint8_t lo = l->data.computed.eff_lokey, hi = l->data.computed.eff_hikey;
+    if (lo <= 127 && hi <= 127 && lo <= hi)
+    {
+        *lokey = lo;
+        *hikey = hi;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static inline gboolean has_keyswitch(const struct sampler_layer_data *ld)
+{
+    return ld->sw_last >= 0 && ld->sw_last <= 127 &&
+        ld->sw_lokey >= 0 && ld->sw_lokey <= 127 &&
+        ld->sw_hikey >= 0 && ld->sw_hikey <= 127 &&
+        ld->sw_last >= ld->sw_lokey && ld->sw_last <= ld->sw_hikey;
+}
+
+static enum sampler_rll_list get_trigger_list(const struct sampler_layer_data *ld)
+{
+    if (ld->trigger == stm_release_key)
+        return srl_key_release;
+    if (ld->trigger == stm_release)
+        return srl_release;
+    return srl_normal;
+}
+
+static struct sampler_keyswitch_group *find_keyswitch_group(struct sampler_rll *rll, const struct sampler_layer_data *ld)
+{
+    for (uint32_t i = 0; i < rll->keyswitch_group_count; ++i)
     {
-        int start = rll->ranges_by_key[lokey];
-        int end = rll->ranges_by_key[hikey];
-        assert(start != 255 && end != 255);
-        for (int i = start; i <= end; ++i)
+        struct sampler_keyswitch_group *ks = rll->keyswitch_groups[i];
+        if (ks->lo == ld->sw_lokey && ks->hi == ld->sw_hikey)
+            return ks;
+    }
+    return NULL;
+}
+
+// Returns the keyswitch state of the layer (0 if not using any), or -1 if
+// the state is not known to the rll
+static int get_keyswitch_state(struct sampler_rll *rll, struct sampler_layer *l)
+{
+    const struct sampler_layer_data *ld = &l->data;
+    if (!has_keyswitch(ld))
+        return 0;
+    const struct sampler_keyswitch_group *ks = find_keyswitch_group(rll, ld);
+    if (!ks)
+        return -1;
+    uint8_t rel_offset = ks->key_offsets[ld->sw_last - ld->sw_lokey];
+    return rel_offset != 255 ? (int)(ks->group_offset + rel_offset) : -1;
+}
+
+// The default of a group comes from the first layer that uses the group and
+// has sw_default within its range, same as in sampler_rll_new_from_program
+static void update_keyswitch_defaults(struct sampler_rll *rll, struct sampler_program *prg)
+{
+    for (uint32_t i = 0; i < rll->keyswitch_group_count; ++i)
+        rll->keyswitch_groups[i]->def_value = 255;
+    for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
+    {
+        const struct sampler_layer_data *ld = &((struct sampler_layer *)p->data)->data;
+        if (!has_keyswitch(ld))
+            continue;
+        struct sampler_keyswitch_group *ks = find_keyswitch_group(rll, ld);
+        if (ks && ld->sw_default >= ks->lo && ld->sw_default <= ks->hi && ks->def_value == 255)
+            ks->def_value = ld->sw_default - ks->lo;
+    }
+}
+
+// Converts the CC conditions of a layer to the bitset form; returns the
+// number of tests, and only counts them if tests is NULL
+static uint32_t make_cc_tests(const struct sampler_cc_range *cc, struct sampler_rll_cc_test *tests)
+{
+    struct sampler_rll_cc_test tmp[256];
+    uint32_t count = 0;
+    for (; cc; cc = cc->next)
+    {
+        uint32_t i;
+        for (i = 0; i < count && tmp[i].cc_number != cc->key.cc_number; i++)
+            ;
+        if (i == count)
         {
-            if (!layers_by_range[i] || layers_by_range[i]->data != l)
-                layers_by_range[i] = g_slist_prepend(layers_by_range[i], l);
+            tmp[i].cc_number = cc->key.cc_number;
+            memset(tmp[i].values, 0xFF, sizeof(tmp[i].values));
+            count++;
         }
+        uint32_t values[4] = {0, 0, 0, 0};
+        for (int v = cc->value.locc; v <= cc->value.hicc && v <= 127; v++)
+            values[v >> 5] |= 1U << (v & 31);
+        for (int j = 0; j < 4; j++)
+            tmp[i].values[j] &= values[j];
     }
+    if (tests)
+        memcpy(tests, tmp, count * sizeof(struct sampler_rll_cc_test));
+    return count;
 }
 
-struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg)
+static struct sampler_rll_block *block_new(struct sampler_layer **layers, uint32_t count)
 {
-    struct sampler_rll *rll = g_new(struct sampler_rll, 1);
-    rll->layers_oncc = NULL;
+    if (!count)
+        return NULL;
+    uint32_t test_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        test_count += make_cc_tests(layers[i]->data.cc, NULL);
+    // A single allocation, with the arrays ordered by alignment
+    size_t size = sizeof(struct sampler_rll_block) +
+        count * (sizeof(struct sampler_layer *) + 2 * sizeof(float) + 2 * sizeof(uint8_t)) +
+        (count + 1) * sizeof(uint32_t) + test_count * sizeof(struct sampler_rll_cc_test);
+    struct sampler_rll_block *b = g_malloc(size);
+    b->refcount = 1;
+    b->count = count;
+    b->layers = (struct sampler_layer **)(b + 1);
+    b->lorand = (float *)(b->layers + count);
+    b->hirand = b->lorand + count;
+    b->cc_test_index = (uint32_t *)(b->hirand + count);
+    b->cc_tests = (struct sampler_rll_cc_test *)(b->cc_test_index + count + 1);
+    b->lovel = (uint8_t *)(b->cc_tests + test_count);
+    b->hivel = b->lovel + count;
+
+    test_count = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const struct sampler_layer_data *ld = &layers[i]->data;
+        int lovel = ld->lovel < 0 ? 0 : ld->lovel, hivel = ld->hivel > 127 ? 127 : ld->hivel;
+        // Empty range, never matches
+        if (lovel > hivel)
+            lovel = 255, hivel = 0;
+        b->layers[i] = layers[i];
+        b->lovel[i] = lovel;
+        b->hivel[i] = hivel;
+        b->lorand[i] = ld->lorand;
+        b->hirand[i] = ld->hirand;
+        b->cc_test_index[i] = test_count;
+        test_count += make_cc_tests(ld->cc, b->cc_tests + test_count);
+    }
+    b->cc_test_index[count] = test_count;
+    return b;
+}
+
+static inline struct sampler_rll_block *block_ref(struct sampler_rll_block *b)
+{
+    if (b)
+        b->refcount++;
+    return b;
+}
+
+static inline void block_unref(struct sampler_rll_block *b)
+{
+    if (b && !--b->refcount)
+        g_free(b);
+}
+
+static inline struct sampler_rll_block **get_list(struct sampler_rll *rll, enum sampler_rll_list list)
+{
+    switch(list)
+    {
+        case srl_release:
+            return rll->release_layers_by_range;
+        case srl_key_release:
+            return rll->key_release_layers_by_range;
+        default:
+            return rll->layers_by_range;
+    }
+}
+
+// Things that depend on all the layers, but are cheap to recalculate
+static void scan_program_layers(struct sampler_rll *rll, struct sampler_program *prg)
+{
+    uint32_t oncc_count = 0;
+    rll->num_release_layers = 0;
+    rll->num_key_release_layers = 0;
     for (int i = 0; i < 4; i++)
         rll->cc_trigger_bitmask[i] = 0;
+    for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
+    {
+        struct sampler_layer_data *ld = &((struct sampler_layer *)p->data)->data;
+        if (ld->trigger == stm_release)
+            rll->num_release_layers++;
+        if (ld->trigger == stm_release_key)
+            rll->num_key_release_layers++;
+        if (ld->on_cc)
+            oncc_count++;
+    }
+    rll->layers_oncc = g_new(struct sampler_layer *, oncc_count);
+    rll->layers_oncc_count = oncc_count;
+    // In the reverse order of all_layers, as they always were
+    for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
+    {
+        struct sampler_layer *l = p->data;
+        struct sampler_cc_range *oncc = l->data.on_cc;
+        if (oncc)
+        {
+            rll->layers_oncc[--oncc_count] = l;
+            while(oncc)
+            {
+                int cc = oncc->key.cc_number;
+                rll->cc_trigger_bitmask[cc >> 5] |= 1 << (cc & 31);
+                oncc = oncc->next;
+            }
+        }
+    }
+}
+
+struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg)
+{
+    struct sampler_rll *rll = g_new(struct sampler_rll, 1);
+    rll->bounds_stale = FALSE;
+    scan_program_layers(rll, prg);
 
     GHashTable *keyswitch_groups = g_hash_table_new(g_direct_hash, g_direct_equal);
     uint32_t keyswitch_group_count = 0, keyswitch_key_count = 0;
     GPtrArray *keyswitch_group_array = g_ptr_array_new();
     memset(rll->ranges_by_key, 255, sizeof(rll->ranges_by_key));
-    rll->num_release_layers = 0;
-    rll->num_key_release_layers = 0;
     for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
     {
         struct sampler_layer *l = p->data;
         struct sampler_layer_data *ld = &l->data;
-        if (ld->trigger == stm_release)
-            rll->num_release_layers++;
-        if (ld->trigger == stm_release_key)
-            rll->num_key_release_layers++;
-        if (ld->sw_last >= 0 && ld->sw_last <= 127 &&
-            ld->sw_lokey >= 0 && ld->sw_lokey <= 127 &&
-            ld->sw_hikey >= 0 && ld->sw_hikey <= 127 &&
-            ld->sw_last >= ld->sw_lokey && ld->sw_last <= ld->sw_hikey)
+        if (has_keyswitch(ld))
         {
             int width = ld->sw_hikey - ld->sw_lokey + 1;
             gpointer key = GINT_TO_POINTER(ld->sw_lokey + (ld->sw_hikey << 8));
@@ -119,65 +306,237 @@ struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg)
             range_count++;
     }
     rll->ranges_by_key[high] = range_count - 1;
-    rll->layers_by_range = g_malloc0_n(range_count * (1 + keyswitch_key_count), sizeof(GSList *));
-    rll->release_layers_by_range = rll->num_release_layers ? g_malloc0_n(range_count * (1 + keyswitch_key_count), sizeof(GSList *)) : NULL;
-    rll->key_release_layers_by_range = rll->num_key_release_layers ? g_malloc0_n(range_count * (1 + keyswitch_key_count), sizeof(GSList *)) : NULL;
     rll->layers_by_range_count = range_count;
-    for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
+    uint32_t list_size = range_count * (1 + keyswitch_key_count);
+    rll->layers_by_range = g_new0(struct sampler_rll_block *, list_size);
+    rll->release_layers_by_range = rll->num_release_layers ? g_new0(struct sampler_rll_block *, list_size) : NULL;
+    rll->key_release_layers_by_range = rll->num_key_release_layers ? g_new0(struct sampler_rll_block *, list_size) : NULL;
+
+    // Count the layers in each slot (list, keyswitch state and key range),
+    // lay the slots out one after another in a temporary array, fill them,
+    // and make blocks out of them
+    uint32_t slot_count = srl_count * list_size;
+    uint32_t *counts = g_new0(uint32_t, slot_count);
+    uint32_t *ends = g_new(uint32_t, slot_count);
+    uint32_t total = 0;
+    for (int pass = 0; pass < 2; ++pass)
     {
-        struct sampler_layer *l = p->data;
-        uint32_t ks_offset = 0;
-        if (l->data.sw_last >= 0 && l->data.sw_last <= 127 &&
-            l->data.sw_lokey >= 0 && l->data.sw_lokey <= 127 &&
-            l->data.sw_hikey >= 0 && l->data.sw_hikey <= 127 &&
-            l->data.sw_last >= l->data.sw_lokey && l->data.sw_last <= l->data.sw_hikey)
+        struct sampler_layer **slot_layers = pass ? g_new(struct sampler_layer *, total) : NULL;
+        for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
         {
-            gpointer key = GINT_TO_POINTER(l->data.sw_lokey + (l->data.sw_hikey << 8));
-            struct sampler_keyswitch_group *ks = g_hash_table_lookup(keyswitch_groups, key);
-            assert(ks);
-            int rel_offset = ks->key_offsets[l->data.sw_last - l->data.sw_lokey];
-            assert(rel_offset != -1);
-            ks_offset = ks->group_offset + rel_offset;
+            struct sampler_layer *l = p->data;
+            uint32_t lokey, hikey;
+            if (!get_key_span(l, &lokey, &hikey))
+                continue;
+            int ks_state = get_keyswitch_state(rll, l);
+            assert(ks_state >= 0);
+            uint32_t base = get_trigger_list(&l->data) * list_size + ks_state * range_count;
+            for (uint32_t i = rll->ranges_by_key[lokey]; i <= rll->ranges_by_key[hikey]; ++i)
+            {
+                // Filled from the end, so that the layers come out in the
+                // reverse order of all_layers, as they always did
+                if (pass)
+                    slot_layers[--ends[base + i]] = l;
+                else
+                    counts[base + i]++;
+            }
         }
-
-        struct sampler_cc_range *oncc = l->data.on_cc;
-        if (oncc)
+        if (!pass)
         {
-            rll->layers_oncc = g_slist_prepend(rll->layers_oncc, l);
-            while(oncc)
+            for (uint32_t i = 0; i < slot_count; ++i)
             {
-                int cc = oncc->key.cc_number;
-                rll->cc_trigger_bitmask[cc >> 5] |= 1 << (cc & 31);
-                oncc = oncc->next;
+                total += counts[i];
+                ends[i] = total;
             }
+            continue;
         }
-        uint8_t lokey = l->data.computed.eff_lokey, hikey = l->data.computed.eff_hikey;
-        if (l->data.trigger == stm_release_key)
-            add_layers(rll, rll->key_release_layers_by_range + ks_offset * range_count, l, lokey, hikey);
-        else if (l->data.trigger == stm_release)
-            add_layers(rll, rll->release_layers_by_range + ks_offset * range_count, l, lokey, hikey);
-        else
-            add_layers(rll, rll->layers_by_range + ks_offset * range_count, l, lokey, hikey);
+        for (int j = 0; j < srl_count; ++j)
+        {
+            struct sampler_rll_block **list = get_list(rll, j);
+            for (uint32_t i = 0; list && i < list_size; ++i)
+                list[i] = block_new(slot_layers + ends[j * list_size + i], counts[j * list_size + i]);
+        }
+        g_free(slot_layers);
     }
+    g_free(counts);
+    g_free(ends);
     g_hash_table_unref(keyswitch_groups);
     return rll;
 }
 
+struct sampler_rll *sampler_rll_new_updated(struct sampler_rll *old_rll, struct sampler_program *prg, struct sampler_layer **layers, uint32_t layer_count, gboolean removed)
+{
+    // Layers that need new keyswitch states or new lists are handled by
+    // a full rebuild, and so is an empty rll. So are removed keyswitch
+    // layers, as their groups or states may be gone. If other layers have
+    // been changed without an update, their blocks can't be reused either.
+    if (old_rll->lokey > old_rll->hikey || old_rll->bounds_stale)
+        return NULL;
+    for (uint32_t i = 0; removed && i < layer_count; ++i)
+    {
+        if (has_keyswitch(&layers[i]->data))
+            return NULL;
+    }
+    uint32_t low = old_rll->lokey, high = old_rll->hikey;
+    gboolean boundary[129];
+    memset(boundary, 0, sizeof(boundary));
+    boundary[low] = boundary[high + 1] = TRUE;
+    for (uint32_t k = low + 1; k <= high; ++k)
+        boundary[k] = old_rll->ranges_by_key[k] != old_rll->ranges_by_key[k - 1];
+    for (uint32_t i = 0; !removed && i < layer_count; ++i)
+    {
+        uint32_t lokey, hikey;
+        if (!get_key_span(layers[i], &lokey, &hikey))
+            continue;
+        if (get_keyswitch_state(old_rll, layers[i]) < 0 || !get_list(old_rll, get_trigger_list(&layers[i]->data)))
+            return NULL;
+        // The existing ranges are split where the new key span begins or
+        // ends. Ranges that are no longer needed are not merged - they
+        // don't hurt, apart from using a bit more memory.
+        boundary[lokey] = boundary[hikey + 1] = TRUE;
+        if (lokey < low)
+            low = lokey;
+        if (hikey > high)
+            high = hikey;
+    }
+
+    struct sampler_rll *rll = g_new(struct sampler_rll, 1);
+    rll->bounds_stale = FALSE;
+    scan_program_layers(rll, prg);
+    rll->keyswitch_group_count = old_rll->keyswitch_group_count;
+    rll->keyswitch_key_count = old_rll->keyswitch_key_count;
+    rll->keyswitch_groups = g_new(struct sampler_keyswitch_group *, old_rll->keyswitch_group_count);
+    for (uint32_t i = 0; i < old_rll->keyswitch_group_count; ++i)
+    {
+        const struct sampler_keyswitch_group *ks = old_rll->keyswitch_groups[i];
+        size_t size = sizeof(struct sampler_keyswitch_group) + ks->hi - ks->lo + 1;
+        rll->keyswitch_groups[i] = g_malloc(size);
+        memcpy(rll->keyswitch_groups[i], ks, size);
+    }
+    // sw_default may have changed
+    update_keyswitch_defaults(rll, prg);
+
+    // Every new range is either a part of an old range, and starts with the
+    // same layers, or covers keys that had no layers before
+    uint8_t old_ranges[128];
+    uint32_t range_count = 0;
+    memset(rll->ranges_by_key, 255, sizeof(rll->ranges_by_key));
+    rll->lokey = low;
+    rll->hikey = high;
+    for (uint32_t k = low; k <= high; ++k)
+    {
+        if (k == low || boundary[k])
+            old_ranges[range_count++] = (k >= old_rll->lokey && k <= old_rll->hikey) ? old_rll->ranges_by_key[k] : 255;
+        rll->ranges_by_key[k] = range_count - 1;
+    }
+    rll->layers_by_range_count = range_count;
+    uint32_t states = 1 + rll->keyswitch_key_count;
+    uint32_t list_size = range_count * states;
+    struct sampler_rll_block **lists[srl_count];
+    for (int j = 0; j < srl_count; ++j)
+    {
+        struct sampler_rll_block **old_list = get_list(old_rll, j);
+        lists[j] = old_list ? g_new(struct sampler_rll_block *, list_size) : NULL;
+        for (uint32_t s = 0; old_list && s < states; ++s)
+        {
+            for (uint32_t r = 0; r < range_count; ++r)
+                lists[j][s * range_count + r] = old_ranges[r] != 255 ? block_ref(old_list[s * old_rll->layers_by_range_count + old_ranges[r]]) : NULL;
+        }
+    }
+    rll->layers_by_range = lists[srl_normal];
+    rll->release_layers_by_range = lists[srl_release];
+    rll->key_release_layers_by_range = lists[srl_key_release];
+
+    // The slots that had any of the layers, or will have them, are rebuilt
+    GHashTable *changed = g_hash_table_new(NULL, NULL);
+    for (uint32_t i = 0; i < layer_count; ++i)
+        g_hash_table_insert(changed, layers[i], layers[i]);
+    uint32_t slot_count = srl_count * list_size;
+    gboolean *dirty = g_new0(gboolean, slot_count);
+    for (uint32_t i = 0; i < slot_count; ++i)
+    {
+        const struct sampler_rll_block *b = lists[i / list_size] ? lists[i / list_size][i % list_size] : NULL;
+        for (uint32_t j = 0; b && j < b->count && !dirty[i]; ++j)
+            dirty[i] = g_hash_table_lookup(changed, b->layers[j]) != NULL;
+    }
+    // First and last slot of every layer that is still in the program
+    uint32_t *first_slot = g_new0(uint32_t, layer_count), *last_slot = g_new0(uint32_t, layer_count);
+    for (uint32_t i = 0; !removed && i < layer_count; ++i)
+    {
+        uint32_t lokey, hikey;
+        if (!get_key_span(layers[i], &lokey, &hikey))
+            continue;
+        uint32_t base = get_trigger_list(&layers[i]->data) * list_size + get_keyswitch_state(rll, layers[i]) * range_count;
+        first_slot[i] = base + rll->ranges_by_key[lokey];
+        last_slot[i] = base + rll->ranges_by_key[hikey] + 1;
+        for (uint32_t j = first_slot[i]; j < last_slot[i]; ++j)
+            dirty[j] = TRUE;
+    }
+    // Positions within all_layers, for putting the layers in the right order
+    GHashTable *positions = NULL;
+    if (!removed)
+    {
+        positions = g_hash_table_new(NULL, NULL);
+        uint32_t pos = 0;
+        for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
+            g_hash_table_insert(positions, p->data, GUINT_TO_POINTER(++pos));
+    }
+
+    for (uint32_t i = 0; i < slot_count; ++i)
+    {
+        if (!dirty[i])
+            continue;
+        struct sampler_rll_block **slot = &lists[i / list_size][i % list_size];
+        uint32_t old_count = *slot ? (*slot)->count : 0, count = 0;
+        struct sampler_layer **slot_layers = g_new(struct sampler_layer *, old_count + layer_count);
+        for (uint32_t j = 0; j < old_count; ++j)
+        {
+            if (!g_hash_table_lookup(changed, (*slot)->layers[j]))
+                slot_layers[count++] = (*slot)->layers[j];
+        }
+        for (uint32_t j = 0; !removed && j < layer_count; ++j)
+        {
+            if (i < first_slot[j] || i >= last_slot[j])
+                continue;
+            // Insert in the reverse order of all_layers
+            uint32_t pos = GPOINTER_TO_UINT(g_hash_table_lookup(positions, layers[j]));
+            uint32_t k = count;
+            while(k > 0 && GPOINTER_TO_UINT(g_hash_table_lookup(positions, slot_layers[k - 1])) < pos)
+            {
+                slot_layers[k] = slot_layers[k - 1];
+                k--;
+            }
+            slot_layers[k] = layers[j];
+            count++;
+        }
+        block_unref(*slot);
+        *slot = block_new(slot_layers, count);
+        g_free(slot_layers);
+    }
+    if (positions)
+        g_hash_table_destroy(positions);
+    g_hash_table_destroy(changed);
+    g_free(dirty);
+    g_free(first_slot);
+    g_free(last_slot);
+    return rll;
+}
+
 void sampler_rll_destroy(struct sampler_rll *rll)
 {
-    g_slist_free(rll->layers_oncc);
-    for (uint32_t i = 0; i < rll->layers_by_range_count * (1 + rll->keyswitch_key_count); ++i)
+    uint32_t list_size = rll->layers_by_range_count * (1 + rll->keyswitch_key_count);
+    for (int j = 0; j < srl_count; ++j)
     {
-        if (rll->num_release_layers)
-            g_slist_free(rll->release_layers_by_range[i]);
-        if (rll->num_key_release_layers)
-            g_slist_free(rll->key_release_layers_by_range[i]);
-        g_slist_free(rll->layers_by_range[i]);
+        struct sampler_rll_block **list = get_list(rll, j);
+        for (uint32_t i = 0; list && i < list_size; ++i)
+            block_unref(list[i]);
     }
+    g_free(rll->layers_oncc);
     for (uint32_t i = 0; i < rll->keyswitch_group_count; ++i)
         g_free(rll->keyswitch_groups[i]);
     g_free(rll->keyswitch_groups);
     g_free(rll->release_layers_by_range);
+    g_free(rll->key_release_layers_by_range);
     g_free(rll->layers_by_range);
     g_free(rll);
 }
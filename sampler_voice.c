@@ -245,11 +245,20 @@ static inline float sfz_crossfade2(float param, float xflo, float xfhi, float le
 void sampler_voice_activate(struct sampler_voice *v, enum sampler_player_type mode)
 {
     assert(v->gen.mode == spt_inactive);
-    sampler_voice_unlink(&v->program->module->voices_free, v);
+    struct sampler_module *m = v->program->module;
+    sampler_voice_unlink(&m->voices_free, v);
     assert(mode != spt_inactive);
     assert(v->channel);
     v->gen.mode = mode;
     sampler_voice_link(&v->channel->voices_running, v);
+    // Voices are started in order of serial_no, so the list stays sorted
+    v->older = m->newest_voice;
+    v->newer = NULL;
+    if (m->newest_voice)
+        m->newest_voice->newer = v;
+    else
+        m->oldest_voice = v;
+    m->newest_voice = v;
 }
 
 void sampler_voice_start_silent(struct sampler_layer_data *l, struct sampler_released_groups *exgroupdata)
@@ -329,6 +338,7 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
     v->released_with_sostenuto = 0;
     v->captured_sostenuto = 0;
     v->channel = c;
+    v->expression = c->note_expression;
     v->layer = l;
     v->program = c->program;
     v->amp_env.shape = &l->amp_env_shape;
@@ -442,15 +452,25 @@ void sampler_voice_unlink(struct sampler_voice **pv, struct sampler_voice *v)
 void sampler_voice_inactivate(struct sampler_voice *v, gboolean expect_active)
 {
     assert((v->gen.mode != spt_inactive) == expect_active);
+    struct sampler_module *m = v->channel->module;
     sampler_voice_unlink(&v->channel->voices_running, v);
+    if (v->older)
+        v->older->newer = v->newer;
+    else
+        m->oldest_voice = v->newer;
+    if (v->newer)
+        v->newer->older = v->older;
+    else
+        m->newest_voice = v->older;
+    v->older = v->newer = NULL;
     v->gen.mode = spt_inactive;
     if (v->current_pipe)
     {
-        cbox_prefetch_stack_push(v->program->module->pipe_stack, v->current_pipe);
+        cbox_prefetch_stack_push(m->pipe_stack, v->current_pipe);
         v->current_pipe = NULL;
     }
     v->channel = NULL;
-    sampler_voice_link(&v->program->module->voices_free, v);
+    sampler_voice_link(&m->voices_free, v);
 }
 
 void sampler_voice_release(struct sampler_voice *v, gboolean is_polyaft)
@@ -489,8 +509,9 @@ static inline void lfo_update_xdelta(struct sampler_module *m, struct sampler_lf
         lfo->xdelta = (uint32_t)(moddests[dest] * 65536.0 * 65536.0 * CBOX_BLOCK_SIZE * m->module.srate_inv);
 }
 
-static inline void sampler_filter_process_control(struct sampler_filter *f, enum sampler_filter_type fil_type, float logcutoff, float resonance_linearized, const struct cbox_sincos *sincos_base)
+static inline void sampler_filter_process_control(struct sampler_filter *f, enum sampler_filter_type fil_type, float logcutoff, float resonance_linearized, float srate, uint32_t ramp_blocks)
 {
+    struct cbox_biquadf_coeffs *coeffs = &f->target_coeffs;
     f->second_filter = &f->filter_coeffs;
 
     if (logcutoff < 0)
@@ -503,46 +524,80 @@ static inline void sampler_filter_process_control(struct sampler_filter *f, enum
         resonance = 0.7f;
     if (resonance > 32.f)
         resonance = 32.f;
-    const struct cbox_sincos *sincos = &sincos_base[(int)logcutoff];
+    // logcutoff is in cents, with 0 = 440 Hz * 2^(-5700/1200)
+    float freq = 440 * cbox_exp2f((logcutoff - 5700) * (1.f / 1200.f));
+    if (freq < 20.f)
+        freq = 20.f;
+    if (freq > srate * 0.45f)
+        freq = srate * 0.45f;
+    struct cbox_sincos sincos;
+    cbox_sincos_from_freq(&sincos, freq, srate);
     switch(fil_type)
     {
     case sft_lp24hybrid:
-        cbox_biquadf_set_lp_rbj_lookup(&f->filter_coeffs, sincos, resonance * resonance);
-        cbox_biquadf_set_1plp_lookup(&f->filter_coeffs_extra, sincos, 1);
+        cbox_biquadf_set_lp_rbj_lookup(coeffs, &sincos, resonance * resonance);
+        cbox_biquadf_set_1plp_lookup(&f->target_coeffs_extra, &sincos, 1);
         f->second_filter = &f->filter_coeffs_extra;
         break;
     case sft_lp12:
     case sft_lp24:
     case sft_lp36:
-        cbox_biquadf_set_lp_rbj_lookup(&f->filter_coeffs, sincos, resonance);
+        cbox_biquadf_set_lp_rbj_lookup(coeffs, &sincos, resonance);
         break;
     case sft_hp12:
     case sft_hp24:
-        cbox_biquadf_set_hp_rbj_lookup(&f->filter_coeffs, sincos, resonance);
+        cbox_biquadf_set_hp_rbj_lookup(coeffs, &sincos, resonance);
         break;
     case sft_bp6:
     case sft_bp12:
-        cbox_biquadf_set_bp_rbj_lookup(&f->filter_coeffs, sincos, resonance);
+        cbox_biquadf_set_bp_rbj_lookup(coeffs, &sincos, resonance);
         break;
     case sft_lp6:
     case sft_lp12nr:
     case sft_lp24nr:
-        cbox_biquadf_set_1plp_lookup(&f->filter_coeffs, sincos, fil_type != sft_lp6);
+        cbox_biquadf_set_1plp_lookup(coeffs, &sincos, fil_type != sft_lp6);
         break;
     case sft_hp6:
     case sft_hp12nr:
     case sft_hp24nr:
-        cbox_biquadf_set_1php_lookup(&f->filter_coeffs, sincos, fil_type != sft_hp6);
+        cbox_biquadf_set_1php_lookup(coeffs, &sincos, fil_type != sft_hp6);
         break;
     default:
         assert(0);
     }
+
+    gboolean has_extra = f->second_filter == &f->filter_coeffs_extra;
+    if (ramp_blocks <= 1)
+    {
+        f->filter_coeffs = f->target_coeffs;
+        if (has_extra)
+            f->filter_coeffs_extra = f->target_coeffs_extra;
+        f->ramp_blocks = 0;
+        return;
+    }
+    cbox_biquadf_set_ramp(&f->delta_coeffs, &f->filter_coeffs, &f->target_coeffs, ramp_blocks);
+    if (has_extra)
+        cbox_biquadf_set_ramp(&f->delta_coeffs_extra, &f->filter_coeffs_extra, &f->target_coeffs_extra, ramp_blocks);
+    f->ramp_blocks = ramp_blocks;
 }
 
-static inline void sampler_filter_process_audio(struct sampler_filter *f, int num_stages, float *leftright)
+// Moves the coefficients one block closer to the values calculated on the
+// last control update
+static inline void sampler_filter_ramp(struct sampler_filter *f)
 {
-    for (int i = 0; i < num_stages; ++i)
-        cbox_biquadf_process_stereo(&f->filter_left[i], &f->filter_right[i], i ? f->second_filter : &f->filter_coeffs, leftright);
+    gboolean has_extra = f->second_filter == &f->filter_coeffs_extra;
+    if (--f->ramp_blocks)
+    {
+        cbox_biquadf_add_coeffs(&f->filter_coeffs, &f->delta_coeffs);
+        if (has_extra)
+            cbox_biquadf_add_coeffs(&f->filter_coeffs_extra, &f->delta_coeffs_extra);
+    }
+    else
+    {
+        f->filter_coeffs = f->target_coeffs;
+        if (has_extra)
+            f->filter_coeffs_extra = f->target_coeffs_extra;
+    }
 }
 
 static inline void do_channel_mixing(float *leftright, uint32_t numsamples, float position, float width)
@@ -571,6 +626,10 @@ static inline uint32_t sampler_gen_sample_playback_with_pipe(struct sampler_gen
     uint32_t limit = cbox_prefetch_pipe_get_remaining(current_pipe);
     if (limit <= 4)
     {
+        // Ran out of data before the I/O thread has reached the end of the
+        // sample (or even opened the file)
+        if (!current_pipe->finished && current_pipe->state != pps_error)
+            current_pipe->stats.underruns++;
         gen->mode = spt_inactive;
         return 0;
     }
@@ -582,32 +641,23 @@ static inline uint32_t sampler_gen_sample_playback_with_pipe(struct sampler_gen
 
 static const float gain_for_num_stages[] = { 1, 1, 0.5, 0.33f };
 
-static inline float sampler_voice_flexlfo_process(struct sampler_voice *v, uint32_t lfo_num, float *lfo_state, uint32_t *mask)
+static inline float sampler_voice_flexlfo_process(struct sampler_voice *v, const struct sampler_flex_lfo *p)
 {
-    if (lfo_num >= MAX_FLEX_LFOS)
-        return 0;
-    if (*mask & (1 << lfo_num))
-        return lfo_state[lfo_num];
     float value = 0;
-    struct sampler_flex_lfo *p = v->layer->computed.eff_flex_lfo_by_num[lfo_num];
-    if (p) {
-        double srate_inv = 1.0 / v->program->module->module.srate;
-        float age_sec = v->age * srate_inv;
-        if (age_sec >= p->value.delay) {
-            age_sec -= p->value.delay;
-            value = lfo_wave_calculate(p->value.wave, v->flexlfo_phase[lfo_num]);
-            if (age_sec < p->value.fade)
-                value *= age_sec / p->value.fade;
-            v->flexlfo_phase[lfo_num] += p->value.freq * 65536.0 * 65536.0 * CBOX_BLOCK_SIZE * srate_inv;
-        }
+    uint32_t lfo_num = p->key.id;
+    double srate_inv = 1.0 / v->program->module->module.srate;
+    float age_sec = v->age * srate_inv;
+    if (age_sec >= p->value.delay) {
+        age_sec -= p->value.delay;
+        value = lfo_wave_calculate(p->value.wave, v->flexlfo_phase[lfo_num]);
+        if (age_sec < p->value.fade)
+            value *= age_sec / p->value.fade;
+        v->flexlfo_phase[lfo_num] += p->value.freq * 65536.0 * 65536.0 * CBOX_BLOCK_SIZE * srate_inv;
     }
-    
-    *mask |= 1 << lfo_num;
-    lfo_state[lfo_num] = value;
     return value;
 }
 
-void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs)
+gboolean sampler_voice_process_control(struct sampler_voice *v, struct sampler_module *m)
 {
     struct sampler_layer_data *l = v->layer;
     assert(v->gen.mode != spt_inactive);
@@ -617,6 +667,14 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     
     const float velscl = v->vel * (1.f / 127.f);
 
+    const struct sampler_mod_program *mp = &l->computed.mod_program;
+    float modsrcs[smi_count];
+    for (uint32_t i = 0; i < mp->cc_input_count; ++i)
+    {
+        const struct sampler_mod_cc_input *ci = &mp->cc_inputs[i];
+        modsrcs[smi_compiled_start + i] = sampler_channel_getcc_mod(c, v, ci->cc_number, ci->curve_id, ci->step);
+    }
+
     struct cbox_envelope_shape *pitcheg_shape = v->pitch_env.shape, *fileg_shape = v->filter_env.shape, *ampeg_shape = v->amp_env.shape;
     if (__builtin_expect(l->computed.mod_bitmask, 0))
     {
@@ -629,18 +687,13 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
         COPY_ORIG_SHAPE(filter, fil, 1)
         COPY_ORIG_SHAPE(pitch, pitch, 2)
 
-        for(struct sampler_modulation *sm = l->modulations; sm; sm = sm->next)
+        const struct sampler_mod_op *eg_ops = mp->ops + mp->add_op_count + mp->mul_op_count;
+        for (uint32_t i = 0; i < mp->eg_op_count; ++i)
         {
-            // Simplified modulations for EG stages (CCs only)
-            if (sm->key.dest >= smdest_eg_stage_start && sm->key.dest <= smdest_eg_stage_end)
-            {
-                float value = 0.f;
-                if (sm->key.src < smsrc_pernote_offset)
-                    value = sampler_channel_getcc_mod(c, v, sm->key.src, sm->value.curve_id, sm->value.step);
-                uint32_t param = sm->key.dest - smdest_eg_stage_start;
-                if (value * sm->value.amount != 0)
-                    cbox_envelope_modify_dahdsr(&v->cc_envs[(param >> 4)], param & 0x0F, value * sm->value.amount, m->module.srate * 1.0 / CBOX_BLOCK_SIZE);
-            }
+            const struct sampler_mod_op *op = &eg_ops[i];
+            float value = modsrcs[op->input] * op->amount;
+            if (value != 0)
+                cbox_envelope_modify_dahdsr(&v->cc_envs[(op->dest >> 4)], op->dest & 0x0F, value, m->module.srate * 1.0 / CBOX_BLOCK_SIZE);
         }
         #define UPDATE_ENV_POSITION(envtype, envtype2) \
             if (l->computed.mod_bitmask & slmb_##envtype##eg_cc) \
@@ -659,6 +712,7 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     #define RECALC_EQ_MASK_EQ3 (7 << smdest_eq3_freq)
     #define RECALC_EQ_MASK_ALL (RECALC_EQ_MASK_EQ1 | RECALC_EQ_MASK_EQ2 | RECALC_EQ_MASK_EQ3)
     uint32_t recalc_eq_mask = 0;
+    gboolean snap_filters = FALSE;
 
     if (__builtin_expect(v->layer_changed, 0))
     {
@@ -673,23 +727,37 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
             }
             else
             {
-                sampler_voice_inactivate(v, TRUE);
-                return;
+                v->gen.mode = spt_inactive;
+                return FALSE;
             }
         }
         if (l->computed.eq_bitmask & (1 << 0)) recalc_eq_mask |= RECALC_EQ_MASK_EQ1;
         if (l->computed.eq_bitmask & (1 << 1)) recalc_eq_mask |= RECALC_EQ_MASK_EQ2;
         if (l->computed.eq_bitmask & (1 << 2)) recalc_eq_mask |= RECALC_EQ_MASK_EQ3;
         v->last_eq_bitmask = l->computed.eq_bitmask;
+        // filter type or cutoff may have changed, don't ramp from the old values
+        v->filter.ramp_blocks = 0;
+        v->filter2.ramp_blocks = 0;
+        snap_filters = TRUE;
         v->layer_changed = FALSE;
     }
 
     float pitch = (v->note - l->computed.eff_pitch_keycenter) * l->pitch_keytrack + l->tune + l->transpose * 100 + v->pitch_shift;
-    float modsrcs[smsrc_pernote_count];
+    modsrcs[smi_one] = 1.f;
+    modsrcs[smi_zero] = 0.f;
     modsrcs[smsrc_vel - smsrc_pernote_offset] = v->vel * velscl;
     modsrcs[smsrc_pitch - smsrc_pernote_offset] = pitch * (1.f / 100.f);
-    modsrcs[smsrc_chanaft - smsrc_pernote_offset] = c->last_chanaft * (1.f / 127.f);
-    modsrcs[smsrc_polyaft - smsrc_pernote_offset] = sampler_channel_get_poly_pressure(c, v->note);
+    if (v->expression)
+    {
+        // MPE note: channel pressure of the member channel is the note's pressure
+        modsrcs[smsrc_chanaft - smsrc_pernote_offset] = v->expression->pressure * (1.f / 127.f);
+        modsrcs[smsrc_polyaft - smsrc_pernote_offset] = modsrcs[smsrc_chanaft - smsrc_pernote_offset];
+    }
+    else
+    {
+        modsrcs[smsrc_chanaft - smsrc_pernote_offset] = c->last_chanaft * (1.f / 127.f);
+        modsrcs[smsrc_polyaft - smsrc_pernote_offset] = sampler_channel_get_poly_pressure(c, v->note);
+    }
     modsrcs[smsrc_pitchenv - smsrc_pernote_offset] = cbox_envelope_get_value(&v->pitch_env, pitcheg_shape) * 0.01f;
     modsrcs[smsrc_filenv - smsrc_pernote_offset] = l->computed.eff_use_filter_mods ? cbox_envelope_get_value(&v->filter_env, fileg_shape) * 0.01f : 0;
     modsrcs[smsrc_ampenv - smsrc_pernote_offset] = cbox_envelope_get_value(&v->amp_env, ampeg_shape) * 0.01f;
@@ -731,52 +799,26 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
             pw = (pw / l->bend_step) * l->bend_step;
         moddests[smdest_pitch] += pw;
     }
-    float flexlfo_state[MAX_FLEX_LFOS];
-    uint32_t flexlfo_mask = 0;
-    
-    for (struct sampler_modulation *sm = l->modulations; sm; sm = sm->next)
-    {
-        enum sampler_modsrc src = sm->key.src;
-        enum sampler_modsrc src2 = sm->key.src2;
-        enum sampler_moddest dest = sm->key.dest;
-        float value = 0.f, value2 = 1.f;
-        if (src < smsrc_pernote_offset)
-            value = sampler_channel_getcc_mod(c, v, src, sm->value.curve_id, sm->value.step);
-        else if (IS_SMSRC_FLEXLFO(src)) {
-            value = sampler_voice_flexlfo_process(v, SMSRC_FLEXLFO_NUM(src), flexlfo_state, &flexlfo_mask);
-        } else
-            value = modsrcs[src - smsrc_pernote_offset];
-
-        if (src2 != smsrc_none)
-        {
-            if (src2 < smsrc_pernote_offset)
-                value2 = sampler_channel_getcc_mod(c, v, src2, sm->value.curve_id, sm->value.step);
-            else
-                value2 = modsrcs[src2 - smsrc_pernote_offset];
-            
-            value *= value2;
-        }
-        if (dest < 32)
-        {
-            if (dest == smdest_amplitude)
-            {
-                if (!(modmask & (1 << dest))) // first value
-                {
-                    moddests[dest] = value * sm->value.amount;
-                    modmask |= (1 << dest);
-                }
-                else
-                    moddests[dest] *= value * sm->value.amount;
-            }
-            else if (!(modmask & (1 << dest))) // first value
-            {
-                moddests[dest] = value * sm->value.amount;
-                modmask |= (1 << dest);
-            }
-            else
-                moddests[dest] += value * sm->value.amount;
-        }
+    if (v->expression && v->expression->pitchwheel)
+        moddests[smdest_pitch] += v->expression->pitchwheel * v->expression->bend_range * (1.f / 8191.f);
+    uint32_t first_lfo_input = smi_compiled_start + mp->cc_input_count;
+    for (uint32_t i = 0; i < mp->flex_lfo_input_count; ++i)
+        modsrcs[first_lfo_input + i] = sampler_voice_flexlfo_process(v, mp->flex_lfo_inputs[i]);
+
+    // Destinations not set up above start from 0 for additive and from 1
+    // for multiplicative modulations
+    for (uint32_t init_mask = (mp->dest_mask | mp->mul_dest_mask) & ~modmask; init_mask; init_mask &= init_mask - 1)
+    {
+        uint32_t dest = __builtin_ctz(init_mask);
+        moddests[dest] = (mp->mul_dest_mask & (1 << dest)) ? 1.f : 0.f;
     }
+    modmask |= mp->dest_mask | mp->mul_dest_mask;
+    const struct sampler_mod_op *ops = mp->ops;
+    for (uint32_t i = 0; i < mp->add_op_count; ++i)
+        moddests[ops[i].dest] += modsrcs[ops[i].input] * modsrcs[ops[i].input2] * ops[i].amount;
+    ops += mp->add_op_count;
+    for (uint32_t i = 0; i < mp->mul_op_count; ++i)
+        moddests[ops[i].dest] *= modsrcs[ops[i].input] * modsrcs[ops[i].input2] * ops[i].amount;
     lfo_update_xdelta(m, &v->pitch_lfo, modmask, smdest_pitchlfo_freq, moddests);
     if (l->computed.eff_use_filter_mods)
         lfo_update_xdelta(m, &v->filter_lfo, modmask, smdest_fillfo_freq, moddests);
@@ -787,7 +829,7 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
         if (recalc_eq_mask & RECALC_EQ_MASK_EQ##index) \
         { \
             float dfreq = velscl * l->eq##index.vel2freq + ((modmask & (1 << smdest_eq##index##_freq)) ? moddests[smdest_eq##index##_freq] : 0);\
-            float fbw = (modmask & (1 << smdest_eq##index##_bw)) ? pow(0.5, moddests[smdest_eq##index##_bw]) : 1;\
+            float fbw = (modmask & (1 << smdest_eq##index##_bw)) ? cbox_exp2f(-moddests[smdest_eq##index##_bw]) : 1;\
             float dgain = velscl * l->eq##index.vel2gain + ((modmask & (1 << smdest_eq##index##_gain)) ? moddests[smdest_eq##index##_gain] : 0);\
             cbox_biquadf_set_peakeq_rbj_scaled(&v->eq_coeffs[index - 1], l->eq##index.effective_freq + dfreq, fbw / l->eq##index.bw, dB2gain(0.5 * (l->eq##index.gain + dgain)), m->module.srate); \
             if (!(v->last_eq_bitmask & (1 << (index - 1)))) \
@@ -810,8 +852,8 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     {
         if (__builtin_expect(is_tail_finished(v), 0))
         {
-            sampler_voice_inactivate(v, TRUE);
-            return;
+            v->gen.mode = spt_inactive;
+            return FALSE;
         }
     }
     
@@ -955,15 +997,28 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     v->gen.lgain = gain * (1.f - pan)  / 32768.f;
     v->gen.rgain = gain * pan / 32768.f;
 
+    // Filter coefficients are only recalculated every filter_control_blocks
+    // blocks, and interpolated linearly in between
+    uint32_t ramp_blocks = snap_filters ? 1 : m->filter_control_blocks;
     if (l->cutoff != -1)
     {
-        float mod_resonance = (modmask & (1 << smdest_resonance)) ? dB2gain(gain_for_num_stages[l->computed.eff_num_stages] * moddests[smdest_resonance]) : 1;
-        sampler_filter_process_control(&v->filter, l->fil_type, l->computed.logcutoff + moddests[smdest_cutoff], l->computed.resonance_scaled * mod_resonance, m->sincos);
+        if (!v->filter.ramp_blocks)
+        {
+            float mod_resonance = (modmask & (1 << smdest_resonance)) ? dB2gain(gain_for_num_stages[l->computed.eff_num_stages] * moddests[smdest_resonance]) : 1;
+            sampler_filter_process_control(&v->filter, l->fil_type, l->computed.logcutoff + moddests[smdest_cutoff], l->computed.resonance_scaled * mod_resonance, m->module.srate, ramp_blocks);
+        }
+        if (v->filter.ramp_blocks)
+            sampler_filter_ramp(&v->filter);
     }
     if (l->cutoff2 != -1)
     {
-        float mod_resonance = (modmask & (1 << smdest_resonance2)) ? dB2gain(gain_for_num_stages[l->computed.eff_num_stages2] * moddests[smdest_resonance2]) : 1;
-        sampler_filter_process_control(&v->filter2, l->fil2_type, l->computed.logcutoff2 + moddests[smdest_cutoff2], l->computed.resonance2_scaled * mod_resonance, m->sincos);
+        if (!v->filter2.ramp_blocks)
+        {
+            float mod_resonance = (modmask & (1 << smdest_resonance2)) ? dB2gain(gain_for_num_stages[l->computed.eff_num_stages2] * moddests[smdest_resonance2]) : 1;
+            sampler_filter_process_control(&v->filter2, l->fil2_type, l->computed.logcutoff2 + moddests[smdest_cutoff2], l->computed.resonance2_scaled * mod_resonance, m->module.srate, ramp_blocks);
+        }
+        if (v->filter2.ramp_blocks)
+            sampler_filter_ramp(&v->filter2);
     }
 
     if (__builtin_expect(l->tonectl_freq != 0, 0))
@@ -974,35 +1029,76 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
         else
             cbox_onepolef_set_highshelf_setgain(&v->onepole_coeffs, 1.0);
     }
+    return TRUE;
+}
 
-    // Audio processing starts here
-    float leftright[2 * CBOX_BLOCK_SIZE];
-        
+void sampler_voice_generate(struct sampler_voice *v, float *leftright)
+{
+    struct sampler_layer_data *l = v->layer;
     uint32_t samples = sampler_gen_sample_playback_with_pipe(&v->gen, leftright, v->current_pipe);
     if (l->computed.eff_use_channel_mixer)
         do_channel_mixing(leftright, samples, l->position, l->width);
     for (int i = 2 * samples; i < 2 * CBOX_BLOCK_SIZE; i++)
         leftright[i] = 0.f;
+}
+
+static inline void add_stage(struct cbox_biquadf_stage *stages, int *count, struct cbox_biquadf_coeffs *coeffs, struct cbox_biquadf_state *left, struct cbox_biquadf_state *right)
+{
+    stages[*count].coeffs = coeffs;
+    stages[*count].left = left;
+    stages[*count].right = right;
+    (*count)++;
+}
 
+int sampler_voice_get_filter_stages(struct sampler_voice *v, struct cbox_biquadf_stage *stages)
+{
+    struct sampler_layer_data *l = v->layer;
+    int count = 0;
     if (l->cutoff != -1)
-        sampler_filter_process_audio(&v->filter, l->computed.eff_num_stages, leftright);
+    {
+        for (int i = 0; i < l->computed.eff_num_stages; i++)
+            add_stage(stages, &count, i ? v->filter.second_filter : &v->filter.filter_coeffs, &v->filter.filter_left[i], &v->filter.filter_right[i]);
+    }
     if (l->cutoff2 != -1)
-        sampler_filter_process_audio(&v->filter2, l->computed.eff_num_stages2, leftright);
+    {
+        for (int i = 0; i < l->computed.eff_num_stages2; i++)
+            add_stage(stages, &count, i ? v->filter2.second_filter : &v->filter2.filter_coeffs, &v->filter2.filter_left[i], &v->filter2.filter_right[i]);
+    }
+    return count;
+}
 
-    if (__builtin_expect(l->tonectl_freq != 0, 0))
-        cbox_onepolef_process_stereo(&v->onepole_left, &v->onepole_right, &v->onepole_coeffs, leftright);
+int sampler_voice_get_eq_stages(struct sampler_voice *v, struct cbox_biquadf_stage *stages)
+{
+    struct sampler_layer_data *l = v->layer;
+    int count = 0;
+    for (int eq = 0; eq < 3; eq++)
+    {
+        if (l->computed.eq_bitmask & (1 << eq))
+            add_stage(stages, &count, &v->eq_coeffs[eq], &v->eq_left[eq], &v->eq_right[eq]);
+    }
+    return count;
+}
 
-    if (__builtin_expect(l->computed.eq_bitmask, 0))
+void sampler_voice_process_filters(struct sampler_voice *v, float *leftright)
+{
+    struct sampler_layer_data *l = v->layer;
+    struct cbox_biquadf_stage stages[SAMPLER_BATCH_MAX_STAGES];
+    int count = sampler_voice_get_filter_stages(v, stages);
+
+    // One pole tone control sits between the filters and the EQ
+    if (__builtin_expect(l->tonectl_freq != 0, 0))
     {
-        for (int eq = 0; eq < 3; eq++)
-        {
-            if (l->computed.eq_bitmask & (1 << eq))
-            { 
-                cbox_biquadf_process_stereo(&v->eq_left[eq], &v->eq_right[eq], &v->eq_coeffs[eq], leftright);
-            }
-        }
+        cbox_biquadf_process_stereo_cascade(stages, count, leftright);
+        count = 0;
+        cbox_onepolef_process_stereo(&v->onepole_left, &v->onepole_right, &v->onepole_coeffs, leftright);
     }
-        
+    if (__builtin_expect(l->computed.eq_bitmask, 0))
+        count += sampler_voice_get_eq_stages(v, stages + count);
+    cbox_biquadf_process_stereo_cascade(stages, count, leftright);
+}
+
+void sampler_voice_mix(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright)
+{
     mix_block_into(outputs, v->output_pair_no * 2, leftright);
     if (__builtin_expect((v->send1bus > 0 && v->send1gain != 0) || (v->send2bus > 0 && v->send2gain != 0), 0))
     {
@@ -1017,6 +1113,18 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
             mix_block_into_with_gain(outputs, oofs, leftright, v->send2gain);
         }
     }
+}
+
+void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs)
+{
+    if (sampler_voice_process_control(v, m))
+    {
+        // Audio processing starts here
+        float leftright[2 * CBOX_BLOCK_SIZE];
+        sampler_voice_generate(v, leftright);
+        sampler_voice_process_filters(v, leftright);
+        sampler_voice_mix(v, m, outputs, leftright);
+    }
     if (v->gen.mode == spt_inactive)
         sampler_voice_inactivate(v, FALSE);
 }
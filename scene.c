@@ -30,6 +30,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "rt.h"
 #include "scene.h"
 #include "seq.h"
+#include "workerpool.h"
 #include <assert.h>
 #include <glib.h>
 
@@ -518,7 +519,7 @@ struct cbox_aux_bus *cbox_scene_get_aux_bus(struct cbox_scene *scene, const char
     return bus;
 }
 
-static int write_events_to_instrument_ports(struct cbox_scene *scene, struct cbox_midi_buffer *source)
+static int write_events_to_instrument_ports(struct cbox_scene *scene, const struct cbox_midi_buffer *source)
 {
     uint32_t i;
 
@@ -623,6 +624,199 @@ void cbox_scene_update_connected_outputs(struct cbox_scene *scene)
     }
 }
 
+static void mix_instrument_block(struct cbox_instrument *instr, uint32_t offset, cbox_sample_t **outputs, float *output_buffers[], uint32_t output_channels)
+{
+    struct cbox_module *module = instr->module;
+    for (uint32_t o = 0; o < module->outputs / 2; o++)
+    {
+        struct cbox_instrument_output *oobj = &instr->outputs[o];
+        struct cbox_gain *gain_obj = &oobj->gain_obj;
+        float *leftbuf, *rightbuf;
+        if (o < module->aux_offset / 2)
+        {
+            if (oobj->output_bus < 0)
+                continue;
+            uint32_t leftch = oobj->output_bus * 2;
+            if (leftch >= output_channels)
+                continue;
+            leftbuf = output_buffers[leftch];
+            uint32_t rightch = leftch + 1;
+            rightbuf = rightch >= output_channels ? NULL : output_buffers[rightch];
+        }
+        else
+        {
+            int bus = o - module->aux_offset / 2;
+            struct cbox_aux_bus *busobj = instr->aux_outputs[bus];
+            if (busobj == NULL)
+                continue;
+            leftbuf = busobj->input_bufs[0];
+            rightbuf = busobj->input_bufs[1];
+        }
+        if (leftbuf && rightbuf)
+        {
+            cbox_gain_add_stereo(gain_obj, &leftbuf[offset], outputs[2 * o], &rightbuf[offset], outputs[2 * o + 1], CBOX_BLOCK_SIZE);
+        }
+        else
+        {
+            if (leftbuf)
+                cbox_gain_add_mono(gain_obj, &leftbuf[offset], outputs[2 * o], CBOX_BLOCK_SIZE);
+            if (rightbuf)
+                cbox_gain_add_mono(gain_obj, &rightbuf[offset], outputs[2 * o + 1], CBOX_BLOCK_SIZE);
+        }
+    }
+}
+
+// If render_buffers is NULL, the output of the instrument is mixed into the
+// output buffers (and aux bus inputs) as it is rendered; otherwise, it is
+// stored in render_buffers (one buffer of instr->render_buffer_size samples
+// per output) and left to the caller to mix with mix_instrument_block.
+static void render_instrument(struct cbox_instrument *instr, uint32_t nframes, float *render_buffers, float *output_buffers[], uint32_t output_channels)
+{
+    struct cbox_module *module = instr->module;
+    struct cbox_engine *engine = instr->scene->engine;
+    int event_count = module->midi_input.count;
+    int cur_event = 0;
+    uint32_t highwatermark = 0;
+    cbox_sample_t channels[CBOX_MAX_AUDIO_PORTS][CBOX_BLOCK_SIZE];
+    cbox_sample_t *outputs[CBOX_MAX_AUDIO_PORTS];
+    uint32_t i;
+    if (!render_buffers)
+    {
+        for (i = 0; i < module->outputs; i++)
+            outputs[i] = channels[i];
+    }
+
+    for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
+    {
+        cbox_engine_set_song_pos_offset(engine, i);
+        if (i >= highwatermark)
+        {
+            while(cur_event < event_count)
+            {
+                const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
+                if (event)
+                {
+                    if (event->time <= i)
+                        (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
+                    else
+                    {
+                        highwatermark = event->time;
+                        break;
+                    }
+                }
+                else
+                    break;
+                
+                cur_event++;
+            }
+        }
+        if (render_buffers)
+        {
+            for (uint32_t c = 0; c < module->outputs; c++)
+                outputs[c] = render_buffers + c * instr->render_buffer_size + i;
+        }
+        (*module->process_block)(module, NULL, outputs);
+        for (uint32_t o = 0; o < module->outputs / 2; o++)
+        {
+            struct cbox_instrument_output *oobj = &instr->outputs[o];
+            struct cbox_module *insert = oobj->insert;
+            if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_dry))
+                cbox_recording_source_push(&oobj->rec_dry, (const float **)(outputs + 2 * o), i, CBOX_BLOCK_SIZE);
+            if (insert && !insert->bypass)
+                (*insert->process_block)(insert, outputs + 2 * o, outputs + 2 * o);
+            if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_wet))
+                cbox_recording_source_push(&oobj->rec_wet, (const float **)(outputs + 2 * o), i, CBOX_BLOCK_SIZE);
+        }
+        if (!render_buffers)
+            mix_instrument_block(instr, i, outputs, output_buffers, output_channels);
+    }
+    while(cur_event < event_count)
+    {
+        const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
+        if (event)
+        {
+            (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
+        }
+        else
+            break;
+        
+        cur_event++;
+    }
+}
+
+struct scene_render_job
+{
+    struct cbox_scene *scene;
+    uint32_t nframes;
+};
+
+static void render_instrument_job(void *user_data, uint32_t index)
+{
+    struct scene_render_job *job = user_data;
+    struct cbox_instrument *instr = job->scene->instruments[index];
+    render_instrument(instr, job->nframes, instr->render_buffers, NULL, 0);
+}
+
+static void render_aux_bus_job(void *user_data, uint32_t index)
+{
+    struct scene_render_job *job = user_data;
+    struct cbox_aux_bus *bus = job->scene->aux_buses[index];
+    for (uint32_t i = 0; i < job->nframes; i += CBOX_BLOCK_SIZE)
+    {
+        float *inputs[2] = { &bus->input_bufs[0][i], &bus->input_bufs[1][i] };
+        float *outputs[2] = { &bus->output_bufs[0][i], &bus->output_bufs[1][i] };
+        bus->module->process_block(bus->module, inputs, outputs);
+    }
+}
+
+static gboolean cbox_scene_can_render_parallel(struct cbox_scene *scene, uint32_t nframes)
+{
+    // Instruments created before the pool was set up don't have their
+    // private buffers, and there is nothing to gain with just one instrument
+    if (scene->instrument_count < 2)
+        return FALSE;
+    for (uint32_t n = 0; n < scene->instrument_count; n++)
+    {
+        if (!scene->instruments[n]->render_buffers || nframes > scene->instruments[n]->render_buffer_size)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// The instruments (and then the aux buses) are rendered in parallel into
+// private buffers, then mixed in the same order as the serial version does,
+// so that the result does not depend on thread scheduling.
+static void cbox_scene_render_parallel(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[], uint32_t output_channels)
+{
+    struct cbox_worker_pool *pool = scene->engine->render_pool;
+    struct scene_render_job job = { scene, nframes };
+    uint32_t i, n;
+
+    cbox_worker_pool_run(pool, render_instrument_job, &job, scene->instrument_count);
+    for (n = 0; n < scene->instrument_count; n++)
+    {
+        struct cbox_instrument *instr = scene->instruments[n];
+        cbox_sample_t *outputs[CBOX_MAX_AUDIO_PORTS];
+        for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
+        {
+            for (uint32_t c = 0; c < instr->module->outputs; c++)
+                outputs[c] = instr->render_buffers + c * instr->render_buffer_size + i;
+            mix_instrument_block(instr, i, outputs, output_buffers, output_channels);
+        }
+    }
+
+    cbox_worker_pool_run(pool, render_aux_bus_job, &job, scene->aux_bus_count);
+    for (n = 0; n < scene->aux_bus_count; n++)
+    {
+        struct cbox_aux_bus *bus = scene->aux_buses[n];
+        for (i = 0; i < nframes; i++)
+        {
+            output_buffers[0][i] += bus->output_bufs[0][i];
+            output_buffers[1][i] += bus->output_bufs[1][i];
+        }
+    }
+}
+
 void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[], uint32_t output_channels)
 {
     uint32_t i, n;
@@ -662,10 +856,7 @@ void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output
         }
     }
     
-    cbox_midi_buffer_clear(&scene->midibuf_total);
-    cbox_midi_merger_render(&scene->scene_input_merger);
-
-    write_events_to_instrument_ports(scene, &scene->midibuf_total);
+    write_events_to_instrument_ports(scene, cbox_midi_merger_render_view(&scene->scene_input_merger));
 
     for (n = 0; n < scene->aux_bus_count; n++)
     {
@@ -676,118 +867,29 @@ void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output
         }
     }
     
-    for (n = 0; n < scene->instrument_count; n++)
+    if (scene->engine->render_pool && cbox_scene_can_render_parallel(scene, nframes))
+        cbox_scene_render_parallel(scene, nframes, output_buffers, output_channels);
+    else
     {
-        struct cbox_instrument *instr = scene->instruments[n];
-        struct cbox_module *module = instr->module;
-        int event_count = instr->module->midi_input.count;
-        int cur_event = 0;
-        uint32_t highwatermark = 0;
-        cbox_sample_t channels[CBOX_MAX_AUDIO_PORTS][CBOX_BLOCK_SIZE];
-        cbox_sample_t *outputs[CBOX_MAX_AUDIO_PORTS];
-        for (i= 0; i < module->outputs; i++)
-            outputs[i] = channels[i];
-        
-        for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
+        for (n = 0; n < scene->instrument_count; n++)
+            render_instrument(scene->instruments[n], nframes, NULL, output_buffers, output_channels);
+        for (n = 0; n < scene->aux_bus_count; n++)
         {
-            scene->engine->song_pos_offset = i;
-            if (i >= highwatermark)
+            struct cbox_aux_bus *bus = scene->aux_buses[n];
+            float left[CBOX_BLOCK_SIZE], right[CBOX_BLOCK_SIZE];
+            float *outputs[2] = {left, right};
+            for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
             {
-                while(cur_event < event_count)
+                float *inputs[2];
+                inputs[0] = &bus->input_bufs[0][i];
+                inputs[1] = &bus->input_bufs[1][i];
+                bus->module->process_block(bus->module, inputs, outputs);
+                for (int j = 0; j < CBOX_BLOCK_SIZE; j++)
                 {
-                    const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
-                    if (event)
-                    {
-                        if (event->time <= i)
-                            (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
-                        else
-                        {
-                            highwatermark = event->time;
-                            break;
-                        }
-                    }
-                    else
-                        break;
-                    
-                    cur_event++;
+                    output_buffers[0][i + j] += left[j];
+                    output_buffers[1][i + j] += right[j];
                 }
             }
-            (*module->process_block)(module, NULL, outputs);
-            for (uint32_t o = 0; o < module->outputs / 2; o++)
-            {
-                struct cbox_instrument_output *oobj = &instr->outputs[o];
-                struct cbox_module *insert = oobj->insert;
-                struct cbox_gain *gain_obj = &oobj->gain_obj;
-                if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_dry))
-                    cbox_recording_source_push(&oobj->rec_dry, (const float **)(outputs + 2 * o), i, CBOX_BLOCK_SIZE);
-                if (insert && !insert->bypass)
-                    (*insert->process_block)(insert, outputs + 2 * o, outputs + 2 * o);
-                if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_wet))
-                    cbox_recording_source_push(&oobj->rec_wet, (const float **)(outputs + 2 * o), i, CBOX_BLOCK_SIZE);
-                float *leftbuf, *rightbuf;
-                if (o < module->aux_offset / 2)
-                {
-                    if (oobj->output_bus < 0)
-                        continue;
-                    uint32_t leftch = oobj->output_bus * 2;
-                    if (leftch >= output_channels)
-                        continue;
-                    leftbuf = output_buffers[leftch];
-                    uint32_t rightch = leftch + 1;
-                    rightbuf = rightch >= output_channels ? NULL : output_buffers[rightch];
-                }
-                else
-                {
-                    int bus = o - module->aux_offset / 2;
-                    struct cbox_aux_bus *busobj = instr->aux_outputs[bus];
-                    if (busobj == NULL)
-                        continue;
-                    leftbuf = busobj->input_bufs[0];
-                    rightbuf = busobj->input_bufs[1];
-                }
-                if (leftbuf && rightbuf)
-                {
-                    cbox_gain_add_stereo(gain_obj, &leftbuf[i], channels[2 * o], &rightbuf[i], channels[2 * o + 1], CBOX_BLOCK_SIZE);
-                }
-                else
-                {
-                    if (leftbuf)
-                        cbox_gain_add_mono(gain_obj, &leftbuf[i], channels[2 * o], CBOX_BLOCK_SIZE);
-                    if (rightbuf)
-                        cbox_gain_add_mono(gain_obj, &rightbuf[i], channels[2 * o + 1], CBOX_BLOCK_SIZE);
-                }
-            }
-        }
-        while(cur_event < event_count)
-        {
-            const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
-            if (event)
-            {
-                (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
-            }
-            else
-                break;
-            
-            cur_event++;
-        }
-    }
-    
-    for (n = 0; n < scene->aux_bus_count; n++)
-    {
-        struct cbox_aux_bus *bus = scene->aux_buses[n];
-        float left[CBOX_BLOCK_SIZE], right[CBOX_BLOCK_SIZE];
-        float *outputs[2] = {left, right};
-        for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
-        {
-            float *inputs[2];
-            inputs[0] = &bus->input_bufs[0][i];
-            inputs[1] = &bus->input_bufs[1][i];
-            bus->module->process_block(bus->module, inputs, outputs);
-            for (int j = 0; j < CBOX_BLOCK_SIZE; j++)
-            {
-                output_buffers[0][i + j] += left[j];
-                output_buffers[1][i + j] += right[j];
-            }
         }
     }
 
@@ -837,6 +939,8 @@ static struct cbox_instrument *create_instrument(struct cbox_scene *scene, struc
     instr->aux_outputs = calloc(auxes, sizeof(struct cbox_aux_bus *));
     instr->aux_output_names = calloc(auxes, sizeof(char *));
     instr->aux_output_count = auxes;
+    instr->render_buffer_size = module->engine->io_env.buffer_size;
+    instr->render_buffers = scene->engine->render_pool ? calloc(module->outputs * instr->render_buffer_size, sizeof(float)) : NULL;
 
     for (uint32_t i = 0; i < module->outputs / 2; i ++)
         cbox_instrument_output_init(&instr->outputs[i], scene, module->engine->io_env.buffer_size);
@@ -1028,6 +1132,7 @@ struct cbox_scene *cbox_scene_new(struct cbox_document *document, struct cbox_en
     s->enable_default_external_input = TRUE;
 
     cbox_midi_buffer_init(&s->midibuf_total);
+    cbox_midi_buffer_set_arena(&s->midibuf_total, &engine->midi_arena);
     cbox_midi_merger_init(&s->scene_input_merger, &s->midibuf_total);
 
     int buffer_size = engine->io_env.buffer_size;
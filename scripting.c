@@ -46,10 +46,11 @@ gboolean cbox_embed_init_engine(const char *config_file, GError **error)
     cbox_dom_init();
     app.tarpool = cbox_tarpool_new();
     app.document = cbox_document_new();
+    // The engine reads its settings (e.g. render_threads) from the config
+    cbox_config_init(config_file);
     app.rt = cbox_rt_new(app.document);
     app.engine = cbox_engine_new(app.document, app.rt);
     app.rt->engine = app.engine;
-    cbox_config_init(config_file);
     cbox_wavebank_init();
     engine_initialised = 1;
 
@@ -16,6 +16,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "engine.h"
 #include "master.h"
 #include "seq.h"
 
@@ -29,6 +30,7 @@ struct cbox_adhoc_pattern *cbox_adhoc_pattern_new(struct cbox_engine *engine, in
     cbox_midi_playback_active_notes_init(&ap->active_notes);
     cbox_midi_clip_playback_init(&ap->playback, &ap->active_notes, ap->master);
     cbox_midi_buffer_init(&ap->output_buffer);
+    cbox_midi_buffer_set_arena(&ap->output_buffer, &engine->midi_arena);
     ap->id = id;
     ap->completed = FALSE;
     
@@ -110,6 +110,7 @@ struct cbox_track_playback *cbox_track_playback_new_from_track(struct cbox_track
                 p->pattern = mppb;
                 p->offset = item->offset + cut;
                 p->length = item->length - cut;
+                safe = item->time + item->length;
                 p++;
             }
         }
@@ -131,6 +132,7 @@ struct cbox_track_playback *cbox_track_playback_new_from_track(struct cbox_track
     cbox_midi_clip_playback_init(&pb->playback, &pb->active_notes, master);
     cbox_midi_playback_active_notes_init(&pb->active_notes);
     cbox_midi_buffer_init(&pb->output_buffer);
+    cbox_midi_buffer_set_arena(&pb->output_buffer, &spb->engine->midi_arena);
     cbox_track_playback_start_item(pb, 0, FALSE, 0);
 
     if (track->external_output_set)
@@ -143,14 +145,53 @@ struct cbox_track_playback *cbox_track_playback_new_from_track(struct cbox_track
     return pb;
 }
     
+static inline uint32_t track_item_end_ppqn(const struct cbox_track_playback *pb, uint32_t pos)
+{
+    return pb->items[pos].time + pb->items[pos].length;
+}
+
+// Returns the index of the first item that ends at or after time_ppqn, or
+// items_count if there is none. Items are sorted and don't overlap, so their
+// end times are sorted too. The current item is checked first, because
+// that's where most seeks (tempo changes, small jumps) land.
+static uint32_t cbox_track_playback_find_item_ppqn(const struct cbox_track_playback *pb, uint32_t time_ppqn)
+{
+    uint32_t pos = pb->pos;
+    if (pos < pb->items_count && track_item_end_ppqn(pb, pos) >= time_ppqn && (!pos || track_item_end_ppqn(pb, pos - 1) < time_ppqn))
+        return pos;
+    uint32_t L = 0, U = pb->items_count;
+    while (L < U)
+    {
+        uint32_t M = L + ((U - L) >> 1);
+        if (track_item_end_ppqn(pb, M) < time_ppqn)
+            L = M + 1;
+        else
+            U = M;
+    }
+    return L;
+}
+
+// Same as above, for a position in samples
+static uint32_t cbox_track_playback_find_item_samples(const struct cbox_track_playback *pb, uint32_t time_samples)
+{
+    uint32_t L = 0, U = pb->items_count;
+    while (L < U)
+    {
+        uint32_t M = L + ((U - L) >> 1);
+        if (cbox_master_ppqn_to_samples(pb->master, track_item_end_ppqn(pb, M)) < time_samples)
+            L = M + 1;
+        else
+            U = M;
+    }
+    return L;
+}
+
 void cbox_track_confirm_stuck_notes(struct cbox_track_playback *pb, struct cbox_midi_playback_active_notes *stuck_notes, uint32_t new_pos_ppqn)
 {
     // Check if no notes are stuck
     if (!stuck_notes->channels_active)
         return;
-    uint32_t pos = 0;
-    while(pos < pb->items_count && pb->items[pos].time + pb->items[pos].length < new_pos_ppqn)
-        pos++;
+    uint32_t pos = cbox_track_playback_find_item_ppqn(pb, new_pos_ppqn);
     if (pos >= pb->items_count) // past the end of the track - all notes are stuck
         return;
     const struct cbox_track_playback_item *tpi = &pb->items[pos];
@@ -197,17 +238,13 @@ void cbox_track_confirm_stuck_notes(struct cbox_track_playback *pb, struct cbox_
 
 void cbox_track_playback_seek_ppqn(struct cbox_track_playback *pb, uint32_t time_ppqn, uint32_t min_time_ppqn)
 {
-    pb->pos = 0;
-    while(pb->pos < pb->items_count && pb->items[pb->pos].time + pb->items[pb->pos].length < time_ppqn)
-        pb->pos++;
+    pb->pos = cbox_track_playback_find_item_ppqn(pb, time_ppqn);
     cbox_track_playback_start_item(pb, time_ppqn, TRUE, min_time_ppqn);
 }
 
 void cbox_track_playback_seek_samples(struct cbox_track_playback *pb, uint32_t time_samples)
 {
-    pb->pos = 0;
-    while(pb->pos < pb->items_count && cbox_master_ppqn_to_samples(pb->master, pb->items[pb->pos].time + pb->items[pb->pos].length) < time_samples)
-        pb->pos++;
+    pb->pos = cbox_track_playback_find_item_samples(pb, time_samples);
     if (pb->pos < pb->items_count)
     {
         int min_time_ppqn = cbox_master_samples_to_ppqn(pb->master, time_samples);
@@ -310,27 +347,56 @@ void cbox_track_playback_destroy(struct cbox_track_playback *pb)
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static gint note_compare_fn(const void *p1, const void *p2, void *user_data)
+#define NOTE_INTERVAL_KEYS (16 * 128)
+
+static inline int note_interval_key(const struct cbox_midi_event *event)
 {
-    const struct cbox_midi_event *e1 = p1, *e2 = p2;
-    int cn1 = ((e1->data_inline[0] & 0x0F) << 8) | e1->data_inline[1];
-    int cn2 = ((e2->data_inline[0] & 0x0F) << 8) | e2->data_inline[1];
-    if (cn1 < cn2)
-        return -1;
-    if (cn2 < cn1)
-        return +1;
-    if (e1->time < e2->time)
-        return -1;
-    if (e1->time > e2->time)
-        return +1;
-    if (p1 < p2)
-        return -1;
-    if (p1 > p2)
-        return +1;
-    return 0;
+    return ((event->data_inline[0] & 0x0F) << 7) | (event->data_inline[1] & 0x7F);
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////
+// Builds the list of held notes, grouped by channel and note number, from
+// the time-sorted events: one pass to size the groups, one to fill them.
+static void cbox_midi_pattern_playback_build_note_intervals(struct cbox_midi_pattern_playback *mppb)
+{
+    uint32_t *group_pos = calloc(NOTE_INTERVAL_KEYS, sizeof(uint32_t));
+    int32_t *held = malloc(NOTE_INTERVAL_KEYS * sizeof(int32_t));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < mppb->event_count; ++i) {
+        const struct cbox_midi_event *event = &mppb->events[i];
+        if (event->size == 3 && (event->data_inline[0] & 0xF0) == 0x90 && event->data_inline[2] > 0) {
+            group_pos[note_interval_key(event)]++;
+            count++;
+        }
+    }
+    for (uint32_t k = 0, pos = 0; k < NOTE_INTERVAL_KEYS; ++k) {
+        uint32_t n = group_pos[k];
+        group_pos[k] = pos;
+        pos += n;
+        held[k] = -1;
+    }
+
+    struct cbox_midi_note_interval *intervals = malloc(count * sizeof(struct cbox_midi_note_interval));
+    for (uint32_t i = 0; i < mppb->event_count; ++i) {
+        const struct cbox_midi_event *event = &mppb->events[i];
+        if (event->size != 3 || (event->data_inline[0] & 0xE0) != 0x80)
+            continue;
+        int key = note_interval_key(event);
+        // a note off, or a note retriggered without one, ends the held note
+        if (held[key] != -1) {
+            intervals[held[key]].end = event->time;
+            held[key] = -1;
+        }
+        if (event->data_inline[0] >= 0x90 && event->data_inline[2] > 0) {
+            held[key] = group_pos[key]++;
+            intervals[held[key]] = (struct cbox_midi_note_interval){ event->time, UINT32_MAX, key };
+            accumulate_event(&mppb->note_bitmask, event);
+        }
+    }
+    free(held);
+    free(group_pos);
+    mppb->note_intervals = intervals;
+    mppb->note_interval_count = count;
+}
 
 struct cbox_midi_pattern_playback *cbox_midi_pattern_playback_new(struct cbox_midi_pattern *pattern)
 {
@@ -340,15 +406,7 @@ struct cbox_midi_pattern_playback *cbox_midi_pattern_playback_new(struct cbox_mi
     mppb->event_count = pattern->event_count;
     mppb->ref_count = 1;
     cbox_midi_playback_active_notes_init(&mppb->note_bitmask);
-    mppb->note_lookup = g_sequence_new(NULL);
-    for (uint32_t i = 0; i < mppb->event_count; ++i) {
-        struct cbox_midi_event *event = &mppb->events[i];
-        if (event->size == 3 && (event->data_inline[0] & 0xE0) == 0x80) {
-            g_sequence_insert_sorted(mppb->note_lookup, event, note_compare_fn, NULL);
-            if (event->data_inline[0] >= 0x90)
-                accumulate_event(&mppb->note_bitmask, event);
-        }
-    }
+    cbox_midi_pattern_playback_build_note_intervals(mppb);
 
     return mppb;
 }
@@ -366,38 +424,27 @@ void cbox_midi_pattern_playback_ref(struct cbox_midi_pattern_playback *mppb)
 
 void cbox_midi_pattern_playback_destroy(struct cbox_midi_pattern_playback *mppb)
 {
-    g_sequence_free(mppb->note_lookup);
+    free(mppb->note_intervals);
     free(mppb->events);
     free(mppb);
 }
 
 gboolean cbox_midi_pattern_playback_is_note_active_at(struct cbox_midi_pattern_playback *mppb, uint32_t time_ppqn, uint32_t channel, uint32_t note)
 {
-    struct cbox_midi_event event;
-    event.time = time_ppqn;
-    event.size = 3;
-    event.data_inline[0] = 0x90 | channel;
-    event.data_inline[1] = note;
-    event.data_inline[2] = 127;
-    // printf("checking stuck note ch %d note %d at %d\n", channel, note, time_ppqn);
-    GSequenceIter *i = g_sequence_search(mppb->note_lookup, &event, note_compare_fn, NULL);
-    if (g_sequence_iter_is_begin(i)) // before first note
-    {
-        // printf("before first note\n");
-        return FALSE;
-    }
-    i = g_sequence_iter_prev(i);
-    // A preceding note with the same channel and note number
-    struct cbox_midi_event *pevent = g_sequence_get(i);
-    // If it's an event for a different note, channel or not a note on event, then the note hasn't been active at the time
-    // XXXKF what about notes that start before clip offset?
-    if (pevent->size != 3 || pevent->data_inline[0] != event.data_inline[0] || pevent->data_inline[1] != event.data_inline[1] || !pevent->data_inline[2]) {
-        // printf("pevent wrong %d %d %d %d\n", pevent->time, pevent->data_inline[0], pevent->data_inline[1], pevent->data_inline[2]);
-        return FALSE;
+    uint16_t key = (channel << 7) | note;
+    const struct cbox_midi_note_interval *intervals = mppb->note_intervals;
+    // find the last interval of that note starting at or before time_ppqn
+    uint32_t L = 0, U = mppb->note_interval_count;
+    while (L < U)
+    {
+        uint32_t M = L + ((U - L) >> 1);
+        if (intervals[M].key < key || (intervals[M].key == key && intervals[M].start <= time_ppqn))
+            L = M + 1;
+        else
+            U = M;
     }
-    
-    // printf("confirmed note ch %d note %d\n", channel, note);
-    return TRUE;
+    // XXXKF what about notes that start before clip offset?
+    return L > 0 && intervals[L - 1].key == key && time_ppqn < intervals[L - 1].end;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -463,35 +510,41 @@ void cbox_midi_clip_playback_render(struct cbox_midi_clip_playback *pb, struct c
 void cbox_midi_clip_playback_seek_ppqn(struct cbox_midi_clip_playback *pb, uint32_t time_ppqn, uint32_t min_time_ppqn)
 {
     uint32_t patrel_time_ppqn = time_ppqn + pb->offset_ppqn;
+    const struct cbox_midi_event *events = pb->pattern->events;
     uint32_t L = 0, U = pb->pattern->event_count;
-
-    if (patrel_time_ppqn > 0) {
-        while (U > L + 2) {
-            uint32_t M = (L >> 1) + (U >> 1) + (L & U & 1);
-            uint32_t time = pb->pattern->events[M].time;
-            if (time < patrel_time_ppqn)
-                L = M + 1;
-            else if (time >= patrel_time_ppqn)
-                U = M + 1; // this might still be the event we're looking for
-        }
+    // first event at or after the position
+    while (L < U)
+    {
+        uint32_t M = L + ((U - L) >> 1);
+        if (events[M].time < patrel_time_ppqn)
+            L = M + 1;
+        else
+            U = M;
     }
-
-    uint32_t pos = L;
-    while (pos < U && pb->pattern->events[pos].time < patrel_time_ppqn)
-        pos++;
     pb->rel_time_samples = cbox_master_ppqn_to_samples(pb->master, pb->item_start_ppqn + time_ppqn) - pb->start_time_samples;
     pb->min_time_ppqn = min_time_ppqn;
-    pb->pos = pos;
+    pb->pos = L;
 }
 
 void cbox_midi_clip_playback_seek_samples(struct cbox_midi_clip_playback *pb, uint32_t time_samples, uint32_t min_time_ppqn)
 {
-    uint32_t pos = 0;
-    while (pos < pb->pattern->event_count && time_samples > cbox_master_ppqn_to_samples(pb->master, pb->item_start_ppqn + pb->pattern->events[pos].time - pb->offset_ppqn))
-        pos++;
+    const struct cbox_midi_event *events = pb->pattern->events;
+    uint32_t abs_time_samples = pb->start_time_samples + time_samples;
+    uint32_t L = 0, U = pb->pattern->event_count;
+    // first event at or after the position; the ones before the clip offset
+    // are never played
+    while (L < U)
+    {
+        uint32_t M = L + ((U - L) >> 1);
+        if (events[M].time < (uint32_t)pb->offset_ppqn ||
+            cbox_master_ppqn_to_samples(pb->master, pb->item_start_ppqn + events[M].time - pb->offset_ppqn) < abs_time_samples)
+            L = M + 1;
+        else
+            U = M;
+    }
     pb->rel_time_samples = time_samples;
     pb->min_time_ppqn = min_time_ppqn;
-    pb->pos = pos;
+    pb->pos = L;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -836,13 +889,17 @@ int cbox_song_playback_tmi_from_ppqn(struct cbox_song_playback *spb, uint32_t ti
         return -1;
     assert(spb->tempo_map_items[0].time_samples == 0);
     assert(spb->tempo_map_items[0].time_ppqn == 0);
-    // XXXKF should use binary search here really
-    for (int i = 1; i < spb->tempo_map_item_count; i++)
+    // last item starting at or before the position
+    int L = 1, U = spb->tempo_map_item_count;
+    while (L < U)
     {
-        if (time_ppqn < spb->tempo_map_items[i].time_ppqn)
-            return i - 1;
+        int M = L + ((U - L) >> 1);
+        if (time_ppqn < spb->tempo_map_items[M].time_ppqn)
+            U = M;
+        else
+            L = M + 1;
     }
-    return spb->tempo_map_item_count - 1;
+    return L - 1;
 }
 
 int cbox_song_playback_tmi_from_samples(struct cbox_song_playback *spb, uint32_t time_samples)
@@ -851,13 +908,17 @@ int cbox_song_playback_tmi_from_samples(struct cbox_song_playback *spb, uint32_t
         return -1;
     assert(spb->tempo_map_items[0].time_samples == 0);
     assert(spb->tempo_map_items[0].time_ppqn == 0);
-    // XXXKF should use binary search here really
-    for (int i = 1; i < spb->tempo_map_item_count; i++)
+    // last item starting at or before the position
+    int L = 1, U = spb->tempo_map_item_count;
+    while (L < U)
     {
-        if (time_samples < spb->tempo_map_items[i].time_samples)
-            return i - 1;
+        int M = L + ((U - L) >> 1);
+        if (time_samples < spb->tempo_map_items[M].time_samples)
+            U = M;
+        else
+            L = M + 1;
     }
-    return spb->tempo_map_item_count - 1;
+    return L - 1;
 }
 
 struct cbox_midi_pattern_playback *cbox_song_playback_get_pattern(struct cbox_song_playback *spb, struct cbox_midi_pattern *pattern)
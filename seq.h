@@ -45,12 +45,22 @@ extern int cbox_midi_playback_active_notes_release(struct cbox_midi_playback_act
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// A note held in a pattern, from start (inclusive) to end (exclusive), in
+// pattern PPQN. end is UINT32_MAX for notes never released.
+struct cbox_midi_note_interval
+{
+    uint32_t start, end;
+    uint16_t key; // channel << 7 | note
+};
+
 struct cbox_midi_pattern_playback
 {
     struct cbox_midi_event *events;
     uint32_t event_count;
     int ref_count;
-    GSequence *note_lookup;
+    // sorted by key, then by start time
+    struct cbox_midi_note_interval *note_intervals;
+    uint32_t note_interval_count;
     struct cbox_midi_playback_active_notes note_bitmask;
 };
 
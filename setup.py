@@ -66,14 +66,18 @@ if support_ext_module:
         "module.c",
         "pattern.c",
         "pattern-maker.c",
+        "pcmcache.c",
         "@phaser.c",
         "prefetch_pipe.c",
         "recsrc.c",
         "@reverb.c",
         "rt.c",
         "sampler.c",
+        "@sampler_batch.c",
+        "@sampler_parallel.c",
         "@sampler_channel.c",
         "@sampler_gen.c",
+        "@sampler_image.c",
         "sampler_layer.c",
         "@sampler_nif.c",
         "@sampler_prevoice.c",
@@ -98,6 +102,7 @@ if support_ext_module:
         "@usbmidi.c",
         "@usbprobe.c",
         "wavebank.c",
+        "workerpool.c",
     ]
 
     headers = [
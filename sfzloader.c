@@ -16,9 +16,14 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "config-api.h"
 #include "sampler.h"
 #include "sfzparser.h"
 #include "sampler_impl.h"
+#include "wavebank.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #define DUMP_LAYER_ATTRIBS 0
 
@@ -40,8 +45,22 @@ struct sfz_load_state
     enum sfz_load_section_type section_type;
     uint32_t curve_index;
     GError **error;
+    GSList *sources;
 };
 
+static gchar *sample_dir_from_default_path(const char *sfz_filename, const char *value)
+{
+    gchar *dir = g_path_get_dirname(sfz_filename);
+    char value2[strlen(value) + 1];
+    int i;
+    for (i = 0; value[i]; ++i)
+        value2[i] = value[i] == '\\' ? '/' : value[i];
+    value2[i] = '\0';
+    gchar *combined = g_build_filename(dir, value2, NULL);
+    g_free(dir);
+    return combined;
+}
+
 static void load_sfz_end_region(struct sfz_parser_client *client)
 {
     struct sfz_load_state *ls = client->user_data;
@@ -214,15 +233,7 @@ static gboolean load_sfz_key_value(struct sfz_parser_client *client, const char
         else if (!strcmp(key, "default_path"))
         {
             g_free(ls->program->sample_dir);
-            gchar *dir = g_path_get_dirname(ls->filename);
-            char value2[strlen(value) + 1];
-            int i;
-            for (i = 0; value[i]; ++i)
-                value2[i] = value[i] == '\\' ? '/' : value[i];
-            value2[i] = '\0';
-            gchar *combined = g_build_filename(dir, value2, NULL);
-            ls->program->sample_dir = combined;
-            g_free(dir);
+            ls->program->sample_dir = sample_dir_from_default_path(ls->filename, value);
         }
         else
             g_warning("Unrecognized SFZ key in control section: %s", key);
@@ -275,10 +286,158 @@ static gboolean handle_token(struct sfz_parser_client *client, const char *token
     return FALSE;
 }
 
+// The sample files are loaded in a separate pass before the real one: the
+// file is parsed just to find the sample file names, and then those are
+// loaded into the wavebank on several threads at once. The real pass then
+// finds all the samples already loaded.
+
+struct sfz_preload_state
+{
+    const char *filename;
+    const char *sample_dir;
+    gboolean in_control;
+    GArray *requests;
+    // strings referenced by the requests
+    GSList *strings;
+};
+
+static gboolean preload_token(struct sfz_parser_client *client, const char *token, GError **error)
+{
+    struct sfz_preload_state *ps = client->user_data;
+    ps->in_control = !strcmp(token, "control");
+    // Any errors will be reported by the real pass
+    return TRUE;
+}
+
+static gboolean preload_key_value(struct sfz_parser_client *client, const char *key, const char *value)
+{
+    struct sfz_preload_state *ps = client->user_data;
+    if (ps->in_control && !strcmp(key, "default_path"))
+    {
+        gchar *sample_dir = sample_dir_from_default_path(ps->filename, value);
+        ps->strings = g_slist_prepend(ps->strings, sample_dir);
+        ps->sample_dir = sample_dir;
+    }
+    else if (!ps->in_control && !strcmp(key, "sample"))
+    {
+        gchar *filename = g_strdup(value);
+        ps->strings = g_slist_prepend(ps->strings, filename);
+        struct cbox_waveform_request req = { ps->sample_dir, filename };
+        g_array_append_val(ps->requests, req);
+    }
+    return TRUE;
+}
+
+static void preload_progress(void *user_data, uint32_t done, uint32_t total)
+{
+    struct sampler_module *m = user_data;
+    if (m->load_progress_fb)
+        cbox_execute_on(m->load_progress_fb, NULL, "/load_progress", "ii", NULL, (int)done, (int)total);
+}
+
+static GSList *preload_sfz_samples(struct sampler_module *m, struct sampler_program *prg, const char *sfz, int is_from_string)
+{
+    struct sfz_preload_state ps = { .filename = sfz, .sample_dir = prg->sample_dir, .in_control = FALSE, .requests = g_array_new(FALSE, FALSE, sizeof(struct cbox_waveform_request)), .strings = NULL };
+    struct sfz_parser_client c = { .user_data = &ps, .token = preload_token, .key_value = preload_key_value };
+    GError *error = NULL;
+    GSList *waveforms = NULL;
+
+    gboolean status;
+    if (is_from_string)
+        status = load_sfz_from_string(sfz, strlen(sfz), &c, &error);
+    else
+        status = load_sfz(sfz, prg->tarfile, &c, &error);
+    g_clear_error(&error);
+    if (status && ps.requests->len)
+        waveforms = cbox_wavebank_preload(prg->name, prg->tarfile, (struct cbox_waveform_request *)ps.requests->data, ps.requests->len, m->load_threads, preload_progress, m);
+    g_array_free(ps.requests, TRUE);
+    for (GSList *p = ps.strings; p; p = p->next)
+        g_free(p->data);
+    g_slist_free(ps.strings);
+    return waveforms;
+}
+
+static void load_sfz_file_opened(struct sfz_parser_client *client, const char *filename, const struct stat *st)
+{
+    struct sfz_load_state *ls = client->user_data;
+    // The image is only valid for the file contents actually parsed, so the
+    // status is the one of the file being read rather than of the file at
+    // the time the image is written
+    if (!st)
+        return;
+    char *path = realpath(filename, NULL);
+    struct sampler_program_source *src = g_new(struct sampler_program_source, 1);
+    src->pathname = path ? g_strdup(path) : g_strdup(filename);
+    src->mtime_sec = st->st_mtim.tv_sec;
+    src->mtime_nsec = st->st_mtim.tv_nsec;
+    src->size = st->st_size;
+    ls->sources = g_slist_prepend(ls->sources, src);
+    free(path);
+}
+
+static void free_program_source(gpointer data)
+{
+    struct sampler_program_source *src = data;
+    g_free(src->pathname);
+    g_free(src);
+}
+
+// Precompiled images of the programs loaded from SFZ files are kept in
+// [sampler] program_cache_dir, if set. The image name depends on the SFZ
+// file and the sample directory it is loaded with.
+static gchar *get_image_pathname(struct sampler_program *prg, const char *sfz, int is_from_string)
+{
+    if (is_from_string || prg->tarfile)
+        return NULL;
+    const char *cache_dir = cbox_config_get_string("sampler", "program_cache_dir");
+    if (!cache_dir || !*cache_dir)
+        return NULL;
+    char *path = realpath(sfz, NULL);
+    if (!path)
+        return NULL;
+    gchar *key = g_strdup_printf("%s\n%s", path, prg->sample_dir);
+    free(path);
+    gchar *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    gchar *basename = g_strdup_printf("%s.prg", checksum);
+    gchar *pathname = g_build_filename(cache_dir, basename, NULL);
+    g_free(basename);
+    g_free(checksum);
+    g_free(key);
+    return pathname;
+}
+
+static void write_image(struct sampler_program *prg, const char *image, GSList *sources)
+{
+    GError *error = NULL;
+    gchar *dir = g_path_get_dirname(image);
+    if (g_mkdir_with_parents(dir, 0755))
+        g_warning("Cannot create the program cache directory '%s': %s", dir, strerror(errno));
+    else if (!sampler_program_write_image(prg, image, sources, &error))
+    {
+        g_warning("Cannot write the program image for '%s': %s", prg->name, error ? error->message : "unknown error");
+        g_clear_error(&error);
+    }
+    g_free(dir);
+}
+
 gboolean sampler_module_load_program_sfz(struct sampler_module *m, struct sampler_program *prg, const char *sfz, int is_from_string, GError **error)
 {
+    gchar *image = get_image_pathname(prg, sfz, is_from_string);
+    if (image)
+    {
+        // A missing or out of date image is not an error, the SFZ file is
+        // loaded instead and the image gets written again
+        if (sampler_program_load_image(prg, image, NULL))
+        {
+            g_free(image);
+            return TRUE;
+        }
+    }
+
+    GSList *preloaded = m->load_threads > 1 ? preload_sfz_samples(m, prg, sfz, is_from_string) : NULL;
+
     struct sfz_load_state ls = { .global = prg->global, .master = prg->global->default_child, .group = prg->global->default_child->default_child, .target = NULL, .m = m, .filename = sfz, .region = NULL, .error = error, .program = prg, .section_type = slst_normal, .default_path = NULL };
-    struct sfz_parser_client c = { .user_data = &ls, .token = handle_token, .key_value = load_sfz_key_value };
+    struct sfz_parser_client c = { .user_data = &ls, .token = handle_token, .key_value = load_sfz_key_value, .file_opened = image ? load_sfz_file_opened : NULL };
     g_clear_error(error);
 
     gboolean status;
@@ -288,16 +447,23 @@ gboolean sampler_module_load_program_sfz(struct sampler_module *m, struct sample
     {
         status = load_sfz(sfz, prg->tarfile, &c, error); //Loads the audio files but also sets fields, like prg->sample_dir. After this we cannot modify any values anymore.
     }
-    if (!status)
+    if (status)
+        end_token(&c);
+    else if (ls.region)
+        CBOX_DELETE(ls.region);
+
+    // The layers hold their own references now
+    for (GSList *p = preloaded; p; p = p->next)
+        cbox_waveform_unref(p->data);
+    g_slist_free(preloaded);
+    if (status)
     {
-        if (ls.region)
-            CBOX_DELETE(ls.region);
-        return FALSE;
+        prg->all_layers = g_slist_reverse(prg->all_layers);
+        sampler_program_update_layers(prg);
+        if (image)
+            write_image(prg, image, ls.sources);
     }
-
-    end_token(&c);
-
-    prg->all_layers = g_slist_reverse(prg->all_layers);
-    sampler_program_update_layers(prg);
-    return TRUE;
+    g_slist_free_full(ls.sources, free_program_source);
+    g_free(image);
+    return status;
 }
@@ -20,94 +20,157 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "tarfile.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 int debug_variable_definitions = 0;
 int debug_variable_substitutions = 0;
 int debug_includes = 0;
 
+// The parser works directly on the (memory-mapped) text of the file, using
+// pointers to the start and end of each token. Only the keys, values and
+// headers passed to the client are copied - into a NUL-terminated scratch
+// buffer that is reused for the whole file, so that parsing does not
+// allocate any memory per token unless variable substitution is needed.
+
 struct sfz_parser_state
 {
     struct sfz_parser_client *client;
-    gboolean (*handler)(struct sfz_parser_state *state, int ch);
     const char *filename;
-    const char *buf;
-    int pos, len, line;
-    int token_start;
-    int key_start, key_end;
-    int value_start, value_end;
+    const char *pos, *end;
+    int line;
+    char *scratch;
+    size_t scratch_size;
     GHashTable *variables;
     struct cbox_tarfile *tarfile;
     GError **error;
 };
 
 static gboolean load_sfz_into_state(struct sfz_parser_state *s, const char *name);
-static gboolean handle_char(struct sfz_parser_state *state, int ch);
 
 static void unexpected_char(struct sfz_parser_state *state, int ch)
 {
     g_set_error(state->error, CBOX_SFZPARSER_ERROR, CBOX_SFZ_PARSER_ERROR_INVALID_CHAR, "Unexpected character '%c' (%d)", ch, ch);
 }
 
-static gboolean handle_header(struct sfz_parser_state *state, int ch)
+static inline int peek_char(struct sfz_parser_state *state, const char *p)
 {
-    if (ch >= 'a' && ch <= 'z')
-        return TRUE;
-    if (ch == '>')
-    {
-        char *token = g_strndup(state->buf + state->token_start, state->pos - 1 - state->token_start);
-        gboolean result = state->client->token(state->client, token, state->error);
-        g_free(token);
-        state->handler = handle_char;
-        return result;
-    }
-    unexpected_char(state, ch);
-    return FALSE;
+    return p < state->end ? (unsigned char)*p : -1;
 }
 
-static void scan_for_value(struct sfz_parser_state *state)
+static inline gboolean is_comment(struct sfz_parser_state *state, const char *p)
 {
-    state->value_start = state->pos;
-    while(state->pos < state->len)
+    return p + 1 < state->end && p[0] == '/' && p[1] == '/';
+}
+
+static inline gboolean is_line_end(int ch)
+{
+    return ch == '\r' || ch == '\n' || ch == -1;
+}
+
+static void skip_comment(struct sfz_parser_state *state)
+{
+    while (state->pos < state->end && *state->pos != '\r' && *state->pos != '\n')
+        state->pos++;
+}
+
+// Skips spaces, line breaks and comments
+static void skip_blanks(struct sfz_parser_state *state)
+{
+    while (state->pos < state->end)
     {
-        if (state->pos < state->len + 2 && state->buf[state->pos] == '/' && state->buf[state->pos + 1] == '/')
+        char ch = *state->pos;
+        if (ch == '/' && is_comment(state, state->pos))
         {
-            state->value_end = state->pos;
-            while(state->value_end > state->value_start && isspace(state->buf[state->value_end - 1]))
-                state->value_end--;
-            state->pos += 2;
-            while (state->pos < state->len && state->buf[state->pos] != '\r' && state->buf[state->pos] != '\n')
-                state->pos++;
-            return;
+            skip_comment(state);
+            continue;
         }
-        int ch = state->buf[state->pos];
-        if (ch == 0 || ch == '\r' || ch == '\n' || ch == '<')
-        {
-            state->value_end = state->pos;
-            // remove spaces before next key
-            while(state->value_end > state->value_start && isspace(state->buf[state->value_end - 1]))
-                state->value_end--;
+        // CR/LF counts as one line break
+        if (ch == '\n' || (ch == '\r' && peek_char(state, state->pos + 1) != '\n'))
+            state->line++;
+        else if (ch != ' ' && ch != '\t' && ch != '\r')
             return;
-        }
+        state->pos++;
+    }
+}
+
+// Copies one or two strings into the scratch buffer and NUL-terminates
+// them. The pointers remain valid until the next call.
+static void copy_to_scratch(struct sfz_parser_state *state, const char *start1, const char *end1, const char **str1, const char *start2, const char *end2, const char **str2)
+{
+    size_t len1 = end1 - start1, len2 = end2 - start2;
+    size_t needed = len1 + len2 + 2;
+    if (needed > state->scratch_size)
+    {
+        while (state->scratch_size < needed)
+            state->scratch_size = state->scratch_size ? state->scratch_size * 2 : 256;
+        state->scratch = g_realloc(state->scratch, state->scratch_size);
+    }
+    char *p = state->scratch;
+    memcpy(p, start1, len1);
+    p[len1] = '\0';
+    *str1 = p;
+    if (str2)
+    {
+        p += len1 + 1;
+        memcpy(p, start2, len2);
+        p[len2] = '\0';
+        *str2 = p;
+    }
+}
+
+static gboolean parse_header(struct sfz_parser_state *state)
+{
+    const char *start = ++state->pos;
+    int ch;
+    while ((ch = peek_char(state, state->pos)) >= 'a' && ch <= 'z')
+        state->pos++;
+    if (ch != '>')
+    {
+        unexpected_char(state, ch);
+        return FALSE;
+    }
+    const char *token;
+    copy_to_scratch(state, start, state->pos, &token, NULL, NULL, NULL);
+    state->pos++;
+    return state->client->token(state->client, token, state->error);
+}
+
+static const char *trim_end(const char *start, const char *end)
+{
+    while(end > start && isspace((unsigned char)end[-1]))
+        end--;
+    return end;
+}
+
+// A value ends at a line break, a comment or a header; it may contain
+// spaces, so if another key follows on the same line, it's only found when
+// its '=' sign is reached.
+static void scan_for_value(struct sfz_parser_state *state, const char **value_end)
+{
+    const char *start = state->pos, *p = start;
+    while(p < state->end)
+    {
+        char ch = *p;
+        if (ch == 0 || ch == '\r' || ch == '\n' || ch == '<' || (ch == '/' && is_comment(state, p)))
+            break;
         if (ch == '=')
         {
-            state->value_end = state->pos;
             // remove next key
-            while(state->value_end > state->value_start && !isspace(state->buf[state->value_end - 1]))
-                state->value_end--;
-            // remove spaces before next key
-            while(state->value_end > state->value_start && isspace(state->buf[state->value_end - 1]))
-                state->value_end--;
-            state->pos = state->value_end;
-            return;
+            while(p > start && !isspace((unsigned char)p[-1]))
+                p--;
+            break;
         }
-        state->pos++;
+        p++;
     }
-    state->value_end = state->pos;
-    while(state->value_end > state->value_start && isspace(state->buf[state->value_end - 1]))
-        state->value_end--;
+    // remove spaces before next key
+    *value_end = trim_end(start, p);
+    state->pos = *value_end;
 }
 
 static gchar *expand_variables(struct sfz_parser_state *state, gchar *text)
@@ -179,27 +242,32 @@ static gchar *expand_variables(struct sfz_parser_state *state, gchar *text)
     return substituted;
 }
 
-static gboolean handle_key(struct sfz_parser_state *state, int ch)
+static gboolean parse_key_value(struct sfz_parser_state *state)
 {
-    if (isalpha(ch) || isdigit(ch) || ch == '_')
-        return TRUE;
-    if(ch == '=')
+    const char *key_start = state->pos;
+    int ch;
+    while ((ch = peek_char(state, state->pos)) != -1 && (isalnum(ch) || ch == '_'))
+        state->pos++;
+    if (ch != '=')
     {
-        state->key_end = state->pos - 1;
-        scan_for_value(state);
-
-        gchar *key = g_strndup(state->buf + state->key_start, state->key_end - state->key_start);
-        gchar *value = g_strndup(state->buf + state->value_start, state->value_end - state->value_start);
-        key = expand_variables(state, key);
-        value = expand_variables(state, value);
-        gboolean result = state->client->key_value(state->client, key, value);
-        g_free(key);
-        g_free(value);
-        state->handler = handle_char;
-        return result;
+        unexpected_char(state, ch);
+        return FALSE;
     }
-    unexpected_char(state, ch);
-    return FALSE;
+    const char *key_end = state->pos++;
+    const char *value_start = state->pos, *value_end;
+    scan_for_value(state, &value_end);
+
+    const char *key, *value;
+    copy_to_scratch(state, key_start, key_end, &key, value_start, value_end, &value);
+    if (!strchr(key, '$') && !strchr(value, '$'))
+        return state->client->key_value(state->client, key, value);
+
+    gchar *key2 = expand_variables(state, g_strdup(key));
+    gchar *value2 = expand_variables(state, g_strdup(value));
+    gboolean result = state->client->key_value(state->client, key2, value2);
+    g_free(key2);
+    g_free(value2);
+    return result;
 }
 
 static gboolean do_include(struct sfz_parser_state *state, const char *name)
@@ -223,217 +291,180 @@ static void do_define(struct sfz_parser_state *state, char *key, char *value)
     g_hash_table_insert(state->variables, key, value);
 }
 
-static gboolean handle_include_filename(struct sfz_parser_state *state, int ch)
+static void skip_spaces(struct sfz_parser_state *state)
 {
-    if (ch == '"')
-    {
-        char *token = g_strndup(state->buf + state->token_start, state->pos - 1 - state->token_start);
-        gboolean result = do_include(state, token);
-        g_free(token);
-        state->handler = handle_char;
-        return result;
-    }
-    if ((unsigned)(ch) >= ' ')
-        return TRUE;
-    unexpected_char(state, ch);
-    return FALSE;
+    int ch;
+    while ((ch = peek_char(state, state->pos)) != -1 && !is_line_end(ch) && isspace(ch))
+        state->pos++;
 }
 
-static gboolean handle_include_skipwhite(struct sfz_parser_state *state, int ch)
+static gboolean parse_include(struct sfz_parser_state *state)
 {
-    if (isspace(ch))
-        return TRUE;
-    if (ch == '"')
+    int ch;
+    // The file name may be on the next line
+    while ((ch = peek_char(state, state->pos)) != -1 && isspace(ch))
     {
-        state->token_start = state->pos;
-        state->handler = handle_include_filename;
-        return TRUE;
+        if (ch == '\n')
+            state->line++;
+        state->pos++;
     }
-    unexpected_char(state, ch);
-    return FALSE;
-}
-
-static gboolean handle_define_value(struct sfz_parser_state *state, int ch)
-{
-    if (ch == '\n' || ch == '\r' || ch == -1)
+    if (ch != '"')
     {
-        char *key = g_strndup(state->buf + state->key_start, state->key_end - state->key_start);
-        char *value = g_strndup(state->buf + state->value_start, state->pos - state->value_start - 1);
-        do_define(state, key, value);
-        state->handler = handle_char;
-        return TRUE;
+        unexpected_char(state, ch);
+        return FALSE;
     }
-    return TRUE;
+    const char *start = ++state->pos;
+    while ((ch = peek_char(state, state->pos)) != '"')
+    {
+        if (ch == -1 || (unsigned)ch < ' ')
+        {
+            unexpected_char(state, ch);
+            return FALSE;
+        }
+        state->pos++;
+    }
+    gchar *name = g_strndup(start, state->pos - start);
+    state->pos++;
+    gboolean result = do_include(state, name);
+    g_free(name);
+    return result;
 }
 
-static gboolean handle_define_skipwhite2(struct sfz_parser_state *state, int ch)
+static gboolean parse_define(struct sfz_parser_state *state)
 {
-    if (ch == '\n' || ch == '\r' || ch == -1)
+    int ch;
+    while ((ch = peek_char(state, state->pos)) != -1 && isspace(ch))
     {
-        char *key = g_strndup(state->buf + state->key_start, state->key_end - state->key_start);
-        g_set_error(state->error, CBOX_SFZPARSER_ERROR, CBOX_SFZ_PARSER_ERROR_INVALID_CHAR, "Unspecified variable value for '%s'", key);
-        g_free(key);
+        if (ch == '\n')
+            state->line++;
+        state->pos++;
+    }
+    if (ch != '$')
+    {
+        unexpected_char(state, ch);
         return FALSE;
     }
-    if (isspace(ch))
-        return TRUE;
-    state->value_start = state->pos - 1;
-    state->handler = handle_define_value;
-    return TRUE;
-}
-
-static gboolean handle_define_varname(struct sfz_parser_state *state, int ch)
-{
-    if (ch == '\n' || ch == '\r' || ch == -1)
+    const char *key_start = ++state->pos;
+    while (!isspace(ch = peek_char(state, state->pos)) && ch != -1)
+    {
+        if (ch < 33 || ch > 127 || ch == '$')
+        {
+            unexpected_char(state, ch);
+            return FALSE;
+        }
+        state->pos++;
+    }
+    if (is_line_end(ch))
     {
-        char *key = g_strndup(state->buf + state->key_start, state->key_end - state->key_start);
         g_set_error(state->error, CBOX_SFZPARSER_ERROR, CBOX_SFZ_PARSER_ERROR_INVALID_CHAR, "Unspecified variable name");
-        g_free(key);
         return FALSE;
     }
-    if (isspace(ch))
+    const char *key_end = state->pos;
+    skip_spaces(state);
+    if (is_line_end(peek_char(state, state->pos)))
     {
-        state->key_end = state->pos - 1;
-        state->handler = handle_define_skipwhite2;
-        return TRUE;
+        char *key = g_strndup(key_start, key_end - key_start);
+        g_set_error(state->error, CBOX_SFZPARSER_ERROR, CBOX_SFZ_PARSER_ERROR_INVALID_CHAR, "Unspecified variable value for '%s'", key);
+        g_free(key);
+        return FALSE;
     }
-    if (ch >= 33 && ch <= 127 && ch != '$')
-        return TRUE;
-    unexpected_char(state, ch);
-    return FALSE;
+    // The value is the rest of the line, without the comment if any
+    const char *value_start = state->pos;
+    while (!is_line_end(peek_char(state, state->pos)) && !is_comment(state, state->pos))
+        state->pos++;
+    do_define(state, g_strndup(key_start, key_end - key_start), g_strndup(value_start, trim_end(value_start, state->pos) - value_start));
+    return TRUE;
 }
 
-static gboolean handle_define_skipwhite(struct sfz_parser_state *state, int ch)
+static gboolean parse_preprocessor(struct sfz_parser_state *state)
 {
-    if (isspace(ch))
-        return TRUE;
-    if (ch == '$')
+    const char *start = ++state->pos;
+    int ch;
+    while ((ch = peek_char(state, state->pos)) != -1 && isalpha(ch))
+        state->pos++;
+    if (ch == -1 || !isspace(ch))
     {
-        state->key_start = state->pos;
-        state->handler = handle_define_varname;
-        return TRUE;
+        unexpected_char(state, ch);
+        return FALSE;
     }
-
-    unexpected_char(state, ch);
+    size_t len = state->pos - start;
+    if (len == 7 && !memcmp(start, "include", 7))
+        return parse_include(state);
+    if (len == 6 && !memcmp(start, "define", 6))
+        return parse_define(state);
+    char *preproc = g_strndup(start, len);
+    g_set_error(state->error, CBOX_SFZPARSER_ERROR, CBOX_SFZ_PARSER_ERROR_INVALID_CHAR, "%s:%d Unsupported parser directive '%s'", state->filename, state->line, preproc);
+    g_free(preproc);
     return FALSE;
 }
 
-static gboolean handle_preprocessor(struct sfz_parser_state *state, int ch)
+static gboolean parse_buffer(struct sfz_parser_state *s)
 {
-    if (isalpha(ch))
-        return TRUE;
-    if (isspace(ch))
+    while(1)
     {
-        if (!memcmp(state->buf + state->token_start, "include", state->pos - state->token_start - 1))
-        {
-            state->handler = handle_include_skipwhite;
+        skip_blanks(s);
+        if (s->pos >= s->end)
             return TRUE;
+        int ch = (unsigned char)*s->pos;
+        gboolean ok;
+        if (isalnum(ch))
+            ok = parse_key_value(s);
+        else if (ch == '<')
+            ok = parse_header(s);
+        else if (ch == '#')
+            ok = parse_preprocessor(s);
+        else if (ch == '_')
+        {
+            s->pos++;
+            ok = TRUE;
         }
-        if (!memcmp(state->buf + state->token_start, "define", state->pos - state->token_start - 1))
+        else
         {
-            state->handler = handle_define_skipwhite;
-            return TRUE;
+            unexpected_char(s, ch);
+            ok = FALSE;
         }
-        char *preproc = g_strndup(state->buf + state->token_start, state->pos - state->token_start - 1);
-        g_set_error(state->error, CBOX_SFZPARSER_ERROR, CBOX_SFZ_PARSER_ERROR_INVALID_CHAR, "%s:%d Unsupported parser directive '%s'", state->filename, state->line, preproc);
-        g_free(preproc);
-        state->handler = handle_char;
-        return FALSE;
-    }
-    unexpected_char(state, ch);
-    return FALSE;
-}
-
-static gboolean handle_char(struct sfz_parser_state *state, int ch)
-{
-    if (isalpha(ch) || isdigit(ch))
-    {
-        state->key_start = state->pos - 1;
-        state->handler = handle_key;
-        return TRUE;
-    }
-    switch(ch)
-    {
-    case '_':
-        return TRUE;
-
-    case '\r':
-    case '\n':
-    case ' ':
-    case '\t':
-    case -1:
-        return TRUE;
-    case '<':
-        state->token_start = state->pos;
-        state->handler = handle_header;
-        return TRUE;
-    case '#':
-        state->token_start = state->pos;
-        state->handler = handle_preprocessor;
-        return TRUE;
-    default:
-        unexpected_char(state, ch);
-        return FALSE;
+        if (!ok)
+            return FALSE;
     }
 }
 
-gboolean load_sfz_from_string_into_state(struct sfz_parser_state *s, const char *buf, int len)
+static gboolean load_sfz_from_string_into_state(struct sfz_parser_state *s, const char *buf, int len)
 {
-    const char *oldbuf = s->buf;
-    int oldpos = s->pos, oldlen = s->len, oldline = s->line;
-    gboolean ok = FALSE;
-    s->buf = buf;
-    s->pos = 0;
-    s->len = len;
-    s->handler = handle_char;
-    s->token_start = 0;
-    if (len >= 3 && buf[0] == 0xEF && buf[1] == 0xBB && buf[2] == 0xBF)
+    const char *oldpos = s->pos, *oldend = s->end;
+    int oldline = s->line;
+    s->pos = buf;
+    s->end = buf + len;
+    if (len >= 3 && (unsigned char)buf[0] == 0xEF && (unsigned char)buf[1] == 0xBB && (unsigned char)buf[2] == 0xBF)
     {
         // UTF-8 BOM
         s->pos += 3;
     }
-    while(s->pos < len && s->handler != NULL)
-    {
-        if (s->pos < len + 2 && buf[s->pos] == '/' && buf[s->pos + 1] == '/')
-        {
-            s->pos += 2;
-            while (s->pos < len && buf[s->pos] != '\r' && buf[s->pos] != '\n')
-                s->pos++;
-            continue;
-        }
-        char ch = buf[s->pos++];
-        gboolean newline = FALSE, eat_lf = FALSE;
-        // Convert CR or CR/LF to LF
-        if (ch == '\r') {
-            newline = TRUE;
-            eat_lf = (buf[s->pos] == '\n');
-            ch = '\n';
-        } else if (ch == '\n')
-            newline = TRUE;
-
-        if (!(*s->handler)(s, ch))
-            goto restore;
-        if (newline)
-            s->line++;
-        if (eat_lf)
-            s->pos++;
-    }
-    if (s->handler)
-    {
-        if (!(*s->handler)(s, -1))
-            goto restore;
-    }
-    ok = TRUE;
-restore:
-    s->buf = oldbuf;
+    gboolean ok = parse_buffer(s);
     s->pos = oldpos;
+    s->end = oldend;
     s->line = oldline;
-    s->len = oldlen;
-    s->handler = handle_char;
-    s->token_start = oldpos;
     return ok;
 }
 
+static void init_state(struct sfz_parser_state *s, const char *filename, struct cbox_tarfile *tarfile, struct sfz_parser_client *c, GError **error)
+{
+    memset(s, 0, sizeof(*s));
+    s->line = 1;
+    s->filename = filename;
+    s->tarfile = tarfile;
+    s->client = c;
+    s->error = error;
+    s->scratch = NULL;
+    s->scratch_size = 0;
+    s->variables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void destroy_state(struct sfz_parser_state *s)
+{
+    g_hash_table_destroy(s->variables);
+    g_free(s->scratch);
+}
+
 /*
  * This is not only called when literally constructing a sfz string
  * but also when loading a null instrument e.g. to first create the jack ports and only later
@@ -442,15 +473,9 @@ restore:
 gboolean load_sfz_from_string(const char *buf, int len, struct sfz_parser_client *c, GError **error)
 {
     struct sfz_parser_state s;
-    memset(&s, 0, sizeof(s));
-    s.line = 1;
-    s.filename = "<inline>";
-    s.tarfile = NULL;
-    s.client = c;
-    s.error = error;
-    s.variables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    init_state(&s, "<inline>", NULL, c, error);
     gboolean result = load_sfz_from_string_into_state(&s, buf, len);
-    g_hash_table_destroy(s.variables);
+    destroy_state(&s);
     return result;
 }
 
@@ -458,71 +483,79 @@ gboolean load_sfz_from_string(const char *buf, int len, struct sfz_parser_client
  * Called once per sfz.
  * Does not load samples, but only the sfz file.
  */
-gboolean load_sfz_into_state(struct sfz_parser_state *s, const char *name)
+static gboolean load_sfz_into_state(struct sfz_parser_state *s, const char *name)
 {
     g_clear_error(s->error);
-    FILE *f;
-    int len = -1;
+    int fd;
+    uint64_t offset = 0, len = 0;
+    struct cbox_taritem *item = NULL;
+    struct stat st;
     if (s->tarfile)
     {   //This only extracts the .sfz file itself and will not attempt to load any sample waveforms, eventhough cbox_tarfile_get_item_by_name will later be used to extract the sample as well.
-        struct cbox_taritem *item = cbox_tarfile_get_item_by_name(s->tarfile, name, TRUE);
+        item = cbox_tarfile_get_item_by_name(s->tarfile, name, TRUE);
         if (!item)
         {
             g_set_error(s->error, G_FILE_ERROR, g_file_error_from_errno (2), "Cannot find '%s' in the tarfile", name);
             return FALSE;
         }
-        int fd = cbox_tarfile_openitem(s->tarfile, item);
+        fd = cbox_tarfile_openitem(s->tarfile, item);
         if (fd < 0)
         {
             g_set_error(s->error, G_FILE_ERROR, g_file_error_from_errno (errno), "Cannot open '%s' in the tarfile", name);
             return FALSE;
         }
-        f = fdopen(fd, "rb");
+        offset = item->offset;
         len = item->size;
     }
     else
-        f = fopen(name, "rb");
-
-    if (!f)
     {
-        g_set_error(s->error, G_FILE_ERROR, g_file_error_from_errno (errno), "Cannot open '%s'", name);
-        return FALSE;
+        fd = open(name, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st))
+        {
+            g_set_error(s->error, G_FILE_ERROR, g_file_error_from_errno (errno), "Cannot open '%s'", name);
+            if (fd >= 0)
+                close(fd);
+            return FALSE;
+        }
+        len = st.st_size;
     }
-
-    if (len == -1)
+    if (s->client->file_opened)
+        s->client->file_opened(s->client, name, item ? NULL : &st);
+    if (!len)
     {
-        fseek(f, 0, SEEK_END);
-        len = ftell(f);
-        fseek(f, 0, SEEK_SET);
+        if (item)
+            cbox_tarfile_closeitem(s->tarfile, item, fd);
+        else
+            close(fd);
+        return load_sfz_from_string_into_state(s, "", 0);
     }
 
-    unsigned char *buf = malloc(len + 1);
-    buf[len] = '\0';
-    if (fread(buf, 1, len, f) != (size_t)len)
+    // The mapping must start at a page boundary, and the tar file items don't
+    uint64_t delta = offset % sysconf(_SC_PAGESIZE);
+    void *mapping = mmap(NULL, len + delta, PROT_READ, MAP_PRIVATE, fd, offset - delta);
+    int mmap_errno = errno;
+    if (item)
+        cbox_tarfile_closeitem(s->tarfile, item, fd);
+    else
+        close(fd);
+    if (mapping == MAP_FAILED)
     {
-        g_set_error(s->error, G_FILE_ERROR, g_file_error_from_errno (errno), "Cannot read '%s'", name);
-        fclose(f);
+        g_set_error(s->error, G_FILE_ERROR, g_file_error_from_errno (mmap_errno), "Cannot read '%s'", name);
         return FALSE;
     }
-    fclose(f);
+    madvise(mapping, len + delta, MADV_SEQUENTIAL);
 
-    gboolean result = load_sfz_from_string_into_state(s, (char *)buf, len);
-    free(buf);
+    gboolean result = load_sfz_from_string_into_state(s, (const char *)mapping + delta, len);
+    munmap(mapping, len + delta);
     return result;
 }
 
 gboolean load_sfz(const char *name, struct cbox_tarfile *tarfile, struct sfz_parser_client *c, GError **error)
 {
     struct sfz_parser_state s;
-    memset(&s, 0, sizeof(s));
-    s.line = 1;
-    s.filename = name;
-    s.tarfile = tarfile;
-    s.client = c;
-    s.error = error;
-    s.variables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    init_state(&s, name, tarfile, c, error);
     gboolean result = load_sfz_into_state(&s, name);
-    g_hash_table_destroy(s.variables);
+    destroy_state(&s);
     return result;
 }
 
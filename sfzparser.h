@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define CBOX_SFZPARSER_H
 
 #include <glib.h>
+#include <sys/stat.h>
 
 #define CBOX_SFZPARSER_ERROR cbox_sfz_parser_error_quark()
 
@@ -37,6 +38,9 @@ struct sfz_parser_client
     void *user_data;
     gboolean (*token)(struct sfz_parser_client *client, const char *token, GError **error);
     gboolean (*key_value)(struct sfz_parser_client *client, const char *key, const char *value);
+    // Optional, called for the main file and every included file, with the
+    // status of the file that is about to be read (NULL inside tar files)
+    void (*file_opened)(struct sfz_parser_client *client, const char *filename, const struct stat *st);
 };
 
 extern gboolean load_sfz(const char *name, struct cbox_tarfile *tarfile, struct sfz_parser_client *c, GError **error);
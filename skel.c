@@ -38,7 +38,9 @@ struct {name}_module
 {
     struct cbox_module module;
 
-    struct {name}_params *params, *old_params;
+    struct {name}_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
 };
 
 gboolean {name}_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
@@ -66,10 +68,13 @@ void {name}_process_event(struct cbox_module *module, const uint8_t *data, uint3
 void {name}_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct {name}_module *m = module->user_data;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct {name}_params *p = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
         // update calculated values
+        m->old_params_generation = generation;
     }
 }
 
@@ -89,7 +94,7 @@ MODULE_CREATE_FUNCTION({name})
     m->module.process_block = {name}_process_block;
     struct {name}_params *p = malloc(sizeof(struct {name}_params));
     m->params = p;
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     
     return &m->module;
 }
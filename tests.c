@@ -1,8 +1,22 @@
+#include "config-api.h"
 #include "module.h"
+#include "rt.h"
 #include "engine.h"
+#include "instr.h"
+#include "layer.h"
+#include "master.h"
+#include "pattern.h"
 #include "sampler.h"
+#include "sampler_impl.h"
+#include "scene.h"
+#include "seq.h"
 #include "sfzloader.h"
+#include "sfzparser.h"
 #include "tests.h"
+#include "workerpool.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static struct sampler_module *create_sampler_instance(struct test_env *env, const char *cfg_section, const char *instance_name)
 {
@@ -25,7 +39,7 @@ static int count_free_voices(struct test_env *env, struct sampler_module *m)
 {
     int count = 0;
     for (struct sampler_voice *v = m->voices_free; v; count++, v = v->next)
-        test_assert(count < MAX_SAMPLER_VOICES);
+        test_assert(count < (int)m->voice_count);
     return count;
 }
 
@@ -35,7 +49,7 @@ static int count_channel_voices_if(struct test_env *env, struct sampler_module *
     int count = 0;
     for (struct sampler_voice *v = c->voices_running; v; v = v->next)
     {
-        test_assert(count < MAX_SAMPLER_VOICES);
+        test_assert(count < (int)m->voice_count);
         count += cond_func ? (cond_func(v, user_data) ? 1 : 0) : 1;
     }
     return count;
@@ -51,7 +65,7 @@ static void verify_sampler_voices_if(struct test_env *env, struct sampler_module
         total += count;
     }
     if (!cond_func)
-        test_assert_equal(int, count_free_voices(env, m), MAX_SAMPLER_VOICES - total);
+        test_assert_equal(int, count_free_voices(env, m), (int)m->voice_count - total);
 }
 
 static void verify_sampler_voices(struct test_env *env, struct sampler_module *m, int voices[16])
@@ -235,6 +249,1115 @@ void test_sampler_note_basic(struct test_env *env)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void send_midi(struct sampler_module *m, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    uint8_t midi_data[3] = { status, data1, data2 };
+    m->module.process_event(&m->module, midi_data, sizeof(midi_data));
+}
+
+static struct sampler_voice *find_mpe_voice(struct sampler_module *m, int member)
+{
+    for (struct sampler_voice *v = m->channels[0].voices_running; v; v = v->next)
+    {
+        if (v->expression == &m->channels[member].expression)
+            return v;
+    }
+    return NULL;
+}
+
+void test_sampler_mpe(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_setup", "smp1");
+    struct sampler_program *prg = load_sfz_into_sampler(env, m,
+        "<region> sample=*saw loop_mode=loop_continuous\n");
+
+    // MPE Configuration Message: lower zone with 3 member channels
+    send_midi(m, 0xB0, 101, 0);
+    send_midi(m, 0xB0, 100, 6);
+    send_midi(m, 0xB0, 6, 3);
+    test_assert_equal(int, m->mpe_members[0], 3);
+    test_assert(m->channels[3].mpe_master == &m->channels[0]);
+    test_assert(!m->channels[4].mpe_master);
+
+    // The same note on two member channels, played by the master channel
+    send_midi(m, 0x91, 60, 100);
+    send_midi(m, 0x92, 60, 100);
+    int expected_voices[16] = {[0] = 2};
+    verify_sampler_voices(env, m, expected_voices);
+    struct sampler_voice *v1 = find_mpe_voice(m, 1), *v2 = find_mpe_voice(m, 2);
+    test_assert(v1 && v2);
+
+    // Per-note expression only affects the voice of its own member channel
+    send_midi(m, 0xE1, 127, 127);
+    send_midi(m, 0xD2, 90, 0);
+    send_midi(m, 0xB2, 74, 127);
+    test_assert(fabs(sampler_channel_get_expensive_cc(&m->channels[0], v1, NULL, smsrc_pitchbend) - 1.f) < 0.001);
+    test_assert(fabs(sampler_channel_get_expensive_cc(&m->channels[0], v2, NULL, smsrc_pitchbend)) < 0.001);
+    test_assert(fabs(sampler_channel_get_expensive_cc(&m->channels[0], v2, NULL, smsrc_chanaft_sfz2) - 90 / 127.0) < 0.001);
+    test_assert(fabs(sampler_channel_get_expensive_cc(&m->channels[0], v1, NULL, smsrc_chanaft_sfz2)) < 0.001);
+    test_assert(fabs(sampler_channel_getcc(&m->channels[0], v2, 74) - 1.f) < 0.001);
+    test_assert(fabs(sampler_channel_getcc(&m->channels[0], v1, 74) - 64 / 127.f) < 0.001);
+    test_assert_equal(int, m->channels[0].pitchwheel, 0);
+
+    // Note off on one member channel releases only that member's note
+    send_midi(m, 0x81, 60, 0);
+    test_assert(v1->released);
+    test_assert(!v2->released);
+
+    // An upper zone using 14 member channels leaves no room for the lower one
+    sampler_set_mpe_zone(m, 1, 14);
+    test_assert_equal(int, m->mpe_members[0], 0);
+    test_assert(m->channels[1].mpe_master == &m->channels[15]);
+    test_assert(!m->channels[0].mpe_master);
+
+    sampler_unselect_program(m, prg);
+    CBOX_DELETE(prg);
+    CBOX_DELETE(&m->module);
+}
+
+void test_sampler_mpe_zone_change(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_setup", "smp1");
+    struct sampler_program *prg = load_sfz_into_sampler(env, m,
+        "<region> sample=*saw loop_mode=loop_continuous\n");
+
+    sampler_set_mpe_zone(m, 0, 3);
+    send_midi(m, 0x91, 60, 100);
+    send_midi(m, 0x92, 62, 100);
+    send_midi(m, 0x93, 64, 100);
+    int expected_voices[16] = {[0] = 3};
+    verify_sampler_voices(env, m, expected_voices);
+    struct sampler_voice *v1 = find_mpe_voice(m, 1), *v2 = find_mpe_voice(m, 2), *v3 = find_mpe_voice(m, 3);
+    test_assert(v1 && v2 && v3);
+
+    // Shrinking the zone while notes are held releases the notes of the
+    // channels that are no longer members, and keeps the others
+    sampler_set_mpe_zone(m, 0, 1);
+    test_assert(!m->channels[2].mpe_master);
+    test_assert(v2->released);
+    test_assert(v3->released);
+    test_assert(!v1->released);
+
+    // The former members' note offs are now ordinary channel events
+    send_midi(m, 0x82, 62, 0);
+    send_midi(m, 0x83, 64, 0);
+    test_assert(!v1->released);
+
+    // Moving the remaining member to the upper zone releases its note too
+    sampler_set_mpe_zone(m, 1, 14);
+    test_assert(m->channels[1].mpe_master == &m->channels[15]);
+    test_assert(v1->released);
+
+    sampler_unselect_program(m, prg);
+    CBOX_DELETE(prg);
+    CBOX_DELETE(&m->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_sampler_batch_render(struct test_env *env)
+{
+    static const char *sfz_data =
+        "<region> sample=*saw loop_mode=loop_continuous hikey=59 cutoff=2000 fil_type=lpf_4p eq1_gain=6 eq1_freq=1000\n"
+        "<region> sample=*sqr loop_mode=loop_continuous lokey=60 cutoff=500 fil_type=lpf_6p cutoff2=3000 fil2_type=hpf_2p\n"
+        "<region> sample=*sine loop_mode=loop_continuous lokey=72\n";
+    env->engine->io_env.srate = 44100;
+    cbox_config_set_int("test_batch", "batch_render", 1);
+    struct sampler_module *m1 = create_sampler_instance(env, "test_setup", "smp1");
+    struct sampler_module *m2 = create_sampler_instance(env, "test_batch", "smp2");
+    test_assert(!m1->batch);
+    test_assert(m2->batch);
+    struct sampler_program *prg1 = load_sfz_into_sampler(env, m1, sfz_data);
+    struct sampler_program *prg2 = load_sfz_into_sampler(env, m2, sfz_data);
+
+    for (int i = 0; i < 8; ++i)
+    {
+        uint8_t midi_data[3] = { 0x90, 48 + 5 * i, 100 };
+        m1->module.process_event(&m1->module, midi_data, sizeof(midi_data));
+        m2->module.process_event(&m2->module, midi_data, sizeof(midi_data));
+    }
+    float buf1[2][CBOX_BLOCK_SIZE], buf2[2][CBOX_BLOCK_SIZE];
+    cbox_sample_t *outputs1[2] = { buf1[0], buf1[1] }, *outputs2[2] = { buf2[0], buf2[1] };
+    for (int block = 0; block < 64; ++block)
+    {
+        m1->module.process_block(&m1->module, NULL, outputs1);
+        m2->module.process_block(&m2->module, NULL, outputs2);
+        for (int c = 0; c < 2; ++c)
+        {
+            for (int i = 0; i < CBOX_BLOCK_SIZE; ++i)
+                test_assert(fabs(buf1[c][i] - buf2[c][i]) < 0.0001);
+        }
+    }
+    test_assert_equal(int, m1->active_voices, m2->active_voices);
+
+    sampler_unselect_program(m1, prg1);
+    sampler_unselect_program(m2, prg2);
+    CBOX_DELETE(prg1);
+    CBOX_DELETE(prg2);
+    CBOX_DELETE(&m1->module);
+    CBOX_DELETE(&m2->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_fast_math(struct test_env *env)
+{
+    double max_err = 0;
+    for (float x = -126; x <= 127; x += 1.0 / 1024)
+        max_err = fmax(max_err, fabs(cbox_fast_exp2f(x) / exp2(x) - 1));
+    test_assert(max_err < 2e-7);
+    max_err = 0;
+    for (float x = -M_PI / 4; x <= M_PI / 4; x += 1.0 / 65536)
+    {
+        if (x != 0)
+            max_err = fmax(max_err, fabs(cbox_fast_tanf(x) / tan(x) - 1));
+    }
+    test_assert(max_err < 3e-7);
+    // Same frequency range as the sampler filters use
+    for (float freq = 20; freq <= 0.45 * 44100; freq *= 1.01)
+    {
+        struct cbox_sincos sc;
+        cbox_sincos_from_freq(&sc, freq, 44100);
+        double omega = 2 * M_PI * freq / 44100;
+        test_assert(fabs(sc.sine - sin(omega)) < 1e-5);
+        test_assert(fabs(sc.cosine - cos(omega)) < 1e-5);
+        test_assert(fabs(sc.prewarp / (2 * tan(omega / 8)) - 1) < 1e-5);
+    }
+}
+
+// Benchmarks of the approximations against the libm functions, run with
+// "calfbox_tests --bench". They only print the timings, there is nothing to
+// pass or fail.
+
+#define BENCH_FAST_MATH_COUNT 10000000
+
+static float bench_libm_sincos_from_freq(float freq)
+{
+    float w = 2 * M_PI * freq / 44100;
+    return sinf(w) + cosf(w) + 2 * tanf(w / 8);
+}
+
+static float bench_fast_sincos_from_freq(float freq)
+{
+    struct cbox_sincos sc;
+    cbox_sincos_from_freq(&sc, freq, 44100);
+    return sc.sine + sc.cosine + sc.prewarp;
+}
+
+#define BENCH_FUNC(func, lo, hi) \
+    do { \
+        float acc = 0, step = ((hi) - (lo)) / BENCH_FAST_MATH_COUNT; \
+        int64_t start = g_get_monotonic_time(); \
+        for (int i = 0; i < BENCH_FAST_MATH_COUNT; i++) \
+            acc += func((lo) + i * step); \
+        int64_t end = g_get_monotonic_time(); \
+        printf("\n    %-28s %6.2f ns/call", #func, (end - start) * 1000.0 / BENCH_FAST_MATH_COUNT); \
+        sink += acc; \
+    } while(0)
+
+void bench_fast_math(struct test_env *env)
+{
+    // keeps the compiler from dropping the loops
+    volatile float sink = 0;
+    BENCH_FUNC(exp2f, -20.f, 20.f);
+    BENCH_FUNC(cbox_fast_exp2f, -20.f, 20.f);
+    BENCH_FUNC(tanf, (float)-M_PI / 4, (float)M_PI / 4);
+    BENCH_FUNC(cbox_fast_tanf, (float)-M_PI / 4, (float)M_PI / 4);
+    BENCH_FUNC(bench_libm_sincos_from_freq, 20.f, 0.45f * 44100);
+    BENCH_FUNC(bench_fast_sincos_from_freq, 20.f, 0.45f * 44100);
+    printf("\n");
+    (void)sink;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_biquad_cascade(struct test_env *env)
+{
+    struct cbox_biquadf_coeffs coeffs[SAMPLER_BATCH_MAX_STAGES];
+    struct cbox_biquadf_state left[2][SAMPLER_BATCH_MAX_STAGES] = {}, right[2][SAMPLER_BATCH_MAX_STAGES] = {};
+    struct cbox_biquadf_stage stages[SAMPLER_BATCH_MAX_STAGES];
+    for (int j = 0; j < SAMPLER_BATCH_MAX_STAGES; j++)
+    {
+        if (j % 3 == 2)
+            cbox_biquadf_set_peakeq_rbj(&coeffs[j], 300 + 700 * j, 0.7, 2, 44100);
+        else
+            cbox_biquadf_set_lp_rbj(&coeffs[j], 500 + 400 * j, 0.7 + 0.5 * j, 44100);
+        stages[j] = (struct cbox_biquadf_stage){ &coeffs[j], &left[1][j], &right[1][j] };
+    }
+    // Every stage count goes through a different combination of fused passes
+    for (int num_stages = 1; num_stages <= SAMPLER_BATCH_MAX_STAGES; num_stages++)
+    {
+        for (int block = 0; block < 8; block++)
+        {
+            float expected[2 * CBOX_BLOCK_SIZE], actual[2 * CBOX_BLOCK_SIZE];
+            for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i++)
+                expected[i] = actual[i] = ((block * 2 * CBOX_BLOCK_SIZE + i) % 13) / 6.0 - 1;
+            for (int j = 0; j < num_stages; j++)
+                cbox_biquadf_process_stereo(&left[0][j], &right[0][j], &coeffs[j], expected);
+            cbox_biquadf_process_stereo_cascade(stages, num_stages, actual);
+            for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i++)
+                test_assert(fabs(expected[i] - actual[i]) < 0.0001);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_sampler_filter_control_period(struct test_env *env)
+{
+    env->engine->io_env.srate = 96000;
+    cbox_config_set_int("test_filter_control", "filter_control_period", 4 * CBOX_BLOCK_SIZE);
+    struct sampler_module *m1 = create_sampler_instance(env, "test_setup", "smp1");
+    struct sampler_module *m2 = create_sampler_instance(env, "test_filter_control", "smp2");
+    test_assert_equal(uint32_t, m1->filter_control_blocks, 2);
+    test_assert_equal(uint32_t, m2->filter_control_blocks, 4);
+
+    struct sampler_program *prg = load_sfz_into_sampler(env, m2,
+        "<region> sample=*saw loop_mode=loop_continuous cutoff=500 fileg_depth=2400 fileg_attack=0.05\n");
+    uint8_t midi_data[3] = { 0x90, 60, 100 };
+    m2->module.process_event(&m2->module, midi_data, sizeof(midi_data));
+    struct sampler_voice *v = m2->channels[0].voices_running;
+    test_assert(v);
+
+    float buf[2][CBOX_BLOCK_SIZE];
+    cbox_sample_t *outputs[2] = { buf[0], buf[1] };
+    struct cbox_biquadf_coeffs last_target = {0};
+    for (uint32_t block = 0; block < 32; ++block)
+    {
+        m2->module.process_block(&m2->module, NULL, outputs);
+        // Coefficients are set directly on the first block of the voice, then
+        // recalculated every 4 blocks and reached by the end of each ramp
+        test_assert_equal(uint32_t, v->filter.ramp_blocks, block ? 3 - (block - 1) % 4 : 0);
+        if (!v->filter.ramp_blocks)
+        {
+            test_assert(!memcmp(&v->filter.filter_coeffs, &v->filter.target_coeffs, sizeof(struct cbox_biquadf_coeffs)));
+        }
+        else if (v->filter.ramp_blocks == 3)
+        {
+            // the filter EG is in the attack phase, so the cutoff keeps rising
+            if (block > 1)
+                test_assert(memcmp(&last_target, &v->filter.target_coeffs, sizeof(struct cbox_biquadf_coeffs)));
+            last_target = v->filter.target_coeffs;
+        }
+    }
+
+    sampler_unselect_program(m2, prg);
+    CBOX_DELETE(prg);
+    CBOX_DELETE(&m1->module);
+    CBOX_DELETE(&m2->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_sampler_parallel_render(struct test_env *env)
+{
+    static const char *sfz_data =
+        "<region> sample=*saw loop_mode=loop_continuous hikey=59 cutoff=2000 fil_type=lpf_4p eq1_gain=6 eq1_freq=1000\n"
+        "<region> sample=*sqr loop_mode=loop_continuous lokey=60 cutoff=500 fil_type=lpf_6p ampeg_release=0.01\n";
+    env->engine->io_env.srate = 44100;
+    cbox_config_set_int("test_parallel", "voice_threads", 3);
+    struct sampler_module *m1 = create_sampler_instance(env, "test_setup", "smp1");
+    struct sampler_module *m2 = create_sampler_instance(env, "test_parallel", "smp2");
+    test_assert(!m1->parallel);
+    test_assert(m2->parallel);
+    struct sampler_program *prg1 = load_sfz_into_sampler(env, m1, sfz_data);
+    struct sampler_program *prg2 = load_sfz_into_sampler(env, m2, sfz_data);
+
+    for (int i = 0; i < 24; ++i)
+    {
+        uint8_t midi_data[3] = { 0x90, 36 + 2 * i, 100 };
+        m1->module.process_event(&m1->module, midi_data, sizeof(midi_data));
+        m2->module.process_event(&m2->module, midi_data, sizeof(midi_data));
+    }
+    float buf1[2][CBOX_BLOCK_SIZE], buf2[2][CBOX_BLOCK_SIZE];
+    cbox_sample_t *outputs1[2] = { buf1[0], buf1[1] }, *outputs2[2] = { buf2[0], buf2[1] };
+    for (int block = 0; block < 256; ++block)
+    {
+        // Release the upper notes half way through, so that some of the
+        // voices finish while rendered on the helper threads
+        if (block == 128)
+        {
+            for (int i = 12; i < 24; ++i)
+            {
+                uint8_t midi_data[3] = { 0x80, 36 + 2 * i, 0 };
+                m1->module.process_event(&m1->module, midi_data, sizeof(midi_data));
+                m2->module.process_event(&m2->module, midi_data, sizeof(midi_data));
+            }
+        }
+        m1->module.process_block(&m1->module, NULL, outputs1);
+        m2->module.process_block(&m2->module, NULL, outputs2);
+        for (int c = 0; c < 2; ++c)
+        {
+            for (int i = 0; i < CBOX_BLOCK_SIZE; ++i)
+                test_assert(fabs(buf1[c][i] - buf2[c][i]) < 0.0001);
+        }
+        test_assert_equal(int, m1->active_voices, m2->active_voices);
+    }
+    test_assert_equal(int, m2->active_voices, 12);
+    test_assert_equal(int, count_free_voices(env, m2), (int)m2->voice_count - 12);
+
+    sampler_unselect_program(m1, prg1);
+    sampler_unselect_program(m2, prg2);
+    CBOX_DELETE(prg1);
+    CBOX_DELETE(prg2);
+    CBOX_DELETE(&m1->module);
+    CBOX_DELETE(&m2->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define RT_QUEUE_TEST_THREADS 4
+#define RT_QUEUE_TEST_ITERATIONS 2000
+
+struct rt_queue_test_state
+{
+    struct cbox_rt *rt;
+    volatile gboolean stop;
+    int executed; // only modified by the fake RT thread
+    volatile int cleaned_up;
+    void *slots[RT_QUEUE_TEST_THREADS];
+    gboolean failed;
+};
+
+static int rt_queue_test_execute(void *user_data)
+{
+    struct rt_queue_test_state *s = user_data;
+    s->executed++;
+    return 1;
+}
+
+static void rt_queue_test_cleanup(void *user_data)
+{
+    struct rt_queue_test_state *s = user_data;
+    __sync_fetch_and_add(&s->cleaned_up, 1);
+}
+
+static void *rt_queue_test_rt_thread(void *user_data)
+{
+    struct rt_queue_test_state *s = user_data;
+    while(!s->stop)
+    {
+        cbox_rt_handle_rt_commands(s->rt);
+        usleep(100);
+    }
+    return NULL;
+}
+
+struct rt_queue_test_producer
+{
+    struct rt_queue_test_state *state;
+    int index;
+};
+
+static void *rt_queue_test_producer_thread(void *user_data)
+{
+    static struct cbox_rt_cmd_definition def = { NULL, rt_queue_test_execute, rt_queue_test_cleanup };
+    struct rt_queue_test_producer *p = user_data;
+    struct rt_queue_test_state *s = p->state;
+    for (intptr_t i = 1; i <= RT_QUEUE_TEST_ITERATIONS; ++i)
+    {
+        if (i % 4)
+            cbox_rt_execute_cmd_async(s->rt, &def, s);
+        else if (cbox_rt_swap_pointers(s->rt, &s->slots[p->index], (void *)i) != (void *)(i - 4))
+            s->failed = TRUE;
+        cbox_rt_handle_cmd_queue(s->rt);
+    }
+    return NULL;
+}
+
+void test_midi_buffer_growth(struct test_env *env)
+{
+    struct cbox_midi_arena arena;
+    struct cbox_midi_buffer fixed, grown;
+    uint8_t sysex[300];
+    cbox_midi_arena_init(&arena, 65536);
+    cbox_midi_buffer_init(&fixed);
+    cbox_midi_buffer_init(&grown);
+    cbox_midi_buffer_set_arena(&grown, &arena);
+    for (uint32_t i = 0; i < sizeof(sysex); i++)
+        sysex[i] = i & 127;
+    sysex[0] = 0xF0;
+    // Dense controller stream with a few long events in between
+    for (int i = 0; i < 1000; i++)
+    {
+        if (i % 250 == 100)
+        {
+            cbox_midi_buffer_write_event(&fixed, i, sysex, sizeof(sysex));
+            test_assert(cbox_midi_buffer_write_event(&grown, i, sysex, sizeof(sysex)));
+        }
+        else
+        {
+            cbox_midi_buffer_write_inline(&fixed, i, 0xB0, 1, i & 127);
+            test_assert(cbox_midi_buffer_write_inline(&grown, i, 0xB0, 1, i & 127));
+        }
+    }
+    // The sysex events don't fit in the inline long data array at all
+    test_assert_equal(uint32_t, fixed.count, CBOX_MIDI_MAX_EVENTS);
+    test_assert_equal(uint32_t, fixed.dropped, 1000 - CBOX_MIDI_MAX_EVENTS);
+    test_assert_equal(uint32_t, grown.count, 1000);
+    test_assert_equal(uint32_t, grown.dropped, 0);
+    for (uint32_t i = 0; i < grown.count; i++)
+    {
+        const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&grown, i);
+        const uint8_t *data = cbox_midi_event_get_data(event);
+        test_assert_equal(uint32_t, event->time, i);
+        if (i % 250 == 100)
+        {
+            test_assert_equal(uint32_t, event->size, sizeof(sysex));
+            test_assert(!memcmp(data, sysex, sizeof(sysex)));
+        }
+        else
+        {
+            test_assert_equal(uint32_t, event->size, 3);
+            test_assert_equal(int, data[2], i & 127);
+        }
+    }
+
+    // Pass-through of a single active input, merging of several
+    struct cbox_midi_merger merger;
+    struct cbox_midi_buffer empty;
+    cbox_midi_buffer_init(&empty);
+    cbox_midi_merger_init(&merger, &fixed);
+    cbox_midi_merger_connect(&merger, &grown, NULL, NULL);
+    cbox_midi_merger_connect(&merger, &empty, NULL, NULL);
+    test_assert(cbox_midi_merger_render_view(&merger) == &grown);
+    test_assert_equal(uint32_t, fixed.count, 0);
+    cbox_midi_buffer_write_inline(&empty, 5, 0x90, 60, 100);
+    const struct cbox_midi_buffer *merged = cbox_midi_merger_render_view(&merger);
+    test_assert(merged == &fixed);
+    test_assert_equal(uint32_t, merged->count, CBOX_MIDI_MAX_EVENTS);
+    int note_ons = 0;
+    for (uint32_t i = 0; i < merged->count; i++)
+    {
+        const struct cbox_midi_event *event = cbox_midi_buffer_get_event(merged, i);
+        if (i)
+            test_assert(event->time >= cbox_midi_buffer_get_event(merged, i - 1)->time);
+        if (cbox_midi_event_get_data(event)[0] == 0x90)
+        {
+            test_assert_equal(uint32_t, event->time, 5);
+            note_ons++;
+        }
+    }
+    test_assert_equal(int, note_ons, 1);
+    cbox_midi_merger_close(&merger, NULL);
+
+    // Running out of arena space counts as a drop too
+    cbox_midi_arena_reset(&arena);
+    cbox_midi_buffer_clear(&grown);
+    uint32_t dropped = grown.dropped;
+    for (int i = 0; i < 10000; i++)
+        cbox_midi_buffer_write_inline(&grown, i, 0xB0, 1, i & 127);
+    test_assert(grown.count < 10000);
+    test_assert_equal(uint32_t, grown.dropped - dropped, 10000 - grown.count);
+    test_assert(arena.failed_allocs > 0);
+    cbox_midi_arena_destroy(&arena);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_engine_midi_arena_size(struct test_env *env)
+{
+    static const struct { int setting, size; } cases[] = {
+        { 4096, 4096 },
+        { 0, 0 },
+        { -1, 0 },
+        { 0x7FFFFFFF, CBOX_MIDI_ARENA_MAX_SIZE },
+    };
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        cbox_config_set_int("io", "midi_arena_size", cases[i].setting);
+        struct cbox_engine *engine = cbox_engine_new(env->doc, NULL);
+        test_assert_equal(int, engine->midi_arena.size, cases[i].size);
+        test_assert((engine->midi_arena.data != NULL) == (cases[i].size != 0));
+        CBOX_DELETE(engine);
+    }
+    cbox_config_remove_key("io", "midi_arena_size");
+}
+
+struct engine_status_result
+{
+    int midi_dropped, midi_arena_failed_allocs;
+};
+
+static gboolean engine_status_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
+{
+    struct engine_status_result *result = ct->user_data;
+    if (!strcmp(cmd->command, "/midi_dropped"))
+        result->midi_dropped = CBOX_ARG_I(cmd, 0);
+    else if (!strcmp(cmd->command, "/midi_arena_failed_allocs"))
+        result->midi_arena_failed_allocs = CBOX_ARG_I(cmd, 0);
+    return TRUE;
+}
+
+static struct engine_status_result get_engine_status(struct test_env *env)
+{
+    struct engine_status_result result = { -1, -1 };
+    struct cbox_command_target fb;
+    cbox_command_target_init(&fb, engine_status_process_cmd, &result);
+    GError *error = NULL;
+    test_assert(cbox_execute_on(&env->engine->cmd_target, &fb, "/status", "", &error));
+    test_assert_no_error(error);
+    return result;
+}
+
+void test_engine_midi_dropped(struct test_env *env)
+{
+    struct cbox_engine *engine = env->engine;
+    struct engine_status_result result = get_engine_status(env);
+    test_assert_equal(int, result.midi_dropped, 0);
+    test_assert_equal(int, result.midi_arena_failed_allocs, 0);
+
+    // Drops in the track outputs of the song and in the ad-hoc patterns
+    // count too
+    struct cbox_track_playback track = {0};
+    struct cbox_track_playback *tracks[1] = { &track };
+    struct cbox_song_playback spb = { .tracks = tracks, .track_count = 1 };
+    struct cbox_scene *scene = cbox_scene_new(env->doc, engine);
+    test_assert(scene);
+    struct cbox_adhoc_pattern ap = {0};
+    engine->midibuf_aux.dropped = 1;
+    track.output_buffer.dropped = 2;
+    ap.output_buffer.dropped = 4;
+    engine->spb = &spb;
+    scene->adhoc_patterns = &ap;
+    engine->midi_arena.failed_allocs = 5;
+    result = get_engine_status(env);
+    engine->spb = NULL;
+    scene->adhoc_patterns = NULL;
+    test_assert_equal(int, result.midi_dropped, 7);
+    test_assert_equal(int, result.midi_arena_failed_allocs, 5);
+
+    CBOX_DELETE(scene);
+}
+
+static void check_merger_order(struct test_env *env, int source_count)
+{
+    struct cbox_midi_arena arena;
+    struct cbox_midi_buffer output;
+    struct cbox_midi_buffer *inputs = calloc(source_count, sizeof(struct cbox_midi_buffer));
+    struct cbox_midi_merger merger;
+    cbox_midi_arena_init(&arena, 65536);
+    cbox_midi_buffer_init(&output);
+    cbox_midi_buffer_set_arena(&output, &arena);
+    cbox_midi_merger_init(&merger, &output);
+    for (int k = 0; k < source_count; k++)
+    {
+        cbox_midi_buffer_init(&inputs[k]);
+        for (int j = 0; j < 6; j++)
+            cbox_midi_buffer_write_inline(&inputs[k], j * (k % 5 + 1), 0xB0, k, j);
+        cbox_midi_merger_connect(&merger, &inputs[k], NULL, NULL);
+    }
+    // Rendering twice makes sure the streaming inputs are rewound
+    for (int pass = 0; pass < 2; pass++)
+    {
+        cbox_midi_merger_render(&merger);
+        test_assert_equal(uint32_t, output.count, 6 * source_count);
+        for (uint32_t i = 1; i < output.count; i++)
+        {
+            const struct cbox_midi_event *prev = cbox_midi_buffer_get_event(&output, i - 1);
+            const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&output, i);
+            test_assert(prev->time <= event->time);
+            // Simultaneous events come in the input list order, and the
+            // inputs are added at the start of the list
+            if (prev->time == event->time)
+                test_assert(cbox_midi_event_get_data(prev)[1] > cbox_midi_event_get_data(event)[1]);
+        }
+    }
+    cbox_midi_merger_close(&merger, NULL);
+    cbox_midi_arena_destroy(&arena);
+    free(inputs);
+}
+
+void test_midi_merger_order(struct test_env *env)
+{
+    // Heap based merge, and the linear fallback for many active inputs
+    check_merger_order(env, 10);
+    check_merger_order(env, CBOX_MIDI_MERGER_HEAP_SIZE + 6);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_seq_seek(struct test_env *env)
+{
+    struct cbox_master *master = env->engine->master;
+    uint32_t ppqn = master->ppqn_factor;
+    int old_srate = master->srate;
+    master->srate = 44100;
+
+    // A tempo map with a tempo change every bar
+    struct cbox_song_playback spb = {0};
+    spb.tempo_map_item_count = 50;
+    spb.tempo_map_items = calloc(spb.tempo_map_item_count, sizeof(struct cbox_tempo_map_item));
+    uint32_t pos_ppqn = 0, pos_samples = 0;
+    for (int i = 0; i < spb.tempo_map_item_count; ++i)
+    {
+        struct cbox_tempo_map_item *tmi = &spb.tempo_map_items[i];
+        tmi->time_ppqn = pos_ppqn;
+        tmi->time_samples = pos_samples;
+        tmi->tempo = 90 + 7 * (i % 9);
+        pos_ppqn += 4 * ppqn;
+        pos_samples += master->srate * 60.0 * 4 * ppqn / (tmi->tempo * ppqn);
+    }
+    for (uint32_t t = 0; t < pos_ppqn + 8 * ppqn; t += ppqn / 4)
+    {
+        int expected = 0;
+        while (expected + 1 < spb.tempo_map_item_count && spb.tempo_map_items[expected + 1].time_ppqn <= t)
+            expected++;
+        test_assert_equal(int, cbox_song_playback_tmi_from_ppqn(&spb, t), expected);
+    }
+    for (uint32_t t = 0; t < pos_samples + 100000; t += 997)
+    {
+        int expected = 0;
+        while (expected + 1 < spb.tempo_map_item_count && spb.tempo_map_items[expected + 1].time_samples <= t)
+            expected++;
+        test_assert_equal(int, cbox_song_playback_tmi_from_samples(&spb, t), expected);
+    }
+
+    // Seeking within a clip that starts at bar 3 and skips the first bar of the pattern
+    struct cbox_midi_event events[3000];
+    for (uint32_t i = 0; i < sizeof(events) / sizeof(events[0]); ++i)
+    {
+        events[i].time = i * ppqn / 16;
+        events[i].size = 3;
+        events[i].data_inline[0] = (i & 1) ? 0x80 : 0x90;
+        events[i].data_inline[1] = 36 + (i >> 1) % 48;
+        events[i].data_inline[2] = 100;
+    }
+    struct cbox_midi_pattern pattern = { .events = events, .event_count = sizeof(events) / sizeof(events[0]) };
+    struct cbox_song_playback *old_spb = master->spb;
+    master->spb = &spb;
+    struct cbox_midi_pattern_playback *mppb = cbox_midi_pattern_playback_new(&pattern);
+    struct cbox_midi_clip_playback pb;
+    cbox_midi_clip_playback_init(&pb, NULL, master);
+    uint32_t item_start = 8 * ppqn, offset = 4 * ppqn, length = events[pattern.event_count - 1].time - offset;
+    uint32_t start_samples = cbox_master_ppqn_to_samples(master, item_start);
+    uint32_t end_samples = cbox_master_ppqn_to_samples(master, item_start + length);
+    cbox_midi_clip_playback_set_pattern(&pb, mppb, start_samples, end_samples, item_start, offset);
+    for (uint32_t t = 0; t < length; t += ppqn / 8 + 1)
+    {
+        cbox_midi_clip_playback_seek_ppqn(&pb, t, item_start + t);
+        uint32_t expected = 0;
+        while (expected < pattern.event_count && events[expected].time < t + offset)
+            expected++;
+        test_assert_equal(int, pb.pos, expected);
+    }
+    for (uint32_t t = 0; t < end_samples - start_samples; t += 1009)
+    {
+        cbox_midi_clip_playback_seek_samples(&pb, t, 0);
+        uint32_t expected = 0;
+        while (expected < pattern.event_count && (events[expected].time < offset ||
+            cbox_master_ppqn_to_samples(master, item_start + events[expected].time - offset) < start_samples + t))
+            expected++;
+        test_assert_equal(int, pb.pos, expected);
+        test_assert_equal(int, pb.rel_time_samples, t);
+    }
+    master->spb = old_spb;
+    master->srate = old_srate;
+    cbox_midi_pattern_playback_destroy(mppb);
+    free(spb.tempo_map_items);
+}
+
+void test_pattern_note_intervals(struct test_env *env)
+{
+    // Notes on two channels, with retriggers, note offs sent as note ons
+    // with zero velocity, and notes left hanging at the end
+    struct cbox_midi_event events[2000];
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < sizeof(events) / sizeof(events[0]); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 8;
+        events[i].time = 2 * i;
+        events[i].size = 3;
+        events[i].data_inline[0] = ((r & 3) ? 0x90 : 0x80) | ((r >> 2) & 1) * 9;
+        events[i].data_inline[1] = 60 + (r >> 3) % 8;
+        events[i].data_inline[2] = ((r >> 6) & 3) ? 100 : 0;
+    }
+    struct cbox_midi_pattern pattern = { .events = events, .event_count = sizeof(events) / sizeof(events[0]) };
+    struct cbox_midi_pattern_playback *mppb = cbox_midi_pattern_playback_new(&pattern);
+    for (uint32_t t = 1; t < 2 * pattern.event_count + 10; t += 2)
+    {
+        for (uint32_t c = 0; c < 16; c += 9)
+        {
+            for (uint32_t n = 59; n < 69; ++n)
+            {
+                // the note is held if its last event is a note on
+                gboolean expected = FALSE;
+                for (uint32_t i = 0; i < pattern.event_count && events[i].time <= t; ++i)
+                {
+                    if ((events[i].data_inline[0] & 0x0F) == c && events[i].data_inline[1] == n)
+                        expected = events[i].data_inline[0] >= 0x90 && events[i].data_inline[2] > 0;
+                }
+                test_assert_equal(int, cbox_midi_pattern_playback_is_note_active_at(mppb, t, c, n), expected);
+            }
+        }
+    }
+    cbox_midi_pattern_playback_destroy(mppb);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_rt_cmd_queue(struct test_env *env)
+{
+    struct rt_queue_test_state state = { .rt = cbox_rt_new(env->doc) };
+    struct rt_queue_test_producer producers[RT_QUEUE_TEST_THREADS];
+    pthread_t rt_thread, producer_threads[RT_QUEUE_TEST_THREADS];
+
+    // Pretend the RT thread is running, so that the commands go through the queue
+    state.rt->started = TRUE;
+    pthread_create(&rt_thread, NULL, rt_queue_test_rt_thread, &state);
+    for (int i = 0; i < RT_QUEUE_TEST_THREADS; ++i)
+    {
+        producers[i].state = &state;
+        producers[i].index = i;
+        pthread_create(&producer_threads[i], NULL, rt_queue_test_producer_thread, &producers[i]);
+    }
+    for (int i = 0; i < RT_QUEUE_TEST_THREADS; ++i)
+        pthread_join(producer_threads[i], NULL);
+    // Wait for the last async commands to be executed
+    while(state.executed < RT_QUEUE_TEST_THREADS * RT_QUEUE_TEST_ITERATIONS * 3 / 4)
+        usleep(1000);
+    state.stop = TRUE;
+    pthread_join(rt_thread, NULL);
+    cbox_rt_handle_cmd_queue(state.rt);
+    state.rt->started = FALSE;
+
+    test_assert(!state.failed);
+    test_assert_equal(int, state.executed, RT_QUEUE_TEST_THREADS * RT_QUEUE_TEST_ITERATIONS * 3 / 4);
+    test_assert_equal(int, state.cleaned_up, state.executed);
+    for (int i = 0; i < RT_QUEUE_TEST_THREADS; ++i)
+        test_assert(state.slots[i] == (void *)RT_QUEUE_TEST_ITERATIONS);
+    CBOX_DELETE(state.rt);
+}
+
+static int rt_batch_test_execute(void *user_data)
+{
+    int *value = user_data;
+    // each command checks that the previous one has already been executed
+    if (value[-1] == 0 || value[0] != 0)
+        return 1000;
+    value[0] = value[-1] + 1;
+    return 1;
+}
+
+void test_rt_cmd_batch(struct test_env *env)
+{
+    static struct cbox_rt_cmd_definition def = { NULL, rt_batch_test_execute, NULL };
+    struct rt_queue_test_state state = { .rt = cbox_rt_new(env->doc) };
+    pthread_t rt_thread;
+    int values[1001] = { 1 };
+    void *slot = NULL, *old_value = (void *)1;
+
+    state.rt->started = TRUE;
+    pthread_create(&rt_thread, NULL, rt_queue_test_rt_thread, &state);
+    // a budget of 10 spreads the batch over 100 periods
+    struct cbox_rt_batch *batch = cbox_rt_batch_new(state.rt, 10);
+    for (int i = 1; i <= 1000; ++i)
+        cbox_rt_batch_add(batch, &def, &values[i]);
+    cbox_rt_batch_swap_pointers(batch, &slot, values, &old_value);
+    cbox_rt_batch_execute_sync(batch);
+    state.stop = TRUE;
+    pthread_join(rt_thread, NULL);
+    state.rt->started = FALSE;
+
+    for (int i = 0; i <= 1000; ++i)
+        test_assert_equal(int, values[i], i + 1);
+    test_assert(slot == values);
+    test_assert(old_value == NULL);
+    CBOX_DELETE(state.rt);
+}
+
+static int count_retired_params(struct cbox_module *module)
+{
+    int count = 0;
+    for (struct cbox_module_retired_params *rp = module->retired_params; rp; rp = rp->next)
+        count++;
+    return count;
+}
+
+void test_module_publish_params(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_params", "smp1");
+    struct cbox_rt *rt = cbox_rt_new(env->doc);
+    void *params = malloc(16);
+
+    // Pretend the RT thread is running, without actually running it
+    m->module.rt = rt;
+    rt->started = TRUE;
+    for (int i = 0; i < 30; ++i)
+        cbox_module_publish_params(&m->module, &params, malloc(16));
+    // no period has started since, so the old blocks may still be in use
+    test_assert_equal(int, count_retired_params(&m->module), 30);
+    rt->epoch++;
+    cbox_module_publish_params(&m->module, &params, malloc(16));
+    test_assert_equal(int, count_retired_params(&m->module), 1);
+    rt->started = FALSE;
+    cbox_module_publish_params(&m->module, &params, malloc(16));
+    test_assert_equal(int, count_retired_params(&m->module), 0);
+
+    free(params);
+    m->module.rt = NULL;
+    CBOX_DELETE(rt);
+    CBOX_DELETE(&m->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void test_sampler_voice_pool(struct test_env *env)
+{
+    env->engine->io_env.srate = 44100;
+    cbox_config_set_int("test_pool", "polyphony", 400);
+    struct sampler_module *m = create_sampler_instance(env, "test_pool", "smp1");
+    test_assert_equal(int, m->max_voices, 400);
+    test_assert_equal(int, m->voice_count, 500);
+    // streaming pipes are only needed up to the polyphony limit
+    test_assert_equal(int, m->pipe_stack->pipe_count, 400);
+    struct sampler_program *prg = load_sfz_into_sampler(env, m, "<region> sample=*sine loop_mode=loop_continuous ampeg_release=0.1\n");
+    for (int c = 0; c < 16; ++c)
+        sampler_channel_set_program(&m->channels[c], prg);
+
+    // 16 channels x 30 notes, each block starts a new note
+    float buf[2][CBOX_BLOCK_SIZE];
+    cbox_sample_t *outputs[2] = { buf[0], buf[1] };
+    for (int i = 0; i < 480; ++i)
+    {
+        uint8_t midi_data[3] = { 0x90 + i % 16, 40 + i / 16, 100 };
+        m->module.process_event(&m->module, midi_data, sizeof(midi_data));
+        m->module.process_block(&m->module, NULL, outputs);
+        test_assert(m->active_voices <= (int)m->voice_count);
+    }
+    int serial_no = -1, playing = 0;
+    for (struct sampler_voice *v = m->oldest_voice; v; v = v->newer)
+    {
+        // the list is in start order, and only the oldest voices get stolen
+        test_assert(v->serial_no >= serial_no);
+        serial_no = v->serial_no;
+        if (v->amp_env.cur_stage != 15)
+            playing++;
+        else
+            test_assert(!v->older || v->older->amp_env.cur_stage == 15);
+    }
+    test_assert(playing <= m->max_voices + 1);
+    test_assert(m->active_voices > playing);
+
+    sampler_unselect_program(m, prg);
+    CBOX_DELETE(prg);
+    CBOX_DELETE(&m->module);
+}
+
+void test_prefetch_stack_adapt(struct test_env *env)
+{
+    struct cbox_prefetch_pipe pipes[2];
+    memset(pipes, 0, sizeof(pipes));
+    struct cbox_prefetch_stack stack;
+    memset(&stack, 0, sizeof(stack));
+    stack.pipes = pipes;
+    stack.pipe_count = 2;
+    stack.buffer_size = stack.initial_buffer_size = 65536;
+    stack.max_buffer_size = 200000;
+
+    // No stalls, no growth
+    cbox_prefetch_stack_adapt(&stack, 2000000);
+    test_assert_equal(int, stack.buffer_size, 65536);
+
+    pipes[0].stats.underruns++;
+    cbox_prefetch_stack_adapt(&stack, 2000000);
+    test_assert_equal(int, stack.buffer_size, 131072);
+
+    // Another stall within a second of the last growth is ignored...
+    pipes[1].stats.late_reads++;
+    cbox_prefetch_stack_adapt(&stack, 2500000);
+    test_assert_equal(int, stack.buffer_size, 131072);
+    // ... and so is a quiet pass after that second
+    cbox_prefetch_stack_adapt(&stack, 3500000);
+    test_assert_equal(int, stack.buffer_size, 131072);
+
+    // The size is capped at max_buffer_size
+    pipes[1].stats.late_reads++;
+    cbox_prefetch_stack_adapt(&stack, 3500000);
+    test_assert_equal(int, stack.buffer_size, 200000);
+    pipes[0].stats.underruns++;
+    cbox_prefetch_stack_adapt(&stack, 5000000);
+    test_assert_equal(int, stack.buffer_size, 200000);
+}
+
+static void init_scheduled_pipe(struct cbox_prefetch_pipe *pipe, enum cbox_prefetch_pipe_state state, uint32_t supply, float consumption_rate)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->state = state;
+    pipe->buffer_loop_end = 65536;
+    pipe->min_buffer_frames = 16384;
+    pipe->produced = 100000 + supply;
+    pipe->consumed = pipe->last_consumed = 100000;
+    pipe->consumption_rate = consumption_rate;
+}
+
+void test_prefetch_stack_schedule(struct test_env *env)
+{
+    struct cbox_prefetch_pipe pipes[6];
+    int queue[6];
+    struct cbox_prefetch_stack stack;
+    memset(&stack, 0, sizeof(stack));
+    stack.pipes = pipes;
+    stack.pipe_count = 6;
+    stack.queue = queue;
+
+    init_scheduled_pipe(&pipes[0], pps_active, 60000, 44100); // enough data buffered
+    init_scheduled_pipe(&pipes[1], pps_active, 1000, 44100);
+    init_scheduled_pipe(&pipes[2], pps_opening, 0, 0);
+    init_scheduled_pipe(&pipes[3], pps_active, 1000, 44100);
+    pipes[3].returned = TRUE;
+    init_scheduled_pipe(&pipes[4], pps_active, 20000, 44100);
+    init_scheduled_pipe(&pipes[5], pps_free, 0, 0);
+
+    // Opening first, then by time until the buffered data runs out, closing
+    // last
+    cbox_prefetch_stack_schedule(&stack, 0);
+    test_assert_equal(int, stack.queue_pos, 0);
+    test_assert_equal(int, stack.queue_len, 4);
+    test_assert_equal(int, queue[0], 2);
+    test_assert_equal(int, queue[1], 1);
+    test_assert_equal(int, queue[2], 4);
+    test_assert_equal(int, queue[3], 3);
+    test_assert_equal(int, pipes[3].state, pps_closing);
+    for (int i = 0; i < 6; i++)
+        test_assert_equal(int, pipes[i].busy, i >= 1 && i <= 4);
+
+    // The opening pipe has been taken by an I/O thread and is still being
+    // worked on; pipe 4 has been drained meanwhile, so it goes first now
+    stack.queue_pos = 1;
+    pipes[4].consumed += 19500;
+    cbox_prefetch_stack_schedule(&stack, 0);
+    test_assert_equal(int, stack.queue_pos, 0);
+    test_assert_equal(int, stack.queue_len, 3);
+    test_assert_equal(int, queue[0], 4);
+    test_assert_equal(int, queue[1], 1);
+    test_assert_equal(int, queue[2], 3);
+    test_assert(pipes[2].busy);
+
+    // Refilled while queued - no longer needs any I/O
+    pipes[1].produced += 50000;
+    cbox_prefetch_stack_schedule(&stack, 0);
+    test_assert_equal(int, stack.queue_len, 2);
+    test_assert_equal(int, queue[0], 4);
+    test_assert_equal(int, queue[1], 3);
+    test_assert(!pipes[1].busy);
+}
+
+struct streaming_stats_result
+{
+    int underruns, late_reads, reads, pipes;
+};
+
+static gboolean streaming_stats_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
+{
+    struct streaming_stats_result *result = ct->user_data;
+    if (!strcmp(cmd->command, "/underruns"))
+        result->underruns = CBOX_ARG_I(cmd, 0);
+    else if (!strcmp(cmd->command, "/late_reads"))
+        result->late_reads = CBOX_ARG_I(cmd, 0);
+    else if (!strcmp(cmd->command, "/reads"))
+        result->reads = CBOX_ARG_I(cmd, 0);
+    else if (!strcmp(cmd->command, "/pipe"))
+        result->pipes++;
+    return TRUE;
+}
+
+void test_sampler_streaming_stats(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_setup", "smp1");
+    struct cbox_prefetch_stack *stack = m->pipe_stack;
+    test_assert(stack->pipe_count >= 2);
+    stack->pipes[0].stats.underruns = 2;
+    stack->pipes[0].stats.reads = 10;
+    stack->pipes[1].stats.late_reads = 3;
+    stack->pipes[1].stats.reads = 5;
+
+    struct streaming_stats_result result = { 0, 0, 0, 0 };
+    struct cbox_command_target fb;
+    cbox_command_target_init(&fb, streaming_stats_process_cmd, &result);
+    GError *error = NULL;
+    test_assert(cbox_execute_on(&m->module.cmd_target, &fb, "/streaming_stats", "", &error));
+    test_assert_equal(int, result.pipes, 2);
+    test_assert_equal(int, result.underruns, 2);
+    test_assert_equal(int, result.late_reads, 3);
+    test_assert_equal(int, result.reads, 15);
+
+    CBOX_DELETE(&m->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct cbox_scene *create_scene_with_samplers(struct test_env *env, const char *prefix, int count, const char *sfz_data)
+{
+    GError *error = NULL;
+    struct cbox_scene *scene = cbox_scene_new(env->doc, env->engine);
+    test_assert(scene);
+    for (int i = 0; i < count; ++i)
+    {
+        gchar *name = g_strdup_printf("%s%d", prefix, i);
+        gchar *section = g_strdup_printf("instrument:%s", name);
+        cbox_config_set_string(section, "engine", "sampler");
+        struct cbox_layer *layer = cbox_layer_new_with_instrument(scene, name, &error);
+        test_assert_no_error(error);
+        test_assert(layer);
+        test_assert(cbox_scene_add_layer(scene, layer, &error));
+        test_assert_no_error(error);
+        struct sampler_module *m = (struct sampler_module *)layer->instrument->module;
+        load_sfz_into_sampler(env, m, sfz_data);
+        for (int j = 0; j < 4; ++j)
+        {
+            uint8_t midi_data[3] = { 0x90, 48 + 7 * i + 3 * j, 100 };
+            m->module.process_event(&m->module, midi_data, sizeof(midi_data));
+        }
+        g_free(section);
+        g_free(name);
+    }
+    return scene;
+}
+
+void test_scene_parallel_render(struct test_env *env)
+{
+    static const char *sfz_data =
+        "<region> sample=*saw loop_mode=loop_continuous hikey=59 cutoff=2000 fil_type=lpf_4p\n"
+        "<region> sample=*sqr loop_mode=loop_continuous lokey=60 cutoff=500 fil_type=lpf_2p\n";
+    env->engine->io_env.srate = 44100;
+    uint32_t nframes = env->engine->io_env.buffer_size;
+
+    struct cbox_scene *serial = create_scene_with_samplers(env, "ser", 5, sfz_data);
+    env->engine->render_pool = cbox_worker_pool_new(3, 0, FALSE);
+    test_assert(env->engine->render_pool);
+    struct cbox_scene *parallel = create_scene_with_samplers(env, "par", 5, sfz_data);
+    test_assert_equal(int, serial->instrument_count, 5);
+    test_assert_equal(int, parallel->instrument_count, 5);
+    test_assert(!serial->instruments[0]->render_buffers);
+    test_assert(parallel->instruments[0]->render_buffers);
+
+    float *buf1 = calloc(4 * nframes, sizeof(float));
+    float *buf2 = buf1 + 2 * nframes;
+    float *outputs1[2] = { buf1, buf1 + nframes }, *outputs2[2] = { buf2, buf2 + nframes };
+    float total = 0;
+    for (int block = 0; block < 16; ++block)
+    {
+        memset(buf1, 0, 4 * nframes * sizeof(float));
+        cbox_scene_render(serial, nframes, outputs1, 2);
+        cbox_scene_render(parallel, nframes, outputs2, 2);
+        // The mixing order is the same, so the result should be bit-exact
+        for (uint32_t i = 0; i < 2 * nframes; ++i)
+        {
+            test_assert(buf1[i] == buf2[i]);
+            total += fabs(buf1[i]);
+        }
+    }
+    test_assert(total > 0);
+    free(buf1);
+
+    CBOX_DELETE(serial);
+    CBOX_DELETE(parallel);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 struct region_logic_test_setup_step
 {
     const uint8_t *midi_data;
@@ -650,6 +1773,772 @@ REGION_LOGIC_TEST_SETUP(switches4,
     "<region>sw_lokey=8 sw_hikey=10 sw_default=10 sw_last=9 lokey=32 hikey=35 sample=*saw"
 );
 
+static gboolean sfz_parser_test_token(struct sfz_parser_client *client, const char *token, GError **error)
+{
+    g_string_append_printf(client->user_data, "<%s>", token);
+    return TRUE;
+}
+
+static gboolean sfz_parser_test_key_value(struct sfz_parser_client *client, const char *key, const char *value)
+{
+    g_string_append_printf(client->user_data, "%s=%s|", key, value);
+    return TRUE;
+}
+
+void test_sfz_parser(struct test_env *env)
+{
+    static const char *sfz =
+        "\xEF\xBB\xBF// comment\r\n"
+        "#define $VEL 64 // comment\n"
+        "<region> sample=foo bar.wav  lovel=$VEL // trailing\r\n"
+        "<group>key=c4<region>amp_velcurve_5=0.5\n"
+        "\tvalue_at_end=x y";
+    GString *out = g_string_new("");
+    struct sfz_parser_client c = { .user_data = out, .token = sfz_parser_test_token, .key_value = sfz_parser_test_key_value };
+    GError *error = NULL;
+
+    test_assert(load_sfz_from_string(sfz, strlen(sfz), &c, &error));
+    test_assert_no_error(error);
+    test_assert_equal_str(out->str, "<region>sample=foo bar.wav|lovel=64|<group>key=c4|<region>amp_velcurve_5=0.5|value_at_end=x y|");
+
+    // The same text loaded from a file, through an include
+    gchar *dir = g_dir_make_tmp("cbox-sfz-XXXXXX", NULL);
+    test_assert(dir);
+    gchar *inc_name = g_build_filename(dir, "inc.sfz", NULL);
+    gchar *main_name = g_build_filename(dir, "main.sfz", NULL);
+    test_assert(g_file_set_contents(inc_name, sfz, -1, NULL));
+    test_assert(g_file_set_contents(main_name, "<control>#include \"inc.sfz\"\n", -1, NULL));
+    g_string_truncate(out, 0);
+    test_assert(load_sfz(main_name, NULL, &c, &error));
+    test_assert_no_error(error);
+    test_assert_equal_str(out->str, "<control><region>sample=foo bar.wav|lovel=64|<group>key=c4|<region>amp_velcurve_5=0.5|value_at_end=x y|");
+    unlink(inc_name);
+    unlink(main_name);
+    rmdir(dir);
+    g_free(inc_name);
+    g_free(main_name);
+    g_free(dir);
+
+    test_assert(!load_sfz_from_string("<reg1on>", 8, &c, &error));
+    test_assert(error);
+    g_clear_error(&error);
+    test_assert(!load_sfz_from_string("#undef $X", 9, &c, &error));
+    test_assert(error);
+    g_clear_error(&error);
+    g_string_free(out, TRUE);
+
+    uint32_t args[10];
+    const struct sampler_layer_param_entry *e = sampler_layer_param_find("cutoff2_cc7", args);
+    test_assert(e);
+    test_assert_equal(uint32_t, args[0], 7);
+    test_assert(sampler_layer_param_find("cutoff_cc7", args) != e);
+    test_assert(sampler_layer_param_find("cutoff2_cc127", args) == e);
+    test_assert_equal(uint32_t, args[0], 127);
+    test_assert(sampler_layer_param_find("eq1_freq", args) != sampler_layer_param_find("eq2_freq", args));
+    test_assert(sampler_layer_param_find("eq1_freq", args) != NULL);
+    test_assert(sampler_layer_param_find("eq9_freq", args) == NULL);
+    test_assert(sampler_layer_param_find("no_such_opcode", args) == NULL);
+}
+
+static struct sampler_program *load_sfz_file_into_sampler(struct test_env *env, struct sampler_module *m, const char *name, int prog_no)
+{
+    GError *error = NULL;
+    struct sampler_program *prg = sampler_program_new(m, prog_no, name, NULL, "", &error);
+    test_assert(prg);
+    test_assert_no_error(error);
+    test_assert(sampler_module_load_program_sfz(m, prg, name, 0, &error));
+    test_assert_no_error(error);
+    return prg;
+}
+
+static void verify_same_programs(struct test_env *env, struct sampler_program *prg1, struct sampler_program *prg2)
+{
+    test_assert_equal(int, g_slist_length(prg1->all_layers), g_slist_length(prg2->all_layers));
+    test_assert_equal(int, g_slist_length(prg1->ctrl_init_list), g_slist_length(prg2->ctrl_init_list));
+    test_assert_equal(int, g_slist_length(prg1->ctrl_label_list), g_slist_length(prg2->ctrl_label_list));
+    test_assert_equal_str(prg1->sample_dir, prg2->sample_dir);
+    for (int i = 0; i < MAX_MIDI_CURVES; ++i)
+        test_assert((prg1->curves[i] != NULL) == (prg2->curves[i] != NULL));
+    for (GSList *p = prg1->all_layers, *q = prg2->all_layers; p && q; p = p->next, q = q->next)
+    {
+        struct sampler_layer *l1 = p->data, *l2 = q->data;
+        gchar *s1 = sampler_layer_to_string(l1, TRUE), *s2 = sampler_layer_to_string(l2, TRUE);
+        test_assert_equal_str(s1, s2);
+        g_free(s1);
+        g_free(s2);
+        test_assert(l1->data.computed.eff_waveform == l2->data.computed.eff_waveform);
+        test_assert_equal(int, l1->data.computed.eff_hikey, l2->data.computed.eff_hikey);
+        test_assert_equal(int, l1->parent->parent == l1->parent_program->global->default_child, l2->parent->parent == l2->parent_program->global->default_child);
+    }
+}
+
+void test_sampler_program_image(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_image", "smp1");
+    gchar *dir = g_dir_make_tmp("cbox-prg-XXXXXX", NULL);
+    test_assert(dir);
+    gchar *cache_dir = g_build_filename(dir, "cache", NULL);
+    gchar *sfz_name = g_build_filename(dir, "test.sfz", NULL);
+    gchar *image_name = g_build_filename(dir, "test.prg", NULL);
+    test_assert(g_file_set_contents(sfz_name,
+        "<control> set_cc7=100 label_cc7=Volume\n"
+        "<curve> curve_index=7 v000=0 v127=1\n"
+        "<global> cutoff=2000 fil_type=lpf_2p\n"
+        "<master> amp_veltrack=50\n"
+        "<group> lokey=36 hikey=47 ampeg_release=0.5 sample=*saw unknown_opcode=abc\n"
+        "<region> key=36 amplfo_freq=3 pitch_oncc7=100\n"
+        "<region> lokey=37 delay_random=0.1 sample=*sine\n"
+        "<group>\n"
+        "<region> key=60 xfin_locc1=0 xfin_hicc1=64 amp_velcurve_64=0.8\n",
+        -1, NULL));
+    cbox_config_set_string("sampler", "program_cache_dir", cache_dir);
+
+    // The first load parses the file and writes the image, the second one
+    // uses the image. To tell them apart, the file is changed in a way the
+    // image check cannot see (same size and modification time): parsing it
+    // again would give a different key.
+    struct sampler_program *prg1 = load_sfz_file_into_sampler(env, m, sfz_name, 1);
+    test_assert_equal(int, g_slist_length(prg1->all_layers), 3);
+    struct stat st;
+    test_assert(!stat(sfz_name, &st));
+    gchar *contents = NULL;
+    test_assert(g_file_get_contents(sfz_name, &contents, NULL, NULL));
+    char *key = strstr(contents, "key=60");
+    test_assert(key);
+    key[5] = '1';
+    test_assert(g_file_set_contents(sfz_name, contents, -1, NULL));
+    g_free(contents);
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    test_assert(!utimensat(AT_FDCWD, sfz_name, times, 0));
+    struct sampler_program *prg2 = load_sfz_file_into_sampler(env, m, sfz_name, 2);
+    verify_same_programs(env, prg1, prg2);
+
+    // Images can also be written and loaded directly
+    GError *error = NULL;
+    test_assert(!stat(sfz_name, &st));
+    struct sampler_program_source src = { sfz_name, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size };
+    GSList *sources = g_slist_prepend(NULL, &src);
+    test_assert(sampler_program_write_image(prg1, image_name, sources, &error));
+    test_assert_no_error(error);
+    struct sampler_program *prg3 = sampler_program_new(m, 3, "prg3", NULL, "", &error);
+    test_assert(sampler_program_load_image(prg3, image_name, &error));
+    test_assert_no_error(error);
+    verify_same_programs(env, prg1, prg3);
+
+    // Modified source files invalidate the image
+    test_assert(g_file_set_contents(sfz_name, "<region> key=60 sample=*saw\n", -1, NULL));
+    struct sampler_program *prg4 = sampler_program_new(m, 4, "prg4", NULL, "", &error);
+    test_assert(!sampler_program_load_image(prg4, image_name, &error));
+    test_assert(error);
+    g_clear_error(&error);
+    g_slist_free(sources);
+
+    CBOX_DELETE(prg1);
+    CBOX_DELETE(prg2);
+    CBOX_DELETE(prg3);
+    CBOX_DELETE(prg4);
+    CBOX_DELETE(&m->module);
+    GDir *cache = g_dir_open(cache_dir, 0, NULL);
+    test_assert(cache);
+    int image_count = 0;
+    for (const gchar *name; (name = g_dir_read_name(cache)); image_count++)
+    {
+        gchar *pathname = g_build_filename(cache_dir, name, NULL);
+        unlink(pathname);
+        g_free(pathname);
+    }
+    g_dir_close(cache);
+    test_assert_equal(int, image_count, 1);
+    rmdir(cache_dir);
+    unlink(sfz_name);
+    unlink(image_name);
+    rmdir(dir);
+    g_free(image_name);
+    g_free(sfz_name);
+    g_free(cache_dir);
+    g_free(dir);
+}
+
+static int16_t test_wav_sample(int i, int seed)
+{
+    return (int16_t)((i * 37 * seed) % 20000 - 10000);
+}
+
+// Writes a 16-bit WAV file with test_wav_sample() as its (interleaved)
+// contents
+static void write_test_wav_channels(struct test_env *env, const char *pathname, int frames, int channels, int seed)
+{
+    uint32_t data_size = frames * channels * sizeof(int16_t);
+    uint8_t *buf = g_malloc(44 + data_size);
+    const uint32_t header[11] = {
+        GUINT32_TO_LE(0x46464952), GUINT32_TO_LE(36 + data_size), GUINT32_TO_LE(0x45564157), // RIFF, size, WAVE
+        GUINT32_TO_LE(0x20746d66), GUINT32_TO_LE(16), // fmt chunk
+        GUINT32_TO_LE(0x00000001 | (channels << 16)), GUINT32_TO_LE(44100), GUINT32_TO_LE(44100 * 2 * channels), GUINT32_TO_LE(0x00100000 | (2 * channels)), // PCM, 44100 Hz, 16 bits
+        GUINT32_TO_LE(0x61746164), GUINT32_TO_LE(data_size), // data chunk
+    };
+    memcpy(buf, header, sizeof(header));
+    int16_t *data = (int16_t *)(buf + 44);
+    for (int i = 0; i < frames * channels; i++)
+        data[i] = GINT16_TO_LE(test_wav_sample(i, seed));
+    test_assert(g_file_set_contents(pathname, (const gchar *)buf, 44 + data_size, NULL));
+    g_free(buf);
+}
+
+static void write_test_wav(struct test_env *env, const char *pathname, int frames, int seed)
+{
+    write_test_wav_channels(env, pathname, frames, 1, seed);
+}
+
+static void verify_test_wav_waveform(struct test_env *env, struct cbox_waveform *waveform, int frames, int seed)
+{
+    test_assert_equal(int, (int)waveform->info.frames, frames);
+    test_assert_equal(int, waveform->info.channels, 1);
+    for (int i = 0; i < frames; i++)
+        test_assert_equal(int, waveform->data[i], test_wav_sample(i, seed));
+}
+
+// Returns the only file in the directory
+static gchar *get_single_file(struct test_env *env, const char *dir)
+{
+    GDir *d = g_dir_open(dir, 0, NULL);
+    test_assert(d);
+    const gchar *name = g_dir_read_name(d);
+    test_assert(name);
+    gchar *pathname = g_build_filename(dir, name, NULL);
+    test_assert(!g_dir_read_name(d));
+    g_dir_close(d);
+    return pathname;
+}
+
+void test_pcm_cache(struct test_env *env)
+{
+    gchar *dir = g_dir_make_tmp("cbox-pcm-XXXXXX", NULL);
+    test_assert(dir);
+    gchar *cache_dir = g_build_filename(dir, "cache", NULL);
+    gchar *wav_name = g_build_filename(dir, "test.wav", NULL);
+    write_test_wav(env, wav_name, 1000, 1);
+    // Restart the bank with the cache directory set, so that no state from
+    // the earlier tests carries over
+    cbox_wavebank_close();
+    cbox_config_set_string("streaming", "pcm_cache_dir", cache_dir);
+    cbox_wavebank_init();
+
+    // The first load decodes the file into a new cache entry
+    GError *error = NULL;
+    struct cbox_waveform *waveform = cbox_wavebank_get_waveform("test", NULL, dir, "test.wav", &error);
+    test_assert_no_error(error);
+    test_assert(waveform && waveform->pcm_cache);
+    verify_test_wav_waveform(env, waveform, 1000, 1);
+    cbox_waveform_unref(waveform);
+    gchar *entry_name = get_single_file(env, cache_dir);
+    struct stat st1, st2;
+    test_assert(!stat(entry_name, &st1));
+
+    // The second one maps the existing entry instead of writing it again
+    waveform = cbox_wavebank_get_waveform("test", NULL, dir, "test.wav", &error);
+    test_assert_no_error(error);
+    test_assert(waveform && waveform->pcm_cache);
+    verify_test_wav_waveform(env, waveform, 1000, 1);
+    cbox_waveform_unref(waveform);
+    test_assert(!stat(entry_name, &st2));
+    test_assert(st1.st_ino == st2.st_ino);
+
+    // Rewriting the source file makes the entry stale, so it is rebuilt
+    write_test_wav(env, wav_name, 1200, 2);
+    waveform = cbox_wavebank_get_waveform("test", NULL, dir, "test.wav", &error);
+    test_assert_no_error(error);
+    test_assert(waveform && waveform->pcm_cache);
+    verify_test_wav_waveform(env, waveform, 1200, 2);
+    cbox_waveform_unref(waveform);
+    g_free(entry_name);
+    entry_name = get_single_file(env, cache_dir);
+    test_assert(!stat(entry_name, &st2));
+    test_assert(st1.st_ino != st2.st_ino);
+
+    unlink(entry_name);
+    rmdir(cache_dir);
+    unlink(wav_name);
+    rmdir(dir);
+    g_free(entry_name);
+    g_free(wav_name);
+    g_free(cache_dir);
+    g_free(dir);
+}
+
+struct load_progress_result
+{
+    int messages, done, total;
+};
+
+static gboolean load_progress_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error)
+{
+    struct load_progress_result *result = ct->user_data;
+    if (!strcmp(cmd->command, "/load_progress"))
+    {
+        result->messages++;
+        result->done = CBOX_ARG_I(cmd, 0);
+        result->total = CBOX_ARG_I(cmd, 1);
+    }
+    return TRUE;
+}
+
+#define PRELOAD_TEST_SAMPLES 6
+
+void test_sampler_parallel_preload(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_setup", "smp1");
+    gchar *dir = g_dir_make_tmp("cbox-preload-XXXXXX", NULL);
+    test_assert(dir);
+    gchar *sfz_name = g_build_filename(dir, "test.sfz", NULL);
+    gchar *wav_names[PRELOAD_TEST_SAMPLES];
+    GString *sfz = g_string_new("");
+    for (int i = 0; i < PRELOAD_TEST_SAMPLES; i++)
+    {
+        gchar *name = g_strdup_printf("s%d.wav", i);
+        wav_names[i] = g_build_filename(dir, name, NULL);
+        g_free(name);
+        write_test_wav(env, wav_names[i], 500 + 100 * i, i + 1);
+        g_string_append_printf(sfz, "<region> key=%d sample=%s\n", 60 + i, wav_names[i]);
+    }
+    // The same file twice is only loaded once
+    g_string_append_printf(sfz, "<region> key=72 sample=%s\n", wav_names[0]);
+    test_assert(g_file_set_contents(sfz_name, sfz->str, -1, NULL));
+    g_string_free(sfz, TRUE);
+
+    // Serial load first, keeping a copy of the sample data
+    m->load_threads = 1;
+    struct sampler_program *prg = load_sfz_file_into_sampler(env, m, sfz_name, 1);
+    int layer_count = g_slist_length(prg->all_layers);
+    test_assert_equal(int, layer_count, PRELOAD_TEST_SAMPLES + 1);
+    int16_t *serial_data[PRELOAD_TEST_SAMPLES + 1];
+    int serial_frames[PRELOAD_TEST_SAMPLES + 1];
+    int i = 0;
+    for (GSList *p = prg->all_layers; p; p = p->next, i++)
+    {
+        struct cbox_waveform *waveform = ((struct sampler_layer *)p->data)->data.computed.eff_waveform;
+        test_assert(waveform);
+        serial_frames[i] = waveform->info.frames;
+        serial_data[i] = malloc(waveform->bytes);
+        memcpy(serial_data[i], waveform->data, waveform->bytes);
+    }
+    // Releases the waveforms, so that the next load reads the files again
+    CBOX_DELETE(prg);
+
+    struct load_progress_result result = { 0, 0, 0 };
+    struct cbox_command_target fb;
+    cbox_command_target_init(&fb, load_progress_process_cmd, &result);
+    m->load_progress_fb = &fb;
+    m->load_threads = 4;
+    prg = load_sfz_file_into_sampler(env, m, sfz_name, 1);
+    m->load_progress_fb = NULL;
+    test_assert(result.messages > 0);
+    test_assert_equal(int, result.total, PRELOAD_TEST_SAMPLES);
+    test_assert_equal(int, result.done, result.total);
+
+    i = 0;
+    for (GSList *p = prg->all_layers; p; p = p->next, i++)
+    {
+        struct cbox_waveform *waveform = ((struct sampler_layer *)p->data)->data.computed.eff_waveform;
+        test_assert(waveform);
+        test_assert_equal(int, (int)waveform->info.frames, serial_frames[i]);
+        test_assert(!memcmp(waveform->data, serial_data[i], serial_frames[i] * sizeof(int16_t)));
+        free(serial_data[i]);
+    }
+    test_assert_equal(int, i, layer_count);
+    CBOX_DELETE(prg);
+    CBOX_DELETE(&m->module);
+
+    for (i = 0; i < PRELOAD_TEST_SAMPLES; i++)
+    {
+        unlink(wav_names[i]);
+        g_free(wav_names[i]);
+    }
+    unlink(sfz_name);
+    rmdir(dir);
+    g_free(sfz_name);
+    g_free(dir);
+}
+
+#define RESAMPLER_TEST_BLOCKS 256
+
+static void render_resampler_test(struct test_env *env, const char *sfz_data, float *output)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_setup", "smp1");
+    struct sampler_program *prg = load_sfz_into_sampler(env, m, sfz_data);
+    for (int note = 60; note <= 64; ++note)
+    {
+        uint8_t midi_data[3] = { 0x90, note, 100 };
+        m->module.process_event(&m->module, midi_data, sizeof(midi_data));
+    }
+    float buf[2][CBOX_BLOCK_SIZE];
+    cbox_sample_t *outputs[2] = { buf[0], buf[1] };
+    for (int block = 0; block < RESAMPLER_TEST_BLOCKS; ++block)
+    {
+        m->module.process_block(&m->module, NULL, outputs);
+        memcpy(output + 2 * block * CBOX_BLOCK_SIZE, buf, sizeof(buf));
+    }
+    sampler_unselect_program(m, prg);
+    CBOX_DELETE(prg);
+    CBOX_DELETE(&m->module);
+}
+
+void test_sampler_resampler_isa(struct test_env *env)
+{
+    gchar *dir = g_dir_make_tmp("cbox-resampler-XXXXXX", NULL);
+    test_assert(dir);
+    gchar *mono_name = g_build_filename(dir, "mono.wav", NULL);
+    gchar *stereo_name = g_build_filename(dir, "stereo.wav", NULL);
+    write_test_wav(env, mono_name, 20000, 1);
+    write_test_wav_channels(env, stereo_name, 20000, 2, 3);
+    // Mono and stereo, looped and not, different pitches and gain ramps
+    gchar *sfz_data = g_strdup_printf(
+        "<region> key=60 sample=%s loop_mode=loop_continuous loop_start=50 loop_end=2000 pitch_keycenter=53 tune=13 ampeg_attack=0.05\n"
+        "<region> key=61 sample=%s pan=-40 tune=-29\n"
+        "<region> key=62 sample=%s tune=37\n"
+        "<region> key=63 sample=%s loop_mode=loop_continuous loop_start=100 loop_end=3000 pitch_keycenter=70 ampeg_attack=0.02\n"
+        "<region> key=64 sample=%s offset=1000 pitch_keycenter=40 end=4000\n",
+        mono_name, mono_name, stereo_name, stereo_name, stereo_name);
+
+    // Without a sample rate, the voices would not move through the samples
+    env->engine->io_env.srate = 44100;
+    size_t size = 2 * RESAMPLER_TEST_BLOCKS * CBOX_BLOCK_SIZE;
+    float *reference = g_new(float, size), *output = g_new(float, size);
+    test_assert_equal_str(sampler_gen_init("narrow"), "narrow");
+    render_resampler_test(env, sfz_data, reference);
+    float peak = 0;
+    for (size_t i = 0; i < size; ++i)
+        peak = fmaxf(peak, fabsf(reference[i]));
+    test_assert(peak > 0.001);
+
+    static const char *isas[] = { "avx2", "avx512" };
+    for (uint32_t i = 0; i < sizeof(isas) / sizeof(isas[0]); ++i)
+    {
+        // Not supported by this CPU (or this build)
+        if (strcmp(sampler_gen_init(isas[i]), isas[i]))
+            continue;
+        render_resampler_test(env, sfz_data, output);
+        float max_diff = 0;
+        for (size_t j = 0; j < size; ++j)
+            max_diff = fmaxf(max_diff, fabsf(output[j] - reference[j]));
+        env->context = g_strdup_printf("%s, max diff %g", isas[i], max_diff);
+        test_assert(max_diff < 1e-5 * peak);
+        g_free(env->context);
+        env->context = NULL;
+    }
+    sampler_gen_init(cbox_config_get_string("sampler", "resampler_isa"));
+
+    g_free(reference);
+    g_free(output);
+    g_free(sfz_data);
+    unlink(mono_name);
+    unlink(stereo_name);
+    rmdir(dir);
+    g_free(mono_name);
+    g_free(stereo_name);
+    g_free(dir);
+}
+
+static void verify_rll_same_layers(struct test_env *env, struct sampler_rll *rll, struct sampler_rll *expected)
+{
+    test_assert_equal(uint32_t, rll->keyswitch_key_count, expected->keyswitch_key_count);
+    test_assert_equal(uint32_t, rll->layers_oncc_count, expected->layers_oncc_count);
+    test_assert_equal(uint32_t, rll->num_release_layers, expected->num_release_layers);
+    test_assert_equal(uint32_t, rll->keyswitch_group_count, expected->keyswitch_group_count);
+    for (uint32_t i = 0; i < rll->keyswitch_group_count; ++i)
+    {
+        const struct sampler_keyswitch_group *ks = rll->keyswitch_groups[i], *ks2 = NULL;
+        for (uint32_t j = 0; j < expected->keyswitch_group_count && !ks2; ++j)
+        {
+            if (expected->keyswitch_groups[j]->lo == ks->lo && expected->keyswitch_groups[j]->hi == ks->hi)
+                ks2 = expected->keyswitch_groups[j];
+        }
+        test_assert(ks2);
+        test_assert_equal(int, ks->num_used, ks2->num_used);
+        test_assert_equal(int, ks->def_value, ks2->def_value);
+    }
+    for (int key = 0; key < 128; ++key)
+    {
+        for (int list = 0; list < 3; ++list)
+        {
+            struct sampler_rll_block **l1 = list == 0 ? rll->layers_by_range : (list == 1 ? rll->release_layers_by_range : rll->key_release_layers_by_range);
+            struct sampler_rll_block **l2 = list == 0 ? expected->layers_by_range : (list == 1 ? expected->release_layers_by_range : expected->key_release_layers_by_range);
+            for (uint32_t state = 0; state <= rll->keyswitch_key_count; ++state)
+            {
+                uint8_t r1 = key >= rll->lokey && key <= rll->hikey ? rll->ranges_by_key[key] : 255;
+                uint8_t r2 = key >= expected->lokey && key <= expected->hikey ? expected->ranges_by_key[key] : 255;
+                const struct sampler_rll_block *b1 = l1 && r1 != 255 ? l1[state * rll->layers_by_range_count + r1] : NULL;
+                const struct sampler_rll_block *b2 = l2 && r2 != 255 ? l2[state * expected->layers_by_range_count + r2] : NULL;
+                uint32_t count = b1 ? b1->count : 0;
+                test_assert_equal(uint32_t, count, b2 ? b2->count : 0);
+                for (uint32_t i = 0; i < count; ++i)
+                {
+                    test_assert(b1->layers[i] == b2->layers[i]);
+                    test_assert_equal(int, b1->lovel[i], b2->lovel[i]);
+                    test_assert_equal(uint32_t, b1->cc_test_index[i + 1] - b1->cc_test_index[i], b2->cc_test_index[i + 1] - b2->cc_test_index[i]);
+                }
+            }
+        }
+    }
+}
+
+void test_sampler_rll_incremental(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_rll", "smp1");
+    struct sampler_program *prg = load_sfz_into_sampler(env, m,
+        "<region> key=60 sample=*saw\n"
+        "<region> lokey=50 hikey=70 lovel=64 sample=*saw\n"
+        "<region> lokey=55 hikey=65 trigger=release sample=*saw\n"
+        "<region> sw_lokey=24 sw_hikey=25 sw_last=24 lokey=40 hikey=80 sample=*saw\n"
+        "<region> sw_lokey=24 sw_hikey=25 sw_last=25 lokey=40 hikey=80 locc1=64 sample=*saw\n"
+        "<region> key=62 on_locc64=64 on_hicc64=127 sample=*saw\n");
+    struct sampler_layer *regions[6];
+    int count = 0;
+    for (GSList *p = prg->all_layers; p && count < 6; p = p->next)
+        regions[count++] = p->data;
+    test_assert_equal(int, count, 6);
+
+    static const struct { int region; const char *key, *value; } edits[] = {
+        { 1, "lokey", "30" }, // below the lowest key so far
+        { 1, "hikey", "100" }, // above the highest key so far
+        { 0, "key", "61" },
+        { 2, "trigger", "attack" },
+        { 4, "hicc1", "100" },
+        { 1, "lovel", "0" },
+        { 3, "lokey", "79" },
+        { 5, "on_locc64", "0" },
+        { 3, "sw_default", "25" },
+        { 4, "sw_default", "24" }, // the first layer's default wins
+        { 3, "sw_default", "10" }, // out of range, the next layer's default is used
+    };
+    for (uint32_t i = 0; i < sizeof(edits) / sizeof(edits[0]); ++i)
+    {
+        struct sampler_layer *l = regions[edits[i].region];
+        GError *error = NULL;
+        test_assert(sampler_layer_apply_param(l, edits[i].key, edits[i].value, &error));
+        test_assert_no_error(error);
+        sampler_layer_data_finalize(&l->data, &l->parent->data, prg);
+
+        struct sampler_rll *rll = sampler_rll_new_updated(prg->rll, prg, &l, 1, FALSE);
+        test_assert(rll);
+        struct sampler_rll *expected = sampler_rll_new_from_program(prg);
+        verify_rll_same_layers(env, rll, expected);
+        sampler_rll_destroy(expected);
+        sampler_rll_destroy(prg->rll);
+        prg->rll = rll;
+    }
+
+    // Removing a layer and adding a new one
+    CBOX_DELETE(regions[0]);
+    struct sampler_rll *expected = sampler_rll_new_from_program(prg);
+    verify_rll_same_layers(env, prg->rll, expected);
+    sampler_rll_destroy(expected);
+
+    // Removing a keyswitch layer leaves one state (and its default) fewer
+    CBOX_DELETE(regions[4]);
+    expected = sampler_rll_new_from_program(prg);
+    test_assert_equal(uint32_t, expected->keyswitch_key_count, 1);
+    test_assert_equal(int, expected->keyswitch_groups[0]->def_value, 255);
+    verify_rll_same_layers(env, prg->rll, expected);
+    sampler_rll_destroy(expected);
+
+    struct sampler_layer *l = sampler_layer_new(m, prg, regions[1]->parent);
+    test_assert(sampler_layer_apply_param(l, "key", "20", NULL));
+    sampler_layer_data_finalize(&l->data, &l->parent->data, prg);
+    sampler_layer_update(l);
+    sampler_program_add_layer(prg, l);
+    sampler_program_update_layer(prg, l, FALSE);
+    expected = sampler_rll_new_from_program(prg);
+    verify_rll_same_layers(env, prg->rll, expected);
+    sampler_rll_destroy(expected);
+
+    CBOX_DELETE(&m->module);
+}
+
+// The selection rules as they were before the rll blocks had their own copy
+// of the bounds - everything is taken from the runtime layer data
+static gboolean is_region_selected(struct sampler_layer_data *l, struct sampler_channel *c, int note, int vel, float random)
+{
+    return l->computed.eff_waveform &&
+        note >= l->computed.eff_lokey && note <= l->computed.eff_hikey &&
+        vel >= l->lovel && vel <= l->hivel &&
+        random >= l->lorand && random < l->hirand &&
+        sampler_cc_range_is_in(l->cc, c);
+}
+
+static void verify_region_selection(struct test_env *env, struct sampler_program *prg, struct sampler_channel *c, struct sampler_layer **regions, int count)
+{
+    static const int notes[] = { 60, 62 };
+    static const int vels[] = { 1, 15, 40, 41, 59, 60, 61, 127 };
+    // random is always below 1, see sampler_channel_start_note
+    static const float randoms[] = { 0, 0.4999f, 0.5f, 0.7499f, 0.75f, 0.9999f };
+    static const int ccs[] = { 0, 63, 64, 100, 101, 127 };
+    for (uint32_t n = 0; n < sizeof(notes) / sizeof(notes[0]); ++n)
+    for (uint32_t v = 0; v < sizeof(vels) / sizeof(vels[0]); ++v)
+    for (uint32_t r = 0; r < sizeof(randoms) / sizeof(randoms[0]); ++r)
+    for (uint32_t cc = 0; cc < sizeof(ccs) / sizeof(ccs[0]); ++cc)
+    {
+        c->intcc[1] = ccs[cc];
+        uint32_t expected = 0, selected = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            if (is_region_selected(regions[i]->runtime, c, notes[n], vels[v], randoms[r]))
+                expected |= 1 << i;
+        }
+        struct sampler_rll_iterator iter;
+        sampler_rll_iterator_init(&iter, prg->rll, c, notes[n], vels[v], randoms[r], TRUE, stm_attack);
+        struct sampler_layer *l;
+        while((l = sampler_rll_iterator_next(&iter)) != NULL)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                if (regions[i] == l)
+                    selected |= 1 << i;
+            }
+        }
+        env->context = g_strdup_printf("note=%d vel=%d random=%f cc1=%d", notes[n], vels[v], randoms[r], ccs[cc]);
+        test_assert_equal(int, selected, expected);
+        g_free(env->context);
+        env->context = NULL;
+    }
+    c->intcc[1] = 0;
+}
+
+void test_sampler_region_selection(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_selection", "smp1");
+    struct sampler_program *prg = load_sfz_into_sampler(env, m,
+        "<region> key=60 lovel=-10 hivel=40 sample=*saw\n"
+        "<region> key=60 lovel=41 hivel=300 sample=*saw\n"
+        "<region> key=60 lorand=0 hirand=0.5 sample=*saw\n"
+        "<region> key=60 lorand=0.5 hirand=1 sample=*saw\n"
+        "<region> key=60 locc1=0 hicc1=63 sample=*saw\n"
+        "<region> key=60 locc1=64 hicc1=127 sample=*saw\n"
+        "<region> key=60 lovel=90 hivel=20 sample=*saw\n"
+        "<region> key=62 lovel=0 hivel=40 locc1=64 sample=*saw\n");
+    struct sampler_layer *regions[8];
+    int count = 0;
+    for (GSList *p = prg->all_layers; p && count < 8; p = p->next)
+        regions[count++] = p->data;
+    test_assert_equal(int, count, 8);
+    struct sampler_channel *c = &m->channels[0];
+    verify_region_selection(env, prg, c, regions, count);
+
+    // Without automatic updates, the changes take effect immediately, even
+    // though the rll is left alone
+    GError *error = NULL;
+    test_assert(cbox_execute_on(&prg->cmd_target, NULL, "/auto_update_layers", "i", &error, 0));
+    test_assert_no_error(error);
+    struct sampler_rll *rll = prg->rll;
+    static const struct { int region; const char *key, *value; } edits[] = {
+        { 0, "hivel", "60" },
+        { 2, "hirand", "0.75" },
+        { 4, "hicc1", "100" },
+        { 6, "lovel", "10" },
+        { 7, "hivel", "127" },
+        { 7, "locc1", "0" },
+    };
+    for (uint32_t i = 0; i < sizeof(edits) / sizeof(edits[0]); ++i)
+    {
+        test_assert(cbox_execute_on(&regions[edits[i].region]->cmd_target, NULL, "/set_param", "ss", &error, edits[i].key, edits[i].value));
+        test_assert_no_error(error);
+    }
+    // CC bounds outside of 0..127 are rejected
+    test_assert(!cbox_execute_on(&regions[5]->cmd_target, NULL, "/set_param", "ss", &error, "locc1", "-1"));
+    test_assert(error);
+    g_clear_error(&error);
+    test_assert(!cbox_execute_on(&regions[5]->cmd_target, NULL, "/set_param", "ss", &error, "hicc1", "128"));
+    test_assert(error);
+    g_clear_error(&error);
+    test_assert(prg->rll == rll);
+    test_assert(rll->bounds_stale);
+    verify_region_selection(env, prg, c, regions, count);
+
+    // An incremental update of another key range rebuilds the whole rll,
+    // as the blocks of the key range changed earlier can't be reused
+    test_assert(cbox_execute_on(&prg->cmd_target, NULL, "/auto_update_layers", "i", &error, 1));
+    test_assert(cbox_execute_on(&regions[1]->cmd_target, NULL, "/set_param", "ss", &error, "lovel", "61"));
+    test_assert_no_error(error);
+    test_assert(!prg->rll->bounds_stale);
+    verify_region_selection(env, prg, c, regions, count);
+
+    test_assert(cbox_execute_on(&prg->cmd_target, NULL, "/auto_update_layers", "i", &error, 0));
+    test_assert(cbox_execute_on(&regions[3]->cmd_target, NULL, "/set_param", "ss", &error, "lorand", "0.25"));
+    test_assert(prg->rll->bounds_stale);
+    test_assert(cbox_execute_on(&prg->cmd_target, NULL, "/update_layers", "", &error));
+    test_assert_no_error(error);
+    test_assert(!prg->rll->bounds_stale);
+    verify_region_selection(env, prg, c, regions, count);
+
+    CBOX_DELETE(&m->module);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void verify_mod_input(struct test_env *env, const struct sampler_mod_program *mp, uint32_t input, enum sampler_modsrc src, const struct sampler_modulation_value *value)
+{
+    if (src == smsrc_none)
+        test_assert_equal(uint32_t, input, smi_one);
+    else if (src < smsrc_pernote_offset)
+    {
+        test_assert(input >= smi_compiled_start && input < smi_compiled_start + mp->cc_input_count);
+        const struct sampler_mod_cc_input *ci = &mp->cc_inputs[input - smi_compiled_start];
+        test_assert_equal(uint32_t, ci->cc_number, src);
+        test_assert_equal(uint32_t, ci->curve_id, value->curve_id);
+        test_assert(ci->step == value->step);
+    }
+    else if (IS_SMSRC_FLEXLFO(src))
+    {
+        uint32_t first = smi_compiled_start + mp->cc_input_count;
+        test_assert(input >= first && input < first + mp->flex_lfo_input_count);
+        test_assert_equal(uint32_t, mp->flex_lfo_inputs[input - first]->key.id, SMSRC_FLEXLFO_NUM(src));
+    }
+    else
+        test_assert_equal(uint32_t, input, src - smsrc_pernote_offset);
+}
+
+void test_sampler_mod_program(struct test_env *env)
+{
+    struct sampler_module *m = create_sampler_instance(env, "test_mod", "smp1");
+    struct sampler_program *prg = load_sfz_into_sampler(env, m,
+        "<region> key=60 amplitude_oncc2=50 pitch_oncc2=100 pan_oncc2=10 pan_curvecc2=3 "
+        "ampeg_attack_oncc4=1 fillfo_depthcc5=20 lfo01_freq=2 lfo01_pitch=50 sample=*saw\n");
+    struct sampler_layer *l = prg->all_layers->data;
+    const struct sampler_layer_data *ld = l->runtime;
+    const struct sampler_mod_program *mp = &ld->computed.mod_program;
+
+    test_assert_equal(uint32_t, mp->mul_op_count, 1);
+    test_assert_equal(uint32_t, mp->eg_op_count, 1);
+    test_assert_equal(uint32_t, mp->flex_lfo_input_count, 1);
+    test_assert_equal(uint32_t, mp->mul_dest_mask, 1 << smdest_amplitude);
+    // amplitude and pitch share the same input, pan uses a different curve
+    uint32_t cc2_inputs = 0;
+    for (uint32_t i = 0; i < mp->cc_input_count; ++i)
+        cc2_inputs += mp->cc_inputs[i].cc_number == 2;
+    test_assert_equal(uint32_t, cc2_inputs, 2);
+
+    // The ops are grouped by kind, in the order of the modulation list
+    uint32_t next_op[3] = { 0, mp->add_op_count, mp->add_op_count + mp->mul_op_count };
+    for (const struct sampler_modulation *sm = ld->modulations; sm; sm = sm->next)
+    {
+        gboolean is_eg = sm->key.dest >= smdest_eg_stage_start && sm->key.dest <= smdest_eg_stage_end;
+        const struct sampler_mod_op *op = &mp->ops[next_op[is_eg ? 2 : (sm->key.dest == smdest_amplitude ? 1 : 0)]++];
+        test_assert(op->amount == sm->value.amount);
+        verify_mod_input(env, mp, op->input, sm->key.src, &sm->value);
+        if (is_eg)
+            test_assert_equal(uint32_t, op->dest, sm->key.dest - smdest_eg_stage_start);
+        else
+        {
+            test_assert_equal(uint32_t, op->dest, sm->key.dest);
+            verify_mod_input(env, mp, op->input2, sm->key.src2, &sm->value);
+            test_assert(mp->dest_mask & (1 << sm->key.dest) || sm->key.dest == smdest_amplitude);
+        }
+    }
+    test_assert_equal(uint32_t, next_op[0], mp->add_op_count);
+    test_assert_equal(uint32_t, next_op[2], mp->add_op_count + mp->mul_op_count + mp->eg_op_count);
+
+    CBOX_DELETE(&m->module);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void test_assert_failed(struct test_env *env, const char *file, int line, const char *check)
@@ -682,6 +2571,35 @@ struct test_info {
     { "test_sampler_midicurve", test_sampler_midicurve },
     { "test_sampler_midicurve2", test_sampler_midicurve2 },
     { "test_sampler_note_basic", test_sampler_note_basic },
+    { "test_sampler_batch_render", test_sampler_batch_render },
+    { "test_fast_math", test_fast_math },
+    { "test_biquad_cascade", test_biquad_cascade },
+    { "test_sampler_filter_control_period", test_sampler_filter_control_period },
+    { "test_sampler_parallel_render", test_sampler_parallel_render },
+    { "test_scene_parallel_render", test_scene_parallel_render },
+    { "test_sampler_voice_pool", test_sampler_voice_pool },
+    { "test_sampler_mpe", test_sampler_mpe },
+    { "test_sampler_mpe_zone_change", test_sampler_mpe_zone_change },
+    { "test_midi_buffer_growth", test_midi_buffer_growth },
+    { "test_engine_midi_dropped", test_engine_midi_dropped },
+    { "test_engine_midi_arena_size", test_engine_midi_arena_size },
+    { "test_midi_merger_order", test_midi_merger_order },
+    { "test_seq_seek", test_seq_seek },
+    { "test_pattern_note_intervals", test_pattern_note_intervals },
+    { "test_rt_cmd_queue", test_rt_cmd_queue },
+    { "test_rt_cmd_batch", test_rt_cmd_batch },
+    { "test_module_publish_params", test_module_publish_params },
+    { "test_prefetch_stack_adapt", test_prefetch_stack_adapt },
+    { "test_prefetch_stack_schedule", test_prefetch_stack_schedule },
+    { "test_sampler_streaming_stats", test_sampler_streaming_stats },
+    { "test_sfz_parser", test_sfz_parser },
+    { "test_sampler_program_image", test_sampler_program_image },
+    { "test_pcm_cache", test_pcm_cache },
+    { "test_sampler_parallel_preload", test_sampler_parallel_preload },
+    { "test_sampler_resampler_isa", test_sampler_resampler_isa },
+    { "test_sampler_rll_incremental", test_sampler_rll_incremental },
+    { "test_sampler_region_selection", test_sampler_region_selection },
+    { "test_sampler_mod_program", test_sampler_mod_program },
     { "test_sampler_note_region_logic/key", test_sampler_note_region_logic, &setup_lokeyhikey },
     { "test_sampler_note_region_logic/key2", test_sampler_note_region_logic, &setup_lokeyhikey2 },
     { "test_sampler_note_region_logic/vel", test_sampler_note_region_logic, &setup_lovelhivel },
@@ -700,24 +2618,35 @@ struct test_info {
     { "test_sampler_note_region_logic/switches4", test_sampler_note_region_logic, &setup_switches4 },
 };
 
+struct test_info benchmarks[] = {
+    { "bench_fast_math", bench_fast_math },
+};
+
 int main(int argc, char *argv[])
 {
     uint32_t tests_run = 0, tests_failed = 0;
-    for (unsigned int i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+    struct test_info *list = tests;
+    unsigned int count = sizeof(tests) / sizeof(tests[0]);
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        list = benchmarks;
+        count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    }
+    for (unsigned int i = 0; i < count; ++i)
     {
         struct test_env env;
+        cbox_config_init("");
         env.doc = cbox_document_new();
         env.engine = cbox_engine_new(env.doc, NULL);
-        env.arg = tests[i].arg;
+        env.arg = list[i].arg;
         env.context = NULL;
-        cbox_config_init("");
         cbox_wavebank_init();
         tests_run++;
         if (0 == setjmp(env.on_fail))
         {
-            printf("Running %s... ", tests[i].name);
+            printf("Running %s... ", list[i].name);
             fflush(stdout);
-            tests[i].func(&env);
+            list[i].func(&env);
             printf("PASS\n");
         }
         else
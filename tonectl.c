@@ -40,7 +40,9 @@ struct tone_control_module
 {
     struct cbox_module module;
 
-    struct tone_control_params *params, *old_params;
+    struct tone_control_params *params;
+    // generation of the parameter block the derived values were computed from
+    uint32_t old_params_generation;
     
     struct cbox_onepolef_coeffs lowpass_coeffs, highpass_coeffs;
     
@@ -77,12 +79,14 @@ void tone_control_process_event(struct cbox_module *module, const uint8_t *data,
 void tone_control_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct tone_control_module *m = (struct tone_control_module *)module;
+    uint32_t generation = cbox_module_get_params_generation(&m->module);
+    struct tone_control_params *p = m->params;
     
-    if (m->params != m->old_params)
+    if (generation != m->old_params_generation)
     {
-        cbox_onepolef_set_lowpass(&m->lowpass_coeffs, m->params->lowpass * m->tpdsr);
-        cbox_onepolef_set_highpass(&m->highpass_coeffs, m->params->highpass * m->tpdsr);
-        m->old_params = m->params;
+        cbox_onepolef_set_lowpass(&m->lowpass_coeffs, p->lowpass * m->tpdsr);
+        cbox_onepolef_set_highpass(&m->highpass_coeffs, p->highpass * m->tpdsr);
+        m->old_params_generation = generation;
     }
     
     cbox_onepolef_process_to(&m->lowpass_state[0], &m->lowpass_coeffs, inputs[0], outputs[0]);
@@ -108,7 +112,7 @@ MODULE_CREATE_FUNCTION(tone_control)
     
     m->tpdsr = 2 * M_PI * m->module.srate_inv;
     
-    m->old_params = NULL;
+    m->old_params_generation = (uint32_t)-1;
     m->params = malloc(sizeof(struct tone_control_params));
     
     m->params->lowpass = cbox_config_get_float(cfg_section, "lowpass", 8000.f);
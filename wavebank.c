@@ -27,8 +27,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <errno.h>
 #include <glib.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #define STD_WAVEFORM_FRAMES 1024
 #define STD_WAVEFORM_BITS 10
@@ -125,6 +128,7 @@ struct wave_bank
     GHashTable *waveforms_by_name, *waveforms_by_id;
     GSList *std_waveforms;
     uint32_t streaming_prefetch_size;
+    const char *pcm_cache_dir;
 };
 
 static struct wave_bank bank;
@@ -268,6 +272,7 @@ void cbox_wavebank_init()
     bank.waveforms_by_id = g_hash_table_new(g_int_hash, g_int_equal);
     bank.std_waveforms = NULL;
     bank.streaming_prefetch_size = cbox_config_get_int("streaming", "prefetch_size", 65536);
+    bank.pcm_cache_dir = cbox_config_get_string("streaming", "pcm_cache_dir");
 
     cbox_wavebank_add_std_waveform("*sine", func_sine, NULL, 0);
     // XXXKF this should not be a real waveform
@@ -277,30 +282,9 @@ void cbox_wavebank_init()
     cbox_wavebank_add_std_waveform("*triangle", func_tri, NULL, 11);
 }
 
-struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struct cbox_tarfile *tarfile, const char *sample_dir, const char *filename, GError **error)
+// Returns the canonical name of a sample file, and the path to open it from
+static gchar *resolve_waveform_name(const char *context_name, struct cbox_tarfile *tarfile, const char *sample_dir, const char *filename, gchar **ppathname, GError **error)
 {
-    if (!filename)
-    {
-        g_set_error(error, CBOX_WAVEFORM_ERROR, CBOX_WAVEFORM_ERROR_FAILED, "%s: no filename specified", context_name);
-        return NULL;
-    }
-
-    // Built in waveforms don't go through path canonicalization
-    if (filename[0] == '*')
-    {
-        if (!strcmp(filename + 1, "sqr"))
-            filename = "*square";
-        else if (!strcmp(filename + 1, "tri"))
-            filename = "*triangle";
-        gpointer value = g_hash_table_lookup(bank.waveforms_by_name, filename);
-        if (value)
-        {
-            struct cbox_waveform *waveform = value;
-            cbox_waveform_ref(waveform);
-            return waveform;
-        }
-    }
-
     gchar *value_copy = g_strdup(filename);
     for (int i = 0; value_copy[i]; i++)
     {
@@ -329,95 +313,283 @@ struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struc
         g_free(pathname);
         return NULL;
     }
-    gpointer value = g_hash_table_lookup(bank.waveforms_by_name, canonical);
-    if (value)
-    {
-        g_free(pathname);
-        g_free(canonical);
-
-        struct cbox_waveform *waveform = value;
-        cbox_waveform_ref(waveform);
-        return waveform;
-    }
+    *ppathname = pathname;
+    return canonical;
+}
 
+// Opens and decodes the file. Does not touch the bank (other than reading its
+// settings), so it can be called from several threads at once. Takes
+// ownership of canonical.
+static struct cbox_waveform *load_waveform(const char *context_name, struct cbox_tarfile *tarfile, const char *pathname, gchar *canonical, GError **error)
+{
     struct cbox_waveform *waveform = calloc(1, sizeof(struct cbox_waveform));
     SNDFILE *sndfile = NULL;
     struct cbox_taritem *taritem = NULL;
+    const char *source_pathname = tarfile ? tarfile->file_pathname : canonical;
     if (tarfile)
-    {
         taritem = cbox_tarfile_get_item_by_name(tarfile, pathname, TRUE);
-        if (taritem)
-            sndfile = cbox_tarfile_opensndfile(tarfile, taritem, &waveform->sndstream, &waveform->info);
+
+    struct cbox_pcm_cache_entry *pcm_cache = (!tarfile || taritem) ? cbox_pcm_cache_lookup(bank.pcm_cache_dir, canonical, source_pathname) : NULL;
+    if (pcm_cache)
+    {
+        const struct cbox_pcm_cache_header *hdr = pcm_cache->header;
+        waveform->info.frames = hdr->frames;
+        waveform->info.channels = hdr->channels;
+        waveform->info.samplerate = hdr->sample_rate;
+        waveform->info.format = hdr->format;
+        waveform->has_loop = hdr->has_loop;
+        waveform->loop_start = hdr->loop_start;
+        waveform->loop_end = hdr->loop_end;
     }
     else
-        sndfile = sf_open(pathname, SFM_READ, &waveform->info);
-    if (!sndfile)
     {
-        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno (errno), "%s: cannot open '%s'", context_name, pathname);
-        g_free(pathname);
-        g_free(canonical);
-        free(waveform);
-        return NULL;
-    }
+        if (taritem)
+            sndfile = cbox_tarfile_opensndfile(tarfile, taritem, &waveform->sndstream, &waveform->info);
+        else if (!tarfile)
+            sndfile = sf_open(pathname, SFM_READ, &waveform->info);
+        if (!sndfile)
+        {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno (errno), "%s: cannot open '%s'", context_name, pathname);
+            g_free(canonical);
+            free(waveform);
+            return NULL;
+        }
+        if (waveform->info.channels != 1 && waveform->info.channels != 2)
+        {
+            g_set_error(error, CBOX_WAVEFORM_ERROR, CBOX_WAVEFORM_ERROR_FAILED,
+                "%s: cannot open file '%s': unsupported channel count %d", context_name, pathname, (int)waveform->info.channels);
+            sf_close(sndfile);
+            g_free(canonical);
+            free(waveform);
+            return NULL;
+        }
 
-    SF_INSTRUMENT instrument;
-    uint32_t nshorts;
-    if (waveform->info.channels != 1 && waveform->info.channels != 2)
-    {
-        g_set_error(error, CBOX_WAVEFORM_ERROR, CBOX_WAVEFORM_ERROR_FAILED,
-            "%s: cannot open file '%s': unsupported channel count %d", context_name, pathname, (int)waveform->info.channels);
-        sf_close(sndfile);
-        free(canonical);
-        g_free(pathname);
-        return NULL;
+        SF_INSTRUMENT instrument;
+        waveform->has_loop = FALSE;
+        if (sf_command(sndfile, SFC_GET_INSTRUMENT, &instrument, sizeof(SF_INSTRUMENT)))
+        {
+            for (int i = 0; i < instrument.loop_count; i++)
+            {
+                if (instrument.loops[i].mode == SF_LOOP_FORWARD)
+                {
+                    waveform->loop_start = instrument.loops[i].start;
+                    waveform->loop_end = instrument.loops[i].end;
+                    waveform->has_loop = TRUE;
+                    break;
+                }
+            }
+        }
+        pcm_cache = cbox_pcm_cache_create(bank.pcm_cache_dir, canonical, source_pathname, sndfile, &waveform->info, waveform->has_loop, waveform->loop_start, waveform->loop_end);
+        if (pcm_cache)
+        {
+            sf_close(sndfile);
+            sndfile = NULL;
+            waveform->info.frames = pcm_cache->header->frames;
+        }
+        else
+            sf_seek(sndfile, 0, SEEK_SET);
     }
-    g_free(pathname);
+
     uint32_t preloaded_frames = waveform->info.frames;
     // If sample is larger than 2x prefetch buffer size, then load only
     // a prefetch buffer worth of data, and stream the rest.
     if (preloaded_frames > 2 * bank.streaming_prefetch_size)
         preloaded_frames = bank.streaming_prefetch_size;
-    waveform->id = ++bank.serial_no;
     waveform->bytes = waveform->info.channels * 2 * preloaded_frames;
-    waveform->data = malloc(waveform->bytes);
     waveform->refcount = 1;
     waveform->canonical_name = canonical;
     waveform->display_name = g_filename_display_name(canonical);
-    waveform->has_loop = FALSE;
     waveform->levels = NULL;
     waveform->level_count = 0;
     waveform->preloaded_frames = preloaded_frames;
     waveform->tarfile = tarfile;
     waveform->taritem = taritem;
+    waveform->pcm_cache = pcm_cache;
 
-    if (sf_command(sndfile, SFC_GET_INSTRUMENT, &instrument, sizeof(SF_INSTRUMENT)))
+    if (pcm_cache)
     {
-        for (int i = 0; i < instrument.loop_count; i++)
+        // The preloaded part is used directly by the RT thread, so it must
+        // not cause any page faults there. The rest is read by the prefetch
+        // threads only.
+        waveform->data = pcm_cache->data;
+        if (mlock(waveform->data, waveform->bytes))
         {
-            if (instrument.loops[i].mode == SF_LOOP_FORWARD)
-            {
-                waveform->loop_start = instrument.loops[i].start;
-                waveform->loop_end = instrument.loops[i].end;
-                waveform->has_loop = TRUE;
-                break;
-            }
+            volatile int16_t sum = 0;
+            for (size_t i = 0; i < waveform->bytes / sizeof(int16_t); i += 2048)
+                sum += waveform->data[i];
         }
     }
+    else
+    {
+        uint32_t nshorts = waveform->info.channels * preloaded_frames;
+        waveform->data = malloc(waveform->bytes);
+        for (uint32_t i = 0; i < nshorts; i++)
+            waveform->data[i] = 0;
+        sf_readf_short(sndfile, waveform->data, preloaded_frames);
+        sf_close(sndfile);
+    }
+    return waveform;
+}
 
-    nshorts = waveform->info.channels * preloaded_frames;
-    for (uint32_t i = 0; i < nshorts; i++)
-        waveform->data[i] = 0;
-    sf_readf_short(sndfile, waveform->data, preloaded_frames);
-    sf_close(sndfile);
+static void register_waveform(struct cbox_waveform *waveform)
+{
+    waveform->id = ++bank.serial_no;
     bank.bytes += waveform->bytes;
     if (bank.bytes > bank.maxbytes)
         bank.maxbytes = bank.bytes;
     g_hash_table_insert(bank.waveforms_by_name, waveform->canonical_name, waveform);
     g_hash_table_insert(bank.waveforms_by_id, &waveform->id, waveform);
+}
+
+struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struct cbox_tarfile *tarfile, const char *sample_dir, const char *filename, GError **error)
+{
+    if (!filename)
+    {
+        g_set_error(error, CBOX_WAVEFORM_ERROR, CBOX_WAVEFORM_ERROR_FAILED, "%s: no filename specified", context_name);
+        return NULL;
+    }
+
+    // Built in waveforms don't go through path canonicalization
+    if (filename[0] == '*')
+    {
+        if (!strcmp(filename + 1, "sqr"))
+            filename = "*square";
+        else if (!strcmp(filename + 1, "tri"))
+            filename = "*triangle";
+        gpointer value = g_hash_table_lookup(bank.waveforms_by_name, filename);
+        if (value)
+        {
+            struct cbox_waveform *waveform = value;
+            cbox_waveform_ref(waveform);
+            return waveform;
+        }
+    }
 
+    gchar *pathname = NULL;
+    gchar *canonical = resolve_waveform_name(context_name, tarfile, sample_dir, filename, &pathname, error);
+    if (!canonical)
+        return NULL;
+    gpointer value = g_hash_table_lookup(bank.waveforms_by_name, canonical);
+    if (value)
+    {
+        g_free(pathname);
+        g_free(canonical);
+
+        struct cbox_waveform *waveform = value;
+        cbox_waveform_ref(waveform);
+        return waveform;
+    }
+
+    struct cbox_waveform *waveform = load_waveform(context_name, tarfile, pathname, canonical, error);
+    g_free(pathname);
+    if (waveform)
+        register_waveform(waveform);
     return waveform;
 }
 
+struct preload_job
+{
+    gchar *pathname;
+    gchar *canonical;
+    struct cbox_waveform *waveform;
+};
+
+struct preload_state
+{
+    const char *context_name;
+    struct cbox_tarfile *tarfile;
+    struct preload_job *jobs;
+    uint32_t job_count;
+    volatile uint32_t next_job;
+    volatile uint32_t jobs_done;
+};
+
+// Returns FALSE when there are no more jobs
+static gboolean preload_one(struct preload_state *state)
+{
+    uint32_t index = __sync_fetch_and_add(&state->next_job, 1);
+    if (index >= state->job_count)
+        return FALSE;
+    struct preload_job *job = &state->jobs[index];
+    // Errors are reported later, when the sample is actually used
+    job->waveform = load_waveform(state->context_name, state->tarfile, job->pathname, job->canonical, NULL);
+    job->canonical = NULL;
+    __sync_fetch_and_add(&state->jobs_done, 1);
+    return TRUE;
+}
+
+static void *preload_thread(void *user_data)
+{
+    while(preload_one(user_data))
+        ;
+    return NULL;
+}
+
+GSList *cbox_wavebank_preload(const char *context_name, struct cbox_tarfile *tarfile, const struct cbox_waveform_request *requests, uint32_t count, int thread_count, cbox_wavebank_progress_func progress, void *user_data)
+{
+    GSList *waveforms = NULL;
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    struct preload_state state = { .context_name = context_name, .tarfile = tarfile, .jobs = calloc(count ? count : 1, sizeof(struct preload_job)), .job_count = 0, .next_job = 0, .jobs_done = 0 };
+
+    // Only the files that are not loaded yet, each one once
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char *filename = requests[i].filename;
+        if (!filename || filename[0] == '*')
+            continue;
+        gchar *pathname = NULL;
+        gchar *canonical = resolve_waveform_name(context_name, tarfile, requests[i].sample_dir, filename, &pathname, NULL);
+        if (!canonical)
+            continue;
+        if (g_hash_table_lookup(bank.waveforms_by_name, canonical) || g_hash_table_lookup(seen, canonical))
+        {
+            g_free(pathname);
+            g_free(canonical);
+            continue;
+        }
+        g_hash_table_insert(seen, canonical, canonical);
+        state.jobs[state.job_count].pathname = pathname;
+        state.jobs[state.job_count].canonical = canonical;
+        state.job_count++;
+    }
+    g_hash_table_destroy(seen);
+
+    if (thread_count > (int)state.job_count)
+        thread_count = state.job_count;
+    pthread_t *threads = calloc(thread_count > 1 ? thread_count - 1 : 1, sizeof(pthread_t));
+    int started = 0;
+    // The calling thread does its share of work too
+    for (int i = 0; i < thread_count - 1; i++)
+    {
+        if (pthread_create(&threads[i], NULL, preload_thread, &state))
+            break;
+        started++;
+    }
+    while(preload_one(&state))
+    {
+        if (progress)
+            progress(user_data, state.jobs_done, state.job_count);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (uint32_t i = 0; i < state.job_count; i++)
+    {
+        struct preload_job *job = &state.jobs[i];
+        if (job->waveform)
+        {
+            register_waveform(job->waveform);
+            waveforms = g_slist_prepend(waveforms, job->waveform);
+        }
+        g_free(job->pathname);
+    }
+    free(state.jobs);
+    if (progress)
+        progress(user_data, state.job_count, state.job_count);
+    return waveforms;
+}
+
 int64_t cbox_wavebank_get_bytes()
 {
     return bank.bytes;
@@ -490,7 +662,10 @@ void cbox_waveform_unref(struct cbox_waveform *waveform)
         for (int i = 0; i < waveform->level_count; i++)
             free(waveform->levels[i].data);
         free(waveform->levels);
-        free(waveform->data);
+        if (waveform->pcm_cache)
+            cbox_pcm_cache_entry_close(waveform->pcm_cache);
+        else
+            free(waveform->data);
     }
     free(waveform);
 
@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdbool.h>
 #include <glib.h>
 #include <sndfile.h>
+#include "pcmcache.h"
 #include "tarfile.h"
 
 #define MAX_INTERPOLATION_ORDER 3
@@ -61,6 +62,9 @@ struct cbox_waveform
     struct cbox_tarfile *tarfile;
     struct cbox_taritem *taritem;
     struct cbox_tarfile_sndstream sndstream;
+    // if not NULL, data points into the mapped cache entry, which also
+    // holds the rest of the sample for streaming
+    struct cbox_pcm_cache_entry *pcm_cache;
 
     struct cbox_waveform_level *levels;
     int level_count;
@@ -72,6 +76,19 @@ extern struct cbox_command_target cbox_waves_cmd_target;
 
 extern void cbox_wavebank_init(void);
 extern struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struct cbox_tarfile *tf, const char *sample_dir, const char *filename, GError **error);
+// Loads a number of sample files in parallel, so that the following calls to
+// cbox_wavebank_get_waveform for the same files return immediately. Files
+// that are already loaded or requested more than once are only loaded once.
+// The progress function is called on the calling thread. Returns the list of
+// newly loaded waveforms, each holding one reference to be released by the
+// caller.
+struct cbox_waveform_request
+{
+    const char *sample_dir;
+    const char *filename;
+};
+typedef void (*cbox_wavebank_progress_func)(void *user_data, uint32_t done, uint32_t total);
+extern GSList *cbox_wavebank_preload(const char *context_name, struct cbox_tarfile *tf, const struct cbox_waveform_request *requests, uint32_t count, int thread_count, cbox_wavebank_progress_func progress, void *user_data);
 extern struct cbox_waveform *cbox_wavebank_peek_waveform_by_id(int id);
 extern void cbox_wavebank_foreach(void (*cb)(void *user_data, struct cbox_waveform *waveform), void *user_data);
 extern void cbox_wavebank_add_std_waveform(const char *name, float (*getfunc)(struct cbox_waveform_generate_data *generate, float v), void *user_data, int levels);
@@ -0,0 +1,188 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "workerpool.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEQUE_RANGE(head, tail) ((((uint64_t)(tail)) << 32) | (uint32_t)(head))
+
+static inline int64_t deque_pop(struct cbox_worker_deque *d)
+{
+    while(1)
+    {
+        uint64_t range = d->range;
+        uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+        if (head >= tail)
+            return -1;
+        if (__sync_bool_compare_and_swap(&d->range, range, DEQUE_RANGE(head, tail - 1)))
+            return tail - 1;
+    }
+}
+
+static inline int64_t deque_steal(struct cbox_worker_deque *d)
+{
+    while(1)
+    {
+        uint64_t range = d->range;
+        uint32_t head = (uint32_t)range, tail = (uint32_t)(range >> 32);
+        if (head >= tail)
+            return -1;
+        if (__sync_bool_compare_and_swap(&d->range, range, DEQUE_RANGE(head + 1, tail)))
+            return head;
+    }
+}
+
+static void run_jobs(struct cbox_worker_pool *pool, int self)
+{
+    int participants = pool->thread_count + 1;
+    while(1)
+    {
+        int64_t job = deque_pop(&pool->deques[self]);
+        for (int i = 1; job < 0 && i < participants; i++)
+            job = deque_steal(&pool->deques[(self + i) % participants]);
+        if (job < 0)
+            return;
+        pool->func(pool->user_data, (uint32_t)job);
+        __sync_fetch_and_sub(&pool->jobs_remaining, 1);
+    }
+}
+
+static void *worker_thread(void *user_data)
+{
+    struct cbox_worker_thread *thr = user_data;
+    struct cbox_worker_pool *pool = thr->pool;
+
+    while(1)
+    {
+        while(sem_wait(&thr->sem_wakeup) && errno == EINTR)
+            ;
+        if (pool->finished)
+            break;
+        // A thread that woke up late may find the jobs already taken by the
+        // others - that's fine, it will just go back to sleep
+        run_jobs(pool, thr->index);
+    }
+    return NULL;
+}
+
+static void setup_thread(struct cbox_worker_thread *thr, int rtpriority, gboolean pin_threads)
+{
+    if (rtpriority > 0)
+    {
+        struct sched_param p;
+        memset(&p, 0, sizeof(p));
+        p.sched_priority = rtpriority;
+        int err = pthread_setschedparam(thr->thread, SCHED_FIFO, &p);
+        if (err)
+            g_warning("Cannot set realtime priority for the render thread %d: %s.", thr->index, strerror(err));
+    }
+    if (pin_threads)
+    {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpus > 1)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(thr->index % ncpus, &cpus);
+            int err = pthread_setaffinity_np(thr->thread, sizeof(cpus), &cpus);
+            if (err)
+                g_warning("Cannot set CPU affinity for the render thread %d: %s.", thr->index, strerror(err));
+        }
+    }
+}
+
+struct cbox_worker_pool *cbox_worker_pool_new(int thread_count, int rtpriority, gboolean pin_threads)
+{
+    struct cbox_worker_pool *pool = calloc(1, sizeof(struct cbox_worker_pool));
+    pool->threads = calloc(thread_count, sizeof(struct cbox_worker_thread));
+    if (posix_memalign((void **)&pool->deques, 64, (thread_count + 1) * sizeof(struct cbox_worker_deque)))
+    {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->deques, 0, (thread_count + 1) * sizeof(struct cbox_worker_deque));
+    pool->finished = FALSE;
+    pool->jobs_remaining = 0;
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        struct cbox_worker_thread *thr = &pool->threads[i];
+        thr->pool = pool;
+        thr->index = i + 1;
+        sem_init(&thr->sem_wakeup, 0, 0);
+        if (pthread_create(&thr->thread, NULL, worker_thread, thr))
+        {
+            g_warning("Cannot create a render thread, using %d instead of %d.", i, thread_count);
+            sem_destroy(&thr->sem_wakeup);
+            break;
+        }
+        setup_thread(thr, rtpriority, pin_threads);
+        pool->thread_count = i + 1;
+    }
+    return pool;
+}
+
+void cbox_worker_pool_run(struct cbox_worker_pool *pool, cbox_worker_job_func func, void *user_data, uint32_t job_count)
+{
+    if (!job_count)
+        return;
+    uint32_t participants = pool->thread_count + 1;
+    uint32_t chunk = (job_count + participants - 1) / participants;
+
+    pool->func = func;
+    pool->user_data = user_data;
+    pool->jobs_remaining = job_count;
+    __sync_synchronize();
+    for (uint32_t i = 0; i < participants; i++)
+    {
+        uint32_t start = i * chunk < job_count ? i * chunk : job_count;
+        uint32_t end = start + chunk < job_count ? start + chunk : job_count;
+        pool->deques[i].range = DEQUE_RANGE(start, end);
+    }
+    __sync_synchronize();
+
+    // Only wake up the threads that have been given any jobs, the calling
+    // thread always takes part in the processing
+    for (uint32_t i = 1; i < participants && i * chunk < job_count; i++)
+        sem_post(&pool->threads[i - 1].sem_wakeup);
+
+    run_jobs(pool, 0);
+    while(pool->jobs_remaining)
+        __sync_synchronize();
+}
+
+void cbox_worker_pool_destroy(struct cbox_worker_pool *pool)
+{
+    pool->finished = TRUE;
+    __sync_synchronize();
+    for (int i = 0; i < pool->thread_count; i++)
+        sem_post(&pool->threads[i].sem_wakeup);
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i].thread, NULL);
+        sem_destroy(&pool->threads[i].sem_wakeup);
+    }
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+}
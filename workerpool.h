@@ -0,0 +1,72 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CBOX_WORKERPOOL_H
+#define CBOX_WORKERPOOL_H
+
+#include <glib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+// Pool of helper threads used by the real-time thread to spread a set of
+// independent jobs (e.g. rendering of the instruments of a scene) across
+// several CPU cores. Each participant owns a deque of job indexes; when it
+// runs out of its own jobs, it steals from the other end of the deques of
+// the other participants.
+
+typedef void (*cbox_worker_job_func)(void *user_data, uint32_t index);
+
+struct cbox_worker_deque
+{
+    // low 32 bits = head (next job to steal), high 32 bits = tail (one past
+    // the next job to pop by the owner); both updated with a single CAS
+    volatile uint64_t range;
+    char padding[64 - sizeof(uint64_t)];
+};
+
+struct cbox_worker_thread
+{
+    struct cbox_worker_pool *pool;
+    pthread_t thread;
+    sem_t sem_wakeup;
+    int index;
+};
+
+struct cbox_worker_pool
+{
+    int thread_count;
+    struct cbox_worker_thread *threads;
+    // one per worker thread + one for the real-time thread calling
+    // cbox_worker_pool_run (which is always participant 0)
+    struct cbox_worker_deque *deques;
+
+    cbox_worker_job_func func;
+    void *user_data;
+    volatile uint32_t jobs_remaining;
+    volatile gboolean finished;
+};
+
+extern struct cbox_worker_pool *cbox_worker_pool_new(int thread_count, int rtpriority, gboolean pin_threads);
+// Runs func(user_data, i) for 0 <= i < job_count and returns when all the
+// jobs are done. Does not allocate memory or take any locks, so it can be
+// called from the real-time thread.
+extern void cbox_worker_pool_run(struct cbox_worker_pool *pool, cbox_worker_job_func func, void *user_data, uint32_t job_count);
+extern void cbox_worker_pool_destroy(struct cbox_worker_pool *pool);
+
+#endif